@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_ANALYZE_H
+#define USERFS_ANALYZE_H
+
+/*
+ * Overlay copy-up analyzer.
+ *
+ * "userfs analyze [-p] [-q]" walks the upper directory of every overlay mount
+ * point and compares each entry with the lower directory:
+ *
+ *   identical  Copy-up with the same content, mode, owner, mtime and xattrs
+ *              as the lower file (only touched, or atime changed)
+ *   metadata   Same content, different mode/owner/mtime/xattrs, or overlay
+ *              metadata (trusted.overlay.*, e.g. a metacopy copy-up)
+ *   modified   Content or type differs from the lower file
+ *   new        No lower file
+ *   whiteout   Lower file deleted
+ *   opaque     Directory hiding the lower directory
+ *   redirect   Renamed directory, its entries are compared with the origin
+ *
+ * The lower directories are read through a non-recursive bind mount of / in a
+ * private mount namespace, so the analysis also works with the overlays
+ * mounted. -p removes the identical copy-ups from the upper directories, which
+ * is only allowed while the overlays are not mounted (e.g. after "userfs -o").
+ */
+
+int analyze_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_ANALYZE_H */
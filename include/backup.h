@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_BACKUP_H
+#define USERFS_BACKUP_H
+
+/*
+ * Backup and restore of the userfs subvolumes with btrfs send streams.
+ *
+ * "userfs backup" takes read-only snapshots of vol-config and vol-data in
+ * BACKUP_DIR_NAME and generates a single send stream for both in-process
+ * (BTRFS_IOC_SEND), incremental against the snapshots of the previous backup,
+ * which are then deleted. The stream is compressed with zstd when built with
+ * libzstd, and written to a file or to the standard output. The snapshots of
+ * the last backup are kept as parents of the next one: an incremental backup
+ * only reads the extents changed since.
+ *
+ * "userfs restore" decompresses a stream and feeds it to "btrfs receive" in
+ * RESTORE_DIR_NAME (full and incremental streams must be restored in order),
+ * apart from the local snapshots which have the same names. With -a, the
+ * last received snapshots replace the subvolumes, the previous ones are kept
+ * as RESTORE_DIR_NAME/"<subvolume>.prev" until the next restore.
+ */
+
+#define BACKUP_DIR_NAME  ".backup"
+#define RESTORE_DIR_NAME ".restore"
+
+#if !defined(BACKUP_ZSTD_LEVEL)
+#define BACKUP_ZSTD_LEVEL 3
+#endif
+
+int backup_cmd_run(int argc, char *argv[]);
+
+int backup_cmd_restore(int argc, char *argv[]);
+
+#endif /* USERFS_BACKUP_H */
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_BMAP_H
+#define USERFS_BMAP_H
+
+/*
+ * Block map (bmap) of a provisioned disk or image, for bmaptool-compatible
+ * flashers which only write the mapped blocks.
+ *
+ * "userfs bmap" maps:
+ *  - the area before the first partition (MBR, boot loader gap) and the EBRs;
+ *  - the partitions userfs does not manage (boot, rootfs), entirely;
+ *  - the swap header (BMAP_SWAP_HEADER_SIZE bytes, any page size);
+ *  - the superblock copies and the allocated chunks (dev extents) of the
+ *    userfs btrfs filesystem, read from the mounted filesystem which must be
+ *    the one of the image (same fsid).
+ *
+ * The output is a bmap version 2.0 file with sha256 range checksums. The
+ * filesystem is synced first, the image must then be copied with the
+ * filesystem unmounted (or read-only) so that the chunks do not change.
+ */
+
+#define BMAP_BLOCK_SIZE       4096u
+#define BMAP_SWAP_HEADER_SIZE (64u * 1024u)
+
+int bmap_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_BMAP_H */
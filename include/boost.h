@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_BOOST_H
+#define USERFS_BOOST_H
+
+#include <stdio.h>
+
+/*
+ * Resource boost of the critical provisioning steps (-Dboost=nice|fifo).
+ *
+ * Between boost_begin() and boost_end() (partition, btrfs, /etc and /var
+ * overlays), userfs and the commands it runs (mkfs.btrfs, btrfs-convert, ...)
+ * get:
+ *  - the real-time I/O class (ioprio RT, level BOOST_IOPRIO_LEVEL);
+ *  - nice BOOST_NICE (nice) or SCHED_FIFO priority BOOST_FIFO_PRIORITY (fifo);
+ *  - the performance cpufreq governor on every cpufreq policy;
+ *  - the CPU USERFS_BOOST_CPU only (-Dboost_cpu), e.g. a core without early
+ *    interrupt load.
+ * The scheduling attributes are per thread and inherited by the children, the
+ * device threads (see devices.h) started before the window keep theirs.
+ *
+ * boost_end() restores every setting changed by boost_begin(), before the
+ * deferrable steps run and before the deferred worker is forked. userfs -d
+ * (exits once the partition is deleted) does not run boosted. The window,
+ * the runqueue wait of userfs and the preemptions of userfs and its children
+ * in the window are in the boot report ("boost").
+ */
+
+#define BOOST_IOPRIO_LEVEL  4u
+#define BOOST_NICE          -10
+#define BOOST_FIFO_PRIORITY 1
+#define BOOST_GOVERNOR      "performance"
+#define BOOST_MAX_POLICIES  8u
+
+#if !defined(USERFS_BOOST_CPU)
+#define USERFS_BOOST_CPU -1 // No pinning
+#endif
+
+/**
+ * Boost the calling thread, no-op if built without -Dboost.
+ *
+ * A setting that cannot be applied (e.g. no cpufreq, no CAP_SYS_NICE) is
+ * logged and skipped, never fails the boot.
+ */
+void boost_begin(void);
+
+/* Restore the settings changed by boost_begin(), can be called again */
+void boost_end(void);
+
+void boost_write_json(FILE *fp);
+
+#endif /* USERFS_BOOST_H */
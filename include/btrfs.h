@@ -7,11 +7,54 @@
 #ifndef USERFS_BTRFS_H
 #define USERFS_BTRFS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #define BTRFS_SV_DATA_INDEX   0
 #define BTRFS_SV_CONFIG_INDEX 1
 
+#if defined(USERFS_OVERLAY_OPT)
+#define BTRFS_SV_OPT_INDEX 2
+#endif
+
+#if defined(USERFS_CONTAINERS_PATH) && defined(USERFS_OVERLAY_OPT)
+#define BTRFS_SV_CONTAINERS_INDEX 3
+#elif defined(USERFS_CONTAINERS_PATH)
+#define BTRFS_SV_CONTAINERS_INDEX 2
+#endif
+
 const char *btrfs_get_volume(size_t sv_index);
 
+/**
+ * Snapshot a subvolume (BTRFS_IOC_SNAP_CREATE_V2).
+ *
+ * @param src_fd Open directory of the subvolume to snapshot.
+ * @param dir_fd Open directory to create the snapshot in.
+ * @param name Name of the snapshot in dir_fd.
+ * @param readonly Create a read-only snapshot.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+int btrfs_snapshot(int src_fd, int dir_fd, const char *name, bool readonly);
+
+/**
+ * Delete a subvolume or snapshot (BTRFS_IOC_SNAP_DESTROY).
+ *
+ * @param dir_fd Open directory containing the subvolume.
+ * @param name Name of the subvolume in dir_fd.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+int btrfs_delete_subvolume(int dir_fd, const char *name);
+
+#if defined(USERFS_CONTAINERS_PATH)
+/**
+ * Bind mount the container storage subvolume on USERFS_CONTAINERS_PATH,
+ * outside of the overlays, so that the container runtime btrfs driver creates
+ * layers as snapshots and reflinks. Copy-on-write is enforced and compression
+ * enabled on the subvolume.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int btrfs_mount_containers(void);
+#endif
+
 #endif /* USERFS_BTRFS_H */
\ No newline at end of file
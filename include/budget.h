@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_BUDGET_H
+#define USERFS_BUDGET_H
+
+/*
+ * Syscall and fork budget.
+ *
+ * "userfs budget [-b FILE] [-w FILE] [-- ARGS]" runs userfs ARGS under ptrace,
+ * counts forks, execs, opens, reads, ioctls, mounts and the bytes read from
+ * the disk, and compares them with the budget FILE. Each line of a budget file
+ * is "<counter> <max>", '#' starts a comment. -w writes the measured counts in
+ * the same format, to be used as a new baseline.
+ *
+ * Processes starting their own session (setsid(), e.g. the deferred worker or
+ * the autofs server) are counted as "daemons" and detached: they outlive the
+ * boot path and are neither counted further nor waited for.
+ *
+ * The command fails if the traced run fails or if any counter exceeds its
+ * budget, so that added work on the boot path can be caught in CI. The budgets
+ * of the CI scenarios are in scripts/budget/, see scripts/budget.sh.
+ */
+
+int budget_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_BUDGET_H */
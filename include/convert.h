@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_CONVERT_H
+#define USERFS_CONVERT_H
+
+/*
+ * In-place conversion of legacy ext4 userfs partitions to btrfs.
+ *
+ * Older systems have an ext4 userfs partition, with the overlay upper and
+ * work directories at its root. Instead of a backup, reformat and restore,
+ * step2 converts it with btrfs-convert: the ext4 data blocks stay in place
+ * and only btrfs metadata is written. Data checksums are not computed
+ * (--no-datasum, the file data is never read), files written afterwards
+ * have them.
+ *
+ * The ext4 image is kept in the CONVERT_SAVED_SUBVOL subvolume: until it is
+ * dropped with 'userfs convert -d', the conversion can be rolled back with
+ * btrfs-convert -r (partition unmounted).
+ *
+ * The converted filesystem has the layout version 0 (see layout.h), its
+ * migration creates vol-config and vol-data as snapshots of the converted
+ * root which only keep their overlay directories: no file data is copied.
+ */
+
+#define CONVERT_SAVED_SUBVOL "ext2_saved"
+#define CONVERT_SAVED_IMAGE  CONVERT_SAVED_SUBVOL "/image"
+
+/**
+ * Convert an unmounted ext4 filesystem to btrfs (label FORMAT_LABEL).
+ *
+ * The filesystem is checked (e2fsck -p) first, btrfs-convert refuses a
+ * filesystem that was not cleanly unmounted.
+ *
+ * @param device The partition device.
+ * @return 0 on success, -1 on failure (the ext4 filesystem is left as is).
+ */
+int convert_ext4(const char *device);
+
+int convert_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_CONVERT_H */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_DEADLINE_H
+#define USERFS_DEADLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "history.h"
+#include "report.h"
+
+/*
+ * Boot deadline and deferral of non-critical steps.
+ *
+ * Critical steps (partition, btrfs, /etc and /var overlays) always run inline:
+ * services cannot start without them. Deferrable steps (swap formatting,
+ * /home and /opt overlays) run through deadline_run(): with a deadline set
+ * (userfs -b MS, BOOT_DEADLINE_MS by default), a step only runs inline if its
+ * estimated duration fits in what is left of the deadline. The estimate is the
+ * duration of the step in the most recent boot of the history where it ran,
+ * or the step default estimate (first boot).
+ *
+ * Steps that do not fit are queued and run by a detached worker (own session,
+ * idle I/O priority, nice 19), started once the boot is reported:
+ *  - with systemd (Type=notify), READY=1 and MAINPID=<worker> are sent to
+ *    $NOTIFY_SOCKET, the service stays active until the worker is done;
+ *  - DEADLINE_PID_PATH holds the worker pid while it runs.
+ * The worker then rewrites the boot report and completes the history record
+ * of the boot with the duration of the deferred steps.
+ */
+
+#define DEADLINE_PID_PATH  REPORT_DIR "/worker.pid"
+#define DEADLINE_MAX_TASKS 8u
+
+#if !defined(BOOT_DEADLINE_MS)
+#define BOOT_DEADLINE_MS 0u // No deadline, everything runs inline
+#endif
+
+struct args;
+struct disk_info;
+
+struct deadline_task {
+    const char *name;
+    enum report_step step;
+    uint32_t estimate_ms; // Used when the step never ran (e.g. first boot)
+    int (*run)(struct args *args, struct disk_info *disk);
+};
+
+/**
+ * Start the boot deadline, must be called when the program starts.
+ *
+ * @param budget_ms Deadline in milliseconds, 0 for none.
+ */
+void deadline_init(uint32_t budget_ms);
+
+/**
+ * Run a deferrable step inline if it fits in the deadline, queue it otherwise.
+ *
+ * The step is timed and reported (action REPORT_ACTION_DEFERRED if queued).
+ *
+ * @return The step result if it ran, 0 if it was queued.
+ */
+int deadline_run(const struct deadline_task *task,
+                 struct args *args,
+                 struct disk_info *disk);
+
+/* Number of queued steps */
+size_t deadline_pending(void);
+
+/**
+ * Fork the deferred worker if steps are queued and the boot succeeded.
+ *
+ * The worker returns from this function once the parent called
+ * deadline_ready() (the boot report and history record are written).
+ *
+ * @param ret Result of the critical steps, queued steps are dropped on failure.
+ * @return The worker pid in the parent, 0 in the worker, -1 if there is no
+ *         worker (nothing queued or fork failure, steps stay queued).
+ */
+pid_t deadline_spawn_worker(int ret);
+
+/**
+ * Run the queued steps (in the worker, or inline if it could not be forked).
+ *
+ * @return 0 on success, -1 if a step failed.
+ */
+int deadline_run_deferred(struct args *args, struct disk_info *disk);
+
+/**
+ * Signal readiness: write the pidfile and release the worker if any, then
+ * notify $NOTIFY_SOCKET.
+ *
+ * @param rec History record of this boot (completed by the worker), or NULL.
+ */
+void deadline_ready(const struct history_record *rec);
+
+/**
+ * Complete the history record of the boot with the deferred steps (worker).
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int deadline_update_history(void);
+
+/* Remove the pidfile, to be called by the worker when done */
+void deadline_worker_done(void);
+
+void deadline_write_json(FILE *fp);
+
+#endif /* USERFS_DEADLINE_H */
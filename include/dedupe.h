@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_DEDUPE_H
+#define USERFS_DEDUPE_H
+
+/*
+ * Out-of-band deduplication of the userfs subvolumes.
+ *
+ * "userfs dedupe [-n] [-r] [-t SECONDS] [-p PERCENT]" reads the regular files
+ * of the subvolumes by DEDUPE_BLOCK_SIZE blocks, and looks each block up by
+ * its 64-bit hash in a fixed-size open addressing table (block hash, file,
+ * block number). Consecutive matching blocks are merged into one range, which
+ * is deduplicated with FIDEDUPERANGE: the kernel compares the data and shares
+ * the extents only if identical, a hash collision is never a corruption.
+ *
+ * Memory is bounded by the table and by a pool of the indexed file paths: once
+ * one of them is full, blocks are still looked up but no longer indexed.
+ *
+ * The pass is meant to run when the system is idle (e.g. from a timer): it
+ * runs at idle I/O and CPU priority, backs off while the I/O pressure (PSI
+ * "some" avg10) is above PERCENT, and drops the pages it read from the page
+ * cache. It stops after SECONDS or on SIGTERM, the last completed file is
+ * checkpointed in DEDUPE_FILE_NAME and the next run resumes after it (btrfs
+ * returns directory entries in a stable order). -r restarts the pass.
+ */
+
+#define DEDUPE_FILE_NAME  ".userfs-dedupe"
+#define DEDUPE_BLOCK_SIZE (128u * 1024u) // Maximum btrfs compressed extent size
+
+int dedupe_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_DEDUPE_H */
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_DEVICES_H
+#define USERFS_DEVICES_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Additional block devices (e.g. SD card or USB SSD next to the eMMC).
+ *
+ * DISK stays the primary device (userfs partition, swap partition). Other
+ * devices are given as DEVICE:ROLE, with -Ddevices (USERFS_DEVICES, comma
+ * separated) and userfs -x DEVICE:ROLE:
+ *  - data: joins the userfs btrfs filesystem (more space, single data);
+ *  - mirror: joins the userfs btrfs filesystem, metadata converted to RAID1.
+ *    btrfs has no per-subvolume profile, all the metadata is mirrored, which
+ *    covers the small files of vol-config (inlined in the metadata);
+ *  - swap: formatted as swap;
+ *  - bulk: own btrfs filesystem (label DEVICES_BULK_LABEL), mounted on
+ *    DEVICES_BULK_DIR/<device name>.
+ *
+ * Each device is provisioned by its own thread (libfdisk context, partprobe,
+ * libblkid probe, mkfs) while the primary device is, so the provisioning
+ * takes as long as the slowest device. A device without a partition table
+ * gets one with a single partition over the whole device, partition 1 is
+ * used otherwise. Only a partition without a signature is formatted, an
+ * unrelated filesystem (e.g. the vfat or exfat of a user SD card, any
+ * signature libblkid recognises) is never overwritten unless -f is given.
+ *
+ * data and mirror devices are registered to the kernel (BTRFS_IOC_SCAN_DEV)
+ * before the userfs filesystem is mounted, and added to it afterwards when
+ * not a member yet (not in kiosk mode). The RAID1 conversion is a background
+ * balance, the boot does not wait for it: the metadata is only mirrored once
+ * it completes, an interrupted one is resumed by the kernel on the next mount.
+ */
+
+#define DEVICES_MAX        4u
+#define DEVICES_BULK_DIR   "/mnt/bulk"
+#define DEVICES_BULK_LABEL "userfs-bulk"
+
+#if !defined(USERFS_DEVICES)
+#define USERFS_DEVICES "" // No additional device
+#endif
+
+struct args;
+
+/**
+ * Add a device to provision.
+ *
+ * @param spec DEVICE:ROLE, e.g. /dev/sda:bulk.
+ * @return 0 on success, -1 if invalid or too many devices.
+ */
+int devices_add(const char *spec);
+
+/**
+ * Add the USERFS_DEVICES devices and start one provisioning thread per device.
+ *
+ * @return 0 on success, -1 on failure (invalid USERFS_DEVICES).
+ */
+int devices_start(struct args *args);
+
+/**
+ * Wait for the provisioning threads, must be called before the userfs
+ * filesystem is mounted. A failed device is reported, never fails the boot.
+ *
+ * @return 0 on success, -1 if a data or mirror device failed.
+ */
+int devices_wait(void);
+
+/**
+ * Whether a data or mirror device failed to be provisioned (e.g. missing), the
+ * userfs filesystem may then only be mounted degraded. Valid after
+ * devices_wait().
+ */
+bool devices_member_failed(void);
+
+/**
+ * Add the data and mirror devices to the mounted userfs filesystem if needed
+ * and start the conversion of the metadata to RAID1 if there is a mirror.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int devices_attach(struct args *args);
+
+void devices_write_json(FILE *fp);
+
+#endif /* USERFS_DEVICES_H */
@@ -26,11 +26,13 @@ enum fs_type {
     FS_TYPE_BTRFS   = 1,
     FS_TYPE_EXT4    = 2,
     FS_TYPE_SWAP    = 3,
+    FS_TYPE_OTHER   = 4, // Signature not used by userfs (e.g. vfat, exfat, xfs)
 };
 
 struct fs_info {
     enum fs_type type;
     char uuid[37u]; // UUID is 36 characters + null terminator
+    char name[16u]; // blkid TYPE (or PTTYPE), e.g. "vfat", empty without signature
     char _reversed[3];
 };
 
@@ -69,4 +71,29 @@ void disk_clear_info(struct disk_info *disk);
 
 ssize_t disk_part_build_path(char *buf, size_t buf_len, size_t partno);
 
+/**
+ * Make sure a device has a DOS partition table with a first partition, the
+ * table and the partition (whole device) are created if missing.
+ *
+ * Unlike step1_create_userfs_partition(), works on any device and never
+ * changes an existing partition.
+ *
+ * The device is probed before partition 0 is created: if it holds a signature
+ * (e.g. whole device filesystem, vfat superfloppy), a new partition table is
+ * only written, and the signature wiped, with force. Otherwise it fails with
+ * errno set to EEXIST.
+ *
+ * @param device The block device.
+ * @param type Type code of the partition if created (e.g. 0x83, 0x82).
+ * @param force Label a device holding a signature (-f).
+ * @return 0 if the partition was created, 1 if it already exists, -1 on failure.
+ */
+int disk_prepare_device(const char *device, int type, bool force);
+
+/* Path of a partition (from 0) of any block device, e.g. /dev/sda1, /dev/mmcblk1p1 */
+ssize_t disk_device_part_path(char *buf,
+                              size_t buf_len,
+                              const char *device,
+                              size_t partno);
+
 #endif /* USERFS_DISK_H */
\ No newline at end of file
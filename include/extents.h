@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_EXTENTS_H
+#define USERFS_EXTENTS_H
+
+/*
+ * Per-subvolume compression and extent statistics.
+ *
+ * "userfs extents [-b]" walks the file extent items of each userfs subvolume
+ * with BTRFS_IOC_TREE_SEARCH_V2 (no external tool, no fork) and prints, per
+ * compression type, the disk usage, uncompressed and referenced sizes (same
+ * meaning as compsize), the number of files and extents and the fragmentation.
+ *
+ * The walk streams the tree through a fixed-size buffer and runs at idle I/O
+ * and CPU priority. Shared extents are counted once through a fixed-size set
+ * of extent addresses: if the set fills up the disk usage and uncompressed
+ * sizes are flagged as approximate (shared extents may be counted twice).
+ */
+
+int extents_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_EXTENTS_H */
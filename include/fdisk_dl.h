@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_FDISK_DL_H
+#define USERFS_FDISK_DL_H
+
+#include <libfdisk.h>
+
+/*
+ * libfdisk, loaded on first use.
+ *
+ * The partition table is read with the built-in reader (see mbr.h), libfdisk
+ * is only needed to change it (first boot, -d, additional devices). It is not
+ * linked: fdisk_dl_load() opens FDISK_DL_SONAME and resolves the functions
+ * below, the fdisk_*() calls of the files including this header go through
+ * the resolved pointers.
+ */
+
+#define FDISK_DL_SONAME "libfdisk.so.1"
+
+// clang-format off
+#define FDISK_DL_SYMBOLS(X)                  \
+    X(fdisk_add_partition)                   \
+    X(fdisk_assign_device)                   \
+    X(fdisk_create_disklabel)                \
+    X(fdisk_deassign_device)                 \
+    X(fdisk_delete_partition)                \
+    X(fdisk_enable_wipe)                     \
+    X(fdisk_get_label)                       \
+    X(fdisk_get_npartitions)                 \
+    X(fdisk_get_nsectors)                    \
+    X(fdisk_get_partition)                   \
+    X(fdisk_has_label)                       \
+    X(fdisk_init_debug)                      \
+    X(fdisk_is_labeltype)                    \
+    X(fdisk_is_partition_used)               \
+    X(fdisk_label_get_parttype_from_code)    \
+    X(fdisk_label_get_type)                  \
+    X(fdisk_new_context)                     \
+    X(fdisk_new_partition)                   \
+    X(fdisk_partition_end_follow_default)    \
+    X(fdisk_partition_get_end)               \
+    X(fdisk_partition_get_partno)            \
+    X(fdisk_partition_get_size)              \
+    X(fdisk_partition_get_start)             \
+    X(fdisk_partition_get_type)              \
+    X(fdisk_partition_set_partno)            \
+    X(fdisk_partition_set_size)              \
+    X(fdisk_partition_set_start)             \
+    X(fdisk_partition_set_type)              \
+    X(fdisk_partition_start_follow_default)  \
+    X(fdisk_parttype_get_code)               \
+    X(fdisk_parttype_get_name)               \
+    X(fdisk_unref_context)                   \
+    X(fdisk_unref_partition)                 \
+    X(fdisk_unref_parttype)                  \
+    X(fdisk_write_disklabel)
+// clang-format on
+
+#define FDISK_DL_DECLARE(sym) extern __typeof__(sym) *sym_##sym;
+FDISK_DL_SYMBOLS(FDISK_DL_DECLARE)
+#undef FDISK_DL_DECLARE
+
+/**
+ * Load libfdisk, if not done yet (thread safe).
+ *
+ * @return 0 on success, -1 on failure (library or function missing).
+ */
+int fdisk_dl_load(void);
+
+#if !defined(FDISK_DL_IMPL)
+// clang-format off
+#define fdisk_add_partition                  (*sym_fdisk_add_partition)
+#define fdisk_assign_device                  (*sym_fdisk_assign_device)
+#define fdisk_create_disklabel               (*sym_fdisk_create_disklabel)
+#define fdisk_deassign_device                (*sym_fdisk_deassign_device)
+#define fdisk_delete_partition               (*sym_fdisk_delete_partition)
+#define fdisk_enable_wipe                    (*sym_fdisk_enable_wipe)
+#define fdisk_get_label                      (*sym_fdisk_get_label)
+#define fdisk_get_npartitions                (*sym_fdisk_get_npartitions)
+#define fdisk_get_nsectors                   (*sym_fdisk_get_nsectors)
+#define fdisk_get_partition                  (*sym_fdisk_get_partition)
+#define fdisk_has_label                      (*sym_fdisk_has_label)
+#define fdisk_init_debug                     (*sym_fdisk_init_debug)
+#define fdisk_is_labeltype                   (*sym_fdisk_is_labeltype)
+#define fdisk_is_partition_used              (*sym_fdisk_is_partition_used)
+#define fdisk_label_get_parttype_from_code   (*sym_fdisk_label_get_parttype_from_code)
+#define fdisk_label_get_type                 (*sym_fdisk_label_get_type)
+#define fdisk_new_context                    (*sym_fdisk_new_context)
+#define fdisk_new_partition                  (*sym_fdisk_new_partition)
+#define fdisk_partition_end_follow_default   (*sym_fdisk_partition_end_follow_default)
+#define fdisk_partition_get_end              (*sym_fdisk_partition_get_end)
+#define fdisk_partition_get_partno           (*sym_fdisk_partition_get_partno)
+#define fdisk_partition_get_size             (*sym_fdisk_partition_get_size)
+#define fdisk_partition_get_start            (*sym_fdisk_partition_get_start)
+#define fdisk_partition_get_type             (*sym_fdisk_partition_get_type)
+#define fdisk_partition_set_partno           (*sym_fdisk_partition_set_partno)
+#define fdisk_partition_set_size             (*sym_fdisk_partition_set_size)
+#define fdisk_partition_set_start            (*sym_fdisk_partition_set_start)
+#define fdisk_partition_set_type             (*sym_fdisk_partition_set_type)
+#define fdisk_partition_start_follow_default (*sym_fdisk_partition_start_follow_default)
+#define fdisk_parttype_get_code              (*sym_fdisk_parttype_get_code)
+#define fdisk_parttype_get_name              (*sym_fdisk_parttype_get_name)
+#define fdisk_unref_context                  (*sym_fdisk_unref_context)
+#define fdisk_unref_partition                (*sym_fdisk_unref_partition)
+#define fdisk_unref_parttype                 (*sym_fdisk_unref_parttype)
+#define fdisk_write_disklabel                (*sym_fdisk_write_disklabel)
+// clang-format on
+#endif /* FDISK_DL_IMPL */
+
+#endif /* USERFS_FDISK_DL_H */
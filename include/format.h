@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_FORMAT_H
+#define USERFS_FORMAT_H
+
+#include <stdio.h>
+
+#include "disk.h"
+
+/*
+ * First boot format decision.
+ *
+ * When the userfs partition was just created (and neither -t nor -f is
+ * given), the partition is inspected instead of being formatted blindly:
+ *  - a healthy userfs btrfs (label FORMAT_LABEL, valid primary superblock,
+ *    first mirror in sync, fits in the partition) is kept;
+ *  - a blank region (FORMAT_SCAN_SAMPLES samples of FORMAT_SCAN_SAMPLE_SIZE
+ *    bytes spread over the partition, all 0x00 or all 0xff, e.g. a pre-erased
+ *    card) is formatted without discard (mkfs.btrfs -K);
+ *  - anything else is formatted with discard, as before.
+ *
+ * The samples are large sequential O_DIRECT reads, checked with NEON or SSE2
+ * when available.
+ */
+
+#define FORMAT_LABEL "userfs"
+
+#if !defined(FORMAT_SCAN_SAMPLES)
+#define FORMAT_SCAN_SAMPLES 16u
+#endif
+
+#if !defined(FORMAT_SCAN_SAMPLE_SIZE)
+#define FORMAT_SCAN_SAMPLE_SIZE (1024u * 1024u)
+#endif
+
+enum format_mode {
+    FORMAT_MODE_KEEP = 0, // Healthy userfs filesystem, do not format
+    FORMAT_MODE_FAST,     // Blank region, format without discard
+    FORMAT_MODE_FULL,     // Format with discard
+};
+
+/**
+ * Decide how to format a newly created userfs partition.
+ *
+ * @param device The partition device.
+ * @param info The probed filesystem of the partition.
+ * @param mode Output decision, FORMAT_MODE_FULL on error.
+ * @return 0 on success, -1 on failure (the device could not be read).
+ */
+int format_decide(const char *device, const struct fs_info *info, enum format_mode *mode);
+
+const char *format_mode_to_string(enum format_mode mode);
+
+void format_write_json(FILE *fp);
+
+#endif /* USERFS_FORMAT_H */
@@ -21,6 +21,8 @@
 
 int fs_probe(const char *part_device, struct fs_info *info);
 
+const char *fs_type_to_string(enum fs_type type);
+
 void fs_info_display(const struct fs_info *info);
 
 #endif /* USERFS_FS_H */
\ No newline at end of file
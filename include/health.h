@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_HEALTH_H
+#define USERFS_HEALTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Btrfs health telemetry: device error counters (BTRFS_IOC_GET_DEV_STATS,
+ * summed over the devices of the filesystem) and transaction commit statistics
+ * (/sys/fs/btrfs/<fsid>/commit_stats).
+ *
+ * A snapshot is part of the boot report. "userfs health -d" keeps sampling
+ * them, writes HEALTH_PROM_PATH at every interval and flags new device errors
+ * and slow or degrading commits.
+ */
+
+#define HEALTH_PROM_PATH "/run/userfs/health.prom"
+
+#define HEALTH_DEV_STAT_COUNT 5u
+
+struct btrfs_health {
+    char fsid[37];
+    uint64_t devices;
+    uint64_t dev_stats[HEALTH_DEV_STAT_COUNT]; // Indexed by BTRFS_DEV_STAT_*
+
+    bool has_commit_stats; // commit_stats is only available since Linux 6.0
+    uint64_t commits;
+    uint64_t last_commit_ms;
+    uint64_t max_commit_ms;
+    uint64_t total_commit_ms;
+};
+
+/**
+ * Collect the health counters of a mounted btrfs filesystem.
+ *
+ * @param mount_point Any path in the filesystem.
+ * @param health Output counters.
+ * @return 0 on success, -1 on failure.
+ */
+int health_collect(const char *mount_point, struct btrfs_health *health);
+
+void health_write_json(FILE *fp, const struct btrfs_health *health);
+
+/**
+ * Write the health counters in the Prometheus text format.
+ *
+ * @param fp Output file.
+ * @param health Counters to write.
+ * @param prefix Metric name prefix (e.g. "userfs_btrfs_").
+ */
+void health_write_prom(FILE *fp, const struct btrfs_health *health, const char *prefix);
+
+int health_cmd_run(int argc, char *argv[]);
+
+#endif /* USERFS_HEALTH_H */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_HISTORY_H
+#define USERFS_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Boot history: fixed-size ring of fixed-size records stored in vol-data.
+ *
+ * Appending a record is a single pwrite() at the next slot (no fsync), each
+ * record carries a crc32c so that torn or stale writes are simply ignored
+ * when the ring is read back.
+ */
+
+#define HISTORY_FILE_NAME ".userfs-history"
+#define HISTORY_CAPACITY  1024u
+#define HISTORY_MAX_STEPS 8u
+
+#define HISTORY_FLAG_FIRST_BOOT (1u << 0)
+
+struct history_record {
+    uint32_t magic;
+    uint32_t seq; // Monotonic sequence number, slot is seq % capacity
+    int64_t timestamp;
+    uint64_t run_written_bytes; // Written to the disk during the run
+    uint64_t dev_written_bytes; // Written to the disk since power on
+    int32_t exit_code;
+    uint32_t flags;
+    uint32_t total_us;
+    uint32_t step_us[HISTORY_MAX_STEPS];
+    uint8_t step_action[HISTORY_MAX_STEPS]; // enum report_action
+    uint8_t _reserved[40];
+    uint32_t crc; // crc32c of all the fields above
+};
+
+/**
+ * Append a record to the history file of the mounted userfs filesystem.
+ *
+ * The file is created on first use. The record magic, sequence number and crc
+ * are filled in by this function.
+ *
+ * @param rec The record to append.
+ * @return 0 on success, -1 on failure.
+ */
+int history_append(struct history_record *rec);
+
+/**
+ * Rewrite a record previously appended with history_append().
+ *
+ * Used by the deferred worker to complete the record of its boot with the
+ * timings of the deferred steps. Nothing is written if the slot was reused.
+ *
+ * @param rec The record to rewrite (same seq), the crc is updated.
+ * @return 0 on success, -1 on failure.
+ */
+int history_update(struct history_record *rec);
+
+/**
+ * Get the duration of a step in the most recent boot where it ran.
+ *
+ * @param step The step (enum report_step).
+ * @param us Output duration in microseconds.
+ * @return 0 on success, -1 if there is no such record.
+ */
+int history_last_step_us(size_t step, uint32_t *us);
+
+/**
+ * Get the number of bytes written to the userfs disk since power on.
+ *
+ * @param bytes Output number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int history_disk_written_bytes(uint64_t *bytes);
+
+int history_cmd_stats(int argc, char *argv[]);
+
+#endif /* USERFS_HISTORY_H */
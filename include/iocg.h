@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_IOCG_H
+#define USERFS_IOCG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Cgroup v2 I/O isolation of the userfs disk.
+ *
+ * Each slice is a cgroup (relative to IOCG_ROOT, e.g. "bulk.slice" for
+ * systemd units with Slice=bulk.slice) whose io.weight, io.latency and io.max
+ * are set for the userfs disk. The io controller works on whole disks, the
+ * settings apply to DISK and therefore to all its partitions.
+ *
+ * The slices are part of the write profiles (see wear.h), and only applied
+ * when built with -Dcgroup_io=true.
+ */
+
+#define IOCG_ROOT       "/sys/fs/cgroup"
+#define IOCG_MAX_SLICES 4u
+
+struct iocg_slice {
+    const char *name;
+    unsigned int weight;     // io.weight (1-10000), 0 to leave unchanged
+    unsigned int latency_us; // io.latency target, 0 to leave unchanged
+    uint64_t rbps;           // io.max, 0 for no limit
+    uint64_t wbps;
+    unsigned int riops;
+    unsigned int wiops;
+};
+
+/**
+ * Create the slices and configure their I/O controls for the userfs disk.
+ *
+ * A setting the kernel does not support (e.g. io.latency without
+ * CONFIG_BLK_CGROUP_IOLATENCY) is logged and skipped.
+ *
+ * @param slices Slices to configure.
+ * @param count Number of slices.
+ * @return 0 on success, -1 if any slice could not be fully configured.
+ */
+int iocg_apply(const struct iocg_slice *slices, size_t count);
+
+void iocg_write_json(FILE *fp);
+
+#endif /* USERFS_IOCG_H */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_KIOSK_H
+#define USERFS_KIOSK_H
+
+/*
+ * Ephemeral kiosk mode (userfs -k).
+ *
+ * The userfs filesystem is mounted read-only and never written to, unless it
+ * has to be provisioned. The persisted upper directories (vol-config/etc,
+ * vol-data/var, ...) become read-only middle layers of the overlays, whose
+ * upper and work directories are on a tmpfs of KIOSK_TMPFS_SIZE at
+ * KIOSK_ROOT: all the changes are discarded on reboot.
+ *
+ * "userfs commit PATH..." persists selected paths: the subvolumes holding them
+ * are snapshotted (in KIOSK_DIR_NAME), the paths copied from the merged view
+ * into the snapshots (a deleted path becomes a whiteout), then the snapshots
+ * replace the subvolumes for the next boot. The running overlays keep the
+ * subvolumes they were mounted with, kept as "<subvolume>.prev" until a
+ * commit of a later boot.
+ */
+
+#define KIOSK_ROOT     "/run/userfs/kiosk"
+#define KIOSK_DIR_NAME ".kiosk"
+
+#if !defined(KIOSK_TMPFS_SIZE)
+#define KIOSK_TMPFS_SIZE "64m"
+#endif
+
+/**
+ * Mount the tmpfs holding the overlay upper and work directories.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int kiosk_mount_tmpfs(void);
+
+int kiosk_cmd_commit(int argc, char *argv[]);
+
+#endif /* USERFS_KIOSK_H */
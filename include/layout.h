@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_LAYOUT_H
+#define USERFS_LAYOUT_H
+
+#include <stdbool.h>
+
+/*
+ * Versioned layout of the userfs filesystem (subvolumes, overlay upper and
+ * work directories).
+ *
+ * The layout version is stored in LAYOUT_FILE_NAME at the root of the
+ * filesystem (outside of the subvolumes, so that restoring or replacing a
+ * subvolume keeps it). Filesystems without it have the version 1 layout, or
+ * the version 0 layout if converted from ext4.
+ *
+ * Migrations from one version to the next are lists of operations that never
+ * copy file data: renames, subvolume snapshots and removal of the entries a
+ * split subvolume does not keep. Each operation is idempotent and the next
+ * operation to run is checkpointed in the layout record (synced) before it
+ * runs, an interrupted migration resumes at the next boot.
+ *
+ * Versions:
+ *  0: converted ext4 (see convert.h), overlay directories at the root
+ *  1: vol-data (/var, /home, /opt), vol-config (/etc)
+ *  2: /opt upper and work directories in their own vol-opt subvolume
+ *
+ * The migrations do not depend on the build options (e.g. -Doverlay_opt):
+ * the version recorded by one build must hold for any later one. A migration
+ * with nothing to move only records the new version.
+ */
+
+#define LAYOUT_FILE_NAME ".userfs-layout"
+#define LAYOUT_VERSION   2u
+
+/**
+ * Bring the layout of the mounted userfs filesystem to LAYOUT_VERSION.
+ *
+ * Must run before the subvolumes are created and the overlays mounted.
+ *
+ * @param formatted The filesystem was just created, it has the current layout.
+ * @return 0 on success, -1 on failure.
+ */
+int layout_migrate(bool formatted);
+
+/* Whether the layout is up to date (no migration to run), does not write */
+bool layout_is_current(void);
+
+/* Layout version of the mounted filesystem, 0 if unknown or not migrated yet */
+unsigned int layout_get_version(void);
+
+#endif /* USERFS_LAYOUT_H */
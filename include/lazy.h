@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_LAZY_H
+#define USERFS_LAZY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "overlays.h"
+
+/*
+ * On-demand activation of the deferrable overlays (-Dlazy_overlays).
+ *
+ * Each overlay mount point of USERFS_LAZY_OVERLAYS (e.g. "/home,/opt") gets
+ * an autofs direct mount instead of its overlay. The overlay is mounted on top
+ * of it on first access, the accessing process waits meanwhile, and a tree
+ * never accessed costs nothing but the autofs mount.
+ *
+ * The autofs mounts are served by a detached process (own session, the autofs
+ * "pgrp" so its own accesses never trigger a mount). Before the autofs mount
+ * covers it, the lower directory is bind mounted on LAZY_LOWER_ROOT/<name>
+ * to remain reachable by the overlay. The process exits once all its overlays
+ * are mounted. With systemd, the unit needs RemainAfterExit=yes so that the
+ * process is not stopped with the main one.
+ *
+ * The critical overlays (/etc, /var) are always mounted eagerly.
+ */
+
+#define LAZY_LOWER_ROOT "/run/userfs/lazy"
+
+#if !defined(USERFS_LAZY_OVERLAYS)
+#define USERFS_LAZY_OVERLAYS "" // Every overlay is mounted eagerly
+#endif
+
+/* Whether an overlay is activated on demand */
+bool lazy_is_enabled(const struct overlayfs_mount_point *mp);
+
+/**
+ * Set up the autofs mounts of the given overlays and start serving them.
+ *
+ * @param mps Overlays to activate on demand.
+ * @param count Number of overlays.
+ * @param kiosk Mount the overlays in kiosk mode (see kiosk.h).
+ * @return 0 once the autofs mounts are in place, -1 on failure (nothing
+ *         mounted, the overlays should be mounted eagerly).
+ */
+int lazy_arm(const struct overlayfs_mount_point *const *mps, size_t count, bool kiosk);
+
+#endif /* USERFS_LAZY_H */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_LOG_H
+#define USERFS_LOG_H
+
+#include <stddef.h>
+
+/*
+ * Buffered logging.
+ *
+ * Every message is stored in a fixed-size in-memory ring. Only messages at or
+ * below the console level (warnings by default) are written synchronously to
+ * stderr and /dev/kmsg, as the console is often a slow serial line at boot.
+ * The whole ring is written to a file with log_flush() once a writable
+ * filesystem is available.
+ */
+
+#define LOG_RING_SIZE   (64u * 1024u)
+#define LOG_MSG_MAX_LEN 512u
+
+#define LOG_USERFS_PATH "/mnt/userfs/userfs.log"
+#define LOG_RUN_PATH    "/run/userfs/userfs.log"
+
+enum log_level {
+    LOG_LEVEL_NONE = 0,
+    LOG_LEVEL_ERR  = 1,
+    LOG_LEVEL_WRN  = 2,
+    LOG_LEVEL_INF  = 3,
+    LOG_LEVEL_DBG  = 4,
+};
+
+void log_set_console_level(enum log_level level);
+
+void log_write(enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Write the content of the log ring to a file (truncated first).
+ *
+ * @param path The file to write the log to.
+ * @return 0 on success, -1 on failure.
+ */
+int log_flush(const char *path);
+
+#define LOG_ERR(...) log_write(LOG_LEVEL_ERR, __VA_ARGS__)
+#define LOG_WRN(...) log_write(LOG_LEVEL_WRN, __VA_ARGS__)
+#define LOG_INF(...) log_write(LOG_LEVEL_INF, __VA_ARGS__)
+#define LOG_DBG(...) log_write(LOG_LEVEL_DBG, __VA_ARGS__)
+
+#endif /* USERFS_LOG_H */
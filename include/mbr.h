@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_MBR_H
+#define USERFS_MBR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+/*
+ * Built-in DOS partition table reader.
+ *
+ * Reads the MBR and the EBR chain, one 512-byte read each, and numbers the
+ * partitions as libfdisk does: primary partitions 0 to 3, logical partitions
+ * from 4. This is all the inspection path needs, libfdisk is only loaded when
+ * the partition table has to be changed (see fdisk_dl.h).
+ */
+
+#define MBR_SECTOR_SIZE 512u
+#define MBR_MAX_EBRS    128u // Bound of the EBR chain, loops are not followed
+
+#define MBR_PARTTYPE_SWAP 0x82u
+
+struct mbr_entry {
+    size_t partno;
+    uint8_t type;
+    uint64_t start; // In sectors
+    uint64_t size;  // In sectors
+    uint64_t ebr;   // Sector of the EBR of a logical partition, 0 for a primary one
+};
+
+/* Called for each partition (including the extended one), non-zero to stop */
+typedef int (*mbr_walk_cb)(const struct mbr_entry *entry, void *arg);
+
+/**
+ * Walk the DOS partition table of a device or image.
+ *
+ * @param fd Open device or image.
+ * @param cb Called for each used partition, in partition number order.
+ * @param arg Passed to cb.
+ * @return 0 on success, the cb result if non-zero, -1 on failure (errno
+ *         EINVAL: no DOS partition table).
+ */
+int mbr_walk(int fd, mbr_walk_cb cb, void *arg);
+
+/**
+ * Fill a disk_info from the DOS partition table of a device, with the same
+ * content as read by libfdisk.
+ *
+ * @param device The block device.
+ * @param disk Output disk information.
+ * @return 0 on success, -1 on failure (errno EINVAL: no DOS partition table).
+ */
+int mbr_read_disk(const char *device, struct disk_info *disk);
+
+bool mbr_is_extended(uint8_t type);
+
+#endif /* USERFS_MBR_H */
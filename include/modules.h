@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_MODULES_H
+#define USERFS_MODULES_H
+
+#include <stdio.h>
+
+/*
+ * Kernel module preloading.
+ *
+ * On modular kernels, the first btrfs mount (step2) and the first overlay
+ * mount (step3) block in request_module() while the module and its
+ * dependencies (e.g. crc32c, xxhash, zstd for btrfs) are loaded. The
+ * USERFS_PRELOAD_MODULES modules (-Dpreload_modules) are instead loaded at
+ * program entry by a thread, meanwhile the disk is inspected.
+ *
+ * Dependencies are resolved from /lib/modules/$(uname -r)/modules.dep, and
+ * each module is loaded with finit_module() (compressed modules with
+ * MODULE_INIT_COMPRESSED_FILE, kernel decompression). The soft dependencies
+ * of modules.softdep (e.g. "btrfs pre: crc32c") are loaded before (pre:) or
+ * after (post:) the module, an alias (crc32c) is resolved with modules.alias;
+ * a failed soft dependency is only logged. The softdep lines of
+ * /etc/modprobe.d are not read. Modules already loaded
+ * or built in are skipped. A mount racing with the thread simply waits for
+ * the module being loaded, a failed preload is reported and left to
+ * request_module().
+ */
+
+#define MODULES_MAX     4u
+#define MODULES_DIR     "/lib/modules"
+#define MODULES_DEP     "modules.dep"
+#define MODULES_SOFTDEP "modules.softdep"
+#define MODULES_ALIAS   "modules.alias"
+
+#if !defined(USERFS_PRELOAD_MODULES)
+#define USERFS_PRELOAD_MODULES "" // No preloading
+#endif
+
+/**
+ * Start loading the USERFS_PRELOAD_MODULES modules in a thread.
+ *
+ * @return 0 on success (or nothing to load), -1 if the thread cannot start.
+ */
+int modules_start(void);
+
+/* Wait for the preloading thread, can be called again */
+void modules_wait(void);
+
+void modules_write_json(FILE *fp);
+
+#endif /* USERFS_MODULES_H */
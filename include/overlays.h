@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_OVERLAYS_H
+#define USERFS_OVERLAYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct overlayfs_mount_point {
+    const char *lowerdir;
+    const char *upper_name;
+    const char *work_name;
+    const char *mount_point;
+    size_t btrfs_sv_index;
+    bool deferrable; // Not needed by services at boot, see deadline.h
+};
+
+const struct overlayfs_mount_point *overlayfs_get_mount_point(size_t index);
+
+/* Whether an overlay is currently mounted on the given mount point */
+bool overlayfs_is_mounted(const char *mount_point);
+
+/**
+ * Build the path of the upper directory of an overlay mount point.
+ *
+ * @param buf Output buffer.
+ * @param size Size of the output buffer.
+ * @param mp The overlay mount point.
+ * @return Number of characters written (as snprintf) or -1 on error.
+ */
+int overlayfs_build_upper_dir(char *buf,
+                              size_t size,
+                              const struct overlayfs_mount_point *mp);
+
+/**
+ * Create the upper and work directories of an overlay and mount it.
+ *
+ * @param mp The overlay mount point.
+ * @param lowerdir Lower directory, mp->lowerdir unless covered (see lazy.h).
+ * @param kiosk Keep the changes in the kiosk tmpfs (see kiosk.h).
+ * @return 0 on success, -1 on failure.
+ */
+int overlayfs_mount_lower(const struct overlayfs_mount_point *mp,
+                          const char *lowerdir,
+                          bool kiosk);
+
+#endif /* USERFS_OVERLAYS_H */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_REPORT_H
+#define USERFS_REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "history.h"
+
+#define REPORT_DIR       "/run/userfs"
+#define REPORT_JSON_PATH REPORT_DIR "/report.json"
+#define REPORT_PROM_PATH REPORT_DIR "/userfs.prom"
+
+#define REPORT_MAX_MOUNTS 16u
+
+enum report_step {
+    REPORT_STEP_PARTITION = 0,
+    REPORT_STEP_PARTPROBE,
+    REPORT_STEP_BTRFS,
+    REPORT_STEP_OVERLAYFS,
+    REPORT_STEP_SWAP,
+    REPORT_STEP_LATE_OVERLAYFS, // Deferrable overlays (/home, /opt)
+    REPORT_STEP_DEVICES,        // Waiting for the additional devices (see devices.h)
+    REPORT_STEP_COUNT,
+};
+
+enum report_action {
+    REPORT_ACTION_NONE = 0, // Step did not run (or has nothing to report)
+    REPORT_ACTION_SKIPPED,  // Step ran but nothing had to be done
+    REPORT_ACTION_CREATED,
+    REPORT_ACTION_FORMATTED,
+    REPORT_ACTION_MOUNTED,
+    REPORT_ACTION_FAILED,
+    REPORT_ACTION_DEFERRED, // Step handed to the deferred worker (see deadline.h)
+    REPORT_ACTION_CONVERTED, // ext4 filesystem converted to btrfs (see convert.h)
+};
+
+void report_init(void);
+
+void report_step_begin(enum report_step step);
+
+void report_step_end(enum report_step step, int ret);
+
+void report_set_action(enum report_step step, enum report_action action);
+
+void report_add_mount(const char *source,
+                      const char *target,
+                      const char *fstype,
+                      const char *options);
+
+void report_set_disk(const struct disk_info *disk);
+
+const char *report_step_name(enum report_step step);
+
+/**
+ * Fill a boot history record with the timings and actions of this run.
+ *
+ * @param rec The record to fill.
+ * @param ret The exit code of the program.
+ */
+void report_fill_history(struct history_record *rec, int ret);
+
+/**
+ * Write the boot report to REPORT_JSON_PATH and REPORT_PROM_PATH.
+ *
+ * Both files are written to a temporary file first and renamed over the
+ * previous report, so readers (e.g. node_exporter) never see a partial file.
+ *
+ * @param ret The exit code of the program.
+ * @return 0 on success, -1 on failure.
+ */
+int report_write(int ret);
+
+#endif /* USERFS_REPORT_H */
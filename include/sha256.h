@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_SHA256_H
+#define USERFS_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-256 (FIPS 180-4), used for the bmap checksums */
+
+#define SHA256_DIGEST_SIZE 32u
+#define SHA256_BLOCK_SIZE  64u
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    uint8_t block[SHA256_BLOCK_SIZE];
+    size_t block_len;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/* Lowercase hexadecimal representation, hex must hold 2 * SHA256_DIGEST_SIZE + 1 */
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex);
+
+#endif /* USERFS_SHA256_H */
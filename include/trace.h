@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_TRACE_H
+#define USERFS_TRACE_H
+
+/*
+ * USDT (SystemTap SDT compatible) static tracepoints, provider "userfs".
+ *
+ * When built with -Dusdt=enabled (or auto and <sys/sdt.h> is available), each
+ * TRACE() site compiles to a single NOP plus a .note.stapsdt entry, so probes
+ * can be attached in the field without rebuilding, e.g.:
+ *
+ *     bpftrace -e 'usdt:/usr/bin/userfs:userfs:step__exit { ... }'
+ *
+ * Without <sys/sdt.h> the macros compile to nothing.
+ *
+ * Probes (arguments in order):
+ *   step__entry          (int step, const char *name)
+ *   step__exit           (int step, const char *name, int ret)
+ *   fdisk__add_part      (size_t partno, u64 start, u64 size, int ret)
+ *   fdisk__delete_part   (size_t partno, int ret)
+ *   fdisk__write_label   (const char *disk, int ret)
+ *   fs__probe__entry     (const char *device)
+ *   fs__probe__exit      (const char *device, int fs_type, int ret)
+ *   command__spawn       (const char *program, int pid)
+ *   command__exit        (const char *program, int pid, int ret)
+ *   mount__entry         (const char *source, const char *target, const char *fstype)
+ *   mount__exit          (const char *target, int ret, int errno)
+ *   umount__entry        (const char *target)
+ *   umount__exit         (const char *target, int ret, int errno)
+ */
+
+#if defined(USERFS_USDT)
+
+#include <sys/sdt.h>
+
+#define TRACE(name)                 DTRACE_PROBE(userfs, name)
+#define TRACE1(name, a)             DTRACE_PROBE1(userfs, name, a)
+#define TRACE2(name, a, b)          DTRACE_PROBE2(userfs, name, a, b)
+#define TRACE3(name, a, b, c)       DTRACE_PROBE3(userfs, name, a, b, c)
+#define TRACE4(name, a, b, c, d)    DTRACE_PROBE4(userfs, name, a, b, c, d)
+
+#else
+
+#define TRACE(name)                 do { } while (0)
+#define TRACE1(name, a)             do { (void)(a); } while (0)
+#define TRACE2(name, a, b)          do { (void)(a); (void)(b); } while (0)
+#define TRACE3(name, a, b, c)       do { (void)(a); (void)(b); (void)(c); } while (0)
+#define TRACE4(name, a, b, c, d)    do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#endif /* USERFS_USDT */
+
+#endif /* USERFS_TRACE_H */
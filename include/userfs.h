@@ -15,16 +15,20 @@
  *
  * 1. PARSE ARGUMENTS:
  *    - Parse command line options:
- *      * -v: Enable verbose output
+ *      * -v: Enable verbose output (all log levels on the console)
  *      * -d: Delete userfs partition and exit
  *      * -f: Force mkfs.btrfs even if already initialized (mutually exclusive with -t)
  *      * -t: Trust existing userfs filesystem after partition creation (first boot only)
  *      * -o: Skip overlayfs setup (useful for debugging)
+ *      * -k: Kiosk mode (see kiosk.h)
+ *      * -b MS: Boot deadline for the deferrable steps (see deadline.h)
+ *      * -x DEV:ROLE: Additional device to provision (see devices.h)
  *      * -h: Show help message
  *
  * 2. DISK INSPECTION & PARTITION MANAGEMENT:
  *    - Get disk size using ioctl(BLKGETSIZE64) on /dev/mmcblk0
- *    - Read existing partition table using libfdisk
+ *    - Read existing partition table (MBR and EBRs) with the built-in reader,
+ *      libfdisk is only loaded if the table has to change (see mbr.h)
  *    - Analyze current partitions (boot, rootfs, userfs)
  *
  *    IF delete flag (-d):
@@ -35,11 +39,22 @@
  *      
  *    FIRST BOOT vs SUBSEQUENT BOOT LOGIC:
  *      - If partition was just created (first boot):
- *        * Default: Force format to BTRFS (ignores existing filesystem)
+ *        * Default: Keep a healthy userfs filesystem, format a blank partition
+ *          without discard, format anything else to BTRFS (see format.h)
  *        * With -t flag: Trust existing filesystem without formatting
  *      - If partition already existed (subsequent boots):
  *        * Preserve existing filesystem unless -f flag is used
  *
+ *    Additional devices (-x, -Ddevices) are provisioned by one thread each
+ *    meanwhile, and waited for before the BTRFS filesystem is mounted
+ *    (see devices.h)
+ *
+ *    The kernel modules of the mounts (btrfs, overlay) are loaded by a thread
+ *    meanwhile (see modules.h)
+ *
+ *    With -Dboost, steps 2 to 6 (up to the /etc and /var overlays) run with a
+ *    raised I/O and CPU priority, restored afterwards (see boost.h)
+ *
  * 3. PARTITION TABLE REFRESH:
  *    - Run `partprobe /dev/mmcblk0` to refresh kernel partition table
  *    - Wait for device nodes to appear
@@ -50,24 +65,45 @@
  *
  * 5. BTRFS FILESYSTEM CREATION:
  *    - Skip if already BTRFS and not forced (-f flag) and not first boot
- *    - Run `mkfs.btrfs -f /dev/mmcblk0p3` if:
+ *    - Convert a legacy ext4 userfs in place with btrfs-convert (see convert.h)
+ *    - Run `mkfs.btrfs -f -L userfs /dev/mmcblk0p3` if:
  *      * Partition is unformatted, OR
  *      * Force flag (-f) is used, OR  
- *      * First boot and trust flag (-t) is NOT used
+ *      * First boot, trust flag (-t) is NOT used and the partition does not
+ *        hold a healthy userfs filesystem (-K if the partition is blank)
  *    - Create mount point /mnt/userfs
  *    - Mount BTRFS filesystem on /mnt/userfs
- *    - Create BTRFS subvolumes (only when filesystem is newly created):
+ *    - Migrate the layout of an existing filesystem (see layout.h)
+ *    - Create missing BTRFS subvolumes:
  *      * vol-data (for /var and /home overlays)
  *      * vol-config (for /etc overlay)
+ *      * vol-opt (for /opt overlay, with -Doverlay_opt=true)
+ *      * vol-containers (container storage, with -Dcontainers=true)
  *
  * 6. OVERLAYFS SETUP (skipped if -o flag used):
  *    - Unmount existing /var/volatile tmpfs
- *    - For each mount point (/etc, /var, /home):
+ *    - For each mount point (/etc, /var, then /home and /opt if deferrable steps
+ *      fit in the boot deadline, after the boot otherwise):
  *      * Create upper and work directories in appropriate BTRFS subvolumes
  *      * Unmount existing mount if present
  *      * Mount overlayfs with lowerdir=original, upperdir=persistent, workdir=work
+ *    - /home and /opt in -Dlazy_overlays get an autofs mount instead, their
+ *      overlay is mounted on first access (see lazy.h)
+ *    - Bind mount vol-containers on the container storage path (not overlaid)
  *    - Remount /var/volatile as tmpfs with mode 0755
  *
+ * 7. DEFERRED STEPS:
+ *    - Steps which did not fit in the boot deadline (late overlays, swap) run
+ *      in a detached worker, after readiness is signaled (see deadline.h)
+ *
+ * 8. BOOT REPORT AND LOG (always, even on failure):
+ *    - Write /run/userfs/report.json and /run/userfs/userfs.prom atomically
+ *    - Disk layout, probed filesystems, per-step action and duration,
+ *      mount options in effect, free space and swap state
+ *    - Messages are kept in an in-memory ring, only warnings and errors go to
+ *      the console and /dev/kmsg. The full log is written to
+ *      /mnt/userfs/userfs.log (or /run/userfs/userfs.log on failure)
+ *
  * RESULT:
  * The program creates a persistent userfs partition with BTRFS and sets up
  * overlayfs mounts to make /etc, /var, and /home writable and persistent
@@ -130,6 +166,22 @@
 #include "btrfs.h"
 #include "utils.h"
 #include "fs.h"
+#include "history.h"
+#include "log.h"
+#include "report.h"
+#include "health.h"
+#include "wear.h"
+#include "iocg.h"
+#include "layout.h"
+#include "kiosk.h"
+#include "deadline.h"
+#include "boost.h"
+#include "devices.h"
+#include "modules.h"
+#include "format.h"
+#include "convert.h"
+#include "overlays.h"
+#include "lazy.h"
 
 #ifndef DISK
 #define DISK "/dev/mmcblk0"
@@ -155,24 +207,18 @@
 #define FLAG_USERFS_FORCE_FORMAT   (1 << 2u)
 #define FLAG_USERFS_TRUST_RESIDENT (1 << 3u)
 #define FLAG_USERFS_SKIP_OVERLAYS  (1 << 4u)
-
-extern int verbose;
+#define FLAG_USERFS_KIOSK          (1 << 5u)
+#define FLAG_USERFS_FIRST_BOOT     (1 << 6u) // Partition created, format decided by step2
 
 struct args {
-    uint32_t flags; // Bitmask for flags
+    uint32_t flags;       // Bitmask for flags
+    uint32_t deadline_ms; // Boot deadline, 0 for none
 };
 
-#define LOG(fmt, ...)                                                                    \
-    do {                                                                                 \
-        if (verbose) {                                                                   \
-            printf(fmt, ##__VA_ARGS__);                                                  \
-        }                                                                                \
-    } while (0)
-
 #define ASSERT(cond, msg)                                                                \
     do {                                                                                 \
         if (!(cond)) {                                                                   \
-            fprintf(stderr, "Assertion failed: %s\n", msg);                              \
+            LOG_ERR("Assertion failed: %s\n", msg);                                     \
             return -1;                                                                   \
         }                                                                                \
     } while (0)
@@ -185,6 +231,8 @@ int step2_create_btrfs_filesystem(struct args *args, struct disk_info *disk, siz
 
 int step3_create_overlayfs(struct args *args);
 
+int step3_create_late_overlayfs(struct args *args);
+
 int step4_format_swap_partition(struct args *args, struct disk_info *disk, size_t swap_partno);
 
 #endif /* USERFS_H */
\ No newline at end of file
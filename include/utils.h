@@ -24,8 +24,25 @@
 
 int create_directory(const char *dir);
 
+/* Create a directory and its missing parents, like mkdir -p */
+int create_directories(const char *path);
+
+/* Remove an entry relative to dir_fd and, for a directory, its content */
+int remove_tree_at(int dir_fd, const char *name);
+
 void command_display(const char *program, char *const argv[]);
 
 int command_run(char *buf, size_t *buflen, const char *program, char *const argv[]);
 
+int do_mount(const char *source,
+             const char *target,
+             const char *fstype,
+             unsigned long flags,
+             const void *data);
+
+int do_umount2(const char *target, int flags);
+
+/* CRC-32C (Castagnoli), as used by btrfs. Pass 0 as initial crc. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
 #endif /* USERFS_UTILS_H */
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef USERFS_WEAR_H
+#define USERFS_WEAR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "iocg.h"
+
+/*
+ * Wear-aware write profile.
+ *
+ * The wear of the card is estimated from the eMMC device health report
+ * (life_time, pre_eol_info in sysfs) when available, otherwise from the bytes
+ * written to the disk over its lifetime (persisted in WEAR_FILE_NAME) against
+ * an endurance of WEAR_SD_ENDURANCE_CYCLES full device writes.
+ *
+ * Worn cards switch to a reduced-write profile, applied right after the btrfs
+ * mount: longer commit interval, stronger compression, noatime and logs kept
+ * in RAM. Each profile also carries the cgroup v2 I/O slices of the disk
+ * (see iocg.h).
+ */
+
+#define WEAR_FILE_NAME ".userfs-wear"
+
+#if !defined(WEAR_SD_ENDURANCE_CYCLES)
+#define WEAR_SD_ENDURANCE_CYCLES 500u
+#endif
+
+#define WEAR_WORN_PERCENT     70
+#define WEAR_CRITICAL_PERCENT 90
+
+enum wear_level {
+    WEAR_LEVEL_HEALTHY = 0,
+    WEAR_LEVEL_WORN,
+    WEAR_LEVEL_CRITICAL,
+    WEAR_LEVEL_COUNT,
+};
+
+struct wear_profile {
+    const char *name;
+    unsigned long mount_flags;
+    const char *btrfs_options; // NULL: keep the default mount options
+    bool log_to_ram;
+    const struct iocg_slice *io_slices; // Applied with -Dcgroup_io=true
+    size_t io_slice_count;
+};
+
+struct wear_info {
+    // Card identification (/sys/block/<disk>/device), empty if not an MMC/SD
+    char type[8];
+    char name[16];
+    char cid[40];
+    unsigned int manfid;
+    unsigned int oemid;
+
+    // eMMC 5.0+ device health (EXT_CSD), 0 if not reported
+    unsigned int life_time_a;
+    unsigned int life_time_b;
+    unsigned int pre_eol;
+
+    bool has_lifetime_written;
+    uint64_t lifetime_written_bytes;
+
+    int used_percent; // Estimated share of the endurance used, -1 if unknown
+    enum wear_level level;
+};
+
+/**
+ * Evaluate the wear of the disk and apply the matching profile to the mounted
+ * userfs filesystem (remount with the profile options).
+ *
+ * @param part_device The userfs partition device.
+ * @param disk_size Size of the disk in bytes.
+ * @param readonly Keep the filesystem read-only, only evaluate the wear and
+ *                 apply the I/O slices.
+ * @return 0 on success, -1 on failure.
+ */
+int wear_apply_profile(const char *part_device, uint64_t disk_size, bool readonly);
+
+const struct wear_profile *wear_get_profile(void);
+
+/**
+ * Mount a tmpfs on /var/log if the profile keeps logs in RAM and it is not
+ * already on a tmpfs.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int wear_mount_log_tmpfs(void);
+
+/**
+ * Account the bytes written to the disk since the last call in the lifetime
+ * counter stored in the mounted userfs filesystem.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int wear_account(void);
+
+void wear_write_json(FILE *fp);
+
+void wear_write_prom(FILE *fp);
+
+#endif /* USERFS_WEAR_H */
@@ -0,0 +1,199 @@
+#!/bin/bash
+#
+# Syscall budget check of the boot paths, run in CI.
+#
+# Runs 'userfs budget' on a loop device for the three tracked scenarios and
+# checks each of them against its budget file in scripts/budget/:
+#
+#   first-boot  blank disk with 3 system partitions, userfs created as p4
+#   noop        the same disk on the next boot, already provisioned
+#   extended    blank disk with 4 system partitions, the last one is moved in
+#               an extended partition and userfs created as p6
+#
+# The userfs binaries must be native builds for LOOPDEV, e.g.:
+#
+#   meson build-budget -Dblock_device_name=/dev/loop32 -Dblock_device_type=mmc \
+#       -Duserfs_partno=3
+#   meson build-budget-ext -Dblock_device_name=/dev/loop32 \
+#       -Dblock_device_type=mmc -Duserfs_partno=5
+#
+# Each run happens in a private mount namespace with a private /run, overlays
+# and mounts never leak to the host.
+#
+# The budget files are generated, not written by hand. With -w, each scenario
+# is measured and its budget written from the counts: forks, daemons, threads,
+# execs, mounts and umounts follow the code path and are kept exact, the other
+# counters depend on the tools and kernel versions and get HEADROOM percent on
+# top. To refresh them after a change of the boot path, on the final tree:
+#
+#   just budget -u build-budget/userfs -x build-budget-ext/userfs -w scripts/budget
+#   git diff scripts/budget
+#
+# CI writes the same files on every run and uploads them as the 'budget'
+# artifact, they can be committed from there as well.
+
+set -euo pipefail
+
+usage() {
+    cat <<EOF
+Usage: $0 -u USERFS -x USERFS_EXT [OPTIONS]
+
+  -u USERFS      userfs built for LOOPDEV with -Duserfs_partno=3
+  -x USERFS_EXT  userfs built for LOOPDEV with -Duserfs_partno=5
+  -d LOOPDEV     Loop device userfs was built for (default: /dev/loop32)
+  -b DIR         Budget files directory (default: scripts/budget)
+  -w DIR         Write the budgets measured to DIR instead of checking them
+  -h             Show this help message
+EOF
+}
+
+USERFS=""
+USERFS_EXT=""
+LOOPDEV="/dev/loop32"
+BUDGET_DIR="$(dirname "$(realpath "$0")")/budget"
+WRITE_DIR=""
+
+while getopts "u:x:d:b:w:h" opt; do
+    case "$opt" in
+    u) USERFS="$(realpath "$OPTARG")" ;;
+    x) USERFS_EXT="$(realpath "$OPTARG")" ;;
+    d) LOOPDEV="$OPTARG" ;;
+    b) BUDGET_DIR="$(realpath "$OPTARG")" ;;
+    w) WRITE_DIR="$(realpath -m "$OPTARG")" ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 1 ;;
+    esac
+done
+
+if [ -z "$USERFS" ] || [ -z "$USERFS_EXT" ]; then
+    usage
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Error: must be run as root"
+    exit 1
+fi
+
+for tool in losetup sfdisk unshare partprobe mkfs.btrfs btrfs; do
+    if ! command -v "$tool" >/dev/null 2>&1; then
+        echo "Error: $tool not found"
+        exit 1
+    fi
+done
+
+# LOOPDEV is fixed at build time, it cannot be allocated dynamically
+if losetup "$LOOPDEV" >/dev/null 2>&1; then
+    echo "Error: $LOOPDEV is already in use"
+    exit 1
+fi
+
+WORKDIR="$(mktemp -d /var/tmp/userfs-budget.XXXXXX)"
+[ -n "$WRITE_DIR" ] && mkdir -p "$WRITE_DIR"
+
+cleanup() {
+    set +e
+    losetup -d "$LOOPDEV" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Loaded once for all: the first run would otherwise count the module loading
+modprobe -a btrfs overlay 2>/dev/null || true
+
+# Blank 2 GiB disk with the given sfdisk partitions, at least 1 GiB left free
+create_image() {
+    truncate -s 2G "$1"
+    sfdisk --quiet "$1"
+}
+
+attach_disk() {
+    losetup -P "$LOOPDEV" "$1"
+    udevadm settle 2>/dev/null || true
+}
+
+detach_disk() {
+    losetup -d "$LOOPDEV"
+    udevadm settle 2>/dev/null || true
+}
+
+# Measured counters that depend on the tools and kernel, in percent
+HEADROOM=25
+EXACT_COUNTERS="forks daemons threads execs mounts umounts"
+
+# Budget file from the counts measured by 'userfs budget -w'
+write_budget() {
+    local scenario="$1"
+    local measured="$2"
+
+    {
+        echo "# userfs syscall budget: $scenario, generated by scripts/budget.sh -w"
+        echo "# Counters other than $EXACT_COUNTERS have $HEADROOM% headroom"
+        awk -v headroom="$HEADROOM" -v exact="$EXACT_COUNTERS" '
+            BEGIN { n = split(exact, list, " "); for (i = 1; i <= n; i++) keep[list[i]] = 1 }
+            /^#/ || NF < 2 { next }
+            keep[$1] { print $1, $2; next }
+            { printf "%s %.0f\n", $1, int(($2 * (100 + headroom) + 99) / 100) }
+        ' "$measured"
+    } >"$WRITE_DIR/$scenario.txt"
+}
+
+FAILED=""
+
+# Trace a userfs run in a private mount namespace and check its budget
+run_budget() {
+    local scenario="$1"
+    local userfs="$2"
+    local args
+
+    if [ -n "$WRITE_DIR" ]; then
+        args="-w $WORKDIR/$scenario.measured"
+    else
+        args="-b $BUDGET_DIR/$scenario.txt"
+    fi
+
+    echo "== $scenario"
+    if ! unshare -m --propagation private bash -c '
+        mount -t tmpfs tmpfs /run
+        exec "$0" budget $1
+    ' "$userfs" "$args"; then
+        FAILED="$FAILED $scenario"
+    elif [ -n "$WRITE_DIR" ]; then
+        write_budget "$scenario" "$WORKDIR/$scenario.measured"
+    fi
+    echo
+}
+
+PRIMARY="$WORKDIR/primary.img"
+create_image "$PRIMARY" <<EOF
+label: dos
+size=64MiB, type=c, bootable
+size=256MiB, type=83
+size=256MiB, type=83
+EOF
+
+EXTENDED="$WORKDIR/extended.img"
+create_image "$EXTENDED" <<EOF
+label: dos
+size=64MiB, type=c, bootable
+size=256MiB, type=83
+size=256MiB, type=83
+size=64MiB, type=83
+EOF
+
+attach_disk "$PRIMARY"
+run_budget first-boot "$USERFS"
+detach_disk
+
+attach_disk "$PRIMARY"
+run_budget noop "$USERFS"
+detach_disk
+
+attach_disk "$EXTENDED"
+run_budget extended "$USERFS_EXT"
+detach_disk
+
+if [ -n "$FAILED" ]; then
+    echo "Budget check failed:$FAILED"
+    exit 1
+fi
@@ -0,0 +1,356 @@
+#!/bin/bash
+#
+# Crash-recovery latency harness.
+#
+# Runs a workload (userfs first boot, or userfs + writes) on a disk image
+# behind a dm-log-writes or dm-flakey target, simulates a power loss at many
+# points and measures the next boot (userfs run) for each of them: duration,
+# exit code and consistency of the filesystem and partition table.
+#
+# The userfs binary must be a native build for the loop device used by the
+# harness, e.g.:
+#
+#   meson build-crash -Dblock_device_name=/dev/loop0 -Dblock_device_type=mmc ...
+#
+# The disk under test is stacked as:
+#
+#   IMAGE file -> loop -> dm (log-writes | flakey) -> LOOPDEV (partitioned)
+#
+# so userfs sees a regular partitioned device while every write goes through
+# the dm target. Each userfs run happens in a private mount namespace with a
+# private /run, overlays and mounts never leak to the host.
+
+set -euo pipefail
+
+usage() {
+    cat <<EOF
+Usage: $0 -i IMAGE -u USERFS [OPTIONS]
+
+  -i IMAGE     Disk image with the system partitions (userfs partition optional)
+  -u USERFS    userfs binary built for LOOPDEV
+  -d LOOPDEV   Loop device userfs was built for (default: /dev/loop0)
+  -p PARTNO    userfs partition number (default: 5)
+  -m MODE      log-writes (default) or flakey
+  -w WORKLOAD  boot, write (default) or a shell script run after userfs
+  -n POINTS    Number of crash points (default: 50)
+  -c SECONDS   btrfs commit interval applied during the workload
+  -a ARGS      Extra userfs arguments (e.g. "-o")
+  -o DIR       Output directory (default: ./crash-recovery)
+  -k COUNT     Number of worst cases to print (default: 10)
+  -h           Show this help message
+
+Workloads:
+  boot   userfs first boot on IMAGE as is: partition table write, mkfs,
+         subvolumes, overlay work dirs
+  write  userfs steady-state boot on a provisioned IMAGE, then fsync'ed
+         writes, renames and overlay copy-ups (btrfs log tree, work dirs)
+
+Mode log-writes requires replay-log (xfstests, src/log-writes).
+EOF
+}
+
+IMAGE=""
+USERFS=""
+LOOPDEV="/dev/loop0"
+PARTNO=5
+MODE="log-writes"
+WORKLOAD="write"
+POINTS=50
+COMMIT=""
+USERFS_ARGS=""
+OUTDIR="./crash-recovery"
+WORST=10
+
+DM_NAME="userfs-crash"
+
+while getopts "i:u:d:p:m:w:n:c:a:o:k:h" opt; do
+    case "$opt" in
+    i) IMAGE="$OPTARG" ;;
+    u) USERFS="$(realpath "$OPTARG")" ;;
+    d) LOOPDEV="$OPTARG" ;;
+    p) PARTNO="$OPTARG" ;;
+    m) MODE="$OPTARG" ;;
+    w) WORKLOAD="$OPTARG" ;;
+    n) POINTS="$OPTARG" ;;
+    c) COMMIT="$OPTARG" ;;
+    a) USERFS_ARGS="$OPTARG" ;;
+    o) OUTDIR="$OPTARG" ;;
+    k) WORST="$OPTARG" ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 1 ;;
+    esac
+done
+
+if [ -z "$IMAGE" ] || [ -z "$USERFS" ]; then
+    usage
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Error: must be run as root"
+    exit 1
+fi
+
+case "$MODE" in
+log-writes) REQUIRED="dmsetup losetup unshare btrfs sfdisk replay-log" ;;
+flakey) REQUIRED="dmsetup losetup unshare btrfs sfdisk" ;;
+*) echo "Error: unknown mode '$MODE'"; exit 1 ;;
+esac
+
+for tool in $REQUIRED; do
+    if ! command -v "$tool" >/dev/null 2>&1; then
+        echo "Error: $tool not found"
+        exit 1
+    fi
+done
+
+if losetup "$LOOPDEV" >/dev/null 2>&1; then
+    echo "Error: $LOOPDEV is already in use"
+    exit 1
+fi
+
+PART="${LOOPDEV}p${PARTNO}"
+WORKDIR="$(mktemp -d /var/tmp/userfs-crash.XXXXXX)"
+RESULTS="$OUTDIR/results.csv"
+mkdir -p "$OUTDIR"
+
+BACKING_LOOP=""
+LOG_LOOP=""
+
+cleanup() {
+    set +e
+    losetup -d "$LOOPDEV" 2>/dev/null
+    dmsetup remove "$DM_NAME" 2>/dev/null
+    [ -n "$BACKING_LOOP" ] && losetup -d "$BACKING_LOOP" 2>/dev/null
+    [ -n "$LOG_LOOP" ] && losetup -d "$LOG_LOOP" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Copy an image, instantly on filesystems supporting reflinks
+copy_image() {
+    cp --reflink=auto --sparse=always "$1" "$2"
+}
+
+# userfs is built for LOOPDEV, which cannot be allocated dynamically. Keep it
+# bound to a placeholder whenever the disk is detached, so that the helper
+# devices (losetup -f) never get it.
+reserve_loopdev() {
+    losetup "$LOOPDEV" "$WORKDIR/reserved.img"
+}
+
+# Attach the partitioned LOOPDEV on top of a file or block device
+attach_disk() {
+    losetup -d "$LOOPDEV"
+    losetup -P --direct-io=on "$LOOPDEV" "$1"
+    udevadm settle 2>/dev/null || true
+}
+
+detach_disk() {
+    # userfs may have activated a swap partition, swap is not namespaced
+    awk -v dev="$LOOPDEV" 'index($1, dev) == 1 {print $1}' /proc/swaps |
+        xargs -r -n1 swapoff
+    losetup -d "$LOOPDEV"
+    udevadm settle 2>/dev/null || true
+    reserve_loopdev
+}
+
+# Workload run after userfs inside the namespace, USERFS_MNT is the btrfs root
+workload_write() {
+    local dir="$USERFS_MNT/vol-data/crash-recovery"
+
+    if [ -n "$COMMIT" ]; then
+        mount -o remount,commit="$COMMIT" "$USERFS_MNT"
+    fi
+
+    mkdir -p "$dir"
+    for i in $(seq 1 64); do
+        dd if=/dev/urandom of="$dir/file-$i.tmp" bs=32k count=4 conv=fsync status=none
+        mv "$dir/file-$i.tmp" "$dir/file-$i"
+        if [ $((i % 8)) -eq 0 ]; then
+            # fsync of a directory: btrfs log tree, replayed at the next mount
+            sync -f "$dir"
+        fi
+        # Overlay copy-ups and new files in the upper dirs
+        if [ -e /etc/hostname ]; then
+            chmod "$(stat -c %a /etc/hostname)" /etc/hostname 2>/dev/null || true
+        fi
+        echo "$i" >/var/crash-recovery 2>/dev/null || true
+    done
+}
+
+# Run userfs, then the workload ("none" for userfs only), in a private mount
+# namespace with a private /run. The userfs report is copied to $2.json and
+# the output to $2.log, returns the userfs exit code.
+run_userfs() {
+    WORKLOAD_FN="$1" OUT="$2" unshare -m --propagation private bash -c '
+        mount -t tmpfs tmpfs /run
+        "$USERFS" $USERFS_ARGS
+        rc=$?
+        cp /run/userfs/report.json "$OUT.json" 2>/dev/null
+        if [ $rc -eq 0 ] && [ "$WORKLOAD_FN" != none ]; then
+            export USERFS_MNT=/mnt/userfs
+            case "$WORKLOAD_FN" in
+            write) workload_write ;;
+            *) . "$WORKLOAD_FN" ;;
+            esac
+        fi
+        exit $rc
+    ' >"$2.log" 2>&1
+}
+export -f workload_write
+export USERFS USERFS_ARGS COMMIT
+
+# Next boot after a crash: time userfs and check the result
+check_boot() {
+    local point="$1"
+    local entry="$2"
+    local out="$OUTDIR/point-$point"
+    local rc=0
+    local check="ok"
+
+    local start
+    start="$(now_ms)"
+    run_userfs none "$out" || rc=$?
+    local boot_ms=$(($(now_ms) - start))
+
+    local report_ms
+    report_ms="$(grep -o '"duration_ms": [0-9.]*' "$out.json" 2>/dev/null |
+        head -n1 | awk '{print $2}')"
+
+    if ! sfdisk -V "$LOOPDEV" >>"$out.log" 2>&1; then
+        check="partition-table"
+    elif [ -b "$PART" ] && ! btrfs check --readonly "$PART" >>"$out.log" 2>&1; then
+        check="btrfs"
+    fi
+    if [ "$rc" -ne 0 ] && [ "$check" = "ok" ]; then
+        check="userfs"
+    fi
+
+    echo "$point,$entry,$rc,$boot_ms,${report_ms:-},$check" >>"$RESULTS"
+    printf "point %4s entry %8s: userfs=%d boot=%6d ms check=%s\n" \
+        "$point" "$entry" "$rc" "$boot_ms" "$check"
+}
+
+truncate -s 1M "$WORKDIR/reserved.img"
+reserve_loopdev
+
+# Disk state before the workload
+BASE="$WORKDIR/base.img"
+copy_image "$IMAGE" "$BASE"
+SECTORS="$(($(stat -c %s "$BASE") / 512))"
+
+# The boot workload is userfs itself, on the unprovisioned image
+case "$WORKLOAD" in
+boot) WORKLOAD_FN=none ;;
+write) WORKLOAD_FN=write ;;
+*) WORKLOAD_FN="$(realpath "$WORKLOAD")" ;;
+esac
+
+if [ "$WORKLOAD" != "boot" ]; then
+    echo "Provisioning base image"
+    attach_disk "$BASE"
+    if ! run_userfs none "$WORKDIR/provision"; then
+        echo "Error: failed to provision base image"
+        cat "$WORKDIR/provision.log"
+        exit 1
+    fi
+    detach_disk
+fi
+
+echo "point,entry,userfs_exit,boot_ms,report_ms,check" >"$RESULTS"
+
+if [ "$MODE" = "log-writes" ]; then
+    LOG="$WORKDIR/log.img"
+    truncate -s 4G "$LOG"
+    copy_image "$BASE" "$WORKDIR/work.img"
+    BACKING_LOOP="$(losetup -f --show "$WORKDIR/work.img")"
+    LOG_LOOP="$(losetup -f --show "$LOG")"
+
+    echo "Recording workload '$WORKLOAD' with dm-log-writes"
+    dmsetup create "$DM_NAME" --table "0 $SECTORS log-writes $BACKING_LOOP $LOG_LOOP"
+    attach_disk "/dev/mapper/$DM_NAME"
+    dmsetup message "$DM_NAME" 0 mark start
+    run_userfs "$WORKLOAD_FN" "$WORKDIR/workload" || true
+    dmsetup message "$DM_NAME" 0 mark end
+    detach_disk
+    dmsetup remove "$DM_NAME"
+    losetup -d "$BACKING_LOOP"
+    BACKING_LOOP=""
+
+    ENTRIES="$(replay-log --log "$LOG_LOOP" --num-entries)"
+    echo "Recorded $ENTRIES entries, replaying $POINTS crash points"
+
+    # Replay incrementally on a single image, each boot runs on a copy of it
+    REPLAY="$WORKDIR/replay.img"
+    copy_image "$BASE" "$REPLAY"
+    BACKING_LOOP="$(losetup -f --show "$REPLAY")"
+
+    prev=0
+    for point in $(seq 1 "$POINTS"); do
+        entry=$((ENTRIES * point / POINTS))
+        if [ "$entry" -gt "$prev" ]; then
+            replay-log --log "$LOG_LOOP" --replay "$BACKING_LOOP" \
+                --start-entry "$prev" --limit "$((entry - prev))"
+            blockdev --flushbufs "$BACKING_LOOP"
+            prev="$entry"
+        fi
+
+        copy_image "$REPLAY" "$WORKDIR/boot.img"
+        attach_disk "$WORKDIR/boot.img"
+        check_boot "$point" "$entry"
+        detach_disk
+    done
+else
+    # Duration of an uninterrupted run, crash points are spread over it
+    copy_image "$BASE" "$WORKDIR/work.img"
+    attach_disk "$WORKDIR/work.img"
+    start="$(now_ms)"
+    run_userfs "$WORKLOAD_FN" "$WORKDIR/workload" || true
+    DURATION_MS=$(($(now_ms) - start))
+    detach_disk
+    echo "Workload '$WORKLOAD' takes $DURATION_MS ms, running $POINTS crash points"
+
+    for point in $(seq 1 "$POINTS"); do
+        delay_ms=$((DURATION_MS * point / (POINTS + 1)))
+
+        copy_image "$BASE" "$WORKDIR/work.img"
+        BACKING_LOOP="$(losetup -f --show "$WORKDIR/work.img")"
+        dmsetup create "$DM_NAME" --table "0 $SECTORS flakey $BACKING_LOOP 0 86400 0"
+        attach_disk "/dev/mapper/$DM_NAME"
+
+        run_userfs "$WORKLOAD_FN" "$WORKDIR/workload" &
+        pid=$!
+        sleep "$(awk -v ms="$delay_ms" 'BEGIN {printf "%.3f", ms / 1000}')"
+
+        # Power loss: every write from now on is dropped
+        dmsetup suspend --nolockfs "$DM_NAME"
+        dmsetup reload "$DM_NAME" --table \
+            "0 $SECTORS flakey $BACKING_LOOP 0 0 1 1 drop_writes"
+        dmsetup resume "$DM_NAME"
+        wait "$pid" || true
+
+        detach_disk
+        dmsetup remove "$DM_NAME"
+        losetup -d "$BACKING_LOOP"
+        BACKING_LOOP=""
+
+        attach_disk "$WORKDIR/work.img"
+        check_boot "$point" "${delay_ms}ms"
+        detach_disk
+    done
+fi
+
+echo
+echo "Failures:"
+awk -F, 'NR > 1 && $6 != "ok" {print "  point " $1 " (entry " $2 "): " $6}' "$RESULTS"
+echo
+echo "Worst $WORST next-boot times (ms):"
+tail -n +2 "$RESULTS" | sort -t, -k4 -n -r | head -n "$WORST" |
+    awk -F, '{printf "  point %4s entry %8s: %6d ms (userfs %s ms) %s\n", $1, $2, $4, $5, $6}'
+echo
+echo "Results: $RESULTS"
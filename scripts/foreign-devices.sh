@@ -0,0 +1,168 @@
+#!/bin/bash
+#
+# Foreign filesystem check of the additional devices (-x DEVICE:ROLE).
+#
+# Gives userfs one device per role, each holding the vfat filesystem of a
+# user SD card, and checks that none of them is partitioned, formatted or
+# added to the userfs filesystem without -f:
+#
+#   data    vfat partition in a DOS partition table
+#   mirror  vfat over the whole device, no partition table (superfloppy)
+#   bulk    vfat partition in a DOS partition table
+#   swap    vfat partition in a DOS partition table
+#
+# The userfs binary must be a native build for LOOPDEV, e.g.:
+#
+#   meson build-foreign -Dblock_device_name=/dev/loop32 \
+#       -Dblock_device_type=mmc -Duserfs_partno=3
+#
+# The run happens in a private mount namespace with a private /run, overlays
+# and mounts never leak to the host.
+
+set -euo pipefail
+
+usage() {
+    cat <<EOF
+Usage: $0 -u USERFS [OPTIONS]
+
+  -u USERFS   userfs built for LOOPDEV with -Duserfs_partno=3
+  -d LOOPDEV  Loop device userfs was built for (default: /dev/loop32)
+  -h          Show this help message
+EOF
+}
+
+USERFS=""
+LOOPDEV="/dev/loop32"
+
+while getopts "u:d:h" opt; do
+    case "$opt" in
+    u) USERFS="$(realpath "$OPTARG")" ;;
+    d) LOOPDEV="$OPTARG" ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 1 ;;
+    esac
+done
+
+if [ -z "$USERFS" ]; then
+    usage
+    exit 1
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Error: must be run as root"
+    exit 1
+fi
+
+for tool in losetup sfdisk mkfs.vfat blkid unshare; do
+    if ! command -v "$tool" >/dev/null 2>&1; then
+        echo "Error: $tool not found"
+        exit 1
+    fi
+done
+
+# LOOPDEV is fixed at build time, it cannot be allocated dynamically
+if losetup "$LOOPDEV" >/dev/null 2>&1; then
+    echo "Error: $LOOPDEV is already in use"
+    exit 1
+fi
+
+WORKDIR="$(mktemp -d /var/tmp/userfs-foreign.XXXXXX)"
+
+cleanup() {
+    set +e
+    for image in "$WORKDIR"/*.img; do
+        losetup -j "$image" -O NAME --noheadings 2>/dev/null | xargs -r losetup -d
+    done
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Primary disk: 3 system partitions, userfs created as p4
+truncate -s 2G "$WORKDIR/primary.img"
+sfdisk --quiet "$WORKDIR/primary.img" <<EOF
+label: dos
+size=64MiB, type=c, bootable
+size=256MiB, type=83
+size=256MiB, type=83
+EOF
+losetup -P "$LOOPDEV" "$WORKDIR/primary.img"
+
+# Foreign device: vfat partition, or vfat over the whole device with "whole"
+attach_foreign() {
+    local image="$WORKDIR/$1.img"
+    local dev
+
+    truncate -s 128M "$image"
+    if [ "$2" = "whole" ]; then
+        mkfs.vfat -I "$image" >/dev/null
+    else
+        echo "type=c" | sfdisk --quiet "$image"
+    fi
+
+    dev="$(losetup -f -P --show "$image")"
+    udevadm settle 2>/dev/null || true
+    [ "$2" = "whole" ] || mkfs.vfat "${dev}p1" >/dev/null
+
+    echo "$dev"
+}
+
+DATA="$(attach_foreign data part)"
+MIRROR="$(attach_foreign mirror whole)"
+BULK="$(attach_foreign bulk part)"
+SWAP="$(attach_foreign swap part)"
+
+echo "== userfs -x $DATA:data -x $MIRROR:mirror -x $BULK:bulk -x $SWAP:swap"
+# The boot itself may fail (e.g. degraded), only the devices are checked
+unshare -m --propagation private bash -c '
+    mount -t tmpfs tmpfs /run
+    "$0" -x "$1:data" -x "$2:mirror" -x "$3:bulk" -x "$4:swap"
+    cp /run/userfs/report.json "$5" 2>/dev/null
+' "$USERFS" "$DATA" "$MIRROR" "$BULK" "$SWAP" "$WORKDIR/report.json" || true
+echo
+
+FAILED=""
+
+# The vfat filesystem must be intact, and the superfloppy left unpartitioned
+check_vfat() {
+    local role="$1"
+    local dev="$2"
+    local type
+
+    type="$(blkid -p -o value -s TYPE "$dev" 2>/dev/null || true)"
+    if [ "$type" != "vfat" ]; then
+        echo "FAIL $role: $dev holds '${type:-nothing}' instead of vfat"
+        FAILED="$FAILED $role"
+    else
+        echo "ok   $role: $dev still vfat"
+    fi
+}
+
+check_vfat data "${DATA}p1"
+check_vfat mirror "$MIRROR"
+check_vfat bulk "${BULK}p1"
+check_vfat swap "${SWAP}p1"
+
+if [ -n "$(blkid -p -o value -s PTTYPE "$MIRROR" 2>/dev/null || true)" ]; then
+    echo "FAIL mirror: partition table written on $MIRROR"
+    FAILED="$FAILED mirror-table"
+fi
+
+# Each device reported as refused
+if [ -f "$WORKDIR/report.json" ]; then
+    refused="$(grep -o '"error": "foreign filesystem"' "$WORKDIR/report.json" |
+        wc -l)"
+    if [ "$refused" -ne 4 ]; then
+        echo "FAIL report: $refused of 4 devices refused as foreign filesystem"
+        FAILED="$FAILED report"
+    fi
+else
+    echo "FAIL report: no boot report"
+    FAILED="$FAILED report"
+fi
+
+if [ -n "$FAILED" ]; then
+    echo "Foreign devices check failed:$FAILED"
+    exit 1
+fi
+
+echo "Foreign devices check passed"
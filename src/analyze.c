@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "analyze.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <linux/limits.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define ANALYZE_LOWER_ROOT "/run/userfs/lower"
+#define ANALYZE_BUF_SIZE   (64u * 1024u)
+
+#define OVL_XATTR_PREFIX   "trusted.overlay."
+#define OVL_XATTR_OPAQUE   OVL_XATTR_PREFIX "opaque"
+#define OVL_XATTR_METACOPY OVL_XATTR_PREFIX "metacopy"
+#define OVL_XATTR_REDIRECT OVL_XATTR_PREFIX "redirect"
+
+enum analyze_class {
+    ANALYZE_IDENTICAL = 0,
+    ANALYZE_METADATA,
+    ANALYZE_MODIFIED,
+    ANALYZE_NEW,
+    ANALYZE_WHITEOUT,
+    ANALYZE_OPAQUE,
+    ANALYZE_REDIRECT,
+    ANALYZE_CLASS_COUNT,
+};
+
+static const char *const analyze_class_names[ANALYZE_CLASS_COUNT] = {
+    [ANALYZE_IDENTICAL] = "identical",
+    [ANALYZE_METADATA]  = "metadata",
+    [ANALYZE_MODIFIED]  = "modified",
+    [ANALYZE_NEW]       = "new",
+    [ANALYZE_WHITEOUT]  = "whiteout",
+    [ANALYZE_OPAQUE]    = "opaque",
+    [ANALYZE_REDIRECT]  = "redirect",
+};
+
+struct analyze_stats {
+    uint64_t count[ANALYZE_CLASS_COUNT];
+    uint64_t bytes[ANALYZE_CLASS_COUNT]; // Space used in the upper directory
+    uint64_t pruned;
+    uint64_t pruned_bytes;
+    uint64_t errors;
+};
+
+struct analyze_ctx {
+    const char *mount_point;
+    int lower_root_fd; // Lower directory of the overlay, -1 if missing
+    bool prune;
+    bool quiet;
+    struct analyze_stats stats;
+};
+
+static uint8_t analyze_upper_buf[ANALYZE_BUF_SIZE];
+static uint8_t analyze_lower_buf[ANALYZE_BUF_SIZE];
+static char analyze_upper_xattr[ANALYZE_BUF_SIZE]; // Value of an xattr
+static char analyze_lower_xattr[ANALYZE_BUF_SIZE];
+
+/* *xattr() have no *at() variant, go through /proc/self/fd */
+static void analyze_fd_path(char *path, size_t size, int dir_fd, const char *name)
+{
+    snprintf(path, size, "/proc/self/fd/%d/%s", dir_fd, name);
+}
+
+/* Check for an xattr, and for its first character if expected is not 0 */
+static bool analyze_has_xattr(int dir_fd,
+                              const char *name,
+                              const char *xattr,
+                              char expected)
+{
+    char path[PATH_MAX + 32];
+    char value[1];
+
+    analyze_fd_path(path, sizeof(path), dir_fd, name);
+
+    if (!expected) return lgetxattr(path, xattr, NULL, 0) >= 0;
+
+    ssize_t len = lgetxattr(path, xattr, value, sizeof(value));
+    return len == 1 && value[0] == expected;
+}
+
+/* Compare the contents of two regular files of the same size */
+static int analyze_same_content(int upper_dir_fd, int lower_dir_fd, const char *name)
+{
+    int ret      = -1;
+    int upper_fd = openat(upper_dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int lower_fd = openat(lower_dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (upper_fd < 0 || lower_fd < 0) goto exit;
+
+    for (;;) {
+        ssize_t upper_len = read(upper_fd, analyze_upper_buf, sizeof(analyze_upper_buf));
+        ssize_t lower_len = read(lower_fd, analyze_lower_buf, sizeof(analyze_lower_buf));
+
+        if (upper_len < 0 || lower_len < 0) goto exit;
+
+        if (upper_len != lower_len ||
+            memcmp(analyze_upper_buf, analyze_lower_buf, (size_t)upper_len) != 0) {
+            ret = 0;
+            goto exit;
+        }
+
+        if (upper_len == 0) break;
+    }
+
+    ret = 1;
+
+exit:
+    if (upper_fd >= 0) close(upper_fd);
+    if (lower_fd >= 0) close(lower_fd);
+    return ret;
+}
+
+/* List the xattr names of an entry, an unsupported filesystem has none */
+static ssize_t analyze_list_xattrs(const char *path, char *list)
+{
+    ssize_t len = llistxattr(path, list, ANALYZE_BUF_SIZE);
+
+    if (len < 0 && errno == ENOTSUP) return 0;
+    return len;
+}
+
+/*
+ * Compare the xattrs (capabilities, ACLs, SELinux labels...) of two entries.
+ * Entries with overlay metadata (origin, redirect, metacopy...) never compare
+ * equal, the upper entry is more than a copy of the lower one.
+ */
+static int analyze_same_xattrs(int upper_dir_fd, int lower_dir_fd, const char *name)
+{
+    char upper_path[PATH_MAX + 32];
+    char lower_path[PATH_MAX + 32];
+    size_t upper_count = 0;
+    size_t lower_count = 0;
+
+    analyze_fd_path(upper_path, sizeof(upper_path), upper_dir_fd, name);
+    analyze_fd_path(lower_path, sizeof(lower_path), lower_dir_fd, name);
+
+    // The content buffers are free once the content is compared
+    char *upper_list = (char *)analyze_upper_buf;
+    char *lower_list = (char *)analyze_lower_buf;
+
+    ssize_t upper_len = analyze_list_xattrs(upper_path, upper_list);
+    ssize_t lower_len = analyze_list_xattrs(lower_path, lower_list);
+    if (upper_len < 0 || lower_len < 0) return -1;
+
+    for (ssize_t i = 0; i < lower_len; i += (ssize_t)strlen(&lower_list[i]) + 1) {
+        lower_count++;
+    }
+
+    for (ssize_t i = 0; i < upper_len; i += (ssize_t)strlen(&upper_list[i]) + 1) {
+        const char *xattr = &upper_list[i];
+
+        if (strncmp(xattr, OVL_XATTR_PREFIX, strlen(OVL_XATTR_PREFIX)) == 0) return 0;
+        upper_count++;
+
+        ssize_t upper_size =
+            lgetxattr(upper_path, xattr, analyze_upper_xattr, ANALYZE_BUF_SIZE);
+        ssize_t lower_size =
+            lgetxattr(lower_path, xattr, analyze_lower_xattr, ANALYZE_BUF_SIZE);
+        if (upper_size < 0) return -1;
+        if (lower_size < 0 && errno != ENODATA) return -1;
+
+        if (upper_size != lower_size ||
+            memcmp(analyze_upper_xattr, analyze_lower_xattr, (size_t)upper_size) != 0) {
+            return 0;
+        }
+    }
+
+    // Every upper xattr is in the lower entry, names are unique
+    return upper_count == lower_count ? 1 : 0;
+}
+
+/* Copy-up preserves the mode, the owner and the timestamps */
+static bool analyze_same_metadata(const struct stat *upper, const struct stat *lower)
+{
+    return upper->st_mode == lower->st_mode && upper->st_uid == lower->st_uid &&
+           upper->st_gid == lower->st_gid &&
+           upper->st_mtim.tv_sec == lower->st_mtim.tv_sec &&
+           upper->st_mtim.tv_nsec == lower->st_mtim.tv_nsec;
+}
+
+static enum analyze_class analyze_classify(int upper_dir_fd,
+                                           int lower_dir_fd,
+                                           const char *name,
+                                           const struct stat *upper)
+{
+    struct stat lower;
+
+    if (S_ISCHR(upper->st_mode) && upper->st_rdev == makedev(0, 0)) {
+        return ANALYZE_WHITEOUT;
+    }
+
+    if (lower_dir_fd < 0 ||
+        fstatat(lower_dir_fd, name, &lower, AT_SYMLINK_NOFOLLOW) != 0) {
+        return ANALYZE_NEW;
+    }
+
+    if ((upper->st_mode & S_IFMT) != (lower.st_mode & S_IFMT)) {
+        return ANALYZE_MODIFIED;
+    }
+
+    if (S_ISREG(upper->st_mode)) {
+        // Metacopy: only the metadata was copied up, the data is still in the lower
+        if (analyze_has_xattr(upper_dir_fd, name, OVL_XATTR_METACOPY, 0)) {
+            return ANALYZE_METADATA;
+        }
+
+        if (upper->st_size != lower.st_size) return ANALYZE_MODIFIED;
+
+        int same = analyze_same_content(upper_dir_fd, lower_dir_fd, name);
+        if (same < 0) return ANALYZE_CLASS_COUNT;
+        if (same == 0) return ANALYZE_MODIFIED;
+    } else if (S_ISLNK(upper->st_mode)) {
+        char upper_target[PATH_MAX];
+        char lower_target[PATH_MAX];
+
+        ssize_t upper_len = readlinkat(upper_dir_fd, name, upper_target, PATH_MAX);
+        ssize_t lower_len = readlinkat(lower_dir_fd, name, lower_target, PATH_MAX);
+        if (upper_len < 0 || lower_len < 0) return ANALYZE_CLASS_COUNT;
+
+        if (upper_len != lower_len ||
+            memcmp(upper_target, lower_target, (size_t)upper_len) != 0) {
+            return ANALYZE_MODIFIED;
+        }
+    } else if (upper->st_rdev != lower.st_rdev) {
+        return ANALYZE_MODIFIED;
+    }
+
+    if (!analyze_same_metadata(upper, &lower)) return ANALYZE_METADATA;
+
+    int same = analyze_same_xattrs(upper_dir_fd, lower_dir_fd, name);
+    if (same < 0) return ANALYZE_CLASS_COUNT;
+
+    return same ? ANALYZE_IDENTICAL : ANALYZE_METADATA;
+}
+
+/*
+ * Open the lower directory of a renamed upper directory. The redirect is a
+ * path from the root of the lower layer, or a name in the same parent.
+ */
+static int analyze_open_redirect(struct analyze_ctx *ctx,
+                                 int upper_dir_fd,
+                                 int lower_dir_fd,
+                                 const char *name)
+{
+    char path[PATH_MAX + 32];
+    char redirect[PATH_MAX];
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+    analyze_fd_path(path, sizeof(path), upper_dir_fd, name);
+
+    ssize_t len = lgetxattr(path, OVL_XATTR_REDIRECT, redirect, sizeof(redirect) - 1u);
+    if (len <= 0) return -1;
+    redirect[len] = '\0';
+
+    if (redirect[0] == '/') {
+        if (ctx->lower_root_fd < 0) return -1;
+        return redirect[1] ? openat(ctx->lower_root_fd, &redirect[1], flags)
+                           : dup(ctx->lower_root_fd);
+    }
+
+    return lower_dir_fd >= 0 ? openat(lower_dir_fd, redirect, flags) : -1;
+}
+
+static void analyze_account(struct analyze_ctx *ctx,
+                            enum analyze_class class,
+                            const char *relpath,
+                            uint64_t bytes)
+{
+    ctx->stats.count[class]++;
+    ctx->stats.bytes[class] += bytes;
+
+    // New entries are the expected content of the upper directories
+    if (!ctx->quiet && class != ANALYZE_NEW) {
+        printf("%-10s %12llu  %s/%s\n",
+               analyze_class_names[class],
+               (unsigned long long)bytes,
+               ctx->mount_point,
+               relpath);
+    }
+}
+
+static void analyze_prune(struct analyze_ctx *ctx,
+                          int upper_dir_fd,
+                          const char *name,
+                          const char *relpath,
+                          const struct stat *upper,
+                          uint64_t bytes)
+{
+    // Hard linked copy-ups (index feature) are shared, leave them alone
+    if (upper->st_nlink > 1) return;
+
+    if (unlinkat(upper_dir_fd, name, 0) != 0) {
+        LOG_WRN("Failed to prune %s/%s: %s\n",
+                ctx->mount_point,
+                relpath,
+                strerror(errno));
+        ctx->stats.errors++;
+        return;
+    }
+
+    ctx->stats.pruned++;
+    ctx->stats.pruned_bytes += bytes;
+}
+
+/* Walk an upper directory, lower_dir_fd is -1 if there is no lower directory */
+static int analyze_dir(struct analyze_ctx *ctx,
+                       int upper_dir_fd,
+                       int lower_dir_fd,
+                       const char *relpath)
+{
+    char child_relpath[PATH_MAX];
+    struct dirent *ent;
+
+    int fd = dup(upper_dir_fd);
+    if (fd < 0) return -1;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat upper;
+        const char *name = ent->d_name;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        snprintf(child_relpath,
+                 sizeof(child_relpath),
+                 "%s%s%s",
+                 relpath,
+                 relpath[0] ? "/" : "",
+                 name);
+
+        if (fstatat(upper_dir_fd, name, &upper, AT_SYMLINK_NOFOLLOW) != 0) {
+            ctx->stats.errors++;
+            continue;
+        }
+
+        uint64_t bytes = (uint64_t)upper.st_blocks * 512u;
+
+        if (S_ISDIR(upper.st_mode)) {
+            int child_lower_fd = -1;
+            enum analyze_class class;
+
+            if (analyze_has_xattr(upper_dir_fd, name, OVL_XATTR_OPAQUE, 'y')) {
+                class = ANALYZE_OPAQUE;
+            } else if (analyze_has_xattr(upper_dir_fd, name, OVL_XATTR_REDIRECT, 0)) {
+                // Renamed directory, its entries are compared with the origin
+                class = ANALYZE_REDIRECT;
+                child_lower_fd =
+                    analyze_open_redirect(ctx, upper_dir_fd, lower_dir_fd, name);
+            } else if (lower_dir_fd >= 0 &&
+                       (child_lower_fd = openat(lower_dir_fd,
+                                                name,
+                                                O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                                    O_CLOEXEC)) >= 0) {
+                class = ANALYZE_CLASS_COUNT; // Merged directory, only its entries count
+            } else {
+                class = ANALYZE_NEW;
+            }
+
+            if (class != ANALYZE_CLASS_COUNT) {
+                analyze_account(ctx, class, child_relpath, 0);
+            }
+
+            int child_upper_fd = openat(
+                upper_dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_upper_fd >= 0) {
+                analyze_dir(ctx, child_upper_fd, child_lower_fd, child_relpath);
+                close(child_upper_fd);
+            } else {
+                ctx->stats.errors++;
+            }
+
+            if (child_lower_fd >= 0) close(child_lower_fd);
+            continue;
+        }
+
+        enum analyze_class class =
+            analyze_classify(upper_dir_fd, lower_dir_fd, name, &upper);
+        if (class == ANALYZE_CLASS_COUNT) {
+            LOG_WRN("Failed to compare %s/%s: %s\n",
+                    ctx->mount_point,
+                    child_relpath,
+                    strerror(errno));
+            ctx->stats.errors++;
+            continue;
+        }
+
+        analyze_account(ctx, class, child_relpath, bytes);
+
+        if (ctx->prune && class == ANALYZE_IDENTICAL) {
+            analyze_prune(ctx, upper_dir_fd, name, child_relpath, &upper, bytes);
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * Make the lower directories visible at ANALYZE_LOWER_ROOT, even when hidden
+ * by the overlays: bind mount / without its submounts in a private namespace.
+ */
+static int analyze_setup_lower_root(void)
+{
+    if (unshare(CLONE_NEWNS) != 0) {
+        LOG_ERR("Failed to create mount namespace: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (do_mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        LOG_ERR("Failed to make / private: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (create_directory(ANALYZE_LOWER_ROOT) != 0) {
+        LOG_ERR("Failed to create %s: %s\n", ANALYZE_LOWER_ROOT, strerror(errno));
+        return -1;
+    }
+
+    if (do_mount("/", ANALYZE_LOWER_ROOT, NULL, MS_BIND, NULL) != 0) {
+        LOG_ERR("Failed to bind mount / on %s: %s\n",
+                ANALYZE_LOWER_ROOT,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void analyze_print_stats(const char *name, const struct analyze_stats *stats)
+{
+    printf("%s:", name);
+    for (size_t c = 0; c < ANALYZE_CLASS_COUNT; c++) {
+        printf(" %s=%llu (%llu KiB)",
+               analyze_class_names[c],
+               (unsigned long long)stats->count[c],
+               (unsigned long long)(stats->bytes[c] / 1024u));
+    }
+    if (stats->pruned) {
+        printf(" pruned=%llu (%llu KiB)",
+               (unsigned long long)stats->pruned,
+               (unsigned long long)(stats->pruned_bytes / 1024u));
+    }
+    if (stats->errors) {
+        printf(" errors=%llu", (unsigned long long)stats->errors);
+    }
+    printf("\n");
+}
+
+static void analyze_print_usage(void)
+{
+    printf("Usage: userfs analyze [-p] [-q]\n");
+    printf("Classify overlay upper entries against the lower directories\n\n");
+    printf("  -p    Prune identical copy-ups (overlays must not be mounted)\n");
+    printf("  -q    Only print the summary\n");
+}
+
+int analyze_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret = 0;
+    bool prune = false;
+    bool quiet = false;
+    struct analyze_stats total;
+    const struct overlayfs_mount_point *mp;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "pqh")) != -1) {
+        switch (opt) {
+        case 'p':
+            prune = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'h':
+            analyze_print_usage();
+            return 0;
+        default:
+            analyze_print_usage();
+            return -1;
+        }
+    }
+
+    if (prune) {
+        for (size_t i = 0; (mp = overlayfs_get_mount_point(i)) != NULL; i++) {
+            if (overlayfs_is_mounted(mp->mount_point)) {
+                LOG_ERR("Overlay mounted on %s, cannot prune online\n", mp->mount_point);
+                return -1;
+            }
+        }
+    }
+
+    if (analyze_setup_lower_root() != 0) return -1;
+
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; (mp = overlayfs_get_mount_point(i)) != NULL; i++) {
+        char upper_dir[PATH_MAX];
+        char lower_dir[PATH_MAX];
+        struct analyze_ctx ctx = {
+            .mount_point   = mp->mount_point,
+            .lower_root_fd = -1,
+            .prune         = prune,
+            .quiet         = quiet,
+        };
+
+        overlayfs_build_upper_dir(upper_dir, sizeof(upper_dir), mp);
+        snprintf(lower_dir, sizeof(lower_dir), "%s%s", ANALYZE_LOWER_ROOT, mp->lowerdir);
+
+        int upper_fd = open(upper_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (upper_fd < 0) {
+            LOG_ERR("Failed to open upper directory %s: %s\n",
+                    upper_dir,
+                    strerror(errno));
+            ret = -1;
+            continue;
+        }
+
+        // A missing lower directory simply makes every entry new
+        int lower_fd      = open(lower_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ctx.lower_root_fd = lower_fd;
+
+        analyze_dir(&ctx, upper_fd, lower_fd, "");
+
+        close(upper_fd);
+        if (lower_fd >= 0) close(lower_fd);
+
+        analyze_print_stats(mp->mount_point, &ctx.stats);
+
+        for (size_t c = 0; c < ANALYZE_CLASS_COUNT; c++) {
+            total.count[c] += ctx.stats.count[c];
+            total.bytes[c] += ctx.stats.bytes[c];
+        }
+        total.pruned += ctx.stats.pruned;
+        total.pruned_bytes += ctx.stats.pruned_bytes;
+        total.errors += ctx.stats.errors;
+    }
+
+    analyze_print_stats("total", &total);
+
+    do_umount2(ANALYZE_LOWER_ROOT, MNT_DETACH);
+
+    return ret;
+}
@@ -0,0 +1,755 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "backup.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/limits.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(USERFS_ZSTD)
+#include <zstd.h>
+#endif
+
+#define BACKUP_BUF_SIZE   (128u * 1024u)
+#define BACKUP_ZSTD_MAGIC 0xfd2fb528u
+
+static const size_t backup_subvolumes[] = {
+    BTRFS_SV_CONFIG_INDEX,
+    BTRFS_SV_DATA_INDEX,
+};
+
+#define BACKUP_SV_COUNT ARRAY_SIZE(backup_subvolumes)
+
+struct backup_stream {
+    int fd;
+    uint64_t raw_bytes;  // Send stream size
+    uint64_t out_bytes;  // Written size (compressed)
+#if defined(USERFS_ZSTD)
+    ZSTD_CCtx *cctx;
+#endif
+};
+
+static uint8_t backup_in_buf[BACKUP_BUF_SIZE];
+#if defined(USERFS_ZSTD)
+static uint8_t backup_out_buf[BACKUP_BUF_SIZE];
+#endif
+
+static int backup_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+static int backup_stream_write(struct backup_stream *s, const void *buf, size_t len)
+{
+    s->raw_bytes += len;
+
+#if defined(USERFS_ZSTD)
+    if (s->cctx) {
+        ZSTD_inBuffer in = {buf, len, 0};
+
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = {backup_out_buf, sizeof(backup_out_buf), 0};
+
+            size_t ret = ZSTD_compressStream2(s->cctx, &out, &in, ZSTD_e_continue);
+            if (ZSTD_isError(ret)) {
+                LOG_ERR("zstd compression failed: %s\n", ZSTD_getErrorName(ret));
+                errno = EIO;
+                return -1;
+            }
+
+            if (backup_write_all(s->fd, out.dst, out.pos) != 0) return -1;
+            s->out_bytes += out.pos;
+        }
+
+        return 0;
+    }
+#endif
+
+    if (backup_write_all(s->fd, buf, len) != 0) return -1;
+    s->out_bytes += len;
+
+    return 0;
+}
+
+static int backup_stream_finish(struct backup_stream *s)
+{
+#if defined(USERFS_ZSTD)
+    if (s->cctx) {
+        ZSTD_inBuffer in = {NULL, 0, 0};
+        size_t remaining;
+
+        do {
+            ZSTD_outBuffer out = {backup_out_buf, sizeof(backup_out_buf), 0};
+
+            remaining = ZSTD_compressStream2(s->cctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(remaining)) {
+                LOG_ERR("zstd compression failed: %s\n", ZSTD_getErrorName(remaining));
+                errno = EIO;
+                return -1;
+            }
+
+            if (backup_write_all(s->fd, out.dst, out.pos) != 0) return -1;
+            s->out_bytes += out.pos;
+        } while (remaining != 0);
+    }
+#else
+    (void)s;
+#endif
+
+    return 0;
+}
+
+/* Check that the userfs btrfs filesystem is mounted, open its root */
+static int backup_open_userfs(void)
+{
+    struct statfs sfs;
+
+    if (statfs(USERFS_MOUNT_POINT, &sfs) != 0 || sfs.f_type != BTRFS_SUPER_MAGIC) {
+        LOG_ERR("No btrfs filesystem mounted on %s\n", USERFS_MOUNT_POINT);
+        return -1;
+    }
+
+    int fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+    }
+
+    return fd;
+}
+
+/* Open (and create) a directory at the root of the userfs filesystem */
+static int backup_open_dir(const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", USERFS_MOUNT_POINT, name);
+
+    if (create_directory(path) != 0) return -1;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+    }
+
+    return fd;
+}
+
+/* Highest sequence number of the "<sv_name>.<seq>" snapshots, 0 if none */
+static unsigned int backup_latest(int dir_fd, const char *sv_name)
+{
+    unsigned int latest = 0;
+    size_t len          = strlen(sv_name);
+
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return 0;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, sv_name, len) != 0 || de->d_name[len] != '.') continue;
+
+        char *end;
+        unsigned long seq = strtoul(&de->d_name[len + 1], &end, 10);
+        if (end == &de->d_name[len + 1] || *end != '\0') continue;
+
+        if (seq > latest) latest = (unsigned int)seq;
+    }
+
+    closedir(dir);
+    return latest;
+}
+
+static int backup_get_tree_id(int fd, uint64_t *tree_id)
+{
+    struct btrfs_ioctl_ino_lookup_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+
+    if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) != 0) return -1;
+
+    *tree_id = args.treeid;
+    return 0;
+}
+
+/*
+ * Send a snapshot: the kernel writes the stream into a pipe from a child
+ * process, the parent compresses it to the output.
+ */
+static int backup_send(int snap_fd,
+                       uint64_t parent_root,
+                       uint64_t flags,
+                       struct backup_stream *s)
+{
+    int ret = -1;
+    int pipefd[2];
+    int status;
+
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        LOG_ERR("pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERR("fork: %s\n", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    } else if (pid == 0) {
+        struct btrfs_ioctl_send_args args;
+        __u64 clone_root = parent_root;
+
+        close(pipefd[0]);
+
+        memset(&args, 0, sizeof(args));
+        args.send_fd     = pipefd[1];
+        args.parent_root = parent_root;
+        args.flags       = flags;
+        if (parent_root) {
+            args.clone_sources       = &clone_root;
+            args.clone_sources_count = 1;
+        }
+
+        if (ioctl(snap_fd, BTRFS_IOC_SEND, &args) != 0) {
+            LOG_ERR("BTRFS_IOC_SEND failed: %s\n", strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(pipefd[1]);
+
+    for (;;) {
+        ssize_t n = read(pipefd[0], backup_in_buf, sizeof(backup_in_buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERR("Failed to read the send stream: %s\n", strerror(errno));
+            goto exit;
+        }
+        if (n == 0) break;
+
+        if (backup_stream_write(s, backup_in_buf, (size_t)n) != 0) {
+            LOG_ERR("Failed to write the backup: %s\n", strerror(errno));
+            goto exit;
+        }
+    }
+
+    ret = 0;
+
+exit:
+    // Unblocks the child if we stopped reading early
+    close(pipefd[0]);
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void backup_print_usage(void)
+{
+    printf("Usage: userfs backup [-o FILE] [-f] [-l LEVEL]\n");
+    printf("Write a btrfs send stream of the userfs subvolumes\n\n");
+    printf("  -o FILE   Output file (default: standard output)\n");
+    printf("  -f        Full backup, do not use the previous backup as parent\n");
+    printf("  -l LEVEL  zstd compression level, 0 to disable (default: %d)\n",
+           BACKUP_ZSTD_LEVEL);
+}
+
+int backup_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret            = -1;
+    const char *output = NULL;
+    bool full          = false;
+    int level          = BACKUP_ZSTD_LEVEL;
+    int mount_fd       = -1;
+    int dir_fd         = -1;
+    unsigned int prev[BACKUP_SV_COUNT];
+    bool created[BACKUP_SV_COUNT];
+    struct backup_stream stream;
+    struct timespec begin, end;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "o:fl:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        case 'f':
+            full = true;
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'h':
+            backup_print_usage();
+            return 0;
+        default:
+            backup_print_usage();
+            return -1;
+        }
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    memset(created, 0, sizeof(created));
+    stream.fd = -1;
+
+    if (!output || strcmp(output, "-") == 0) {
+        if (isatty(STDOUT_FILENO)) {
+            LOG_ERR("Refusing to write the backup to a terminal, use -o FILE\n");
+            return -1;
+        }
+        stream.fd = STDOUT_FILENO;
+    } else {
+        stream.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (stream.fd < 0) {
+            LOG_ERR("Failed to open %s: %s\n", output, strerror(errno));
+            return -1;
+        }
+    }
+
+#if defined(USERFS_ZSTD)
+    if (level > 0) {
+        stream.cctx = ZSTD_createCCtx();
+        if (!stream.cctx) {
+            LOG_ERR("Failed to create the zstd context\n");
+            goto exit;
+        }
+        ZSTD_CCtx_setParameter(stream.cctx, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(stream.cctx, ZSTD_c_checksumFlag, 1);
+    }
+#else
+    if (level > 0) {
+        LOG_WRN("Built without zstd, writing an uncompressed stream\n");
+    }
+#endif
+
+    mount_fd = backup_open_userfs();
+    if (mount_fd < 0) goto exit;
+
+    dir_fd = backup_open_dir(BACKUP_DIR_NAME);
+    if (dir_fd < 0) goto exit;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (size_t i = 0; i < BACKUP_SV_COUNT; i++) {
+        const char *sv_name = btrfs_get_volume(backup_subvolumes[i]);
+        char name[NAME_MAX + 1];
+        uint64_t parent_root = 0;
+        uint64_t flags       = 0;
+
+        prev[i] = backup_latest(dir_fd, sv_name);
+        snprintf(name, sizeof(name), "%s.%u", sv_name, prev[i] + 1u);
+
+        int sv_fd = openat(mount_fd, sv_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sv_fd < 0) {
+            LOG_ERR("Failed to open subvolume %s: %s\n", sv_name, strerror(errno));
+            goto exit;
+        }
+
+        int r = btrfs_snapshot(sv_fd, dir_fd, name, true);
+        close(sv_fd);
+        if (r != 0) {
+            LOG_ERR("Failed to snapshot %s: %s\n", sv_name, strerror(errno));
+            goto exit;
+        }
+        created[i] = true;
+
+        if (!full && prev[i] != 0) {
+            char parent[NAME_MAX + 1];
+
+            snprintf(parent, sizeof(parent), "%s.%u", sv_name, prev[i]);
+
+            int parent_fd = openat(dir_fd, parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (parent_fd < 0 || backup_get_tree_id(parent_fd, &parent_root) != 0) {
+                LOG_WRN("Parent snapshot %s unusable, full backup of %s\n",
+                        parent,
+                        sv_name);
+                parent_root = 0;
+            }
+            if (parent_fd >= 0) close(parent_fd);
+        }
+
+        // A single stream for all the subvolumes, as "btrfs send A B"
+        if (i > 0) flags |= BTRFS_SEND_FLAG_OMIT_STREAM_HEADER;
+        if (i + 1 < BACKUP_SV_COUNT) flags |= BTRFS_SEND_FLAG_OMIT_END_CMD;
+
+        int snap_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (snap_fd < 0) {
+            LOG_ERR("Failed to open snapshot %s: %s\n", name, strerror(errno));
+            goto exit;
+        }
+
+        uint64_t before = stream.raw_bytes;
+
+        r = backup_send(snap_fd, parent_root, flags, &stream);
+        close(snap_fd);
+        if (r != 0) {
+            LOG_ERR("Failed to send %s\n", name);
+            goto exit;
+        }
+
+        fprintf(stderr,
+                "%s: %s, %llu KiB\n",
+                name,
+                parent_root ? "incremental" : "full",
+                (unsigned long long)((stream.raw_bytes - before) / 1024u));
+    }
+
+    if (backup_stream_finish(&stream) != 0) {
+        LOG_ERR("Failed to write the backup: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    if (stream.fd != STDOUT_FILENO && fsync(stream.fd) != 0) {
+        LOG_ERR("Failed to sync %s: %s\n", output, strerror(errno));
+        goto exit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // The new snapshots are the parents of the next backup
+    for (size_t i = 0; i < BACKUP_SV_COUNT; i++) {
+        char name[NAME_MAX + 1];
+
+        created[i] = false;
+        if (prev[i] == 0) continue;
+
+        snprintf(name,
+                 sizeof(name),
+                 "%s.%u",
+                 btrfs_get_volume(backup_subvolumes[i]),
+                 prev[i]);
+        if (btrfs_delete_subvolume(dir_fd, name) != 0) {
+            LOG_WRN("Failed to delete snapshot %s: %s\n", name, strerror(errno));
+        }
+    }
+
+    fprintf(stderr,
+            "stream %llu KiB, written %llu KiB in %.1f s\n",
+            (unsigned long long)(stream.raw_bytes / 1024u),
+            (unsigned long long)(stream.out_bytes / 1024u),
+            (double)(end.tv_sec - begin.tv_sec) +
+                (double)(end.tv_nsec - begin.tv_nsec) / 1e9);
+
+    ret = 0;
+
+exit:
+    // Drop the snapshots of a failed backup, the previous ones stay the parents
+    for (size_t i = 0; i < BACKUP_SV_COUNT; i++) {
+        char name[NAME_MAX + 1];
+
+        if (!created[i]) continue;
+
+        snprintf(name,
+                 sizeof(name),
+                 "%s.%u",
+                 btrfs_get_volume(backup_subvolumes[i]),
+                 prev[i] + 1u);
+        btrfs_delete_subvolume(dir_fd, name);
+    }
+
+#if defined(USERFS_ZSTD)
+    ZSTD_freeCCtx(stream.cctx);
+#endif
+    if (stream.fd >= 0 && stream.fd != STDOUT_FILENO) close(stream.fd);
+    if (dir_fd >= 0) close(dir_fd);
+    if (mount_fd >= 0) close(mount_fd);
+
+    return ret;
+}
+
+/*
+ * Feed the (decompressed) input to "btrfs receive" in RESTORE_DIR_NAME. The
+ * received snapshots have the names of the local ones in BACKUP_DIR_NAME,
+ * which exist when restoring on the device that made the backup.
+ */
+static int backup_receive(int in_fd)
+{
+    int ret = -1;
+    int pipefd[2];
+    int status;
+    char dir[PATH_MAX];
+    bool first = true;
+#if defined(USERFS_ZSTD)
+    ZSTD_DCtx *dctx = NULL;
+#endif
+
+    snprintf(dir, sizeof(dir), "%s/%s", USERFS_MOUNT_POINT, RESTORE_DIR_NAME);
+
+    char *const receive_args[] = {
+        "btrfs",
+        "receive",
+        dir,
+        NULL,
+    };
+
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        LOG_ERR("pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    command_display(receive_args[0], receive_args);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERR("fork: %s\n", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(pipefd[0], STDIN_FILENO) < 0) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
+        execvp(receive_args[0], receive_args);
+        perror("execvp");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pipefd[0]);
+
+    for (;;) {
+        ssize_t n = read(in_fd, backup_in_buf, sizeof(backup_in_buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERR("Failed to read the backup: %s\n", strerror(errno));
+            goto exit;
+        }
+        if (n == 0) break;
+
+        if (first) {
+            uint32_t magic = 0;
+
+            first = false;
+            if ((size_t)n >= sizeof(magic)) memcpy(&magic, backup_in_buf, sizeof(magic));
+            if (le32toh(magic) == BACKUP_ZSTD_MAGIC) {
+#if defined(USERFS_ZSTD)
+                dctx = ZSTD_createDCtx();
+                if (!dctx) {
+                    LOG_ERR("Failed to create the zstd context\n");
+                    goto exit;
+                }
+#else
+                LOG_ERR("Compressed backup, userfs was built without zstd\n");
+                goto exit;
+#endif
+            }
+        }
+
+#if defined(USERFS_ZSTD)
+        if (dctx) {
+            ZSTD_inBuffer in = {backup_in_buf, (size_t)n, 0};
+
+            while (in.pos < in.size) {
+                ZSTD_outBuffer out = {backup_out_buf, sizeof(backup_out_buf), 0};
+
+                size_t r = ZSTD_decompressStream(dctx, &out, &in);
+                if (ZSTD_isError(r)) {
+                    LOG_ERR("zstd decompression failed: %s\n", ZSTD_getErrorName(r));
+                    goto exit;
+                }
+
+                if (backup_write_all(pipefd[1], out.dst, out.pos) != 0) {
+                    LOG_ERR("Failed to write to btrfs receive: %s\n", strerror(errno));
+                    goto exit;
+                }
+            }
+            continue;
+        }
+#endif
+
+        if (backup_write_all(pipefd[1], backup_in_buf, (size_t)n) != 0) {
+            LOG_ERR("Failed to write to btrfs receive: %s\n", strerror(errno));
+            goto exit;
+        }
+    }
+
+    ret = 0;
+
+exit:
+    close(pipefd[1]);
+#if defined(USERFS_ZSTD)
+    ZSTD_freeDCtx(dctx);
+#endif
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        LOG_ERR("btrfs receive failed\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Replace the subvolumes with writable snapshots of the last received ones */
+static int backup_apply(int mount_fd, int dir_fd)
+{
+    for (size_t i = 0; i < BACKUP_SV_COUNT; i++) {
+        const char *sv_name = btrfs_get_volume(backup_subvolumes[i]);
+        char name[NAME_MAX + 1];
+        char prev[NAME_MAX + 1];
+
+        unsigned int latest = backup_latest(dir_fd, sv_name);
+        if (latest == 0) {
+            LOG_ERR("No received snapshot of %s\n", sv_name);
+            return -1;
+        }
+
+        snprintf(name, sizeof(name), "%s.%u", sv_name, latest);
+        snprintf(prev, sizeof(prev), "%s.prev", sv_name);
+
+        int snap_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (snap_fd < 0) {
+            LOG_ERR("Failed to open snapshot %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+
+        if (btrfs_delete_subvolume(dir_fd, prev) != 0 && errno != ENOENT) {
+            LOG_WRN("Failed to delete %s: %s\n", prev, strerror(errno));
+        }
+
+        if (renameat(mount_fd, sv_name, dir_fd, prev) != 0 && errno != ENOENT) {
+            LOG_ERR("Failed to move %s away: %s\n", sv_name, strerror(errno));
+            close(snap_fd);
+            return -1;
+        }
+
+        if (btrfs_snapshot(snap_fd, mount_fd, sv_name, false) != 0) {
+            LOG_ERR("Failed to restore %s from %s: %s\n", sv_name, name, strerror(errno));
+            renameat(dir_fd, prev, mount_fd, sv_name);
+            close(snap_fd);
+            return -1;
+        }
+
+        close(snap_fd);
+        fprintf(stderr, "%s: restored from %s\n", sv_name, name);
+    }
+
+    return 0;
+}
+
+static void backup_print_restore_usage(void)
+{
+    printf("Usage: userfs restore [-i FILE] [-a]\n");
+    printf("Receive a backup stream of the userfs subvolumes\n\n");
+    printf("  -i FILE   Input file (default: standard input)\n");
+    printf("  -a        Replace the subvolumes with the received snapshots\n");
+    printf("            (overlays must not be mounted)\n");
+}
+
+int backup_cmd_restore(int argc, char *argv[])
+{
+    int opt;
+    int ret           = -1;
+    const char *input = NULL;
+    bool apply        = false;
+    int in_fd         = STDIN_FILENO;
+    int mount_fd      = -1;
+    int dir_fd        = -1;
+    const struct overlayfs_mount_point *mp;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "i:ah")) != -1) {
+        switch (opt) {
+        case 'i':
+            input = optarg;
+            break;
+        case 'a':
+            apply = true;
+            break;
+        case 'h':
+            backup_print_restore_usage();
+            return 0;
+        default:
+            backup_print_restore_usage();
+            return -1;
+        }
+    }
+
+    if (apply) {
+        for (size_t i = 0; (mp = overlayfs_get_mount_point(i)) != NULL; i++) {
+            if (overlayfs_is_mounted(mp->mount_point)) {
+                LOG_ERR("Overlay mounted on %s, cannot restore online\n",
+                        mp->mount_point);
+                return -1;
+            }
+        }
+    }
+
+    if (input && strcmp(input, "-") != 0) {
+        in_fd = open(input, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            LOG_ERR("Failed to open %s: %s\n", input, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Report a failed btrfs receive as an error rather than dying
+    signal(SIGPIPE, SIG_IGN);
+
+    mount_fd = backup_open_userfs();
+    if (mount_fd < 0) goto exit;
+
+    dir_fd = backup_open_dir(RESTORE_DIR_NAME);
+    if (dir_fd < 0) goto exit;
+
+    if (backup_receive(in_fd) != 0) goto exit;
+
+    if (apply && backup_apply(mount_fd, dir_fd) != 0) goto exit;
+
+    ret = 0;
+
+exit:
+    if (dir_fd >= 0) close(dir_fd);
+    if (mount_fd >= 0) close(mount_fd);
+    if (in_fd != STDIN_FILENO) close(in_fd);
+
+    return ret;
+}
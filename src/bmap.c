@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "bmap.h"
+#include "mbr.h"
+#include "sha256.h"
+#include "userfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BMAP_IO_SIZE (1024u * 1024u)
+
+#define BMAP_SB_PRIMARY (64ull * 1024ull)
+#define BMAP_SB_SIZE    4096u
+#define BMAP_SB_FSID    0x20u
+
+/* Superblock copies: 64 KiB, 64 MiB, 256 GiB */
+static const uint64_t bmap_sb_offsets[] = {
+    BMAP_SB_PRIMARY,
+    64ull * 1024ull * 1024ull,
+    256ull * 1024ull * 1024ull * 1024ull,
+};
+
+/* Byte range, end excluded */
+struct bmap_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct bmap {
+    struct bmap_range *ranges;
+    size_t count;
+    size_t capacity;
+    uint64_t image_size;
+
+    // Found while walking the partition table
+    uint64_t first_lba;
+    uint64_t userfs_offset;
+    uint64_t userfs_size;
+};
+
+static int bmap_add(struct bmap *map, uint64_t start, uint64_t len)
+{
+    if (len == 0 || start >= map->image_size) return 0;
+    if (len > map->image_size - start) len = map->image_size - start;
+
+    if (map->count == map->capacity) {
+        size_t capacity           = map->capacity ? map->capacity * 2u : 64u;
+        struct bmap_range *ranges = realloc(map->ranges, capacity * sizeof(*ranges));
+        if (!ranges) return -1;
+
+        map->ranges   = ranges;
+        map->capacity = capacity;
+    }
+
+    map->ranges[map->count++] = (struct bmap_range){.start = start, .end = start + len};
+    return 0;
+}
+
+/* Map a partition according to what it holds */
+static int bmap_add_partition(const struct mbr_entry *entry, void *arg)
+{
+    struct bmap *map = arg;
+    uint64_t start   = entry->start * MBR_SECTOR_SIZE;
+    uint64_t size    = entry->size * MBR_SECTOR_SIZE;
+
+    if (entry->start < map->first_lba) map->first_lba = entry->start;
+
+    // The EBR of a logical partition
+    if (entry->ebr != 0 &&
+        bmap_add(map, entry->ebr * MBR_SECTOR_SIZE, MBR_SECTOR_SIZE) != 0) {
+        return -1;
+    }
+
+    if (mbr_is_extended(entry->type)) return 0;
+
+    if (entry->partno == USERFS_PART_NO) {
+        map->userfs_offset = start;
+        map->userfs_size   = size;
+        return 0;
+    }
+
+    // Only the header of a swap partition is meaningful
+    if (entry->type == MBR_PARTTYPE_SWAP && size > BMAP_SWAP_HEADER_SIZE) {
+        size = BMAP_SWAP_HEADER_SIZE;
+    }
+
+    return bmap_add(map, start, size);
+}
+
+/* Walk the DOS partition table (MBR and EBR chain) */
+static int bmap_add_partitions(int fd, struct bmap *map)
+{
+    map->first_lba = UINT64_MAX;
+
+    if (mbr_walk(fd, bmap_add_partition, map) != 0) {
+        LOG_ERR("Failed to read the DOS partition table: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // MBR and whatever the boot loader keeps before the first partition
+    if (map->first_lba == UINT64_MAX) map->first_lba = 1;
+    return bmap_add(map, 0, map->first_lba * MBR_SECTOR_SIZE);
+}
+
+static int bmap_search_dev_extents(int fs_fd, uint64_t devid, struct bmap *map)
+{
+    static uint64_t search_buf[65536 / sizeof(uint64_t)];
+
+    struct btrfs_ioctl_search_args_v2 *args = (void *)search_buf;
+    struct btrfs_ioctl_search_key *sk       = &args->key;
+
+    memset(sk, 0, sizeof(*sk));
+    sk->tree_id      = BTRFS_DEV_TREE_OBJECTID;
+    sk->min_objectid = devid;
+    sk->max_objectid = devid;
+    sk->min_type     = BTRFS_DEV_EXTENT_KEY;
+    sk->max_type     = BTRFS_DEV_EXTENT_KEY;
+    sk->max_offset   = (uint64_t)-1;
+    sk->max_transid  = (uint64_t)-1;
+
+    for (;;) {
+        sk->nr_items   = 4096;
+        args->buf_size = sizeof(search_buf) - sizeof(*args);
+
+        if (ioctl(fs_fd, BTRFS_IOC_TREE_SEARCH_V2, args) != 0) {
+            LOG_ERR("BTRFS_IOC_TREE_SEARCH_V2 failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (sk->nr_items == 0) break;
+
+        const uint8_t *buf = (const uint8_t *)args->buf;
+        size_t pos         = 0;
+        struct btrfs_ioctl_search_header sh;
+
+        for (uint32_t i = 0; i < sk->nr_items; i++) {
+            memcpy(&sh, buf + pos, sizeof(sh));
+            pos += sizeof(sh);
+
+            // The key offset is the physical start of the extent on the device
+            if (sh.type == BTRFS_DEV_EXTENT_KEY &&
+                sh.len >= offsetof(struct btrfs_dev_extent, chunk_tree_uuid)) {
+                uint64_t length;
+
+                memcpy(&length,
+                       buf + pos + offsetof(struct btrfs_dev_extent, length),
+                       sizeof(length));
+                if (bmap_add(map, map->userfs_offset + sh.offset, le64toh(length)) != 0) {
+                    return -1;
+                }
+            }
+
+            pos += sh.len;
+        }
+
+        // Dev extents of a device only differ by their offset
+        if (sh.offset == (uint64_t)-1) break;
+        sk->min_offset = sh.offset + 1;
+    }
+
+    return 0;
+}
+
+static int bmap_add_btrfs(int img_fd, const char *mount_point, struct bmap *map)
+{
+    int ret = -1;
+    uint8_t sb[BMAP_SB_SIZE];
+    struct btrfs_ioctl_fs_info_args fs_info;
+
+    if (map->userfs_size == 0) {
+        LOG_ERR("No userfs partition %u in the partition table\n", USERFS_PART_NO);
+        return -1;
+    }
+
+    int fs_fd = open(mount_point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fs_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", mount_point, strerror(errno));
+        return -1;
+    }
+
+    memset(&fs_info, 0, sizeof(fs_info));
+    if (ioctl(fs_fd, BTRFS_IOC_FS_INFO, &fs_info) != 0) {
+        LOG_ERR("%s is not a btrfs filesystem: %s\n", mount_point, strerror(errno));
+        goto exit;
+    }
+
+    if (fs_info.num_devices != 1) {
+        LOG_ERR("Multi-device filesystems are not supported\n");
+        goto exit;
+    }
+
+    // The mounted filesystem must be the one of the image
+    if (pread(img_fd, sb, sizeof(sb), (off_t)(map->userfs_offset + BMAP_SB_PRIMARY)) !=
+            (ssize_t)sizeof(sb) ||
+        memcmp(sb + BMAP_SB_FSID, fs_info.fsid, BTRFS_FSID_SIZE) != 0) {
+        LOG_ERR("%s is not the userfs filesystem of the image\n", mount_point);
+        goto exit;
+    }
+
+    // Make the allocation on the device match the one being read
+    if (syncfs(fs_fd) != 0) {
+        LOG_ERR("Failed to sync %s: %s\n", mount_point, strerror(errno));
+        goto exit;
+    }
+
+    // Superblock copies are not part of any chunk
+    for (size_t i = 0; i < ARRAY_SIZE(bmap_sb_offsets); i++) {
+        uint64_t offset = bmap_sb_offsets[i];
+
+        if (offset + BMAP_SB_SIZE > map->userfs_size) break;
+        if (bmap_add(map, map->userfs_offset + offset, BMAP_SB_SIZE) != 0) goto exit;
+    }
+
+    // Device ids are not reused, find the one left
+    struct btrfs_ioctl_dev_info_args dev_info;
+    for (uint64_t devid = 1; devid <= fs_info.max_id; devid++) {
+        memset(&dev_info, 0, sizeof(dev_info));
+        dev_info.devid = devid;
+        if (ioctl(fs_fd, BTRFS_IOC_DEV_INFO, &dev_info) != 0) continue;
+
+        ret = bmap_search_dev_extents(fs_fd, devid, map);
+        break;
+    }
+
+exit:
+    close(fs_fd);
+    return ret;
+}
+
+static uint64_t bmap_blocks_count(const struct bmap *map)
+{
+    return (map->image_size + BMAP_BLOCK_SIZE - 1u) / BMAP_BLOCK_SIZE;
+}
+
+static int bmap_compare_range(const void *a, const void *b)
+{
+    const struct bmap_range *ra = a;
+    const struct bmap_range *rb = b;
+
+    return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+/* Align the ranges to blocks, sort and merge them, return the mapped blocks */
+static uint64_t bmap_merge(struct bmap *map)
+{
+    uint64_t blocks = 0;
+    size_t n        = 0;
+
+    for (size_t i = 0; i < map->count; i++) {
+        struct bmap_range *r = &map->ranges[i];
+
+        r->start = r->start / BMAP_BLOCK_SIZE;
+        r->end   = (r->end + BMAP_BLOCK_SIZE - 1u) / BMAP_BLOCK_SIZE;
+    }
+
+    qsort(map->ranges, map->count, sizeof(*map->ranges), bmap_compare_range);
+
+    for (size_t i = 0; i < map->count; i++) {
+        if (n > 0 && map->ranges[i].start <= map->ranges[n - 1].end) {
+            if (map->ranges[i].end > map->ranges[n - 1].end) {
+                map->ranges[n - 1].end = map->ranges[i].end;
+            }
+        } else {
+            map->ranges[n++] = map->ranges[i];
+        }
+    }
+    map->count = n;
+
+    for (size_t i = 0; i < map->count; i++) {
+        blocks += map->ranges[i].end - map->ranges[i].start;
+    }
+
+    return blocks;
+}
+
+static int bmap_range_checksum(int fd,
+                               const struct bmap *map,
+                               const struct bmap_range *r,
+                               uint8_t *buf,
+                               char *hex)
+{
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t offset = r->start * BMAP_BLOCK_SIZE;
+    uint64_t end    = r->end * BMAP_BLOCK_SIZE;
+
+    // The last block may be partial
+    if (end > map->image_size) end = map->image_size;
+
+    sha256_init(&ctx);
+    while (offset < end) {
+        size_t len = end - offset < BMAP_IO_SIZE ? (size_t)(end - offset) : BMAP_IO_SIZE;
+
+        ssize_t n = pread(fd, buf, len, (off_t)offset);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+
+        sha256_update(&ctx, buf, (size_t)n);
+        offset += (uint64_t)n;
+    }
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+
+    return 0;
+}
+
+/* The file checksum is computed with its own value zeroed */
+#define BMAP_ZERO_CHECKSUM                                                               \
+    "0000000000000000000000000000000000000000000000000000000000000000"
+
+static int bmap_write(FILE *out, int fd, struct bmap *map, uint64_t mapped_blocks)
+{
+    int ret      = -1;
+    char *xml    = NULL;
+    size_t len   = 0;
+    uint8_t *buf = malloc(BMAP_IO_SIZE);
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+
+    FILE *fp = open_memstream(&xml, &len);
+    if (!buf || !fp) {
+        LOG_ERR("Out of memory\n");
+        goto exit;
+    }
+
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n");
+    fprintf(fp, "<!-- Generated by userfs bmap -->\n");
+    fprintf(fp, "<bmap version=\"2.0\">\n");
+    fprintf(fp,
+            "    <ImageSize> %llu </ImageSize>\n",
+            (unsigned long long)map->image_size);
+    fprintf(fp, "    <BlockSize> %u </BlockSize>\n", BMAP_BLOCK_SIZE);
+    fprintf(fp,
+            "    <BlocksCount> %llu </BlocksCount>\n",
+            (unsigned long long)bmap_blocks_count(map));
+    fprintf(fp,
+            "    <MappedBlocksCount> %llu </MappedBlocksCount>\n",
+            (unsigned long long)mapped_blocks);
+    fprintf(fp, "    <ChecksumType> sha256 </ChecksumType>\n");
+    fprintf(fp, "    <BmapFileChecksum> %s </BmapFileChecksum>\n", BMAP_ZERO_CHECKSUM);
+    fprintf(fp, "    <BlockMap>\n");
+
+    for (size_t i = 0; i < map->count; i++) {
+        const struct bmap_range *r = &map->ranges[i];
+
+        if (bmap_range_checksum(fd, map, r, buf, hex) != 0) {
+            LOG_ERR("Failed to read the image: %s\n", strerror(errno));
+            goto exit;
+        }
+
+        if (r->end - r->start == 1u) {
+            fprintf(fp,
+                    "        <Range chksum=\"%s\"> %llu </Range>\n",
+                    hex,
+                    (unsigned long long)r->start);
+        } else {
+            fprintf(fp,
+                    "        <Range chksum=\"%s\"> %llu-%llu </Range>\n",
+                    hex,
+                    (unsigned long long)r->start,
+                    (unsigned long long)(r->end - 1u));
+        }
+    }
+
+    fprintf(fp, "    </BlockMap>\n");
+    fprintf(fp, "</bmap>\n");
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        LOG_ERR("Out of memory\n");
+        goto exit;
+    }
+    fp = NULL;
+
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, xml, len);
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+
+    char *field = strstr(xml, BMAP_ZERO_CHECKSUM);
+    memcpy(field, hex, strlen(hex));
+
+    if (fwrite(xml, 1, len, out) != len || fflush(out) != 0) {
+        LOG_ERR("Failed to write the bmap: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    if (fp) fclose(fp);
+    free(xml);
+    free(buf);
+    return ret;
+}
+
+static void bmap_print_usage(void)
+{
+    printf("Usage: userfs bmap [-i IMAGE] [-m MOUNT] [-o FILE]\n");
+    printf("Write a bmap (for bmaptool) of the mapped blocks of a provisioned disk\n\n");
+    printf("  -i IMAGE  Disk or image to map (default: %s)\n", DISK);
+    printf("  -m MOUNT  Mount point of its userfs filesystem (default: %s)\n",
+           USERFS_MOUNT_POINT);
+    printf("  -o FILE   Output file (default: standard output)\n");
+}
+
+int bmap_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret                 = -1;
+    int fd                  = -1;
+    FILE *out               = stdout;
+    const char *image       = DISK;
+    const char *mount_point = USERFS_MOUNT_POINT;
+    const char *output      = NULL;
+    struct bmap map         = {0};
+    struct stat st;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "i:m:o:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            image = optarg;
+            break;
+        case 'm':
+            mount_point = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            bmap_print_usage();
+            return 0;
+        default:
+            bmap_print_usage();
+            return -1;
+        }
+    }
+
+    fd = open(image, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOG_ERR("Failed to open %s: %s\n", image, strerror(errno));
+        goto exit;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &map.image_size) != 0) {
+            LOG_ERR("Failed to get the size of %s: %s\n", image, strerror(errno));
+            goto exit;
+        }
+    } else {
+        map.image_size = (uint64_t)st.st_size;
+    }
+
+    if (bmap_add_partitions(fd, &map) != 0) goto exit;
+    if (bmap_add_btrfs(fd, mount_point, &map) != 0) goto exit;
+
+    uint64_t mapped_blocks = bmap_merge(&map);
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            LOG_ERR("Failed to open %s: %s\n", output, strerror(errno));
+            goto exit;
+        }
+    }
+
+    ret = bmap_write(out, fd, &map, mapped_blocks);
+    if (ret == 0) {
+        uint64_t blocks = bmap_blocks_count(&map);
+
+        // The bmap may be on the standard output
+        fprintf(stderr,
+                "%s: %llu of %llu blocks mapped (%.1f%%) in %zu ranges\n",
+                image,
+                (unsigned long long)mapped_blocks,
+                (unsigned long long)blocks,
+                blocks ? 100.0 * (double)mapped_blocks / (double)blocks : 0.0,
+                map.count);
+    }
+
+    if (output && fclose(out) != 0 && ret == 0) {
+        LOG_ERR("Failed to write %s: %s\n", output, strerror(errno));
+        ret = -1;
+    }
+
+exit:
+    if (fd >= 0) close(fd);
+    free(map.ranges);
+    return ret;
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "boost.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BOOST_CPUFREQ_DIR "/sys/devices/system/cpu/cpufreq"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT    1
+#define IOPRIO_WHO_PROCESS 1
+
+struct boost_policy {
+    char name[16];     // e.g. policy0
+    char governor[32]; // Governor to restore
+};
+
+static struct {
+    bool active;
+    bool restored;
+    struct timespec begin;
+    double window_ms;
+
+    int ioprio; // Saved settings, valid if the matching has_* is set
+    int policy;
+    struct sched_param param;
+    int nice;
+    cpu_set_t affinity;
+    bool has_ioprio;
+    bool has_sched;
+    bool has_affinity;
+
+    struct boost_policy policies[BOOST_MAX_POLICIES];
+    size_t policy_count;
+
+    uint64_t run_delay_ns; // Runqueue wait of the thread in the window
+    long nivcsw;           // Involuntary context switches in the window
+} boost;
+
+#if defined(USERFS_BOOST_FIFO)
+static const char *const boost_mode = "fifo";
+#elif defined(USERFS_BOOST)
+static const char *const boost_mode = "nice";
+#else
+static const char *const boost_mode = "none";
+#endif
+
+/* Time spent waiting on a runqueue by the calling thread, in ns */
+static uint64_t boost_run_delay(void)
+{
+    unsigned long long runtime = 0, delay = 0;
+
+    FILE *fp = fopen("/proc/thread-self/schedstat", "r");
+    if (!fp) return 0;
+
+    if (fscanf(fp, "%llu %llu", &runtime, &delay) != 2) delay = 0;
+
+    fclose(fp);
+    return delay;
+}
+
+/* Involuntary context switches of the thread and its terminated children */
+static long boost_nivcsw(void)
+{
+    struct rusage self, children;
+
+    if (getrusage(RUSAGE_THREAD, &self) != 0 ||
+        getrusage(RUSAGE_CHILDREN, &children) != 0) {
+        return 0;
+    }
+
+    return self.ru_nivcsw + children.ru_nivcsw;
+}
+
+static int boost_write_governor(const char *policy, const char *governor)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s/scaling_governor", BOOST_CPUFREQ_DIR, policy);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t len = (ssize_t)strlen(governor);
+    ssize_t ret = write(fd, governor, (size_t)len);
+    close(fd);
+
+    return ret == len ? 0 : -1;
+}
+
+#if defined(USERFS_BOOST)
+static int boost_read_governor(const char *policy, char *buf, size_t size)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s/scaling_governor", BOOST_CPUFREQ_DIR, policy);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t len = read(fd, buf, size - 1u);
+    close(fd);
+    if (len <= 0) return -1;
+
+    buf[len] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Switch every cpufreq policy to BOOST_GOVERNOR, remember the ones changed */
+static void boost_set_governors(void)
+{
+    struct dirent *ent;
+
+    DIR *dir = opendir(BOOST_CPUFREQ_DIR);
+    if (!dir) {
+        LOG_DBG("No cpufreq, governor not changed\n");
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL && boost.policy_count < BOOST_MAX_POLICIES) {
+        struct boost_policy *p = &boost.policies[boost.policy_count];
+
+        if (strncmp(ent->d_name, "policy", 6) != 0) continue;
+        if (strlen(ent->d_name) >= sizeof(p->name)) continue;
+
+        strcpy(p->name, ent->d_name);
+        if (boost_read_governor(p->name, p->governor, sizeof(p->governor)) != 0) {
+            continue;
+        }
+
+        if (strcmp(p->governor, BOOST_GOVERNOR) == 0) continue;
+
+        if (boost_write_governor(p->name, BOOST_GOVERNOR) != 0) {
+            LOG_WRN("Failed to set the %s governor of %s: %s\n",
+                    BOOST_GOVERNOR,
+                    p->name,
+                    strerror(errno));
+            continue;
+        }
+
+        boost.policy_count++;
+    }
+
+    closedir(dir);
+}
+#endif /* USERFS_BOOST */
+
+void boost_begin(void)
+{
+#if defined(USERFS_BOOST)
+    if (boost.active) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &boost.begin);
+    boost.run_delay_ns = boost_run_delay();
+    boost.nivcsw       = boost_nivcsw();
+
+    int ioprio = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (ioprio >= 0 &&
+        syscall(SYS_ioprio_set,
+                IOPRIO_WHO_PROCESS,
+                0,
+                (IOPRIO_CLASS_RT << IOPRIO_CLASS_SHIFT) | BOOST_IOPRIO_LEVEL) == 0) {
+        boost.ioprio     = ioprio;
+        boost.has_ioprio = true;
+    } else {
+        LOG_WRN("Failed to set real-time I/O priority: %s\n", strerror(errno));
+    }
+
+    boost.policy = sched_getscheduler(0);
+    if (boost.policy >= 0 && sched_getparam(0, &boost.param) == 0) {
+        errno           = 0;
+        boost.nice      = getpriority(PRIO_PROCESS, 0);
+        boost.has_sched = errno == 0;
+    }
+
+#if defined(USERFS_BOOST_FIFO)
+    struct sched_param param = {.sched_priority = BOOST_FIFO_PRIORITY};
+    if (!boost.has_sched || sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+        LOG_WRN("Failed to set SCHED_FIFO: %s\n", strerror(errno));
+        boost.has_sched = false;
+    }
+#else
+    if (!boost.has_sched || setpriority(PRIO_PROCESS, 0, BOOST_NICE) != 0) {
+        LOG_WRN("Failed to set nice value: %s\n", strerror(errno));
+        boost.has_sched = false;
+    }
+#endif
+
+    if (USERFS_BOOST_CPU >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(USERFS_BOOST_CPU, &set);
+
+        if (sched_getaffinity(0, sizeof(boost.affinity), &boost.affinity) != 0 ||
+            !CPU_ISSET(USERFS_BOOST_CPU, &boost.affinity)) {
+            LOG_WRN("CPU %d not available, not pinned\n", USERFS_BOOST_CPU);
+        } else if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            LOG_WRN("Failed to pin to CPU %d: %s\n", USERFS_BOOST_CPU, strerror(errno));
+        } else {
+            boost.has_affinity = true;
+        }
+    }
+
+    boost_set_governors();
+
+    boost.active = true;
+    LOG_DBG("Boost (%s) started\n", boost_mode);
+#endif /* USERFS_BOOST */
+}
+
+void boost_end(void)
+{
+    struct timespec now;
+    bool ok = true;
+
+    if (!boost.active) return;
+    boost.active = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    boost.window_ms = (double)(now.tv_sec - boost.begin.tv_sec) * 1000.0 +
+                      (double)(now.tv_nsec - boost.begin.tv_nsec) / 1000000.0;
+    boost.run_delay_ns = boost_run_delay() - boost.run_delay_ns;
+    boost.nivcsw       = boost_nivcsw() - boost.nivcsw;
+
+    if (boost.has_ioprio &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, boost.ioprio) != 0) {
+        LOG_WRN("Failed to restore the I/O priority: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    if (boost.has_sched && (sched_setscheduler(0, boost.policy, &boost.param) != 0 ||
+                            setpriority(PRIO_PROCESS, 0, boost.nice) != 0)) {
+        LOG_WRN("Failed to restore the scheduling policy: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    if (boost.has_affinity &&
+        sched_setaffinity(0, sizeof(boost.affinity), &boost.affinity) != 0) {
+        LOG_WRN("Failed to restore the CPU affinity: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    for (size_t i = 0; i < boost.policy_count; i++) {
+        const struct boost_policy *p = &boost.policies[i];
+
+        if (boost_write_governor(p->name, p->governor) != 0) {
+            LOG_WRN("Failed to restore the %s governor of %s: %s\n",
+                    p->governor,
+                    p->name,
+                    strerror(errno));
+            ok = false;
+        }
+    }
+
+    boost.restored = ok;
+    LOG_INF("Boost (%s) ended after %.1f ms, %.1f ms waiting for a CPU, "
+            "%ld preemptions\n",
+            boost_mode,
+            boost.window_ms,
+            (double)boost.run_delay_ns / 1000000.0,
+            boost.nivcsw);
+}
+
+void boost_write_json(FILE *fp)
+{
+    fprintf(fp,
+            "{\"mode\": \"%s\", \"window_ms\": %.3f, \"ioprio_rt\": %s, \"sched\": %s, "
+            "\"cpu\": %d, \"governors\": %zu, \"run_delay_ms\": %.3f, "
+            "\"preemptions\": %ld, \"restored\": %s}",
+            boost_mode,
+            boost.window_ms,
+            boost.has_ioprio ? "true" : "false",
+            boost.has_sched ? "true" : "false",
+            boost.has_affinity ? USERFS_BOOST_CPU : -1,
+            boost.policy_count,
+            (double)boost.run_delay_ns / 1000000.0,
+            boost.nivcsw,
+            boost.restored ? "true" : "false");
+}
@@ -4,6 +4,8 @@
  * SPDX-License-Identifier: Apache-2.0
  */
  
+#define _GNU_SOURCE
+
 #include "userfs.h"
 
 #include <errno.h>
@@ -15,14 +17,25 @@
 #include <string.h>
 
 #include <blkid.h>
+#include <linux/btrfs.h>
 #include <linux/fs.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
+#define BTRFS_CONTAINERS_COMPRESSION "zstd"
+
 static const char *btrfs_subvolumes[] = {
     [BTRFS_SV_DATA_INDEX]   = "vol-data",
     [BTRFS_SV_CONFIG_INDEX] = "vol-config",
+#if defined(USERFS_OVERLAY_OPT)
+    [BTRFS_SV_OPT_INDEX] = "vol-opt",
+#endif
+#if defined(USERFS_CONTAINERS_PATH)
+    [BTRFS_SV_CONTAINERS_INDEX] = "vol-containers",
+#endif
 };
 
 const char *btrfs_get_volume(size_t sv_index)
@@ -33,11 +46,103 @@ const char *btrfs_get_volume(size_t sv_index)
     return btrfs_subvolumes[sv_index];
 }
 
+int btrfs_snapshot(int src_fd, int dir_fd, const char *name, bool readonly)
+{
+    struct btrfs_ioctl_vol_args_v2 args;
+
+    memset(&args, 0, sizeof(args));
+    args.fd    = src_fd;
+    args.flags = readonly ? BTRFS_SUBVOL_RDONLY : 0;
+    snprintf(args.name, sizeof(args.name), "%s", name);
+
+    return ioctl(dir_fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+}
+
+int btrfs_delete_subvolume(int dir_fd, const char *name)
+{
+    struct btrfs_ioctl_vol_args args;
+
+    memset(&args, 0, sizeof(args));
+    snprintf(args.name, sizeof(args.name), "%s", name);
+
+    return ioctl(dir_fd, BTRFS_IOC_SNAP_DESTROY, &args);
+}
+
+/* Migrate the layout and create the missing subvolumes */
+static int btrfs_provision(bool formatted)
+{
+    // Bring the layout up to date before the subvolumes are used
+    if (layout_migrate(formatted) != 0) {
+        LOG_ERR("Failed to migrate the userfs layout\n");
+        return -1;
+    }
+
+    // Create missing subvolumes, also those added after the filesystem
+    // was created (e.g. vol-containers)
+    // FIXME use the btrfs library instead of running commands
+
+    char sv_name[PATH_MAX];
+    const char *btrfs_create_subvolumes[] = {
+        "btrfs",
+        "subvolume",
+        "create",
+        sv_name, // Placeholder for subvolume name
+        NULL,    // End of arguments
+    };
+
+    for (size_t sv = 0u; sv < ARRAY_SIZE(btrfs_subvolumes); sv++) {
+        snprintf(sv_name,
+                 sizeof(sv_name),
+                 "%s/%s",
+                 USERFS_MOUNT_POINT,
+                 btrfs_subvolumes[sv]);
+
+        if (!formatted && access(sv_name, F_OK) == 0) continue;
+
+        LOG_DBG("Creating BTRFS subvolume: %s\n", sv_name);
+
+        command_display(btrfs_create_subvolumes[0],
+                        (char *const *)btrfs_create_subvolumes);
+        int ret = command_run(NULL,
+                              NULL,
+                              btrfs_create_subvolumes[0],
+                              (char *const *)btrfs_create_subvolumes);
+        if (ret < 0) {
+            LOG_ERR("Failed to create BTRFS subvolume %s: %s\n",
+                    btrfs_create_subvolumes[3],
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Whether btrfs_provision() has nothing to do */
+static bool btrfs_is_provisioned(void)
+{
+    char sv_name[PATH_MAX];
+
+    if (!layout_is_current()) return false;
+
+    for (size_t sv = 0u; sv < ARRAY_SIZE(btrfs_subvolumes); sv++) {
+        snprintf(sv_name,
+                 sizeof(sv_name),
+                 "%s/%s",
+                 USERFS_MOUNT_POINT,
+                 btrfs_subvolumes[sv]);
+        if (access(sv_name, F_OK) != 0) return false;
+    }
+
+    return true;
+}
+
 int step2_create_btrfs_filesystem(struct args *args, struct disk_info *disk, size_t userfs_partno)
 {
     int ret = -1;
 
     struct part_info *userfs_part = &disk->partitions[userfs_partno];
+    bool kiosk                    = (args->flags & FLAG_USERFS_KIOSK) != 0;
 
     // Some assertions ...
     ASSERT(userfs_part->used, "Userfs partition should be created and in use");
@@ -54,16 +159,15 @@ int step2_create_btrfs_filesystem(struct args *args, struct disk_info *disk, siz
     ret = disk_part_build_path(
         userfs_part_device, sizeof(userfs_part_device), userfs_part->partno);
     if (ret < 0) {
-        fprintf(stderr, "Failed to build userfs partition path: %s\n", strerror(errno));
+        LOG_ERR("Failed to build userfs partition path: %s\n", strerror(errno));
         goto exit;
     }
 
-    LOG("Userfs partition device: %s\n", userfs_part_device);
+    LOG_DBG("Userfs partition device: %s\n", userfs_part_device);
 
     ret = fs_probe(userfs_part_device, &userfs_part->fs_info);
     if (ret != 0) {
-        fprintf(stderr,
-                "Failed to probe filesystem on %s: %s\n",
+        LOG_ERR("Failed to probe filesystem on %s: %s\n",
                 userfs_part_device,
                 strerror(errno));
         goto exit;
@@ -72,20 +176,41 @@ int step2_create_btrfs_filesystem(struct args *args, struct disk_info *disk, siz
     fs_info_display(&userfs_part->fs_info);
 
     bool do_format_btrfs = false;
+    bool nodiscard       = false;
+    bool converted       = false;
     if (args->flags & FLAG_USERFS_FORCE_FORMAT) {
         do_format_btrfs = true;
-        LOG("Userfs partition (%s) will be formatted to BTRFS due to force flag\n",
-            userfs_part_device);
+        LOG_DBG("Userfs partition (%s) will be formatted to BTRFS due to force flag\n",
+                userfs_part_device);
+    } else if (args->flags & FLAG_USERFS_FIRST_BOOT) {
+        // Keep a healthy userfs, skip the discard of a blank partition
+        enum format_mode mode;
+        format_decide(userfs_part_device, &userfs_part->fs_info, &mode);
+        do_format_btrfs = mode != FORMAT_MODE_KEEP;
+        nodiscard       = mode == FORMAT_MODE_FAST;
     }
 
     switch (userfs_part->fs_info.type) {
     case FS_TYPE_BTRFS:
-        printf("Userfs partition %zu already formatted as BTRFS, skipping\n",
-               userfs_part->partno);
+        LOG_INF("Userfs partition %zu already formatted as BTRFS, skipping\n",
+                userfs_part->partno);
         break;
     case FS_TYPE_EXT4:
-        printf("Userfs partition %zu already formatted as EXT4, skipping\n",
-               userfs_part->partno);
+        if (do_format_btrfs) break;
+
+        // Legacy userfs, converted in place (see convert.h)
+        ret = convert_ext4(userfs_part_device);
+        if (ret != 0) goto exit;
+
+        ret = fs_probe(userfs_part_device, &userfs_part->fs_info);
+        if (ret != 0 || userfs_part->fs_info.type != FS_TYPE_BTRFS) {
+            LOG_ERR("No BTRFS filesystem on %s after conversion\n", userfs_part_device);
+            ret = -1;
+            goto exit;
+        }
+
+        report_set_action(REPORT_STEP_BTRFS, REPORT_ACTION_CONVERTED);
+        converted = true;
         break;
     case FS_TYPE_UNKNOWN:
     default:
@@ -95,88 +220,177 @@ int step2_create_btrfs_filesystem(struct args *args, struct disk_info *disk, siz
 
     if (do_format_btrfs) {
         // If the userfs partition is not BTRFS, create it
-        LOG("Creating BTRFS filesystem on %s\n", userfs_part_device);
+        LOG_DBG("Creating BTRFS filesystem on %s\n", userfs_part_device);
+
+        const char *mkfs_args[8];
+        size_t argc = 0;
 
-        const char *const mkfs_args[] = {
-            "mkfs.btrfs",
-            "-f", // Force creation
-            userfs_part_device,
-            NULL,
-        };
+        mkfs_args[argc++] = "mkfs.btrfs";
+        mkfs_args[argc++] = "-f"; // Force creation
+        mkfs_args[argc++] = "-L";
+        mkfs_args[argc++] = FORMAT_LABEL;
+        if (nodiscard) mkfs_args[argc++] = "-K"; // Blank, no TRIM needed
+        mkfs_args[argc++] = userfs_part_device;
+        mkfs_args[argc]   = NULL;
 
         command_display(mkfs_args[0], (char *const *)mkfs_args);
         ret = command_run(NULL, NULL, mkfs_args[0], (char *const *)mkfs_args);
-        LOG("mkfs.btrfs returned: %d\n", ret);
+        LOG_DBG("mkfs.btrfs returned: %d\n", ret);
         if (ret < 0) {
-            fprintf(stderr, "Failed to create BTRFS filesystem: %s\n", strerror(errno));
+            LOG_ERR("Failed to create BTRFS filesystem: %s\n", strerror(errno));
             goto exit;
         }
 
-        LOG("BTRFS filesystem created successfully on %s\n", userfs_part_device);
+        LOG_DBG("BTRFS filesystem created successfully on %s\n", userfs_part_device);
+        report_set_action(REPORT_STEP_BTRFS, REPORT_ACTION_FORMATTED);
 
         // Create the mount point if it doesn't exist
         ret = create_directory(USERFS_MOUNT_POINT);
         if (ret != 0) {
-            fprintf(stderr,
-                    "Failed to create mount point %s: %s\n",
+            LOG_ERR("Failed to create mount point %s: %s\n",
                     USERFS_MOUNT_POINT,
                     strerror(errno));
             goto exit;
         }
+    } else if (!converted) {
+        report_set_action(REPORT_STEP_BTRFS, REPORT_ACTION_SKIPPED);
     }
 
     // Mount the btrfs filesystem
-    LOG("Mounting BTRFS filesystem on %s\n", USERFS_MOUNT_POINT);
+    LOG_DBG("Mounting BTRFS filesystem on %s\n", USERFS_MOUNT_POINT);
+
+    const char *options = NULL;
 
-    ret = mount(userfs_part_device, USERFS_MOUNT_POINT, "btrfs", 0, NULL);
+    ret = do_mount(userfs_part_device,
+                   USERFS_MOUNT_POINT,
+                   "btrfs",
+                   kiosk ? MS_RDONLY : 0,
+                   options);
+
+    // A data or mirror device is missing, btrfs refuses the mount unless degraded
+    if (ret != 0 && devices_member_failed()) {
+        LOG_WRN("Failed to mount %s: %s, retrying degraded\n",
+                USERFS_MOUNT_POINT,
+                strerror(errno));
+        options = "degraded";
+        ret     = do_mount(userfs_part_device,
+                           USERFS_MOUNT_POINT,
+                           "btrfs",
+                           kiosk ? MS_RDONLY : 0,
+                           options);
+    }
     if (ret != 0) {
-        fprintf(stderr,
-                "Failed to mount BTRFS filesystem on %s: %s\n",
+        LOG_ERR("Failed to mount BTRFS filesystem on %s: %s\n",
                 USERFS_MOUNT_POINT,
                 strerror(errno));
         goto exit;
     }
 
-    if (do_format_btrfs) {
-        // Create subvolumes
-        // FIXME use the btrfs library instead of running commands
-
-        char sv_name[PATH_MAX];
-        const char *btrfs_create_subvolumes[] = {
-            "btrfs",
-            "subvolume",
-            "create",
-            sv_name, // Placeholder for subvolume name
-            NULL,    // End of arguments
-        };
-
-        for (size_t sv = 0u; sv < ARRAY_SIZE(btrfs_subvolumes); sv++) {
-            snprintf(sv_name,
-                     sizeof(sv_name),
-                     "%s/%s",
-                     USERFS_MOUNT_POINT,
-                     btrfs_subvolumes[sv]);
-
-            LOG("Creating BTRFS subvolume: %s\n", sv_name);
-
-            command_display(btrfs_create_subvolumes[0],
-                            (char *const *)btrfs_create_subvolumes);
-            ret = command_run(NULL,
-                              NULL,
-                              btrfs_create_subvolumes[0],
-                              (char *const *)btrfs_create_subvolumes);
-            if (ret < 0) {
-                fprintf(stderr,
-                        "Failed to create BTRFS subvolume %s: %s\n",
-                        btrfs_create_subvolumes[3],
-                        strerror(errno));
-                goto exit;
-            }
+    report_add_mount(userfs_part_device, USERFS_MOUNT_POINT, "btrfs", options);
+
+    // In kiosk mode the filesystem stays read-only, it is only written to when
+    // it has to be provisioned (new filesystem, layout migration, new subvolume)
+    bool provision = !kiosk || do_format_btrfs || !btrfs_is_provisioned();
+
+    if (kiosk && provision) {
+        LOG_WRN("Kiosk mode, provisioning %s read-write\n", USERFS_MOUNT_POINT);
+        ret = do_mount(
+            userfs_part_device, USERFS_MOUNT_POINT, "btrfs", MS_REMOUNT, options);
+        if (ret != 0) {
+            LOG_ERR("Failed to remount %s read-write: %s\n",
+                    USERFS_MOUNT_POINT,
+                    strerror(errno));
+            goto exit;
         }
     }
 
+    if (provision) {
+        ret = btrfs_provision(do_format_btrfs);
+        if (ret != 0) goto exit;
+    }
+
+    if (kiosk && provision) {
+        ret = do_mount(userfs_part_device,
+                       USERFS_MOUNT_POINT,
+                       "btrfs",
+                       MS_REMOUNT | MS_RDONLY,
+                       options);
+        if (ret != 0) {
+            LOG_ERR("Failed to remount %s read-only: %s\n",
+                    USERFS_MOUNT_POINT,
+                    strerror(errno));
+            goto exit;
+        }
+    }
+
+    // Worn cards get a reduced-write profile, never fail the boot because of it
+    if (wear_apply_profile(userfs_part_device, disk->total_size, kiosk) != 0) {
+        LOG_WRN("Continuing with the default mount options\n");
+    }
+
     return 0;
 
 exit:
     return ret;
 }
+
+#if defined(USERFS_CONTAINERS_PATH)
+int btrfs_mount_containers(void)
+{
+    int ret;
+    char sv_path[PATH_MAX];
+
+    snprintf(sv_path,
+             sizeof(sv_path),
+             "%s/%s",
+             USERFS_MOUNT_POINT,
+             btrfs_subvolumes[BTRFS_SV_CONTAINERS_INDEX]);
+
+    int fd = open(sv_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", sv_path, strerror(errno));
+        return -1;
+    }
+
+    // Snapshots and reflinks need copy-on-write, new files inherit both flags
+    int flags = 0;
+    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_NOCOW_FL)) {
+        flags &= ~FS_NOCOW_FL;
+        if (ioctl(fd, FS_IOC_SETFLAGS, &flags) != 0) {
+            LOG_WRN("Failed to clear nodatacow on %s: %s\n", sv_path, strerror(errno));
+        }
+    }
+
+    if (fsetxattr(fd,
+                  "btrfs.compression",
+                  BTRFS_CONTAINERS_COMPRESSION,
+                  strlen(BTRFS_CONTAINERS_COMPRESSION),
+                  0) != 0) {
+        LOG_WRN("Failed to enable compression on %s: %s\n", sv_path, strerror(errno));
+    }
+
+    close(fd);
+
+    // Lives below the /var overlay, create it there
+    ret = create_directories(USERFS_CONTAINERS_PATH);
+    if (ret != 0) {
+        LOG_ERR("Failed to create %s: %s\n", USERFS_CONTAINERS_PATH, strerror(errno));
+        return -1;
+    }
+
+    LOG_INF("Mounting %s on %s\n", sv_path, USERFS_CONTAINERS_PATH);
+
+    ret = do_mount(sv_path, USERFS_CONTAINERS_PATH, NULL, MS_BIND, NULL);
+    if (ret != 0) {
+        LOG_ERR("Failed to mount %s on %s: %s\n",
+                sv_path,
+                USERFS_CONTAINERS_PATH,
+                strerror(errno));
+        return -1;
+    }
+
+    report_add_mount(sv_path, USERFS_CONTAINERS_PATH, "btrfs", NULL);
+
+    return 0;
+}
+#endif /* USERFS_CONTAINERS_PATH */
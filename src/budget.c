@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "budget.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <linux/limits.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BUDGET_MAX_TASKS 64u
+#define BUDGET_MAX_ARGS  32u
+
+/* Mirrors struct ptrace_syscall_info from <linux/ptrace.h>, which cannot be
+ * included together with <sys/ptrace.h> */
+struct budget_syscall_info {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instruction_pointer;
+    uint64_t stack_pointer;
+    union {
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+        } entry;
+        struct {
+            int64_t rval;
+            uint8_t is_error;
+        } exit;
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+            uint32_t ret_data;
+        } seccomp;
+    };
+};
+
+#define BUDGET_SYSCALL_INFO_ENTRY 1
+#define BUDGET_SYSCALL_INFO_EXIT  2
+
+enum budget_counter {
+    BUDGET_FORKS = 0,
+    BUDGET_DAEMONS,
+    BUDGET_THREADS,
+    BUDGET_EXECS,
+    BUDGET_OPENS,
+    BUDGET_READS,
+    BUDGET_IOCTLS,
+    BUDGET_MOUNTS,
+    BUDGET_UMOUNTS,
+    BUDGET_SYSCALLS,
+    BUDGET_READ_BYTES,
+    BUDGET_DISK_READ_BYTES,
+    BUDGET_COUNTER_COUNT,
+};
+
+static const char *const budget_counter_names[BUDGET_COUNTER_COUNT] = {
+    [BUDGET_FORKS]           = "forks",
+    [BUDGET_DAEMONS]         = "daemons",
+    [BUDGET_THREADS]         = "threads",
+    [BUDGET_EXECS]           = "execs",
+    [BUDGET_OPENS]           = "opens",
+    [BUDGET_READS]           = "reads",
+    [BUDGET_IOCTLS]          = "ioctls",
+    [BUDGET_MOUNTS]          = "mounts",
+    [BUDGET_UMOUNTS]         = "umounts",
+    [BUDGET_SYSCALLS]        = "syscalls",
+    [BUDGET_READ_BYTES]      = "read_bytes",
+    [BUDGET_DISK_READ_BYTES] = "disk_read_bytes",
+};
+
+/* Per traced task state, syscall entry and exit stops alternate */
+struct budget_task {
+    pid_t pid;
+    uint64_t nr;
+    int fd;
+};
+
+struct budget_ctx {
+    uint64_t counters[BUDGET_COUNTER_COUNT];
+    struct budget_task tasks[BUDGET_MAX_TASKS];
+    bool initial_exec_seen;
+};
+
+static struct budget_task *budget_task_get(struct budget_ctx *ctx, pid_t pid)
+{
+    struct budget_task *free_slot = NULL;
+
+    for (size_t i = 0; i < BUDGET_MAX_TASKS; i++) {
+        if (ctx->tasks[i].pid == pid) return &ctx->tasks[i];
+        if (!free_slot && ctx->tasks[i].pid == 0) free_slot = &ctx->tasks[i];
+    }
+
+    if (free_slot) {
+        free_slot->pid = pid;
+        free_slot->nr  = (uint64_t)-1;
+        free_slot->fd  = -1;
+    }
+
+    return free_slot;
+}
+
+static void budget_task_release(struct budget_ctx *ctx, pid_t pid)
+{
+    for (size_t i = 0; i < BUDGET_MAX_TASKS; i++) {
+        if (ctx->tasks[i].pid == pid) ctx->tasks[i].pid = 0;
+    }
+}
+
+static bool budget_is_read(uint64_t nr)
+{
+    return nr == SYS_read || nr == SYS_pread64 || nr == SYS_readv || nr == SYS_preadv;
+}
+
+static void budget_syscall_entry(struct budget_ctx *ctx,
+                                 struct budget_task *task,
+                                 const struct budget_syscall_info *info)
+{
+    uint64_t nr = info->entry.nr;
+
+    task->nr = nr;
+    task->fd = (int)info->entry.args[0];
+
+    ctx->counters[BUDGET_SYSCALLS]++;
+
+    if (nr == SYS_openat
+#if defined(SYS_open)
+        || nr == SYS_open
+#endif
+#if defined(SYS_openat2)
+        || nr == SYS_openat2
+#endif
+    ) {
+        ctx->counters[BUDGET_OPENS]++;
+    } else if (budget_is_read(nr)) {
+        ctx->counters[BUDGET_READS]++;
+    } else if (nr == SYS_ioctl) {
+        ctx->counters[BUDGET_IOCTLS]++;
+    } else if (nr == SYS_mount) {
+        ctx->counters[BUDGET_MOUNTS]++;
+    } else if (nr == SYS_umount2) {
+        ctx->counters[BUDGET_UMOUNTS]++;
+    }
+}
+
+/* Return true if the task has to be detached */
+static bool budget_syscall_exit(struct budget_ctx *ctx,
+                                struct budget_task *task,
+                                const struct budget_syscall_info *info)
+{
+    char link[64];
+    char target[PATH_MAX];
+
+    // A task starting its own session is a daemon (autofs server, deferred
+    // worker), it outlives the boot path and is not waited for
+    if (task->nr == SYS_setsid && !info->exit.is_error) {
+        ctx->counters[BUDGET_DAEMONS]++;
+        return true;
+    }
+
+    if (!budget_is_read(task->nr) || info->exit.is_error || info->exit.rval <= 0) {
+        return false;
+    }
+
+    ctx->counters[BUDGET_READ_BYTES] += (uint64_t)info->exit.rval;
+
+    // Attribute the read to the disk if the fd points to it or one of its partitions
+    snprintf(link, sizeof(link), "/proc/%d/fd/%d", task->pid, task->fd);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len < 0) return false;
+    target[len] = '\0';
+
+    if (strncmp(target, DISK, strlen(DISK)) == 0) {
+        ctx->counters[BUDGET_DISK_READ_BYTES] += (uint64_t)info->exit.rval;
+    }
+
+    return false;
+}
+
+/* Return true if the task has to be detached */
+static bool budget_handle_syscall_stop(struct budget_ctx *ctx, pid_t pid)
+{
+    struct budget_syscall_info info;
+    struct budget_task *task = budget_task_get(ctx, pid);
+
+    if (!task) return false;
+
+    memset(&info, 0, sizeof(info));
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) < 0) {
+        return false;
+    }
+
+    if (info.op == BUDGET_SYSCALL_INFO_ENTRY) {
+        budget_syscall_entry(ctx, task, &info);
+    } else if (info.op == BUDGET_SYSCALL_INFO_EXIT) {
+        return budget_syscall_exit(ctx, task, &info);
+    }
+
+    return false;
+}
+
+static void budget_handle_event(struct budget_ctx *ctx, int event)
+{
+    switch (event) {
+    case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_VFORK:
+        ctx->counters[BUDGET_FORKS]++;
+        break;
+    case PTRACE_EVENT_CLONE:
+        ctx->counters[BUDGET_THREADS]++;
+        break;
+    case PTRACE_EVENT_EXEC:
+        // The first exec is userfs itself being started by the tracer
+        if (ctx->initial_exec_seen) {
+            ctx->counters[BUDGET_EXECS]++;
+        }
+        ctx->initial_exec_seen = true;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Run userfs with the given arguments under ptrace, return its exit code */
+static int budget_trace(struct budget_ctx *ctx, char *const argv[])
+{
+    int status;
+    int exit_code = -1;
+
+    pid_t child = fork();
+    if (child < 0) {
+        LOG_ERR("fork: %s\n", strerror(errno));
+        return -1;
+    } else if (child == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(127);
+    }
+
+    if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        LOG_ERR("Failed to start traced process\n");
+        return -1;
+    }
+
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                   PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, child, NULL, (void *)options) < 0) {
+        LOG_ERR("PTRACE_SETOPTIONS: %s\n", strerror(errno));
+        kill(child, SIGKILL);
+        return -1;
+    }
+
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    for (;;) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break; // ECHILD: all traced tasks are gone
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child) {
+                exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                              : 128 + WTERMSIG(status);
+            }
+            budget_task_release(ctx, pid);
+            continue;
+        }
+
+        if (!WIFSTOPPED(status)) continue;
+
+        int sig    = WSTOPSIG(status);
+        int inject = 0;
+
+        if (sig == (SIGTRAP | 0x80)) {
+            if (budget_handle_syscall_stop(ctx, pid)) {
+                ptrace(PTRACE_DETACH, pid, NULL, NULL);
+                budget_task_release(ctx, pid);
+                continue;
+            }
+        } else if (sig == SIGTRAP && (status >> 16) != 0) {
+            budget_handle_event(ctx, status >> 16);
+        } else if (sig != SIGSTOP && sig != SIGTRAP) {
+            // Forward genuine signals, new tasks start with a SIGSTOP
+            inject = sig;
+        }
+
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)inject);
+    }
+
+    return exit_code;
+}
+
+static int budget_find_counter(const char *name)
+{
+    for (int i = 0; i < BUDGET_COUNTER_COUNT; i++) {
+        if (strcmp(budget_counter_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Load a budget file, counters without budget are set to UINT64_MAX */
+static int budget_load(const char *path, uint64_t budget[BUDGET_COUNTER_COUNT])
+{
+    char line[256];
+    char name[64];
+    unsigned long long max;
+    int lineno = 0;
+
+    for (int i = 0; i < BUDGET_COUNTER_COUNT; i++) budget[i] = UINT64_MAX;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        LOG_ERR("Failed to open budget %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        if (sscanf(line, "%63s %llu", name, &max) != 2) continue;
+
+        int counter = budget_find_counter(name);
+        if (counter < 0) {
+            LOG_WRN("%s:%d: unknown counter '%s'\n", path, lineno, name);
+            continue;
+        }
+        budget[counter] = max;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static int budget_save(const char *path, const uint64_t counters[BUDGET_COUNTER_COUNT])
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "# userfs syscall budget, generated by 'userfs budget -w'\n");
+    for (int i = 0; i < BUDGET_COUNTER_COUNT; i++) {
+        fprintf(fp,
+                "%s %llu\n",
+                budget_counter_names[i],
+                (unsigned long long)counters[i]);
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static void budget_print_usage(void)
+{
+    printf("Usage: userfs budget [-b BUDGET] [-w OUTPUT] [-- USERFS_ARGS]\n");
+    printf("Run userfs under ptrace and check syscall/fork counts against a budget\n\n");
+    printf("  -b BUDGET  Budget file (\"<counter> <max>\" per line)\n");
+    printf("  -w OUTPUT  Write the measured counts as a budget file\n");
+    printf("\nCounters:");
+    for (int i = 0; i < BUDGET_COUNTER_COUNT; i++) printf(" %s", budget_counter_names[i]);
+    printf("\n");
+}
+
+int budget_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    const char *budget_path = NULL;
+    const char *output_path = NULL;
+    char *child_argv[BUDGET_MAX_ARGS + 2];
+    uint64_t budget[BUDGET_COUNTER_COUNT];
+    struct budget_ctx ctx;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "+b:w:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            budget_path = optarg;
+            break;
+        case 'w':
+            output_path = optarg;
+            break;
+        case 'h':
+            budget_print_usage();
+            return 0;
+        default:
+            budget_print_usage();
+            return -1;
+        }
+    }
+
+    if (argc - optind > (int)BUDGET_MAX_ARGS) {
+        LOG_ERR("Too many arguments\n");
+        return -1;
+    }
+
+    size_t n        = 0;
+    child_argv[n++] = "userfs";
+    for (int i = optind; i < argc; i++) child_argv[n++] = argv[i];
+    child_argv[n] = NULL;
+
+    if (budget_path && budget_load(budget_path, budget) != 0) return -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    int exit_code = budget_trace(&ctx, child_argv);
+
+    bool exceeded = false;
+    printf("%-16s %12s %12s %10s\n", "counter", "count", "budget", "diff");
+    for (int i = 0; i < BUDGET_COUNTER_COUNT; i++) {
+        if (budget_path && budget[i] != UINT64_MAX) {
+            long long diff = (long long)ctx.counters[i] - (long long)budget[i];
+            printf("%-16s %12llu %12llu %+10lld%s\n",
+                   budget_counter_names[i],
+                   (unsigned long long)ctx.counters[i],
+                   (unsigned long long)budget[i],
+                   diff,
+                   diff > 0 ? "  EXCEEDED" : "");
+            if (diff > 0) exceeded = true;
+        } else {
+            printf("%-16s %12llu %12s %10s\n",
+                   budget_counter_names[i],
+                   (unsigned long long)ctx.counters[i],
+                   "-",
+                   "");
+        }
+    }
+
+    fflush(stdout);
+
+    if (output_path && budget_save(output_path, ctx.counters) != 0) return -1;
+
+    if (exit_code != 0) {
+        LOG_ERR("Traced userfs exited with code %d\n", exit_code);
+        return -1;
+    }
+
+    if (exceeded) {
+        LOG_ERR("Syscall budget exceeded\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "convert.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* e2fsck exit codes above this one mean uncorrected errors */
+#define CONVERT_FSCK_MAX_OK 2
+
+int convert_ext4(const char *device)
+{
+    int ret;
+    struct timespec begin, end;
+
+    const char *const fsck_args[] = {
+        "e2fsck",
+        "-f",
+        "-p",
+        device,
+        NULL,
+    };
+
+    const char *const convert_args[] = {
+        "btrfs-convert",
+        "--no-datasum",
+        "-l",
+        FORMAT_LABEL,
+        device,
+        NULL,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    LOG_INF("Converting ext4 userfs partition %s to btrfs\n", device);
+
+    command_display(fsck_args[0], (char *const *)fsck_args);
+    ret = command_run(NULL, NULL, fsck_args[0], (char *const *)fsck_args);
+    if (ret < 0 || ret > CONVERT_FSCK_MAX_OK) {
+        LOG_ERR("e2fsck of %s failed (%d), not converting it\n", device, ret);
+        return -1;
+    }
+
+    command_display(convert_args[0], (char *const *)convert_args);
+    ret = command_run(NULL, NULL, convert_args[0], (char *const *)convert_args);
+    if (ret != 0) {
+        LOG_ERR("btrfs-convert of %s failed (%d)\n", device, ret);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOG_INF("Converted %s to btrfs in %.1f ms, ext4 image kept in %s/%s\n",
+            device,
+            (double)(end.tv_sec - begin.tv_sec) * 1000.0 +
+                (double)(end.tv_nsec - begin.tv_nsec) / 1000000.0,
+            USERFS_MOUNT_POINT,
+            CONVERT_SAVED_SUBVOL);
+
+    return 0;
+}
+
+static void convert_print_usage(void)
+{
+    printf("Usage: userfs convert [-d]\n");
+    printf("Show the ext4 rollback image of a converted userfs filesystem\n\n");
+    printf("  -d    Drop the rollback image, the conversion can no longer be undone\n");
+    printf("  -h    Show this help message\n");
+}
+
+int convert_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret     = -1;
+    bool drop   = false;
+    int root_fd = -1;
+    struct stat st;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "dh")) != -1) {
+        switch (opt) {
+        case 'd':
+            drop = true;
+            break;
+        case 'h':
+            convert_print_usage();
+            return 0;
+        default:
+            convert_print_usage();
+            return -1;
+        }
+    }
+
+    root_fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        return -1;
+    }
+
+    if (fstatat(root_fd, CONVERT_SAVED_SUBVOL, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        printf("No ext4 rollback image in %s\n", USERFS_MOUNT_POINT);
+        ret = 0;
+        goto exit;
+    }
+
+    if (!drop) {
+        if (fstatat(root_fd, CONVERT_SAVED_IMAGE, &st, 0) != 0) {
+            LOG_ERR("Failed to stat %s/%s: %s\n",
+                    USERFS_MOUNT_POINT,
+                    CONVERT_SAVED_IMAGE,
+                    strerror(errno));
+            goto exit;
+        }
+
+        printf("ext4 rollback image: %s/%s (%llu MiB)\n",
+               USERFS_MOUNT_POINT,
+               CONVERT_SAVED_IMAGE,
+               (unsigned long long)st.st_size / MB);
+        printf("Drop it with 'userfs convert -d' once the conversion is validated\n");
+        ret = 0;
+        goto exit;
+    }
+
+    if (btrfs_delete_subvolume(root_fd, CONVERT_SAVED_SUBVOL) != 0) {
+        LOG_ERR("Failed to delete %s/%s: %s\n",
+                USERFS_MOUNT_POINT,
+                CONVERT_SAVED_SUBVOL,
+                strerror(errno));
+        goto exit;
+    }
+
+    printf("Dropped the ext4 rollback image, its space is freed in the background\n");
+    ret = 0;
+
+exit:
+    close(root_fd);
+    return ret;
+}
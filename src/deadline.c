@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "deadline.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+enum deadline_worker_state {
+    DEADLINE_WORKER_NONE = 0,
+    DEADLINE_WORKER_RUNNING,
+    DEADLINE_WORKER_DONE,
+    DEADLINE_WORKER_FAILED,
+};
+
+static struct {
+    struct timespec start;
+    uint32_t budget_ms;
+    double ready_ms;
+
+    const struct deadline_task *queue[DEADLINE_MAX_TASKS];
+    size_t count;
+
+    enum deadline_worker_state worker;
+    pid_t worker_pid;
+    int pipe_fd; // Write end in the parent, until the worker is released
+
+    struct history_record rec; // Record of the boot, received by the worker
+    bool has_rec;
+} deadline = {.pipe_fd = -1};
+
+static double deadline_elapsed_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - deadline.start.tv_sec) * 1000.0 +
+           (double)(now.tv_nsec - deadline.start.tv_nsec) / 1000000.0;
+}
+
+void deadline_init(uint32_t budget_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &deadline.start);
+    deadline.budget_ms = budget_ms;
+}
+
+static uint32_t deadline_estimate_ms(const struct deadline_task *task)
+{
+    uint32_t us;
+
+    if (history_last_step_us((size_t)task->step, &us) == 0) return us / 1000u;
+    return task->estimate_ms;
+}
+
+static int deadline_run_task(const struct deadline_task *task,
+                             struct args *args,
+                             struct disk_info *disk)
+{
+    report_step_begin(task->step);
+    int ret = task->run(args, disk);
+    report_step_end(task->step, ret);
+
+    return ret;
+}
+
+int deadline_run(const struct deadline_task *task,
+                 struct args *args,
+                 struct disk_info *disk)
+{
+    if (deadline.budget_ms == 0 || deadline.count >= DEADLINE_MAX_TASKS) {
+        return deadline_run_task(task, args, disk);
+    }
+
+    uint32_t estimate_ms = deadline_estimate_ms(task);
+    double left_ms       = (double)deadline.budget_ms - deadline_elapsed_ms();
+
+    if ((double)estimate_ms <= left_ms) {
+        LOG_DBG("Running %s inline (estimated %u ms, %.0f ms left)\n",
+                task->name,
+                estimate_ms,
+                left_ms);
+        return deadline_run_task(task, args, disk);
+    }
+
+    LOG_INF("Deferring %s (estimated %u ms, %.0f ms left)\n",
+            task->name,
+            estimate_ms,
+            left_ms);
+
+    deadline.queue[deadline.count++] = task;
+
+    report_step_begin(task->step);
+    report_step_end(task->step, 0);
+    report_set_action(task->step, REPORT_ACTION_DEFERRED);
+
+    return 0;
+}
+
+size_t deadline_pending(void)
+{
+    return deadline.count;
+}
+
+/* The worker must not slow down the services started after the boot */
+static void deadline_set_idle_priority(void)
+{
+    int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+        LOG_WRN("Failed to set idle I/O priority: %s\n", strerror(errno));
+    }
+
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+        LOG_WRN("Failed to set nice value: %s\n", strerror(errno));
+    }
+}
+
+pid_t deadline_spawn_worker(int ret)
+{
+    int fds[2];
+
+    deadline.ready_ms = deadline_elapsed_ms();
+
+    if (deadline.count == 0) return -1;
+
+    if (ret != 0) {
+        LOG_WRN("Boot failed, %zu deferred step(s) not run\n", deadline.count);
+        deadline.count = 0;
+        return -1;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        LOG_WRN("Failed to create the worker pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_WRN("Failed to fork the deferred worker: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid > 0) {
+        close(fds[0]);
+        deadline.pipe_fd    = fds[1];
+        deadline.worker_pid = pid;
+        deadline.worker     = DEADLINE_WORKER_RUNNING;
+        LOG_INF("Deferred worker %d started for %zu step(s)\n", (int)pid, deadline.count);
+        return pid;
+    }
+
+    // Worker: detach from the boot session and wait for the parent to be done
+    close(fds[1]);
+    setsid();
+    deadline_set_idle_priority();
+
+    ssize_t n = read(fds[0], &deadline.rec, sizeof(deadline.rec));
+    deadline.has_rec = n == (ssize_t)sizeof(deadline.rec);
+    close(fds[0]);
+
+    deadline.worker_pid = getpid();
+    deadline.worker     = DEADLINE_WORKER_RUNNING;
+    return 0;
+}
+
+int deadline_run_deferred(struct args *args, struct disk_info *disk)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < deadline.count; i++) {
+        const struct deadline_task *task = deadline.queue[i];
+
+        LOG_INF("Running deferred step %s\n", task->name);
+        if (deadline_run_task(task, args, disk) != 0) {
+            LOG_ERR("Deferred step %s failed: %s\n", task->name, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    deadline.worker = ret == 0 ? DEADLINE_WORKER_DONE : DEADLINE_WORKER_FAILED;
+    return ret;
+}
+
+/* sd_notify(3) without libsystemd: one datagram to $NOTIFY_SOCKET */
+static int deadline_notify(const char *state)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const char *path        = getenv("NOTIFY_SOCKET");
+    int ret                 = -1;
+
+    if (!path || (path[0] != '/' && path[0] != '@')) return 0;
+
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(addr.sun_path, path, len);
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = '\0'; // Abstract socket
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    socklen_t addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+    ssize_t n          = sendto(
+        fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, addr_len);
+    if (n >= 0) ret = 0;
+
+    close(fd);
+    return ret;
+}
+
+static int deadline_write_pidfile(pid_t pid)
+{
+    char buf[32];
+    char tmp_path[] = DEADLINE_PID_PATH ".tmp";
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    int n   = snprintf(buf, sizeof(buf), "%d\n", (int)pid);
+    int ret = write(fd, buf, (size_t)n) == n ? 0 : -1;
+
+    if (close(fd) != 0) ret = -1;
+    if (ret == 0) ret = rename(tmp_path, DEADLINE_PID_PATH);
+    if (ret != 0) unlink(tmp_path);
+
+    return ret;
+}
+
+void deadline_ready(const struct history_record *rec)
+{
+    char state[64];
+
+    if (deadline.pipe_fd >= 0) {
+        // The pidfile must exist before the worker can remove it
+        if (deadline_write_pidfile(deadline.worker_pid) != 0) {
+            LOG_WRN("Failed to write %s: %s\n", DEADLINE_PID_PATH, strerror(errno));
+        }
+
+        if (rec && write(deadline.pipe_fd, rec, sizeof(*rec)) != (ssize_t)sizeof(*rec)) {
+            LOG_WRN("Failed to pass the history record to the worker\n");
+        }
+
+        close(deadline.pipe_fd);
+        deadline.pipe_fd = -1;
+
+        snprintf(state, sizeof(state), "READY=1\nMAINPID=%d", (int)deadline.worker_pid);
+    } else {
+        snprintf(state, sizeof(state), "READY=1");
+    }
+
+    if (deadline_notify(state) != 0) {
+        LOG_WRN("Failed to notify readiness: %s\n", strerror(errno));
+    }
+}
+
+int deadline_update_history(void)
+{
+    struct history_record now;
+
+    if (!deadline.has_rec) return -1;
+
+    // Only the deferred steps, the total is still the time to readiness
+    report_fill_history(&now, 0);
+    for (size_t i = 0; i < deadline.count; i++) {
+        enum report_step step = deadline.queue[i]->step;
+
+        deadline.rec.step_us[step]     = now.step_us[step];
+        deadline.rec.step_action[step] = now.step_action[step];
+    }
+
+    return history_update(&deadline.rec);
+}
+
+void deadline_worker_done(void)
+{
+    if (unlink(DEADLINE_PID_PATH) != 0 && errno != ENOENT) {
+        LOG_WRN("Failed to remove %s: %s\n", DEADLINE_PID_PATH, strerror(errno));
+    }
+}
+
+static const char *deadline_worker_state_to_string(enum deadline_worker_state state)
+{
+    switch (state) {
+    case DEADLINE_WORKER_RUNNING:
+        return "running";
+    case DEADLINE_WORKER_DONE:
+        return "done";
+    case DEADLINE_WORKER_FAILED:
+        return "failed";
+    case DEADLINE_WORKER_NONE:
+    default:
+        return "none";
+    }
+}
+
+void deadline_write_json(FILE *fp)
+{
+    fprintf(fp,
+            "{\"budget_ms\": %u, \"ready_ms\": %.3f, \"worker\": \"%s\", "
+            "\"deferred\": [",
+            deadline.budget_ms,
+            deadline.ready_ms,
+            deadline_worker_state_to_string(deadline.worker));
+
+    for (size_t i = 0; i < deadline.count; i++) {
+        fprintf(fp,
+                "%s\"%s\"",
+                i == 0 ? "" : ", ",
+                report_step_name(deadline.queue[i]->step));
+    }
+    fprintf(fp, "]}");
+}
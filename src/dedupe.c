@@ -0,0 +1,617 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "dedupe.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DEDUPE_TABLE_CAPACITY   65536u // Must be a power of 2, 1 MiB
+#define DEDUPE_PATHS_SIZE       (1024u * 1024u)
+#define DEDUPE_MAX_RANGE        (16u * 1024u * 1024u) // FIDEDUPERANGE limit
+#define DEDUPE_CHECK_BLOCKS     32u // Blocks read between two pressure checks
+#define DEDUPE_BACKOFF_S        5u
+#define DEDUPE_DEFAULT_BUDGET_S 600u
+#define DEDUPE_DEFAULT_PRESSURE 10.0
+#define DEDUPE_PRESSURE_PATH    "/proc/pressure/io"
+#define DEDUPE_RECORD_MAGIC     0x44465555u // "UUFD"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Indexed block, hash 0 marks an empty slot */
+struct dedupe_entry {
+    uint64_t hash;
+    uint32_t path;  // Offset of the file path in dedupe_paths
+    uint32_t block; // Block number in the file
+};
+
+/* Checkpoint, not synced: a lost or torn record only restarts the pass */
+struct dedupe_record {
+    uint32_t magic;
+    uint32_t passes;     // Completed passes
+    uint64_t deduped;    // Bytes deduplicated by all the runs
+    char path[PATH_MAX]; // Last completed file of the current pass, empty if none
+    uint32_t crc;
+};
+
+/* Range of consecutive matching blocks, not deduplicated yet */
+struct dedupe_pending {
+    uint32_t src_path;
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t len;
+};
+
+struct dedupe_stats {
+    uint64_t files;
+    uint64_t scanned; // Bytes read
+    uint64_t ranges;  // Ranges deduplicated
+    uint64_t deduped; // Bytes deduplicated
+    uint64_t differs; // Ranges with a matching hash but different data
+    uint64_t errors;
+    unsigned int throttled_s;
+};
+
+struct dedupe_ctx {
+    int root_fd;
+    bool dry_run;
+    double max_pressure;
+    struct timespec deadline; // tv_sec 0 for none
+    const char *resume;       // Checkpoint path to skip to, NULL once reached
+    bool stopped;
+
+    size_t paths_len;
+    size_t table_count;
+    bool full;
+
+    int src_fd; // Open source file of the last range
+    uint32_t src_path;
+    struct dedupe_pending pending;
+
+    struct dedupe_record rec;
+    struct dedupe_stats stats;
+};
+
+static struct dedupe_entry dedupe_table[DEDUPE_TABLE_CAPACITY];
+static char dedupe_paths[DEDUPE_PATHS_SIZE];
+static uint64_t dedupe_buf[DEDUPE_BLOCK_SIZE / sizeof(uint64_t)];
+
+static char dedupe_resume[PATH_MAX];
+
+static volatile sig_atomic_t dedupe_stop;
+
+static void dedupe_on_signal(int sig)
+{
+    (void)sig;
+    dedupe_stop = 1;
+}
+
+static uint64_t dedupe_hash(const uint64_t *words, size_t count)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ words[i]) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+
+    return hash ? hash : 1u;
+}
+
+/* Return the entry of hash, or the empty slot where to insert it */
+static struct dedupe_entry *dedupe_lookup(uint64_t hash)
+{
+    size_t i = (size_t)(hash >> 32) & (DEDUPE_TABLE_CAPACITY - 1);
+
+    while (dedupe_table[i].hash != 0 && dedupe_table[i].hash != hash) {
+        i = (i + 1) & (DEDUPE_TABLE_CAPACITY - 1);
+    }
+
+    return &dedupe_table[i];
+}
+
+static uint32_t dedupe_record_crc(const struct dedupe_record *rec)
+{
+    return crc32c(0, rec, offsetof(struct dedupe_record, crc));
+}
+
+static void dedupe_save_record(struct dedupe_ctx *ctx, int fd)
+{
+    ctx->rec.magic = DEDUPE_RECORD_MAGIC;
+    ctx->rec.crc   = dedupe_record_crc(&ctx->rec);
+
+    if (pwrite(fd, &ctx->rec, sizeof(ctx->rec), 0) != (ssize_t)sizeof(ctx->rec)) {
+        LOG_WRN("Failed to write the dedupe checkpoint: %s\n", strerror(errno));
+    }
+}
+
+static bool dedupe_should_stop(struct dedupe_ctx *ctx)
+{
+    struct timespec now;
+
+    if (dedupe_stop) ctx->stopped = true;
+
+    if (!ctx->stopped && ctx->deadline.tv_sec != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ctx->stopped = now.tv_sec >= ctx->deadline.tv_sec;
+    }
+
+    return ctx->stopped;
+}
+
+/* "some" avg10 of the I/O pressure, -1 if PSI is not available */
+static double dedupe_io_pressure(void)
+{
+    double avg10 = -1.0;
+
+    FILE *fp = fopen(DEDUPE_PRESSURE_PATH, "r");
+    if (!fp) return -1.0;
+
+    if (fscanf(fp, "some avg10=%lf", &avg10) != 1) avg10 = -1.0;
+
+    fclose(fp);
+    return avg10;
+}
+
+/* Back off while the foreground is waiting for I/O */
+static void dedupe_wait_idle(struct dedupe_ctx *ctx)
+{
+    while (!dedupe_should_stop(ctx)) {
+        double pressure = dedupe_io_pressure();
+        if (pressure < 0.0 || pressure <= ctx->max_pressure) return;
+
+        LOG_DBG("I/O pressure %.1f%%, pausing for %u s\n", pressure, DEDUPE_BACKOFF_S);
+        sleep(DEDUPE_BACKOFF_S);
+        ctx->stats.throttled_s += DEDUPE_BACKOFF_S;
+    }
+}
+
+static void dedupe_flush(struct dedupe_ctx *ctx, int dst_fd)
+{
+    struct dedupe_pending *p = &ctx->pending;
+    uint64_t req_buf[(sizeof(struct file_dedupe_range) +
+                      sizeof(struct file_dedupe_range_info)) /
+                     sizeof(uint64_t)];
+    struct file_dedupe_range *req = (struct file_dedupe_range *)req_buf;
+
+    if (p->len == 0) return;
+
+    if (ctx->dry_run) {
+        ctx->stats.ranges++;
+        ctx->stats.deduped += p->len;
+        goto exit;
+    }
+
+    if (ctx->src_fd < 0 || ctx->src_path != p->src_path) {
+        if (ctx->src_fd >= 0) close(ctx->src_fd);
+        ctx->src_path = p->src_path;
+        ctx->src_fd   = openat(ctx->root_fd,
+                             &dedupe_paths[p->src_path],
+                             O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (ctx->src_fd < 0) {
+            LOG_DBG("Failed to open %s: %s\n",
+                    &dedupe_paths[p->src_path],
+                    strerror(errno));
+            ctx->stats.errors++;
+            goto exit;
+        }
+    }
+
+    memset(req_buf, 0, sizeof(req_buf));
+    req->src_offset          = p->src_offset;
+    req->src_length          = p->len;
+    req->dest_count          = 1;
+    req->info[0].dest_fd     = dst_fd;
+    req->info[0].dest_offset = p->dst_offset;
+
+    if (ioctl(ctx->src_fd, FIDEDUPERANGE, req) != 0) {
+        LOG_DBG("FIDEDUPERANGE from %s failed: %s\n",
+                &dedupe_paths[p->src_path],
+                strerror(errno));
+        ctx->stats.errors++;
+    } else if (req->info[0].status == FILE_DEDUPE_RANGE_SAME) {
+        ctx->stats.ranges++;
+        ctx->stats.deduped += req->info[0].bytes_deduped;
+    } else if (req->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+        ctx->stats.differs++;
+    } else {
+        ctx->stats.errors++;
+    }
+
+exit:
+    p->len = 0;
+}
+
+/* Account a block matching entry, merged with the pending range if contiguous */
+static void dedupe_match(struct dedupe_ctx *ctx,
+                         int dst_fd,
+                         uint32_t dst_path,
+                         uint64_t dst_offset,
+                         const struct dedupe_entry *entry)
+{
+    struct dedupe_pending *p = &ctx->pending;
+    uint64_t src_offset      = (uint64_t)entry->block * DEDUPE_BLOCK_SIZE;
+
+    // Ranges of the same file must not overlap
+    if (entry->path == dst_path && src_offset + DEDUPE_BLOCK_SIZE > dst_offset) {
+        dedupe_flush(ctx, dst_fd);
+        return;
+    }
+
+    if (p->len != 0 && p->src_path == entry->path &&
+        p->src_offset + p->len == src_offset && p->dst_offset + p->len == dst_offset &&
+        p->len + DEDUPE_BLOCK_SIZE <= DEDUPE_MAX_RANGE &&
+        (entry->path != dst_path || src_offset + DEDUPE_BLOCK_SIZE <= p->dst_offset)) {
+        p->len += DEDUPE_BLOCK_SIZE;
+        return;
+    }
+
+    dedupe_flush(ctx, dst_fd);
+    p->src_path   = entry->path;
+    p->src_offset = src_offset;
+    p->dst_offset = dst_offset;
+    p->len        = DEDUPE_BLOCK_SIZE;
+}
+
+static void dedupe_file(struct dedupe_ctx *ctx,
+                        int dir_fd,
+                        const char *name,
+                        const char *relpath)
+{
+    size_t len = strlen(relpath) + 1u;
+    uint32_t path;
+    bool indexed = false;
+    ssize_t nread;
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        ctx->stats.errors++;
+        return;
+    }
+
+    // The path is kept in the pool only if a block of the file is indexed
+    path = (uint32_t)ctx->paths_len;
+    if (ctx->paths_len + len <= DEDUPE_PATHS_SIZE) {
+        memcpy(&dedupe_paths[ctx->paths_len], relpath, len);
+    } else {
+        ctx->full = true;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (uint32_t block = 0;; block++) {
+        if (block % DEDUPE_CHECK_BLOCKS == 0) {
+            dedupe_wait_idle(ctx);
+            if (ctx->stopped) break;
+        }
+
+        // A partial last block cannot be shared with a full block of another file
+        nread = read(fd, dedupe_buf, sizeof(dedupe_buf));
+        if (nread != (ssize_t)sizeof(dedupe_buf)) {
+            if (nread < 0) ctx->stats.errors++;
+            break;
+        }
+
+        ctx->stats.scanned += (uint64_t)nread;
+
+        uint64_t hash              = dedupe_hash(dedupe_buf, ARRAY_SIZE(dedupe_buf));
+        uint64_t offset            = (uint64_t)block * DEDUPE_BLOCK_SIZE;
+        struct dedupe_entry *entry = dedupe_lookup(hash);
+
+        if (entry->hash == hash) {
+            dedupe_match(ctx, fd, path, offset, entry);
+            continue;
+        }
+
+        dedupe_flush(ctx, fd);
+
+        // Keep the probe sequences short, stop indexing when 3/4 full
+        if (ctx->full || ctx->table_count >= DEDUPE_TABLE_CAPACITY * 3 / 4) {
+            ctx->full = true;
+            continue;
+        }
+
+        entry->hash  = hash;
+        entry->path  = path;
+        entry->block = block;
+        ctx->table_count++;
+        indexed = true;
+    }
+
+    dedupe_flush(ctx, fd);
+
+    if (indexed) ctx->paths_len += len;
+
+    // Do not evict the pages of the foreground applications with ours
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    if (!ctx->stopped) {
+        ctx->stats.files++;
+        snprintf(ctx->rec.path, sizeof(ctx->rec.path), "%s", relpath);
+    }
+}
+
+/*
+ * Whether an entry is skipped while resuming: entries before the checkpoint
+ * are, except the directories leading to it.
+ */
+static bool dedupe_skip(struct dedupe_ctx *ctx, const char *relpath, bool is_dir)
+{
+    size_t len = strlen(relpath);
+
+    if (!ctx->resume) return false;
+
+    if (strcmp(relpath, ctx->resume) == 0) {
+        ctx->resume = NULL; // Last completed file, resume after it
+        return true;
+    }
+
+    return !(is_dir && strncmp(ctx->resume, relpath, len) == 0 &&
+             ctx->resume[len] == '/');
+}
+
+static void dedupe_dir(struct dedupe_ctx *ctx, int dir_fd, const char *relpath)
+{
+    char child_relpath[PATH_MAX];
+    struct dirent *ent;
+
+    int fd = dup(dir_fd);
+    if (fd < 0) return;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    while (!ctx->stopped && (ent = readdir(dir)) != NULL) {
+        struct stat st;
+        const char *name = ent->d_name;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        snprintf(child_relpath, sizeof(child_relpath), "%s/%s", relpath, name);
+
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ctx->stats.errors++;
+            continue;
+        }
+
+        if (dedupe_skip(ctx, child_relpath, S_ISDIR(st.st_mode))) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            int child_fd =
+                openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0) {
+                ctx->stats.errors++;
+                continue;
+            }
+
+            dedupe_dir(ctx, child_fd, child_relpath);
+            close(child_fd);
+        } else if (S_ISREG(st.st_mode) && st.st_size >= (off_t)DEDUPE_BLOCK_SIZE) {
+            dedupe_file(ctx, dir_fd, name, child_relpath);
+        }
+    }
+
+    closedir(dir);
+}
+
+/* The pass is a background job, make sure it does not slow down the system */
+static void dedupe_set_idle_priority(void)
+{
+    int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+        LOG_WRN("Failed to set idle I/O priority: %s\n", strerror(errno));
+    }
+
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+        LOG_WRN("Failed to set nice value: %s\n", strerror(errno));
+    }
+}
+
+static void dedupe_print_stats(const struct dedupe_ctx *ctx)
+{
+    const struct dedupe_stats *stats = &ctx->stats;
+
+    printf("%s %llu files (%llu MiB), %llu ranges (%llu MiB)%s\n",
+           ctx->dry_run ? "dry run:" : "deduplicated:",
+           (unsigned long long)stats->files,
+           (unsigned long long)(stats->scanned / MB),
+           (unsigned long long)stats->ranges,
+           (unsigned long long)(stats->deduped / MB),
+           ctx->dry_run ? " to deduplicate" : "");
+    printf("  index %zu/%u blocks%s, %llu differing, %llu errors, throttled %u s\n",
+           ctx->table_count,
+           DEDUPE_TABLE_CAPACITY,
+           ctx->full ? " (full)" : "",
+           (unsigned long long)stats->differs,
+           (unsigned long long)stats->errors,
+           stats->throttled_s);
+
+    if (ctx->stopped) {
+        printf("  paused after %s\n", ctx->rec.path[0] ? ctx->rec.path : "(none)");
+    } else if (!ctx->dry_run) {
+        printf("  pass %u complete, %llu MiB deduplicated by all the passes\n",
+               ctx->rec.passes,
+               (unsigned long long)(ctx->rec.deduped / MB));
+    }
+}
+
+static void dedupe_print_usage(void)
+{
+    printf("Usage: userfs dedupe [-n] [-r] [-t SECONDS] [-p PERCENT]\n");
+    printf("Deduplicate identical blocks of the userfs subvolumes\n\n");
+    printf("  -n    Dry run, only report the duplicate blocks\n");
+    printf("  -r    Restart the pass instead of resuming it\n");
+    printf("  -t    Stop after SECONDS, resume at the next run (default: %u, 0: none)\n",
+           DEDUPE_DEFAULT_BUDGET_S);
+    printf("  -p    Pause while the I/O pressure is above PERCENT (default: %.0f)\n",
+           DEDUPE_DEFAULT_PRESSURE);
+    printf("  -h    Show this help message\n");
+}
+
+int dedupe_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret               = -1;
+    int fd                = -1;
+    bool restart          = false;
+    unsigned int budget_s = DEDUPE_DEFAULT_BUDGET_S;
+    const char *sv_name;
+    struct statvfs vfs;
+    struct sigaction sa;
+    struct dedupe_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.max_pressure = DEDUPE_DEFAULT_PRESSURE;
+    ctx.src_fd       = -1;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "nrt:p:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            ctx.dry_run = true;
+            break;
+        case 'r':
+            restart = true;
+            break;
+        case 't':
+            budget_s = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            ctx.max_pressure = strtod(optarg, NULL);
+            break;
+        case 'h':
+            dedupe_print_usage();
+            return 0;
+        default:
+            dedupe_print_usage();
+            return -1;
+        }
+    }
+
+    if (statvfs(USERFS_MOUNT_POINT, &vfs) != 0 || (vfs.f_flag & ST_RDONLY)) {
+        LOG_ERR("%s is not mounted read-write (kiosk mode?)\n", USERFS_MOUNT_POINT);
+        return -1;
+    }
+
+    ctx.root_fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.root_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        return -1;
+    }
+
+    fd = openat(ctx.root_fd, DEDUPE_FILE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s/%s: %s\n",
+                USERFS_MOUNT_POINT,
+                DEDUPE_FILE_NAME,
+                strerror(errno));
+        goto exit;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        LOG_ERR("Another dedupe pass is running\n");
+        goto exit;
+    }
+
+    if (pread(fd, &ctx.rec, sizeof(ctx.rec), 0) != (ssize_t)sizeof(ctx.rec) ||
+        ctx.rec.magic != DEDUPE_RECORD_MAGIC ||
+        ctx.rec.crc != dedupe_record_crc(&ctx.rec)) {
+        memset(&ctx.rec, 0, sizeof(ctx.rec));
+    }
+    ctx.rec.path[sizeof(ctx.rec.path) - 1u] = '\0';
+
+    // The checkpoint path is overwritten as files complete, keep a copy
+    if (!restart && !ctx.dry_run && ctx.rec.path[0]) {
+        snprintf(dedupe_resume, sizeof(dedupe_resume), "%s", ctx.rec.path);
+        ctx.resume = dedupe_resume;
+        LOG_INF("Resuming the dedupe pass after %s\n", dedupe_resume);
+    }
+    ctx.rec.path[0] = '\0';
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dedupe_on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    if (budget_s != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ctx.deadline);
+        ctx.deadline.tv_sec += (time_t)budget_s;
+    }
+
+    dedupe_set_idle_priority();
+    memset(dedupe_table, 0, sizeof(dedupe_table));
+
+    for (size_t i = 0; !ctx.stopped && (sv_name = btrfs_get_volume(i)) != NULL; i++) {
+        if (dedupe_skip(&ctx, sv_name, true)) continue;
+
+        int sv_fd = openat(ctx.root_fd, sv_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sv_fd < 0) {
+            LOG_WRN("Failed to open %s/%s: %s\n",
+                    USERFS_MOUNT_POINT,
+                    sv_name,
+                    strerror(errno));
+            continue;
+        }
+
+        dedupe_dir(&ctx, sv_fd, sv_name);
+        close(sv_fd);
+    }
+
+    if (ctx.src_fd >= 0) close(ctx.src_fd);
+
+    if (ctx.resume) {
+        LOG_WRN("Dedupe checkpoint %s not found, the next pass starts over\n",
+                ctx.resume);
+    }
+
+    ret = 0;
+    if (ctx.dry_run) goto print;
+
+    ctx.rec.deduped += ctx.stats.deduped;
+    if (!ctx.stopped) {
+        ctx.rec.passes++;
+        ctx.rec.path[0] = '\0';
+    } else if (!ctx.rec.path[0] && ctx.resume) {
+        // Stopped before reaching the checkpoint, keep it
+        snprintf(ctx.rec.path, sizeof(ctx.rec.path), "%s", ctx.resume);
+    }
+    dedupe_save_record(&ctx, fd);
+
+print:
+    dedupe_print_stats(&ctx);
+
+exit:
+    if (fd >= 0) close(fd);
+    close(ctx.root_fd);
+    return ret;
+}
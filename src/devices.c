@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "devices.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <blkid.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+#define DEVICES_PARTTYPE_LINUX 0x83
+#define DEVICES_PARTTYPE_SWAP  0x82
+#define DEVICES_BTRFS_CONTROL  "/dev/btrfs-control"
+
+enum devices_role {
+    DEVICES_ROLE_DATA = 0,
+    DEVICES_ROLE_MIRROR,
+    DEVICES_ROLE_SWAP,
+    DEVICES_ROLE_BULK,
+};
+
+static const char *const devices_role_names[] = {
+    [DEVICES_ROLE_DATA]   = "data",
+    [DEVICES_ROLE_MIRROR] = "mirror",
+    [DEVICES_ROLE_SWAP]   = "swap",
+    [DEVICES_ROLE_BULK]   = "bulk",
+};
+
+struct device {
+    char path[PATH_MAX];
+    char part[PATH_MAX];
+    char mount_point[PATH_MAX];
+    enum devices_role role;
+    struct fs_info fs_info;
+
+    pthread_t thread;
+    bool running; // Thread started and not joined yet
+    int ret;
+    const char *error; // Failed operation, NULL on success
+    double duration_ms;
+
+    bool created;   // Partition created
+    bool formatted; // mkswap or mkfs.btrfs
+    bool mounted;   // bulk
+    bool member;    // Device of the userfs filesystem (data, mirror)
+    bool added;     // Added to the userfs filesystem in this boot
+};
+
+static struct {
+    struct device list[DEVICES_MAX];
+    size_t count;
+    uint32_t flags; // struct args flags, read by the threads
+    bool started;
+    bool waited;
+} devices;
+
+static bool devices_is_member_role(enum devices_role role)
+{
+    return role == DEVICES_ROLE_DATA || role == DEVICES_ROLE_MIRROR;
+}
+
+int devices_add(const char *spec)
+{
+    const char *sep = strrchr(spec, ':');
+
+    if (!sep || spec[0] != '/' || (size_t)(sep - spec) >= PATH_MAX) {
+        LOG_ERR("Invalid device %s, expected DEVICE:ROLE\n", spec);
+        return -1;
+    }
+
+    if (devices.count >= DEVICES_MAX) {
+        LOG_ERR("Too many devices (max %u)\n", DEVICES_MAX);
+        return -1;
+    }
+
+    struct device *dev = &devices.list[devices.count];
+    size_t role;
+
+    memset(dev, 0, sizeof(*dev));
+    memcpy(dev->path, spec, (size_t)(sep - spec));
+
+    for (role = 0; role < ARRAY_SIZE(devices_role_names); role++) {
+        if (strcmp(sep + 1, devices_role_names[role]) == 0) break;
+    }
+    if (role == ARRAY_SIZE(devices_role_names)) {
+        LOG_ERR("Unknown role %s for %s (data, mirror, swap, bulk)\n",
+                sep + 1,
+                dev->path);
+        return -1;
+    }
+    dev->role = (enum devices_role)role;
+
+    if (strcmp(dev->path, DISK) == 0) {
+        LOG_ERR("%s is the primary device\n", dev->path);
+        return -1;
+    }
+
+    for (size_t i = 0; i < devices.count; i++) {
+        if (strcmp(devices.list[i].path, dev->path) == 0) {
+            LOG_ERR("Device %s given twice\n", dev->path);
+            return -1;
+        }
+    }
+
+    devices.count++;
+    return 0;
+}
+
+/*
+ * The partition holds a filesystem of another use, e.g. a user SD card. Any
+ * signature counts, not only the filesystems userfs knows (vfat, exfat, ...).
+ */
+static bool devices_is_foreign(const struct device *dev, enum fs_type expected)
+{
+    if (dev->fs_info.type == FS_TYPE_UNKNOWN || dev->fs_info.type == expected) {
+        return false;
+    }
+
+    return (devices.flags & FLAG_USERFS_FORCE_FORMAT) == 0;
+}
+
+static int devices_run(const char *const argv[])
+{
+    command_display(argv[0], (char *const *)argv);
+    return command_run(NULL, NULL, argv[0], (char *const *)argv);
+}
+
+static int devices_provision_swap(struct device *dev)
+{
+    if (dev->fs_info.type == FS_TYPE_SWAP) {
+        LOG_INF("%s already formatted as swap, skipping\n", dev->part);
+        return 0;
+    }
+
+    const char *const mkswap_args[] = {
+        "mkswap",
+        dev->part,
+        NULL,
+    };
+
+    if (devices_run(mkswap_args) != 0) {
+        dev->error = "mkswap";
+        return -1;
+    }
+
+    dev->formatted = true;
+    return 0;
+}
+
+static int devices_provision_bulk(struct device *dev)
+{
+    const char *name = strrchr(dev->path, '/') + 1;
+    const char *fstype;
+
+    // Anything but btrfs and ext4 (blank, or foreign with -f) is formatted
+    if (dev->fs_info.type != FS_TYPE_BTRFS && dev->fs_info.type != FS_TYPE_EXT4) {
+        const char *const mkfs_args[] = {
+            "mkfs.btrfs",
+            "-f",
+            "-L",
+            DEVICES_BULK_LABEL,
+            dev->part,
+            NULL,
+        };
+
+        if (devices_run(mkfs_args) != 0) {
+            dev->error = "mkfs.btrfs";
+            return -1;
+        }
+
+        dev->formatted    = true;
+        dev->fs_info.type = FS_TYPE_BTRFS;
+    }
+
+    fstype = fs_type_to_string(dev->fs_info.type);
+
+    snprintf(dev->mount_point, sizeof(dev->mount_point), "%s/%s", DEVICES_BULK_DIR, name);
+    if (create_directories(dev->mount_point) != 0) {
+        dev->error = "mkdir";
+        return -1;
+    }
+
+    // Like the userfs filesystem, nothing is written to it in kiosk mode
+    unsigned long flags = (devices.flags & FLAG_USERFS_KIOSK) ? MS_RDONLY : 0;
+    if (do_mount(dev->part, dev->mount_point, fstype, flags, NULL) != 0) {
+        LOG_ERR("Failed to mount %s on %s: %s\n",
+                dev->part,
+                dev->mount_point,
+                strerror(errno));
+        dev->error = "mount";
+        return -1;
+    }
+
+    dev->mounted = true;
+    return 0;
+}
+
+/* Register a device to the kernel, a multi-device filesystem only mounts once
+ * all its devices are known */
+static int devices_scan(const char *part)
+{
+    struct btrfs_ioctl_vol_args args;
+
+    memset(&args, 0, sizeof(args));
+    snprintf(args.name, sizeof(args.name), "%s", part);
+
+    int fd = open(DEVICES_BTRFS_CONTROL, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    int ret = ioctl(fd, BTRFS_IOC_SCAN_DEV, &args);
+    close(fd);
+
+    return ret;
+}
+
+static int devices_provision_member(struct device *dev)
+{
+    // Added to the filesystem once it is mounted, see devices_attach()
+    if (dev->fs_info.type != FS_TYPE_BTRFS) return 0;
+
+    if (devices_scan(dev->part) != 0) {
+        LOG_ERR("Failed to register %s: %s\n", dev->part, strerror(errno));
+        dev->error = "scan";
+        return -1;
+    }
+
+    return 0;
+}
+
+static int devices_provision(struct device *dev)
+{
+    int type = dev->role == DEVICES_ROLE_SWAP ? DEVICES_PARTTYPE_SWAP
+                                               : DEVICES_PARTTYPE_LINUX;
+
+    bool force = (devices.flags & FLAG_USERFS_FORCE_FORMAT) != 0;
+    int ret    = disk_prepare_device(dev->path, type, force);
+    if (ret < 0) {
+        dev->error = errno == EEXIST ? "foreign filesystem" : "partition";
+        return -1;
+    }
+    dev->created = ret == 0;
+
+    disk_device_part_path(dev->part, sizeof(dev->part), dev->path, 0u);
+
+    // Make the new partition device node appear
+    if (dev->created && disk_partprobe(dev->path) != 0) {
+        dev->error = "partprobe";
+        return -1;
+    }
+
+    if (fs_probe(dev->part, &dev->fs_info) != 0) {
+        dev->error = "probe";
+        return -1;
+    }
+
+    enum fs_type expected;
+    switch (dev->role) {
+    case DEVICES_ROLE_SWAP:
+        expected = FS_TYPE_SWAP;
+        break;
+    case DEVICES_ROLE_BULK:
+        expected = dev->fs_info.type == FS_TYPE_EXT4 ? FS_TYPE_EXT4 : FS_TYPE_BTRFS;
+        break;
+    case DEVICES_ROLE_DATA:
+    case DEVICES_ROLE_MIRROR:
+    default:
+        expected = FS_TYPE_BTRFS;
+        break;
+    }
+
+    if (devices_is_foreign(dev, expected)) {
+        LOG_ERR("%s holds a %s filesystem, not overwritten without -f\n",
+                dev->part,
+                dev->fs_info.name);
+        dev->error = "foreign filesystem";
+        return -1;
+    }
+
+    switch (dev->role) {
+    case DEVICES_ROLE_SWAP:
+        return devices_provision_swap(dev);
+    case DEVICES_ROLE_BULK:
+        return devices_provision_bulk(dev);
+    case DEVICES_ROLE_DATA:
+    case DEVICES_ROLE_MIRROR:
+    default:
+        return devices_provision_member(dev);
+    }
+}
+
+static void *devices_thread(void *arg)
+{
+    struct device *dev = arg;
+    struct timespec begin, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    dev->ret = devices_provision(dev);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    dev->duration_ms = (double)(end.tv_sec - begin.tv_sec) * 1000.0 +
+                       (double)(end.tv_nsec - begin.tv_nsec) / 1000000.0;
+
+    return NULL;
+}
+
+int devices_start(struct args *args)
+{
+    char list[] = USERFS_DEVICES;
+    char *saveptr;
+
+    for (char *spec = strtok_r(list, ",", &saveptr); spec;
+         spec = strtok_r(NULL, ",", &saveptr)) {
+        if (devices_add(spec) != 0) return -1;
+    }
+
+    if (devices.count == 0) return 0;
+
+    devices.flags   = args->flags;
+    devices.started = true;
+
+    // The library debug mask is global, set it before the threads start
+    blkid_init_debug(0x0);
+
+    for (size_t i = 0; i < devices.count; i++) {
+        struct device *dev = &devices.list[i];
+
+        LOG_INF("Provisioning %s (%s)\n", dev->path, devices_role_names[dev->role]);
+
+        int err = pthread_create(&dev->thread, NULL, devices_thread, dev);
+        if (err != 0) {
+            LOG_WRN("Failed to start thread for %s: %s, provisioning it inline\n",
+                    dev->path,
+                    strerror(err));
+            devices_thread(dev);
+            continue;
+        }
+        dev->running = true;
+    }
+
+    return 0;
+}
+
+int devices_wait(void)
+{
+    int ret                   = 0;
+    enum report_action action = REPORT_ACTION_SKIPPED;
+
+    if (!devices.started || devices.waited) return 0;
+    devices.waited = true;
+
+    report_step_begin(REPORT_STEP_DEVICES);
+
+    for (size_t i = 0; i < devices.count; i++) {
+        struct device *dev = &devices.list[i];
+
+        if (dev->running) {
+            pthread_join(dev->thread, NULL);
+            dev->running = false;
+        }
+
+        if (dev->ret != 0) {
+            LOG_WRN("Failed to provision %s (%s): %s\n",
+                    dev->path,
+                    devices_role_names[dev->role],
+                    dev->error ? dev->error : "unknown");
+            if (devices_is_member_role(dev->role)) ret = -1;
+            continue;
+        }
+
+        LOG_INF("Provisioned %s (%s) in %.1f ms\n",
+                dev->path,
+                devices_role_names[dev->role],
+                dev->duration_ms);
+
+        if (dev->mounted) {
+            report_add_mount(dev->part,
+                             dev->mount_point,
+                             fs_type_to_string(dev->fs_info.type),
+                             NULL);
+            if (action == REPORT_ACTION_SKIPPED) action = REPORT_ACTION_MOUNTED;
+        }
+        if (dev->formatted && action != REPORT_ACTION_CREATED) {
+            action = REPORT_ACTION_FORMATTED;
+        }
+        if (dev->created) action = REPORT_ACTION_CREATED;
+    }
+
+    report_step_end(REPORT_STEP_DEVICES, ret);
+    report_set_action(REPORT_STEP_DEVICES, ret == 0 ? action : REPORT_ACTION_FAILED);
+
+    return ret;
+}
+
+bool devices_member_failed(void)
+{
+    for (size_t i = 0; i < devices.count; i++) {
+        const struct device *dev = &devices.list[i];
+
+        if (devices_is_member_role(dev->role) && dev->ret != 0) return true;
+    }
+
+    return false;
+}
+
+/* Same format as the libblkid UUID, e.g. 0b7c2c6a-6f5e-4a3b-9d4e-2f1a0c9e8d7b */
+static void devices_format_uuid(char *buf, const uint8_t fsid[BTRFS_FSID_SIZE])
+{
+    for (size_t i = 0; i < BTRFS_FSID_SIZE; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) *buf++ = '-';
+        buf += sprintf(buf, "%02x", fsid[i]);
+    }
+}
+
+/* Whether all the metadata (and system) chunks are mirrored */
+static int devices_metadata_is_raid1(int fd, bool *raid1)
+{
+    struct btrfs_ioctl_space_args count = {0};
+    struct btrfs_ioctl_space_args *args = NULL;
+
+    if (ioctl(fd, BTRFS_IOC_SPACE_INFO, &count) != 0) return -1;
+
+    args = calloc(1,
+                  sizeof(*args) +
+                      count.total_spaces * sizeof(struct btrfs_ioctl_space_info));
+    if (!args) return -1;
+
+    args->space_slots = count.total_spaces;
+    if (ioctl(fd, BTRFS_IOC_SPACE_INFO, args) != 0) {
+        free(args);
+        return -1;
+    }
+
+    *raid1 = true;
+    for (uint64_t i = 0; i < args->total_spaces; i++) {
+        uint64_t flags = args->spaces[i].flags;
+
+        if ((flags & (BTRFS_BLOCK_GROUP_METADATA | BTRFS_BLOCK_GROUP_SYSTEM)) &&
+            !(flags & BTRFS_BLOCK_GROUP_RAID1_MASK)) {
+            *raid1 = false;
+        }
+    }
+
+    free(args);
+    return 0;
+}
+
+static int devices_convert_metadata(int fd)
+{
+    bool raid1;
+
+    if (devices_metadata_is_raid1(fd, &raid1) != 0) {
+        LOG_ERR("Failed to get the chunk profiles: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (raid1) return 0;
+
+    // An interrupted balance is resumed by the kernel when mounting
+    struct btrfs_ioctl_balance_args progress;
+    memset(&progress, 0, sizeof(progress));
+    if (ioctl(fd, BTRFS_IOC_BALANCE_PROGRESS, &progress) == 0) {
+        LOG_INF("Balance of %s already running\n", USERFS_MOUNT_POINT);
+        return 0;
+    }
+
+    // soft: only the chunks not converted yet, e.g. after a power loss
+    // --bg: runs in the kernel while the boot goes on, not waited for
+    const char *const balance_args[] = {
+        "btrfs",
+        "balance",
+        "start",
+        "--bg",
+        "-f",
+        "-mconvert=raid1,soft",
+        "-sconvert=raid1,soft",
+        USERFS_MOUNT_POINT,
+        NULL,
+    };
+
+    LOG_INF("Converting the metadata of %s to RAID1 (background)\n",
+            USERFS_MOUNT_POINT);
+    if (devices_run(balance_args) != 0) {
+        LOG_ERR("Failed to start the metadata conversion to RAID1\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int devices_attach(struct args *args)
+{
+    int ret     = -1;
+    int fd      = -1;
+    bool mirror = false;
+    bool kiosk  = (args->flags & FLAG_USERFS_KIOSK) != 0;
+    struct btrfs_ioctl_fs_info_args info;
+    char fsid[37];
+
+    fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        goto exit;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (ioctl(fd, BTRFS_IOC_FS_INFO, &info) != 0) {
+        LOG_ERR("BTRFS_IOC_FS_INFO failed on %s: %s\n",
+                USERFS_MOUNT_POINT,
+                strerror(errno));
+        goto exit;
+    }
+    devices_format_uuid(fsid, info.fsid);
+
+    ret = 0;
+    for (size_t i = 0; i < devices.count; i++) {
+        struct device *dev = &devices.list[i];
+
+        if (!devices_is_member_role(dev->role) || dev->ret != 0) continue;
+
+        dev->member = dev->fs_info.type == FS_TYPE_BTRFS &&
+                      strcmp(dev->fs_info.uuid, fsid) == 0;
+
+        // e.g. the btrfs filesystem of another system
+        if (!dev->member && dev->fs_info.type != FS_TYPE_UNKNOWN &&
+            (args->flags & FLAG_USERFS_FORCE_FORMAT) == 0) {
+            LOG_ERR("%s holds another filesystem (%s), not added without -f\n",
+                    dev->part,
+                    dev->fs_info.name);
+            dev->error = "foreign filesystem";
+            ret        = -1;
+            continue;
+        }
+
+        if (!dev->member) {
+            if (kiosk) {
+                LOG_WRN("Kiosk mode, %s not added to %s\n",
+                        dev->part,
+                        USERFS_MOUNT_POINT);
+                continue;
+            }
+
+            const char *const add_args[] = {
+                "btrfs",
+                "device",
+                "add",
+                "-f",
+                dev->part,
+                USERFS_MOUNT_POINT,
+                NULL,
+            };
+
+            LOG_INF("Adding %s to %s\n", dev->part, USERFS_MOUNT_POINT);
+            if (devices_run(add_args) != 0) {
+                LOG_ERR("Failed to add %s to %s\n", dev->part, USERFS_MOUNT_POINT);
+                dev->error = "device add";
+                ret        = -1;
+                continue;
+            }
+
+            dev->member = true;
+            dev->added  = true;
+        }
+
+        if (dev->role == DEVICES_ROLE_MIRROR) mirror = true;
+    }
+
+    if (mirror && !kiosk && devices_convert_metadata(fd) != 0) ret = -1;
+
+exit:
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+void devices_write_json(FILE *fp)
+{
+    fprintf(fp, "[");
+
+    for (size_t i = 0; i < devices.count; i++) {
+        const struct device *dev = &devices.list[i];
+
+        fprintf(fp,
+                "%s{\"device\": \"%s\", \"role\": \"%s\", \"partition\": \"%s\", "
+                "\"fs\": \"%s\", \"created\": %s, \"formatted\": %s, ",
+                i == 0 ? "" : ", ",
+                dev->path,
+                devices_role_names[dev->role],
+                dev->part,
+                fs_type_to_string(dev->fs_info.type),
+                dev->created ? "true" : "false",
+                dev->formatted ? "true" : "false");
+
+        if (dev->mounted) {
+            fprintf(fp, "\"mount_point\": \"%s\", ", dev->mount_point);
+        }
+
+        if (devices_is_member_role(dev->role)) {
+            fprintf(fp,
+                    "\"member\": %s, \"added\": %s, ",
+                    dev->member ? "true" : "false",
+                    dev->added ? "true" : "false");
+        }
+
+        fprintf(fp, "\"duration_ms\": %.3f, \"error\": ", dev->duration_ms);
+        if (dev->error) {
+            fprintf(fp, "\"%s\"}", dev->error);
+        } else {
+            fprintf(fp, "null}");
+        }
+    }
+
+    fprintf(fp, "]");
+}
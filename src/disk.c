@@ -4,8 +4,12 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include "fdisk_dl.h"
+#include "mbr.h"
+#include "trace.h"
 #include "userfs.h"
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,22 +46,19 @@ static int disk_get_size(const char *device, uint64_t *size)
 
     fd = open(device, O_RDWR);
     if (fd < 0) {
-        perror("open");
-        fprintf(stderr, "Failed to open device\n");
+        LOG_ERR("Failed to open device: %s\n", strerror(errno));
         goto exit;
     }
 
     ret = ioctl(fd, BLKGETSIZE64, size);
     if (ret < 0) {
-        perror("ioctl BLKGETSIZE64");
-        fprintf(stderr, "Failed to get device size\n");
+        LOG_ERR("Failed to get device size (BLKGETSIZE64): %s\n", strerror(errno));
         goto exit;
     }
 
     ret = close(fd);
     if (ret < 0) {
-        perror("close");
-        fprintf(stderr, "Failed to close device\n");
+        LOG_ERR("Failed to close device: %s\n", strerror(errno));
         goto exit;
     }
 
@@ -121,9 +122,15 @@ static int disk_read_partitions(struct fdisk_context *ctx,
 
 static void disk_display_info(const struct disk_info *disk)
 {
-    LOG("Disk Information (type: %d, parts: %u)\n", disk->type, disk->partition_count);
-    LOG("\tTotal: %llu sectors (%llu MB)\n", disk->total_sectors, disk->total_size / MB);
-    LOG("\tFree: %u sectors (%llu MB)\n", disk->free_sectors, disk->free_size / MB);
+    LOG_DBG("Disk Information (type: %d, parts: %zu)\n",
+            disk->type,
+            disk->partition_count);
+    LOG_DBG("\tTotal: %llu sectors (%llu MB)\n",
+            (unsigned long long)disk->total_sectors,
+            (unsigned long long)disk->total_size / MB);
+    LOG_DBG("\tFree: %zu sectors (%llu MB)\n",
+            disk->free_sectors,
+            (unsigned long long)disk->free_size / MB);
 
     for (size_t n = 0; n < disk->partition_count; n++) {
         const struct part_info *pinfo = &disk->partitions[n];
@@ -134,25 +141,34 @@ static void disk_display_info(const struct disk_info *disk)
 
         uint64_t approx_size_mb = pinfo->size * SECTOR_SIZE / MB;
 
-        LOG("[%zu] %s (%02zx) start: %llu end: %llu size: %llu (%llu MB)\n",
-            pinfo->partno,
-            pinfo->type_name,
-            pinfo->type,
-            (unsigned long long)pinfo->start,
-            (unsigned long long)pinfo->end,
-            (unsigned long long)pinfo->size,
-            (unsigned long long)approx_size_mb);
+        LOG_DBG("[%zu] %s (%02x) start: %llu end: %llu size: %llu (%llu MB)\n",
+                pinfo->partno,
+                pinfo->type_name,
+                pinfo->type,
+                (unsigned long long)pinfo->start,
+                (unsigned long long)pinfo->end,
+                (unsigned long long)pinfo->size,
+                (unsigned long long)approx_size_mb);
     }
 }
 
+static int disk_write_disklabel(struct fdisk_context *ctx)
+{
+    int ret = fdisk_write_disklabel(ctx);
+    TRACE2(fdisk__write_label, DISK, ret);
+
+    return ret;
+}
+
 static int disk_delete_part(struct fdisk_context *ctx, int partno)
 {
-    printf("Deleting partition %d\n", partno);
+    LOG_INF("Deleting partition %d\n", partno);
     int ret;
     // Delete the old 4th partition
     ret = fdisk_delete_partition(ctx, partno);
+    TRACE2(fdisk__delete_part, (size_t)partno, ret);
     if (ret != 0) {
-        fprintf(stderr, "Failed to delete old 4th partition\n");
+        LOG_ERR("Failed to delete old 4th partition\n");
     }
 
     return ret;
@@ -161,18 +177,18 @@ static int disk_delete_part(struct fdisk_context *ctx, int partno)
 static int
 disk_add_part(struct fdisk_context *ctx, struct fdisk_label *label, struct part_info *new)
 {
-    printf("Adding partition: %d start: %llu end: %llu size: %llu\n",
-           new->partno,
-           (unsigned long long)new->start,
-           (unsigned long long)new->end,
-           (unsigned long long)new->size);
+    LOG_INF("Adding partition: %zu start: %llu end: %llu size: %llu\n",
+            new->partno,
+            (unsigned long long)new->start,
+            (unsigned long long)new->end,
+            (unsigned long long)new->size);
 
     int ret                   = -1;
     struct fdisk_parttype *pt = NULL;
 
     struct fdisk_partition *part = fdisk_new_partition();
     if (!part) {
-        fprintf(stderr, "Failed to create new partition\n");
+        LOG_ERR("Failed to create new partition\n");
         goto exit;
     }
 
@@ -182,7 +198,7 @@ disk_add_part(struct fdisk_context *ctx, struct fdisk_label *label, struct part_
 
     pt = fdisk_label_get_parttype_from_code(label, new->type);
     if (!pt) {
-        fprintf(stderr, "Failed to get partition type\n");
+        LOG_ERR("Failed to get partition type\n");
         goto exit;
     }
 
@@ -190,8 +206,9 @@ disk_add_part(struct fdisk_context *ctx, struct fdisk_label *label, struct part_
 
     size_t cur_partno = (size_t)-1;
     ret               = fdisk_add_partition(ctx, part, &cur_partno);
+    TRACE4(fdisk__add_part, new->partno, (uint64_t)new->start, (uint64_t)new->size, ret);
     if (ret != 0) {
-        fprintf(stderr, "Failed to add partition\n");
+        LOG_ERR("Failed to add partition\n");
         goto exit;
     }
 
@@ -221,10 +238,10 @@ static int disk_dos_add_userfs_as_new_primary_partition(struct fdisk_context *ct
     new->used  = 1;
     new->type  = USERFS_PART_CODE;
 
-    LOG("Creating userfs partition: start=%llu, end=%llu, size=%llu\n",
-        (unsigned long long)new->start,
-        (unsigned long long)new->end,
-        (unsigned long long)new->size);
+    LOG_DBG("Creating userfs partition: start=%llu, end=%llu, size=%llu\n",
+            (unsigned long long)new->start,
+            (unsigned long long)new->end,
+            (unsigned long long)new->size);
 
     ASSERT(prev->end + 1 == new->start,
            "Previous partition end does not match current partition start");
@@ -234,7 +251,7 @@ static int disk_dos_add_userfs_as_new_primary_partition(struct fdisk_context *ct
 
     ret = disk_add_part(ctx, label, new);
     if (ret != 0) {
-        fprintf(stderr, "Failed to add userfs partition\n");
+        LOG_ERR("Failed to add userfs partition\n");
         goto exit;
     }
 
@@ -243,9 +260,9 @@ static int disk_dos_add_userfs_as_new_primary_partition(struct fdisk_context *ct
     ASSERT(ret == 0, "Failed to read partitions after deletion");
     disk_display_info(disk);
 
-    ret = fdisk_write_disklabel(ctx);
+    ret = disk_write_disklabel(ctx);
     if (ret != 0) {
-        fprintf(stderr, "Failed to write disk label\n");
+        LOG_ERR("Failed to write disk label\n");
         goto exit;
     }
 
@@ -272,7 +289,7 @@ static int disk_dos_extend_partition_add_userfs(struct fdisk_context *ctx,
     int old_type          = old->type;
     ret                   = disk_delete_part(ctx, old->partno);
     if (ret != 0) {
-        fprintf(stderr, "Failed to delete old partition\n");
+        LOG_ERR("Failed to delete old partition\n");
         goto exit;
     }
 
@@ -294,7 +311,7 @@ static int disk_dos_extend_partition_add_userfs(struct fdisk_context *ctx,
 
     ret = disk_add_part(ctx, label, ext);
     if (ret != 0) {
-        fprintf(stderr, "Failed to add extended partition\n");
+        LOG_ERR("Failed to add extended partition\n");
         goto exit;
     }
 
@@ -312,7 +329,7 @@ static int disk_dos_extend_partition_add_userfs(struct fdisk_context *ctx,
 
     ret = disk_add_part(ctx, label, moved);
     if (ret != 0) {
-        fprintf(stderr, "Failed to re-add moved partition\n");
+        LOG_ERR("Failed to re-add moved partition\n");
         goto exit;
     }
 
@@ -330,7 +347,7 @@ static int disk_dos_extend_partition_add_userfs(struct fdisk_context *ctx,
 
     ret = disk_add_part(ctx, label, new);
     if (ret != 0) {
-        fprintf(stderr, "Failed to add userfs partition\n");
+        LOG_ERR("Failed to add userfs partition\n");
         goto exit;
     }
 
@@ -375,12 +392,12 @@ static int disk_dos_create_userfs_partition(struct fdisk_context *ctx,
     struct part_info *userfs = &disk->partitions[desired_partno];
 
     if (userfs->used) {
-        fprintf(stderr, "Partition %zu is already defined\n", userfs->partno);
+        LOG_ERR("Partition %zu is already defined\n", userfs->partno);
         return 1;
     }
 
     if (disk->free_sectors < USERFS_MIN_SIZE_S) {
-        fprintf(stderr, "Not enough free space for userfs partition\n");
+        LOG_ERR("Not enough free space for userfs partition\n");
         goto exit;
     }
 
@@ -388,7 +405,7 @@ static int disk_dos_create_userfs_partition(struct fdisk_context *ctx,
         /* Primary partitions */
         ret = disk_dos_add_userfs_as_new_primary_partition(ctx, label, disk);
         if (ret != 0) {
-            fprintf(stderr, "Failed to create primary partition\n");
+            LOG_ERR("Failed to create primary partition\n");
             goto exit;
         }
 
@@ -396,18 +413,18 @@ static int disk_dos_create_userfs_partition(struct fdisk_context *ctx,
         /* Need extended + logical partitions */
         ret = disk_dos_extend_partition_add_userfs(ctx, label, disk);
         if (ret != 0) {
-            fprintf(stderr, "Failed to extend partition\n");
+            LOG_ERR("Failed to extend partition\n");
             goto exit;
         }
     } else {
-        fprintf(stderr, "Unsupported partition number %zu\n", desired_partno);
+        LOG_ERR("Unsupported partition number %zu\n", desired_partno);
         ret = -1;
         goto exit;
     }
 
-    ret = fdisk_write_disklabel(ctx);
+    ret = disk_write_disklabel(ctx);
     if (ret != 0) {
-        fprintf(stderr, "Failed to write disk label\n");
+        LOG_ERR("Failed to write disk label\n");
         goto exit;
     }
 
@@ -426,72 +443,73 @@ static int disk_delete_userfs_partition(struct fdisk_context *ctx,
     int ret = -1;
 
     if (!pinfo->used) {
-        LOG("Partition %zu is not in use, nothing to delete\n", pinfo->partno);
+        LOG_DBG("Partition %zu is not in use, nothing to delete\n", pinfo->partno);
         return 0;
     }
 
-    LOG("Deleting userfs partition %zu\n", pinfo->partno);
+    LOG_DBG("Deleting userfs partition %zu\n", pinfo->partno);
 
     ret = fdisk_delete_partition(ctx, pinfo->partno);
+    TRACE2(fdisk__delete_part, pinfo->partno, ret);
     if (ret != 0) {
-        fprintf(stderr, "Failed to delete partition %zu\n", pinfo->partno);
+        LOG_ERR("Failed to delete partition %zu\n", pinfo->partno);
         return -1;
     }
 
-    ret = fdisk_write_disklabel(ctx);
+    ret = disk_write_disklabel(ctx);
     if (ret != 0) {
-        fprintf(stderr, "Failed to write disk label after deletion\n");
+        LOG_ERR("Failed to write disk label after deletion\n");
         return -1;
     }
 
     // Update partition info
     memset(pinfo, 0, sizeof(*pinfo));
 
-    LOG("Partition %zu deleted successfully\n", pinfo->partno);
+    LOG_DBG("Partition %zu deleted successfully\n", pinfo->partno);
     return 0;
 }
 
-int step1_create_userfs_partition(struct args *args, struct disk_info *disk)
+/* Create or delete the userfs partition with libfdisk */
+static int disk_update_userfs_partition(struct args *args, struct disk_info *disk)
 {
     int ret                   = -1;
     uint64_t device_size      = 0;
     struct fdisk_context *ctx = NULL;
     struct fdisk_label *label = NULL;
 
-    fdisk_init_debug(0x0);
-    blkid_init_debug(0x0);
+    if (fdisk_dl_load() != 0) return -1;
 
     ctx = fdisk_new_context();
     if (!ctx) {
-        fprintf(stderr, "Failed to create fdisk context\n");
+        LOG_ERR("Failed to create fdisk context\n");
         goto exit;
     }
 
     if (fdisk_assign_device(ctx, DISK, RO_ENABLED) < 0) {
-        fprintf(stderr, "Failed to assign device\n");
+        LOG_ERR("Failed to assign device\n");
         goto exit;
     }
 
     label = fdisk_get_label(ctx, "dos");
     if (!label) {
-        fprintf(stderr, "Failed to get label\n");
+        LOG_ERR("Failed to get label\n");
         goto exit;
     }
 
     disk->type = fdisk_label_get_type(label);
     if (disk->type != FDISK_DISKLABEL_DOS) {
-        fprintf(stderr, "Unsupported partition table type\n");
+        LOG_ERR("Unsupported partition table type\n");
         goto exit;
     }
 
     ret = disk_read_partitions(ctx, label, disk);
     if (ret != 0) {
-        fprintf(stderr, "Failed to read disk info\n");
+        LOG_ERR("Failed to read disk info\n");
         goto exit;
     }
 
     if (disk_get_size(DISK, &device_size) != 0) {
-        fprintf(stderr, "Failed to get device size\n");
+        LOG_ERR("Failed to get device size\n");
         goto exit;
     }
     ASSERT(device_size == disk->total_size,
@@ -505,14 +523,14 @@ int step1_create_userfs_partition(struct args *args, struct disk_info *disk)
     if (args->flags & FLAG_USERFS_DELETE) {
         ret = disk_delete_userfs_partition(ctx, userfs_part);
         if (ret != 0) {
-            fprintf(stderr, "Failed to delete userfs partition\n");
+            LOG_ERR("Failed to delete userfs partition\n");
             goto exit;
         }
 
         // Success - cleanup and return success
         ret = fdisk_deassign_device(ctx, 0);
         if (ret != 0) {
-            fprintf(stderr, "Failed to deassign device\n");
+            LOG_ERR("Failed to deassign device\n");
             goto exit;
         }
         fdisk_unref_context(ctx);
@@ -524,28 +542,30 @@ int step1_create_userfs_partition(struct args *args, struct disk_info *disk)
         ret = disk_dos_create_userfs_partition(ctx, label, disk, USERFS_PART_NO);
         if (ret == 0) {
             // FIRST BOOT: Userfs partition created successfully:
-            // we prefer to reformat the userfs partition to BTRFS even if it exists
-            // from a previous installation, unless the user asked to trust it
-            // with the -t flag.
+            // the userfs partition is reformatted to BTRFS unless it holds a
+            // healthy userfs filesystem from a previous installation (see
+            // format.h) or the user asked to trust it with the -t flag.
             if (args->flags & FLAG_USERFS_TRUST_RESIDENT) {
-                printf("First boot: Trusting existing userfs partition without "
-                       "formatting\n");
+                LOG_INF("First boot: Trusting existing userfs partition without "
+                        "formatting\n");
             } else {
-                printf("First boot: Userfs partition created, formatting to BTRFS\n");
-                args->flags |= FLAG_USERFS_FORCE_FORMAT;
+                LOG_INF("First boot: Userfs partition created, inspecting it\n");
+                args->flags |= FLAG_USERFS_FIRST_BOOT;
             }
+            report_set_action(REPORT_STEP_PARTITION, REPORT_ACTION_CREATED);
         } else if (ret == 1) {
             // NOT FIRST BOOT: Userfs partition already exists:
             // we do want to keep the existing userfs partition if it exists
+            report_set_action(REPORT_STEP_PARTITION, REPORT_ACTION_SKIPPED);
         } else {
-            fprintf(stderr, "Failed to create userfs partition\n");
+            LOG_ERR("Failed to create userfs partition\n");
             goto exit;
         }
 
         // Do sync
         ret = fdisk_deassign_device(ctx, 0);
         if (ret != 0) {
-            fprintf(stderr, "Failed to deassign device\n");
+            LOG_ERR("Failed to deassign device\n");
             goto exit;
         }
         fdisk_unref_context(ctx);
@@ -559,6 +579,28 @@ exit:
     return ret;
 }
 
+int step1_create_userfs_partition(struct args *args, struct disk_info *disk)
+{
+    blkid_init_debug(0x0);
+
+    // Steady state: the userfs partition exists, nothing to change
+    if (mbr_read_disk(DISK, disk) == 0) {
+        bool delete = (args->flags & FLAG_USERFS_DELETE) != 0;
+
+        disk_display_info(disk);
+
+        if (disk->partitions[USERFS_PART_NO].used && !delete) {
+            LOG_DBG("Userfs partition %u already exists\n", USERFS_PART_NO);
+            report_set_action(REPORT_STEP_PARTITION, REPORT_ACTION_SKIPPED);
+            return 0;
+        }
+
+        disk_clear_info(disk);
+    }
+
+    return disk_update_userfs_partition(args, disk);
+}
+
 int disk_partprobe(const char *device)
 {
     int ret;
@@ -569,7 +611,7 @@ int disk_partprobe(const char *device)
     // int fd = open(DISK, O_RDONLY);
     // if (fd >= 0) {
     //     ret = ioctl(fd, BLKRRPART); // Re-read partition table
-    //     printf("BLKRRPART returned: %d %s\n", ret, strerror(errno));
+    //     LOG_INF("BLKRRPART returned: %d %s\n", ret, strerror(errno));
     //     close(fd);
     //     sleep(1); // Wait for /dev/mmcblk0pX to appear
     // }
@@ -588,3 +630,159 @@ ssize_t disk_part_build_path(char *buf, size_t buf_len, size_t partno)
 {
     return snprintf(buf, buf_len, DISK_PART_FMT, DISK, partno + 1u);
 }
+
+/* Whole device signature (filesystem, RAID, ...) found by blkid, if any */
+static int disk_probe_signature(const char *device, char *type, size_t type_len)
+{
+    int ret        = -1;
+    const char *ty = NULL;
+
+    blkid_probe pr = blkid_new_probe_from_filename(device);
+    if (!pr) {
+        LOG_ERR("Failed to create blkid probe for %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    blkid_probe_enable_superblocks(pr, true);
+    blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE);
+
+    ret = blkid_do_safeprobe(pr);
+    if (ret == -1) {
+        LOG_ERR("Failed to probe %s\n", device);
+    } else if (ret == 1) {
+        ret = 0; // Nothing found
+    } else {
+        // -2: several signatures, ambiguous but not blank either
+        if (ret == 0 && blkid_probe_lookup_value(pr, "TYPE", &ty, NULL) == 0) {
+            snprintf(type, type_len, "%s", ty);
+        } else {
+            snprintf(type, type_len, "unknown");
+        }
+        ret = 1;
+    }
+
+    blkid_free_probe(pr);
+    return ret;
+}
+
+int disk_prepare_device(const char *device, int type, bool force)
+{
+    int ret                      = -1;
+    struct fdisk_context *ctx    = NULL;
+    struct fdisk_label *label    = NULL;
+    struct fdisk_partition *part = NULL;
+    struct fdisk_parttype *pt    = NULL;
+    struct disk_info info;
+
+    // Only load libfdisk if the partition has to be created
+    if (mbr_read_disk(device, &info) == 0 && info.partitions[0].used) {
+        LOG_DBG("Partition 0 of %s already exists\n", device);
+        return 1;
+    }
+
+    if (fdisk_dl_load() != 0) return -1;
+
+    ctx = fdisk_new_context();
+    if (!ctx) {
+        LOG_ERR("Failed to create fdisk context\n");
+        goto exit;
+    }
+
+    if (fdisk_assign_device(ctx, device, RO_ENABLED) < 0) {
+        LOG_ERR("Failed to assign device %s\n", device);
+        goto exit;
+    }
+
+    bool create = !fdisk_has_label(ctx);
+
+    if (!create && !fdisk_is_label(ctx, DOS)) {
+        LOG_ERR("Unsupported partition table type on %s\n", device);
+        goto exit;
+    } else if (!create && fdisk_is_partition_used(ctx, 0)) {
+        LOG_DBG("Partition 0 of %s already exists\n", device);
+        ret = 1;
+        goto exit;
+    }
+
+    // A whole device filesystem has no partition table, the boot sector of a
+    // superfloppy (vfat) passes for an empty DOS one
+    char sig[32];
+    int found = disk_probe_signature(device, sig, sizeof(sig));
+    if (found < 0) goto exit;
+    if (found && !force) {
+        LOG_ERR("%s holds a signature (%s), not partitioned without -f\n",
+                device,
+                sig);
+        errno = EEXIST;
+        goto exit;
+    }
+    if (found) {
+        LOG_WRN("Erasing the signature (%s) of %s\n", sig, device);
+        fdisk_enable_wipe(ctx, 1);
+        create = true;
+    }
+
+    if (create) {
+        LOG_INF("Creating DOS partition table on %s\n", device);
+        if (fdisk_create_disklabel(ctx, "dos") != 0) {
+            LOG_ERR("Failed to create partition table on %s\n", device);
+            goto exit;
+        }
+    }
+
+    label = fdisk_get_label(ctx, NULL);
+    part  = fdisk_new_partition();
+    pt    = label ? fdisk_label_get_parttype_from_code(label, type) : NULL;
+    if (!part || !pt) {
+        LOG_ERR("Failed to create new partition\n");
+        goto exit;
+    }
+
+    // Whole device, first sector aligned by libfdisk
+    fdisk_partition_set_partno(part, 0);
+    fdisk_partition_start_follow_default(part, 1);
+    fdisk_partition_end_follow_default(part, 1);
+    fdisk_partition_set_type(part, pt);
+
+    LOG_INF("Adding partition 0 (%02x) on %s\n", type, device);
+
+    ret = fdisk_add_partition(ctx, part, NULL);
+    if (ret != 0) {
+        LOG_ERR("Failed to add partition on %s\n", device);
+        goto exit;
+    }
+
+    ret = fdisk_write_disklabel(ctx);
+    TRACE2(fdisk__write_label, device, ret);
+    if (ret != 0) {
+        LOG_ERR("Failed to write disk label on %s\n", device);
+        goto exit;
+    }
+
+    ret = fdisk_deassign_device(ctx, 0);
+    if (ret != 0) {
+        LOG_ERR("Failed to deassign device %s\n", device);
+        goto exit;
+    }
+
+exit:
+    if (part) fdisk_unref_partition(part);
+    if (pt) fdisk_unref_parttype(pt);
+    if (ctx) fdisk_unref_context(ctx);
+    return ret;
+}
+
+ssize_t disk_device_part_path(char *buf,
+                              size_t buf_len,
+                              const char *device,
+                              size_t partno)
+{
+    size_t len = strlen(device);
+
+    // A "p" separates the partition number from a device name ending with a digit
+    if (len > 0 && isdigit((unsigned char)device[len - 1])) {
+        return snprintf(buf, buf_len, "%sp%zu", device, partno + 1u);
+    }
+
+    return snprintf(buf, buf_len, "%s%zu", device, partno + 1u);
+}
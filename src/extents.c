@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "extents.h"
+#include "userfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define EXTENTS_SEARCH_BUF_SIZE (64u * 1024u)
+#define EXTENTS_SEEN_CAPACITY   32768u // Must be a power of 2
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+enum extents_compression {
+    EXTENTS_COMPRESS_NONE = 0,
+    EXTENTS_COMPRESS_ZLIB,
+    EXTENTS_COMPRESS_LZO,
+    EXTENTS_COMPRESS_ZSTD,
+    EXTENTS_COMPRESS_COUNT,
+};
+
+static const char *const extents_compression_names[EXTENTS_COMPRESS_COUNT] = {
+    [EXTENTS_COMPRESS_NONE] = "none",
+    [EXTENTS_COMPRESS_ZLIB] = "zlib",
+    [EXTENTS_COMPRESS_LZO]  = "lzo",
+    [EXTENTS_COMPRESS_ZSTD] = "zstd",
+};
+
+struct extents_usage {
+    uint64_t disk;         // On disk size of the extents, counted once
+    uint64_t uncompressed; // Logical size of the extents, counted once
+    uint64_t referenced;   // Logical size referenced by the files
+    uint64_t extents;
+};
+
+struct extents_stats {
+    struct extents_usage usage[EXTENTS_COMPRESS_COUNT];
+    uint64_t files;
+    uint64_t extents;   // File extent items (including inline, excluding holes)
+    uint64_t fragments; // Extents not contiguous on disk with the previous one
+    bool approximate;
+};
+
+/* Walk state, extent items are returned sorted by inode then file offset */
+struct extents_walk {
+    struct extents_stats *stats;
+    uint64_t last_ino;
+    uint64_t next_bytenr; // Expected disk address of a contiguous extent
+};
+
+/* Open addressing set of the extent disk addresses already accounted */
+static uint64_t extents_seen[EXTENTS_SEEN_CAPACITY];
+static size_t extents_seen_count;
+
+static uint64_t extents_search_buf[EXTENTS_SEARCH_BUF_SIZE / sizeof(uint64_t)];
+
+static void extents_seen_reset(void)
+{
+    memset(extents_seen, 0, sizeof(extents_seen));
+    extents_seen_count = 0;
+}
+
+/* Return true if bytenr was not in the set (and add it), false otherwise */
+static bool extents_seen_add(uint64_t bytenr, bool *full)
+{
+    uint64_t hash = (bytenr >> 12) * 0x9E3779B97F4A7C15ull;
+    size_t i      = (size_t)(hash >> 32) & (EXTENTS_SEEN_CAPACITY - 1);
+
+    for (;;) {
+        if (extents_seen[i] == bytenr) return false;
+        if (extents_seen[i] == 0) break;
+        i = (i + 1) & (EXTENTS_SEEN_CAPACITY - 1);
+    }
+
+    // Keep the probe sequences short, count the extent as new when full
+    if (extents_seen_count >= EXTENTS_SEEN_CAPACITY * 3 / 4) {
+        *full = true;
+        return true;
+    }
+
+    extents_seen[i] = bytenr;
+    extents_seen_count++;
+    return true;
+}
+
+static uint64_t extents_get_le64(const uint8_t *item, size_t offset)
+{
+    uint64_t value;
+    memcpy(&value, item + offset, sizeof(value));
+    return le64toh(value);
+}
+
+static void extents_account(struct extents_walk *walk,
+                            uint64_t ino,
+                            const uint8_t *item,
+                            uint32_t len)
+{
+    struct extents_stats *stats = walk->stats;
+    const size_t inline_offset  = offsetof(struct btrfs_file_extent_item, disk_bytenr);
+
+    if (len < inline_offset) return;
+
+    uint64_t ram_bytes =
+        extents_get_le64(item, offsetof(struct btrfs_file_extent_item, ram_bytes));
+    uint8_t compression = item[offsetof(struct btrfs_file_extent_item, compression)];
+    uint8_t type        = item[offsetof(struct btrfs_file_extent_item, type)];
+
+    if (compression >= EXTENTS_COMPRESS_COUNT) return;
+    struct extents_usage *usage = &stats->usage[compression];
+
+    if (ino != walk->last_ino) {
+        walk->last_ino    = ino;
+        walk->next_bytenr = 0;
+        stats->files++;
+    }
+
+    if (type == BTRFS_FILE_EXTENT_INLINE) {
+        // Data stored in the item itself, never shared
+        usage->disk += len - inline_offset;
+        usage->uncompressed += ram_bytes;
+        usage->referenced += ram_bytes;
+        usage->extents++;
+        stats->extents++;
+        return;
+    }
+
+    if (len < sizeof(struct btrfs_file_extent_item)) return;
+
+    uint64_t disk_bytenr =
+        extents_get_le64(item, offsetof(struct btrfs_file_extent_item, disk_bytenr));
+    uint64_t disk_num_bytes =
+        extents_get_le64(item, offsetof(struct btrfs_file_extent_item, disk_num_bytes));
+    uint64_t num_bytes =
+        extents_get_le64(item, offsetof(struct btrfs_file_extent_item, num_bytes));
+
+    // Hole
+    if (disk_bytenr == 0) return;
+
+    stats->extents++;
+    if (walk->next_bytenr != 0 && disk_bytenr != walk->next_bytenr) {
+        stats->fragments++;
+    }
+    walk->next_bytenr = disk_bytenr + disk_num_bytes;
+
+    // Preallocated extents are not referenced data yet
+    if (type == BTRFS_FILE_EXTENT_REG) {
+        usage->referenced += num_bytes;
+    }
+
+    if (extents_seen_add(disk_bytenr, &stats->approximate)) {
+        usage->disk += disk_num_bytes;
+        usage->uncompressed += ram_bytes;
+        usage->extents++;
+    }
+}
+
+/* Get the id of the subvolume tree containing the given (open) directory */
+static int extents_get_tree_id(int fd, uint64_t *tree_id)
+{
+    struct btrfs_ioctl_ino_lookup_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+
+    if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) != 0) return -1;
+
+    *tree_id = args.treeid;
+    return 0;
+}
+
+static int extents_walk_subvolume(int fd, uint64_t tree_id, struct extents_stats *stats)
+{
+    struct btrfs_ioctl_search_args_v2 *args = (void *)extents_search_buf;
+    struct btrfs_ioctl_search_key *sk       = &args->key;
+    struct extents_walk walk                = {.stats = stats};
+
+    memset(sk, 0, sizeof(*sk));
+    sk->tree_id      = tree_id;
+    sk->min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+    sk->max_objectid = (uint64_t)-1;
+    sk->min_type     = BTRFS_EXTENT_DATA_KEY;
+    sk->max_type     = BTRFS_EXTENT_DATA_KEY;
+    sk->max_offset   = (uint64_t)-1;
+    sk->max_transid  = (uint64_t)-1;
+
+    for (;;) {
+        sk->nr_items   = 4096;
+        args->buf_size = sizeof(extents_search_buf) - sizeof(*args);
+
+        if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) != 0) {
+            LOG_ERR("BTRFS_IOC_TREE_SEARCH_V2 failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (sk->nr_items == 0) break;
+
+        const uint8_t *buf = (const uint8_t *)args->buf;
+        size_t pos         = 0;
+        struct btrfs_ioctl_search_header sh;
+
+        for (uint32_t i = 0; i < sk->nr_items; i++) {
+            memcpy(&sh, buf + pos, sizeof(sh));
+            pos += sizeof(sh);
+
+            // The search range is (objectid, type, offset), other item types
+            // of the inodes in between are returned too
+            if (sh.type == BTRFS_EXTENT_DATA_KEY) {
+                extents_account(&walk, sh.objectid, buf + pos, sh.len);
+            }
+
+            pos += sh.len;
+        }
+
+        // Continue right after the last returned key
+        sk->min_objectid = sh.objectid;
+        sk->min_type     = (uint32_t)sh.type;
+        sk->min_offset   = sh.offset;
+        if (sk->min_offset < (uint64_t)-1) {
+            sk->min_offset++;
+        } else if (sk->min_type < 0xff) {
+            sk->min_type++;
+            sk->min_offset = 0;
+        } else if (sk->min_objectid < (uint64_t)-1) {
+            sk->min_objectid++;
+            sk->min_type   = 0;
+            sk->min_offset = 0;
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void extents_format_size(char *buf, size_t size, uint64_t bytes, bool raw)
+{
+    static const char units[] = "BKMGT";
+    double value              = (double)bytes;
+    size_t unit               = 0;
+
+    if (raw) {
+        snprintf(buf, size, "%llu", (unsigned long long)bytes);
+        return;
+    }
+
+    while (value >= 1024.0 && unit < sizeof(units) - 2) {
+        value /= 1024.0;
+        unit++;
+    }
+
+    snprintf(buf, size, unit ? "%.1f%c" : "%.0f%c", value, units[unit]);
+}
+
+static void extents_print_usage_line(const char *name,
+                                     const struct extents_usage *usage,
+                                     bool raw)
+{
+    char disk[32];
+    char uncompressed[32];
+    char referenced[32];
+
+    extents_format_size(disk, sizeof(disk), usage->disk, raw);
+    extents_format_size(uncompressed, sizeof(uncompressed), usage->uncompressed, raw);
+    extents_format_size(referenced, sizeof(referenced), usage->referenced, raw);
+
+    unsigned int perc = 0;
+    if (usage->uncompressed) {
+        perc = (unsigned int)(usage->disk * 100u / usage->uncompressed);
+    }
+
+    printf("  %-8s %4u%% %14s %14s %14s %10llu\n",
+           name,
+           perc,
+           disk,
+           uncompressed,
+           referenced,
+           (unsigned long long)usage->extents);
+}
+
+static void extents_print_stats(const char *name,
+                                const struct extents_stats *stats,
+                                bool raw)
+{
+    struct extents_usage total = {0};
+
+    for (size_t c = 0; c < EXTENTS_COMPRESS_COUNT; c++) {
+        total.disk += stats->usage[c].disk;
+        total.uncompressed += stats->usage[c].uncompressed;
+        total.referenced += stats->usage[c].referenced;
+        total.extents += stats->usage[c].extents;
+    }
+
+    // Fragmentation: share of the extents following another extent of the same
+    // file which are not contiguous on disk
+    uint64_t followers = 0;
+    double fragmentation = 0.0;
+
+    if (stats->extents > stats->files) {
+        followers     = stats->extents - stats->files;
+        fragmentation = 100.0 * (double)stats->fragments / (double)followers;
+    }
+
+    printf("%s: %llu files, %llu extents (%.1f per file), fragmentation %.1f%%%s\n",
+           name,
+           (unsigned long long)stats->files,
+           (unsigned long long)stats->extents,
+           stats->files ? (double)stats->extents / (double)stats->files : 0.0,
+           fragmentation,
+           stats->approximate ? " (approximate, too many shared extents)" : "");
+    printf("  %-8s %5s %14s %14s %14s %10s\n",
+           "Type",
+           "Perc",
+           "Disk Usage",
+           "Uncompressed",
+           "Referenced",
+           "Extents");
+    extents_print_usage_line("TOTAL", &total, raw);
+
+    for (size_t c = 0; c < EXTENTS_COMPRESS_COUNT; c++) {
+        if (stats->usage[c].extents == 0 && stats->usage[c].referenced == 0) continue;
+        extents_print_usage_line(extents_compression_names[c], &stats->usage[c], raw);
+    }
+}
+
+/* The walk is a background job, make sure it does not slow down the system */
+static void extents_set_idle_priority(void)
+{
+    int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+        LOG_WRN("Failed to set idle I/O priority: %s\n", strerror(errno));
+    }
+
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+        LOG_WRN("Failed to set nice value: %s\n", strerror(errno));
+    }
+}
+
+static void extents_print_usage(void)
+{
+    printf("Usage: userfs extents [-b]\n");
+    printf("Print compression and extent statistics of the userfs subvolumes\n\n");
+    printf("  -b    Print sizes in bytes\n");
+}
+
+int extents_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    int ret  = 0;
+    bool raw = false;
+    const char *sv_name;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "bh")) != -1) {
+        switch (opt) {
+        case 'b':
+            raw = true;
+            break;
+        case 'h':
+            extents_print_usage();
+            return 0;
+        default:
+            extents_print_usage();
+            return -1;
+        }
+    }
+
+    extents_set_idle_priority();
+
+    for (size_t i = 0; (sv_name = btrfs_get_volume(i)) != NULL; i++) {
+        char path[PATH_MAX];
+        uint64_t tree_id;
+        struct extents_stats stats;
+
+        snprintf(path, sizeof(path), "%s/%s", USERFS_MOUNT_POINT, sv_name);
+
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+
+        if (extents_get_tree_id(fd, &tree_id) != 0) {
+            LOG_ERR("Failed to get subvolume id of %s: %s\n", path, strerror(errno));
+            close(fd);
+            ret = -1;
+            continue;
+        }
+
+        // Extents are shared across subvolumes only through reflinks/snapshots,
+        // count them per subvolume
+        memset(&stats, 0, sizeof(stats));
+        extents_seen_reset();
+
+        if (extents_walk_subvolume(fd, tree_id, &stats) != 0) {
+            ret = -1;
+        } else {
+            extents_print_stats(sv_name, &stats, raw);
+        }
+
+        close(fd);
+    }
+
+    return ret;
+}
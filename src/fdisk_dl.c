@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+#define FDISK_DL_IMPL
+
+#include "fdisk_dl.h"
+#include "userfs.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FDISK_DL_DEFINE(sym) __typeof__(sym) *sym_##sym = NULL;
+FDISK_DL_SYMBOLS(FDISK_DL_DEFINE)
+#undef FDISK_DL_DEFINE
+
+static pthread_once_t fdisk_dl_once = PTHREAD_ONCE_INIT;
+static int fdisk_dl_ret             = -1;
+
+static void fdisk_dl_open(void)
+{
+    struct timespec begin, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // Never unloaded, the pointers stay valid until exit
+    void *handle = dlopen(FDISK_DL_SONAME, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        LOG_ERR("Failed to load %s: %s\n", FDISK_DL_SONAME, dlerror());
+        return;
+    }
+
+#define FDISK_DL_RESOLVE(sym)                                                            \
+    *(void **)&sym_##sym = dlsym(handle, #sym);                                          \
+    if (!sym_##sym) {                                                                    \
+        LOG_ERR("Missing %s in %s\n", #sym, FDISK_DL_SONAME);                           \
+        return;                                                                          \
+    }
+    FDISK_DL_SYMBOLS(FDISK_DL_RESOLVE)
+#undef FDISK_DL_RESOLVE
+
+    sym_fdisk_init_debug(0x0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOG_DBG("Loaded %s in %.1f ms\n",
+            FDISK_DL_SONAME,
+            (double)(end.tv_sec - begin.tv_sec) * 1000.0 +
+                (double)(end.tv_nsec - begin.tv_nsec) / 1000000.0);
+
+    fdisk_dl_ret = 0;
+}
+
+int fdisk_dl_load(void)
+{
+    pthread_once(&fdisk_dl_once, fdisk_dl_open);
+    return fdisk_dl_ret;
+}
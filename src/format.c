@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "format.h"
+#include "userfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define FORMAT_IO_ALIGN 4096u
+
+/* btrfs superblock, only the fields checked here (see btrfs on-disk format) */
+#define FORMAT_SB_SIZE            4096u
+#define FORMAT_SB_PRIMARY         (64ull * 1024ull)
+#define FORMAT_SB_MIRROR          (64ull * 1024ull * 1024ull)
+#define FORMAT_SB_MAGIC           0x4d5f53665248425full // "_BHRfS_M"
+#define FORMAT_SB_CSUM_OFF        0x00u
+#define FORMAT_SB_FSID_OFF        0x20u
+#define FORMAT_SB_BYTENR_OFF      0x30u
+#define FORMAT_SB_MAGIC_OFF       0x40u
+#define FORMAT_SB_GENERATION_OFF  0x48u
+#define FORMAT_SB_TOTAL_BYTES_OFF 0x70u
+#define FORMAT_SB_NUM_DEVICES_OFF 0x88u
+#define FORMAT_SB_CSUM_TYPE_OFF   0xc4u
+#define FORMAT_SB_LABEL_OFF       0x12bu
+#define FORMAT_SB_LABEL_SIZE      256u
+#define FORMAT_SB_CSUM_CRC32C     0u
+
+static struct {
+    bool ran;
+    enum format_mode mode;
+    uint64_t scanned_bytes;
+    double duration_ms;
+} format_status;
+
+static uint64_t format_get_le64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+/* Whether all the bytes of buf are equal to value */
+static bool format_is_uniform(const uint8_t *buf, size_t len, uint8_t value)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    const uint8x16_t pattern = vdupq_n_u8(value);
+
+    for (; i + 64u <= len; i += 64u) {
+        uint8x16_t d0   = veorq_u8(vld1q_u8(buf + i), pattern);
+        uint8x16_t d1   = veorq_u8(vld1q_u8(buf + i + 16u), pattern);
+        uint8x16_t d2   = veorq_u8(vld1q_u8(buf + i + 32u), pattern);
+        uint8x16_t d3   = veorq_u8(vld1q_u8(buf + i + 48u), pattern);
+        uint8x16_t diff = vorrq_u8(vorrq_u8(d0, d1), vorrq_u8(d2, d3));
+
+        uint64x2_t diff64 = vreinterpretq_u64_u8(diff);
+        if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) return false;
+    }
+#elif defined(__SSE2__)
+    const __m128i pattern = _mm_set1_epi8((char)value);
+    const __m128i zero    = _mm_setzero_si128();
+
+    for (; i + 64u <= len; i += 64u) {
+        const __m128i *p = (const __m128i *)(buf + i);
+        __m128i d0       = _mm_xor_si128(_mm_loadu_si128(p), pattern);
+        __m128i d1       = _mm_xor_si128(_mm_loadu_si128(p + 1), pattern);
+        __m128i d2       = _mm_xor_si128(_mm_loadu_si128(p + 2), pattern);
+        __m128i d3       = _mm_xor_si128(_mm_loadu_si128(p + 3), pattern);
+        __m128i diff     = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff) return false;
+    }
+#else
+    const uint64_t pattern = 0x0101010101010101ull * value;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, buf + i, sizeof(word));
+        if (word != pattern) return false;
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (buf[i] != value) return false;
+    }
+
+    return true;
+}
+
+static int format_read_super(int fd, uint64_t offset, uint8_t *sb)
+{
+    if (pread(fd, sb, FORMAT_SB_SIZE, (off_t)offset) != (ssize_t)FORMAT_SB_SIZE) {
+        return -1;
+    }
+
+    if (format_get_le64(sb + FORMAT_SB_MAGIC_OFF) != FORMAT_SB_MAGIC ||
+        format_get_le64(sb + FORMAT_SB_BYTENR_OFF) != offset) {
+        return -1;
+    }
+
+    // Other checksum types (xxhash, sha256, blake2) are never used by userfs
+    uint16_t csum_type;
+    memcpy(&csum_type, sb + FORMAT_SB_CSUM_TYPE_OFF, sizeof(csum_type));
+    if (le16toh(csum_type) != FORMAT_SB_CSUM_CRC32C) return -1;
+
+    uint32_t csum;
+    memcpy(&csum, sb + FORMAT_SB_CSUM_OFF, sizeof(csum));
+    if (le32toh(csum) != crc32c(0,
+                                sb + FORMAT_SB_FSID_OFF,
+                                FORMAT_SB_SIZE - FORMAT_SB_FSID_OFF)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Healthy single-device userfs btrfs fitting in the partition */
+static bool format_is_healthy_userfs(int fd, uint64_t size, uint8_t *buf)
+{
+    uint8_t *primary = buf;
+    uint8_t *mirror  = buf + FORMAT_SB_SIZE;
+
+    if (format_read_super(fd, FORMAT_SB_PRIMARY, primary) != 0) {
+        LOG_DBG("No valid btrfs superblock\n");
+        return false;
+    }
+
+    if (strncmp((const char *)primary + FORMAT_SB_LABEL_OFF,
+                FORMAT_LABEL,
+                FORMAT_SB_LABEL_SIZE) != 0) {
+        LOG_DBG("btrfs filesystem is not labeled %s\n", FORMAT_LABEL);
+        return false;
+    }
+
+    if (format_get_le64(primary + FORMAT_SB_NUM_DEVICES_OFF) != 1u ||
+        format_get_le64(primary + FORMAT_SB_TOTAL_BYTES_OFF) > size) {
+        LOG_DBG("btrfs filesystem does not fit the partition\n");
+        return false;
+    }
+
+    // All the superblock copies are written on each commit
+    if (size >= FORMAT_SB_MIRROR + FORMAT_SB_SIZE) {
+        if (format_read_super(fd, FORMAT_SB_MIRROR, mirror) != 0 ||
+            memcmp(primary + FORMAT_SB_FSID_OFF, mirror + FORMAT_SB_FSID_OFF, 16u) != 0 ||
+            format_get_le64(primary + FORMAT_SB_GENERATION_OFF) !=
+                format_get_le64(mirror + FORMAT_SB_GENERATION_OFF)) {
+            LOG_DBG("btrfs superblock mirror is invalid or out of sync\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Whether the sampled region is uniformly 0x00 or 0xff */
+static int format_is_blank(int fd, uint64_t size, uint8_t *buf, bool *blank)
+{
+    size_t sample_size = FORMAT_SCAN_SAMPLE_SIZE;
+    uint64_t stride    = 0;
+    int value          = -1;
+
+    if (size < sample_size) sample_size = (size_t)size & ~(size_t)(FORMAT_IO_ALIGN - 1u);
+    if (sample_size == 0) {
+        *blank = false;
+        return 0;
+    }
+
+    // First sample at the start (superblock, mkfs metadata), last one at the end
+    if (FORMAT_SCAN_SAMPLES > 1u) {
+        stride = (size - sample_size) / (FORMAT_SCAN_SAMPLES - 1u);
+    }
+
+    *blank = true;
+    for (uint32_t i = 0; i < FORMAT_SCAN_SAMPLES && *blank; i++) {
+        uint64_t offset = ((uint64_t)i * stride) & ~(uint64_t)(FORMAT_IO_ALIGN - 1u);
+
+        if (pread(fd, buf, sample_size, (off_t)offset) != (ssize_t)sample_size) return -1;
+        format_status.scanned_bytes += sample_size;
+
+        if (value < 0) value = buf[0];
+        *blank = (value == 0x00 || value == 0xff) &&
+                 format_is_uniform(buf, sample_size, (uint8_t)value);
+    }
+
+    if (*blank) LOG_DBG("Blank region, filled with 0x%02x\n", value);
+    return 0;
+}
+
+int format_decide(const char *device, const struct fs_info *info, enum format_mode *mode)
+{
+    int ret      = -1;
+    uint8_t *buf = NULL;
+    uint64_t size;
+    bool blank;
+    struct timespec begin, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(&format_status, 0, sizeof(format_status));
+    *mode = FORMAT_MODE_FULL;
+
+    // Bypass the page cache, the samples are never read again
+    int fd = open(device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0 && errno == EINVAL) fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", device, strerror(errno));
+        goto exit;
+    }
+
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        LOG_ERR("Failed to get the size of %s: %s\n", device, strerror(errno));
+        goto exit;
+    }
+
+    if (posix_memalign((void **)&buf, FORMAT_IO_ALIGN, FORMAT_SCAN_SAMPLE_SIZE) != 0) {
+        buf = NULL;
+        LOG_ERR("Out of memory\n");
+        goto exit;
+    }
+
+    if (info->type == FS_TYPE_BTRFS) {
+        if (format_is_healthy_userfs(fd, size, buf)) *mode = FORMAT_MODE_KEEP;
+    } else if (info->type == FS_TYPE_UNKNOWN) {
+        if (format_is_blank(fd, size, buf, &blank) != 0) {
+            LOG_ERR("Failed to read %s: %s\n", device, strerror(errno));
+            goto exit;
+        }
+        if (blank) *mode = FORMAT_MODE_FAST;
+    }
+
+    ret = 0;
+
+exit:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    format_status.ran         = true;
+    format_status.mode        = *mode;
+    format_status.duration_ms = (double)(end.tv_sec - begin.tv_sec) * 1000.0 +
+                                (double)(end.tv_nsec - begin.tv_nsec) / 1000000.0;
+
+    LOG_INF("First boot format decision for %s: %s (%llu bytes scanned in %.1f ms)\n",
+            device,
+            format_mode_to_string(*mode),
+            (unsigned long long)format_status.scanned_bytes,
+            format_status.duration_ms);
+
+    free(buf);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+const char *format_mode_to_string(enum format_mode mode)
+{
+    switch (mode) {
+    case FORMAT_MODE_KEEP:
+        return "keep";
+    case FORMAT_MODE_FAST:
+        return "fast";
+    case FORMAT_MODE_FULL:
+    default:
+        return "full";
+    }
+}
+
+void format_write_json(FILE *fp)
+{
+    if (!format_status.ran) {
+        fprintf(fp, "null");
+        return;
+    }
+
+    fprintf(fp,
+            "{\"decision\": \"%s\", \"scanned_bytes\": %llu, \"duration_ms\": %.3f}",
+            format_mode_to_string(format_status.mode),
+            (unsigned long long)format_status.scanned_bytes,
+            format_status.duration_ms);
+}
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "trace.h"
 #include "userfs.h"
 
 int fs_probe(const char *part_device, struct fs_info *info)
@@ -11,30 +12,31 @@ int fs_probe(const char *part_device, struct fs_info *info)
     blkid_probe pr = NULL;
 
     if (!part_device || !info) {
-        fprintf(stderr, "Invalid arguments for fs_probe\n");
+        LOG_ERR("Invalid arguments for fs_probe\n");
         goto exit;
     }
 
+    TRACE1(fs__probe__entry, part_device);
+
     // Clear the fs_info structure
     memset(info, 0, sizeof(struct fs_info));
 
     pr = blkid_new_probe();
     if (!pr) {
-        fprintf(stderr, "Failed to create blkid probe\n");
+        LOG_ERR("Failed to create blkid probe\n");
         goto exit;
     }
 
     fd = open(part_device, 0); // Read-only mode
     if (fd < 0) {
-        perror("open");
-        fprintf(stderr, "Failed to open partition device\n");
+        LOG_ERR("Failed to open partition device: %s\n", strerror(errno));
         goto exit;
     }
 
     // offset = 0, size = 0 (whole device)
     ret = blkid_probe_set_device(pr, fd, 0, 0);
     if (ret < 0) {
-        fprintf(stderr, "Failed to set device for blkid probe: %s\n", strerror(errno));
+        LOG_ERR("Failed to set device for blkid probe: %s\n", strerror(errno));
         goto exit;
     }
 
@@ -48,7 +50,7 @@ int fs_probe(const char *part_device, struct fs_info *info)
 
     ret = blkid_do_safeprobe(pr);
     if (ret < 0) {
-        fprintf(stderr, "blkid_do_safeprobe failed: %s\n", strerror(errno));
+        LOG_ERR("blkid_do_safeprobe failed: %s\n", strerror(errno));
         goto exit;
     }
 
@@ -57,12 +59,17 @@ int fs_probe(const char *part_device, struct fs_info *info)
     blkid_probe_lookup_value(pr, "UUID", &fs_uuid, NULL);
     blkid_probe_lookup_value(pr, "TYPE", &type, NULL);
 
+    // A nested partition table is not blank either
+    if (!type) blkid_probe_lookup_value(pr, "PTTYPE", &type, NULL);
+
     if (fs_uuid) {
         strncpy(info->uuid, fs_uuid, sizeof(info->uuid) - 1);
         info->uuid[sizeof(info->uuid) - 1] = '\0'; // Ensure null termination
     }
 
     if (type) {
+        snprintf(info->name, sizeof(info->name), "%s", type);
+
         if (strcmp(type, "btrfs") == 0) {
             info->type = FS_TYPE_BTRFS;
         } else if (strcmp(type, "ext4") == 0) {
@@ -70,14 +77,13 @@ int fs_probe(const char *part_device, struct fs_info *info)
         } else if (strcmp(type, "swap") == 0) {
             info->type = FS_TYPE_SWAP;
         } else {
-            info->type = FS_TYPE_UNKNOWN;
+            info->type = FS_TYPE_OTHER;
         }
     }
 
     if (close(fd) < 0) {
-        perror("close");
+        LOG_ERR("Failed to close partition device: %s\n", strerror(errno));
         fd = -1; // Prevent double close in exit block
-        fprintf(stderr, "Failed to close partition device\n");
         goto exit;
     }
     fd = -1; // Mark as closed
@@ -85,15 +91,17 @@ int fs_probe(const char *part_device, struct fs_info *info)
     blkid_free_probe(pr);
     pr = NULL;
 
+    TRACE3(fs__probe__exit, part_device, (int)info->type, 0);
     return 0;
 
 exit:
     if (pr) blkid_free_probe(pr);
     if (fd >= 0) close(fd);
+    TRACE3(fs__probe__exit, part_device, (int)FS_TYPE_UNKNOWN, ret);
     return ret;
 }
 
-static const char *fs_type_to_string(enum fs_type type)
+const char *fs_type_to_string(enum fs_type type)
 {
     switch (type) {
     case FS_TYPE_BTRFS:
@@ -102,6 +110,8 @@ static const char *fs_type_to_string(enum fs_type type)
         return "ext4";
     case FS_TYPE_SWAP:
         return "swap";
+    case FS_TYPE_OTHER:
+        return "other";
     case FS_TYPE_UNKNOWN:
     default:
         return "unknown";
@@ -112,7 +122,7 @@ void fs_info_display(const struct fs_info *info)
 {
     if (!info) return;
 
-    printf("Filesystem Info:\n");
-    printf("  Type: %s\n", fs_type_to_string(info->type));
-    printf("  UUID: %s\n", info->uuid[0] ? info->uuid : "Not set");
+    LOG_INF("Filesystem Info:\n");
+    LOG_INF("  Type: %s\n", info->name[0] ? info->name : fs_type_to_string(info->type));
+    LOG_INF("  UUID: %s\n", info->uuid[0] ? info->uuid : "Not set");
 }
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "health.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <linux/btrfs.h>
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEALTH_DEFAULT_INTERVAL_S  60u
+#define HEALTH_DEFAULT_MAX_AVG_MS  1000u
+#define HEALTH_BASELINE_MIN_SAMPLE 10u
+#define HEALTH_BASELINE_FACTOR     4.0
+#define HEALTH_BASELINE_ALPHA      0.1
+
+static const char *const health_dev_stat_names[HEALTH_DEV_STAT_COUNT] = {
+    [BTRFS_DEV_STAT_WRITE_ERRS]      = "write_io",
+    [BTRFS_DEV_STAT_READ_ERRS]       = "read_io",
+    [BTRFS_DEV_STAT_FLUSH_ERRS]      = "flush_io",
+    [BTRFS_DEV_STAT_CORRUPTION_ERRS] = "corruption",
+    [BTRFS_DEV_STAT_GENERATION_ERRS] = "generation",
+};
+
+static volatile sig_atomic_t health_stop;
+
+static void health_format_fsid(char *buf, const uint8_t *fsid)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t pos              = 0;
+
+    for (size_t i = 0; i < BTRFS_FSID_SIZE; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) buf[pos++] = '-';
+        buf[pos++] = hex[fsid[i] >> 4];
+        buf[pos++] = hex[fsid[i] & 0xf];
+    }
+    buf[pos] = '\0';
+}
+
+static void health_read_commit_stats(struct btrfs_health *health)
+{
+    char path[PATH_MAX];
+    char key[32];
+    unsigned long long value;
+
+    snprintf(path, sizeof(path), "/sys/fs/btrfs/%s/commit_stats", health->fsid);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+
+    while (fscanf(fp, "%31s %llu", key, &value) == 2) {
+        if (strcmp(key, "commits") == 0) {
+            health->commits = value;
+        } else if (strcmp(key, "last_commit_ms") == 0) {
+            health->last_commit_ms = value;
+        } else if (strcmp(key, "max_commit_ms") == 0) {
+            health->max_commit_ms = value;
+        } else if (strcmp(key, "total_commit_ms") == 0) {
+            health->total_commit_ms = value;
+        }
+    }
+
+    health->has_commit_stats = true;
+    fclose(fp);
+}
+
+int health_collect(const char *mount_point, struct btrfs_health *health)
+{
+    int ret = -1;
+    struct btrfs_ioctl_fs_info_args fs_info;
+
+    memset(health, 0, sizeof(*health));
+
+    int fd = open(mount_point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", mount_point, strerror(errno));
+        return -1;
+    }
+
+    memset(&fs_info, 0, sizeof(fs_info));
+    if (ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) != 0) {
+        LOG_ERR("BTRFS_IOC_FS_INFO failed on %s: %s\n", mount_point, strerror(errno));
+        goto exit;
+    }
+
+    health_format_fsid(health->fsid, fs_info.fsid);
+
+    // Device ids may have holes after a device removal
+    for (uint64_t devid = 1; devid <= fs_info.max_id; devid++) {
+        struct btrfs_ioctl_get_dev_stats stats;
+
+        memset(&stats, 0, sizeof(stats));
+        stats.devid    = devid;
+        stats.nr_items = HEALTH_DEV_STAT_COUNT;
+
+        if (ioctl(fd, BTRFS_IOC_GET_DEV_STATS, &stats) != 0) {
+            if (errno == ENODEV) continue;
+            LOG_ERR("BTRFS_IOC_GET_DEV_STATS failed for device %llu: %s\n",
+                    (unsigned long long)devid,
+                    strerror(errno));
+            goto exit;
+        }
+
+        health->devices++;
+        for (size_t i = 0; i < HEALTH_DEV_STAT_COUNT && i < stats.nr_items; i++) {
+            health->dev_stats[i] += stats.values[i];
+        }
+    }
+
+    health_read_commit_stats(health);
+    ret = 0;
+
+exit:
+    close(fd);
+    return ret;
+}
+
+void health_write_json(FILE *fp, const struct btrfs_health *health)
+{
+    fprintf(fp,
+            "{\"fsid\": \"%s\", \"devices\": %llu, \"dev_errors\": {",
+            health->fsid,
+            (unsigned long long)health->devices);
+    for (size_t i = 0; i < HEALTH_DEV_STAT_COUNT; i++) {
+        fprintf(fp,
+                "%s\"%s\": %llu",
+                i == 0 ? "" : ", ",
+                health_dev_stat_names[i],
+                (unsigned long long)health->dev_stats[i]);
+    }
+    fprintf(fp, "}, \"commit_stats\": ");
+
+    if (health->has_commit_stats) {
+        fprintf(fp,
+                "{\"commits\": %llu, \"last_commit_ms\": %llu, \"max_commit_ms\": %llu, "
+                "\"total_commit_ms\": %llu}}",
+                (unsigned long long)health->commits,
+                (unsigned long long)health->last_commit_ms,
+                (unsigned long long)health->max_commit_ms,
+                (unsigned long long)health->total_commit_ms);
+    } else {
+        fprintf(fp, "null}");
+    }
+}
+
+void health_write_prom(FILE *fp, const struct btrfs_health *health, const char *prefix)
+{
+    fprintf(fp, "# HELP %sdev_errors_total Btrfs device error counters.\n", prefix);
+    fprintf(fp, "# TYPE %sdev_errors_total counter\n", prefix);
+    for (size_t i = 0; i < HEALTH_DEV_STAT_COUNT; i++) {
+        fprintf(fp,
+                "%sdev_errors_total{type=\"%s\"} %llu\n",
+                prefix,
+                health_dev_stat_names[i],
+                (unsigned long long)health->dev_stats[i]);
+    }
+
+    if (!health->has_commit_stats) return;
+
+    double avg_s = 0.0;
+    if (health->commits) {
+        avg_s = (double)health->total_commit_ms / (double)health->commits / 1000.0;
+    }
+
+    fprintf(fp, "# HELP %scommits_total Btrfs commits since mount.\n", prefix);
+    fprintf(fp, "# TYPE %scommits_total counter\n", prefix);
+    fprintf(fp, "%scommits_total %llu\n", prefix, (unsigned long long)health->commits);
+    fprintf(fp, "# HELP %scommit_last_seconds Duration of the last commit.\n", prefix);
+    fprintf(fp, "# TYPE %scommit_last_seconds gauge\n", prefix);
+    fprintf(fp, "%scommit_last_seconds %.3f\n", prefix, health->last_commit_ms / 1000.0);
+    fprintf(fp, "# HELP %scommit_max_seconds Longest commit since mount.\n", prefix);
+    fprintf(fp, "# TYPE %scommit_max_seconds gauge\n", prefix);
+    fprintf(fp, "%scommit_max_seconds %.3f\n", prefix, health->max_commit_ms / 1000.0);
+    fprintf(fp, "# HELP %scommit_avg_seconds Average commit duration.\n", prefix);
+    fprintf(fp, "# TYPE %scommit_avg_seconds gauge\n", prefix);
+    fprintf(fp, "%scommit_avg_seconds %.3f\n", prefix, avg_s);
+}
+
+/* Health state tracked across the samples of the daemon mode */
+struct health_monitor {
+    struct btrfs_health prev;
+    double interval_avg_ms; // Average commit time over the last interval
+    double baseline_ms;     // Moving average of interval_avg_ms
+    unsigned int samples;   // Intervals with commits, accounted in baseline_ms
+    bool degraded;
+};
+
+static void health_check(struct health_monitor *mon,
+                         const struct btrfs_health *cur,
+                         unsigned int max_avg_ms)
+{
+    const struct btrfs_health *prev = &mon->prev;
+
+    mon->degraded = false;
+
+    for (size_t i = 0; i < HEALTH_DEV_STAT_COUNT; i++) {
+        if (cur->dev_stats[i] > prev->dev_stats[i]) {
+            LOG_ERR("btrfs %s errors increased: %llu (+%llu)\n",
+                    health_dev_stat_names[i],
+                    (unsigned long long)cur->dev_stats[i],
+                    (unsigned long long)(cur->dev_stats[i] - prev->dev_stats[i]));
+            mon->degraded = true;
+        }
+    }
+
+    mon->interval_avg_ms = 0.0;
+    if (!cur->has_commit_stats || cur->commits <= prev->commits) return;
+
+    mon->interval_avg_ms = (double)(cur->total_commit_ms - prev->total_commit_ms) /
+                           (double)(cur->commits - prev->commits);
+
+    if (mon->interval_avg_ms > max_avg_ms) {
+        LOG_WRN("btrfs commits took %.0f ms on average (limit %u ms)\n",
+                mon->interval_avg_ms,
+                max_avg_ms);
+        mon->degraded = true;
+    }
+
+    // Slow drift: compare with the long term average of this device
+    if (mon->samples >= HEALTH_BASELINE_MIN_SAMPLE &&
+        mon->interval_avg_ms > HEALTH_BASELINE_FACTOR * mon->baseline_ms) {
+        LOG_WRN("btrfs commit latency degrading: %.0f ms, usually %.0f ms\n",
+                mon->interval_avg_ms,
+                mon->baseline_ms);
+        mon->degraded = true;
+    }
+
+    if (mon->samples == 0) {
+        mon->baseline_ms = mon->interval_avg_ms;
+    } else {
+        double delta = mon->interval_avg_ms - mon->baseline_ms;
+        mon->baseline_ms += HEALTH_BASELINE_ALPHA * delta;
+    }
+    mon->samples++;
+}
+
+static int health_write_monitor_prom(const struct health_monitor *mon,
+                                     const struct btrfs_health *cur)
+{
+    char tmp_path[PATH_MAX];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", HEALTH_PROM_PATH);
+
+    if (mkdir(REPORT_DIR, 0755) != 0 && errno != EEXIST) return -1;
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) return -1;
+
+    health_write_prom(fp, cur, "userfs_health_");
+
+    fprintf(fp, "# HELP userfs_health_commit_interval_avg_seconds Average commit ");
+    fprintf(fp, "duration over the last sampling interval.\n");
+    fprintf(fp, "# TYPE userfs_health_commit_interval_avg_seconds gauge\n");
+    fprintf(fp,
+            "userfs_health_commit_interval_avg_seconds %.3f\n",
+            mon->interval_avg_ms / 1000.0);
+    fprintf(fp, "# HELP userfs_health_degraded Whether the last sample was flagged.\n");
+    fprintf(fp, "# TYPE userfs_health_degraded gauge\n");
+    fprintf(fp, "userfs_health_degraded %d\n", mon->degraded ? 1 : 0);
+
+    if (fclose(fp) != 0 || rename(tmp_path, HEALTH_PROM_PATH) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void health_on_signal(int sig)
+{
+    (void)sig;
+    health_stop = 1;
+}
+
+static int health_monitor_run(unsigned int interval_s, unsigned int max_avg_ms)
+{
+    struct health_monitor mon;
+    struct btrfs_health cur;
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = health_on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    memset(&mon, 0, sizeof(mon));
+    if (health_collect(USERFS_MOUNT_POINT, &mon.prev) != 0) return -1;
+
+    LOG_INF("Monitoring btrfs %s every %u s\n", mon.prev.fsid, interval_s);
+
+    while (!health_stop) {
+        struct timespec ts = {.tv_sec = interval_s};
+
+        // Interrupted by a signal: health_stop is set
+        if (nanosleep(&ts, NULL) != 0) continue;
+
+        if (health_collect(USERFS_MOUNT_POINT, &cur) != 0) continue;
+
+        health_check(&mon, &cur, max_avg_ms);
+
+        // Keep the lifetime write counter used by the wear profile accurate
+        if (wear_account() != 0) {
+            LOG_WRN("Failed to account disk writes\n");
+        }
+
+        if (health_write_monitor_prom(&mon, &cur) != 0) {
+            LOG_WRN("Failed to write %s: %s\n", HEALTH_PROM_PATH, strerror(errno));
+        }
+
+        mon.prev = cur;
+    }
+
+    return 0;
+}
+
+static void health_print(const struct btrfs_health *health)
+{
+    printf("fsid: %s (%llu device%s)\n",
+           health->fsid,
+           (unsigned long long)health->devices,
+           health->devices == 1 ? "" : "s");
+
+    printf("errors:");
+    for (size_t i = 0; i < HEALTH_DEV_STAT_COUNT; i++) {
+        printf(" %s=%llu",
+               health_dev_stat_names[i],
+               (unsigned long long)health->dev_stats[i]);
+    }
+    printf("\n");
+
+    if (health->has_commit_stats) {
+        printf("commits: %llu, last %llu ms, max %llu ms, avg %.1f ms\n",
+               (unsigned long long)health->commits,
+               (unsigned long long)health->last_commit_ms,
+               (unsigned long long)health->max_commit_ms,
+               health->commits ? (double)health->total_commit_ms / (double)health->commits
+                               : 0.0);
+    } else {
+        printf("commits: commit_stats not available\n");
+    }
+}
+
+static void health_print_usage(void)
+{
+    printf("Usage: userfs health [-d] [-i SECONDS] [-l MS]\n");
+    printf("Print btrfs device errors and commit statistics of userfs\n\n");
+    printf("  -d          Keep monitoring, write %s and flag issues\n", HEALTH_PROM_PATH);
+    printf("  -i SECONDS  Sampling interval (default: %u)\n", HEALTH_DEFAULT_INTERVAL_S);
+    printf("  -l MS       Flag an average commit time above MS (default: %u)\n",
+           HEALTH_DEFAULT_MAX_AVG_MS);
+}
+
+int health_cmd_run(int argc, char *argv[])
+{
+    int opt;
+    bool daemon           = false;
+    unsigned int interval = HEALTH_DEFAULT_INTERVAL_S;
+    unsigned int max_avg  = HEALTH_DEFAULT_MAX_AVG_MS;
+    struct btrfs_health health;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "di:l:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon = true;
+            break;
+        case 'i':
+            interval = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            max_avg = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            health_print_usage();
+            return 0;
+        default:
+            health_print_usage();
+            return -1;
+        }
+    }
+
+    if (interval == 0) {
+        LOG_ERR("Invalid interval\n");
+        return -1;
+    }
+
+    if (daemon) return health_monitor_run(interval, max_avg);
+
+    if (health_collect(USERFS_MOUNT_POINT, &health) != 0) return -1;
+
+    health_print(&health);
+    return 0;
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "history.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HISTORY_MAGIC         0x55465348u // "UFSH"
+#define HISTORY_RECORD_MAGIC  0x55465352u // "UFSR"
+#define HISTORY_VERSION       1u
+#define HISTORY_DEFAULT_COUNT 100u
+
+struct history_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint8_t _reserved[48];
+};
+
+_Static_assert(sizeof(struct history_record) == 128u, "history record must be 128 bytes");
+_Static_assert(sizeof(struct history_header) == 64u, "history header must be 64 bytes");
+_Static_assert(HISTORY_MAX_STEPS >= REPORT_STEP_COUNT, "not enough history step slots");
+
+#define HISTORY_FILE_SIZE                                                                \
+    (sizeof(struct history_header) + HISTORY_CAPACITY * sizeof(struct history_record))
+
+static void history_build_path(char *buf, size_t buf_len)
+{
+    snprintf(buf,
+             buf_len,
+             "%s/%s/%s",
+             USERFS_MOUNT_POINT,
+             btrfs_get_volume(BTRFS_SV_DATA_INDEX),
+             HISTORY_FILE_NAME);
+}
+
+static uint32_t history_record_crc(const struct history_record *rec)
+{
+    return crc32c(0, rec, offsetof(struct history_record, crc));
+}
+
+static bool history_record_valid(const struct history_record *rec)
+{
+    return rec->magic == HISTORY_RECORD_MAGIC && rec->crc == history_record_crc(rec);
+}
+
+static bool history_header_valid(const struct history_header *hdr)
+{
+    return hdr->magic == HISTORY_MAGIC && hdr->version == HISTORY_VERSION &&
+           hdr->record_size == sizeof(struct history_record) &&
+           hdr->capacity == HISTORY_CAPACITY;
+}
+
+static int history_init_file(int fd)
+{
+    struct history_header hdr = {
+        .magic       = HISTORY_MAGIC,
+        .version     = HISTORY_VERSION,
+        .record_size = sizeof(struct history_record),
+        .capacity    = HISTORY_CAPACITY,
+    };
+
+    LOG_INF("Initializing boot history file\n");
+
+    // Zeroed records are invalid (bad magic), so the ring starts empty
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, HISTORY_FILE_SIZE) != 0) {
+        LOG_ERR("Failed to resize history file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        LOG_ERR("Failed to write history header: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Map the history file read-only, the caller must munmap HISTORY_FILE_SIZE bytes */
+static const uint8_t *history_map(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != HISTORY_FILE_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    if (!history_header_valid(map)) {
+        munmap(map, HISTORY_FILE_SIZE);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return map;
+}
+
+static const struct history_record *history_records(const uint8_t *map)
+{
+    return (const struct history_record *)(map + sizeof(struct history_header));
+}
+
+int history_append(struct history_record *rec)
+{
+    int ret = -1;
+    int fd  = -1;
+    char path[PATH_MAX];
+    const uint8_t *map = NULL;
+
+    history_build_path(path, sizeof(path));
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    map = history_map(fd);
+    if (!map) {
+        if (history_init_file(fd) != 0) goto exit;
+
+        map = history_map(fd);
+        if (!map) {
+            LOG_ERR("Failed to map %s: %s\n", path, strerror(errno));
+            goto exit;
+        }
+    }
+
+    // Find the most recent valid record, the new one goes right after it
+    const struct history_record *records = history_records(map);
+    bool found                           = false;
+    uint32_t last_seq                    = 0;
+    for (size_t i = 0; i < HISTORY_CAPACITY; i++) {
+        if (!history_record_valid(&records[i])) continue;
+
+        if (!found || (int32_t)(records[i].seq - last_seq) > 0) {
+            last_seq = records[i].seq;
+            found    = true;
+        }
+    }
+
+    rec->magic = HISTORY_RECORD_MAGIC;
+    rec->seq   = found ? last_seq + 1u : 0u;
+    rec->crc   = history_record_crc(rec);
+
+    off_t offset = (off_t)(sizeof(struct history_header) +
+                           (rec->seq % HISTORY_CAPACITY) * sizeof(struct history_record));
+
+    // No fsync: a lost or torn record is detected by its crc and ignored
+    if (pwrite(fd, rec, sizeof(*rec), offset) != (ssize_t)sizeof(*rec)) {
+        LOG_ERR("Failed to write history record: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    LOG_DBG("Boot history record %u written to %s\n", rec->seq, path);
+    ret = 0;
+
+exit:
+    if (map) munmap((void *)map, HISTORY_FILE_SIZE);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+int history_update(struct history_record *rec)
+{
+    int ret = -1;
+    int fd  = -1;
+    char path[PATH_MAX];
+    const uint8_t *map = NULL;
+
+    history_build_path(path, sizeof(path));
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    map = history_map(fd);
+    if (!map) {
+        LOG_ERR("Invalid history file %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    // Only rewrite the record if its slot was not reused in the meantime
+    const struct history_record *old = &history_records(map)[rec->seq % HISTORY_CAPACITY];
+    if (!history_record_valid(old) || old->seq != rec->seq) {
+        LOG_WRN("Boot history record %u no longer exists\n", rec->seq);
+        goto exit;
+    }
+
+    rec->magic = HISTORY_RECORD_MAGIC;
+    rec->crc   = history_record_crc(rec);
+
+    off_t offset = (off_t)(sizeof(struct history_header) +
+                           (rec->seq % HISTORY_CAPACITY) * sizeof(struct history_record));
+
+    if (pwrite(fd, rec, sizeof(*rec), offset) != (ssize_t)sizeof(*rec)) {
+        LOG_ERR("Failed to write history record: %s\n", strerror(errno));
+        goto exit;
+    }
+
+    LOG_DBG("Boot history record %u updated\n", rec->seq);
+    ret = 0;
+
+exit:
+    if (map) munmap((void *)map, HISTORY_FILE_SIZE);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+int history_last_step_us(size_t step, uint32_t *us)
+{
+    int ret = -1;
+    char path[PATH_MAX];
+
+    if (step >= HISTORY_MAX_STEPS) return -1;
+
+    history_build_path(path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    const uint8_t *map = history_map(fd);
+    close(fd);
+    if (!map) return -1;
+
+    const struct history_record *records = history_records(map);
+    uint32_t last_seq                    = 0;
+    for (size_t i = 0; i < HISTORY_CAPACITY; i++) {
+        if (!history_record_valid(&records[i]) || records[i].step_us[step] == 0) continue;
+
+        if (ret != 0 || (int32_t)(records[i].seq - last_seq) > 0) {
+            last_seq = records[i].seq;
+            *us      = records[i].step_us[step];
+            ret      = 0;
+        }
+    }
+
+    munmap((void *)map, HISTORY_FILE_SIZE);
+    return ret;
+}
+
+int history_disk_written_bytes(uint64_t *bytes)
+{
+    char path[PATH_MAX];
+    unsigned long long sectors_written = 0;
+    const char *name                   = strrchr(DISK, '/');
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/stat", name ? name + 1 : DISK);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    // Fields: read I/Os, read merges, read sectors, read ticks, write I/Os,
+    // write merges, write sectors, ... (sectors are always 512 bytes here)
+    int n = fscanf(fp, "%*u %*u %*u %*u %*u %*u %llu", &sectors_written);
+    fclose(fp);
+
+    if (n != 1) return -1;
+
+    *bytes = (uint64_t)sectors_written * 512u;
+    return 0;
+}
+
+/* Statistics */
+
+static int history_compare_seq(const void *a, const void *b)
+{
+    const struct history_record *ra = a;
+    const struct history_record *rb = b;
+
+    return ((int32_t)(ra->seq - rb->seq) > 0) - ((int32_t)(ra->seq - rb->seq) < 0);
+}
+
+static int history_compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/* Percentile of a sorted array, nearest-rank method */
+static double history_percentile(const double *sorted, size_t count, double pct)
+{
+    if (count == 0) return 0.0;
+
+    size_t rank = (size_t)ceil(pct / 100.0 * (double)count);
+    if (rank == 0) rank = 1;
+    if (rank > count) rank = count;
+
+    return sorted[rank - 1];
+}
+
+/* Least-squares slope of values over their index */
+static double history_slope(const double *values, size_t count)
+{
+    double sum_x = 0.0, sum_y = 0.0, sum_xy = 0.0, sum_xx = 0.0;
+
+    if (count < 2) return 0.0;
+
+    for (size_t i = 0; i < count; i++) {
+        sum_x += (double)i;
+        sum_y += values[i];
+        sum_xy += (double)i * values[i];
+        sum_xx += (double)i * (double)i;
+    }
+
+    double denom = (double)count * sum_xx - sum_x * sum_x;
+    if (denom == 0.0) return 0.0;
+
+    return ((double)count * sum_xy - sum_x * sum_y) / denom;
+}
+
+struct history_summary {
+    double p50;
+    double p95;
+    double p99;
+    double max;
+    double trend; // Change per 100 boots
+    double mad;   // Median absolute deviation
+};
+
+static void history_summarize(const double *values,
+                              size_t count,
+                              double *scratch,
+                              struct history_summary *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    if (count == 0) return;
+
+    memcpy(scratch, values, count * sizeof(double));
+    qsort(scratch, count, sizeof(double), history_compare_double);
+
+    sum->p50   = history_percentile(scratch, count, 50.0);
+    sum->p95   = history_percentile(scratch, count, 95.0);
+    sum->p99   = history_percentile(scratch, count, 99.0);
+    sum->max   = scratch[count - 1];
+    sum->trend = history_slope(values, count) * 100.0;
+
+    for (size_t i = 0; i < count; i++) {
+        scratch[i] = fabs(values[i] - sum->p50);
+    }
+    qsort(scratch, count, sizeof(double), history_compare_double);
+    sum->mad = history_percentile(scratch, count, 50.0);
+}
+
+static void history_print_row(const char *name, const struct history_summary *sum)
+{
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f %+12.1f\n",
+           name,
+           sum->p50,
+           sum->p95,
+           sum->p99,
+           sum->max,
+           sum->trend);
+}
+
+static void history_print_usage(void)
+{
+    printf("Usage: userfs stats [-n COUNT]\n");
+    printf("Print boot timing statistics from the userfs boot history\n\n");
+    printf("  -n COUNT  Number of most recent boots to consider (default: %u)\n",
+           HISTORY_DEFAULT_COUNT);
+}
+
+int history_cmd_stats(int argc, char *argv[])
+{
+    int ret      = -1;
+    int fd       = -1;
+    int opt      = 0;
+    size_t limit = HISTORY_DEFAULT_COUNT;
+    char path[PATH_MAX];
+    const uint8_t *map             = NULL;
+    struct history_record *records = NULL;
+    double *values                 = NULL;
+    double *scratch                = NULL;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            history_print_usage();
+            return 0;
+        default:
+            history_print_usage();
+            return -1;
+        }
+    }
+
+    if (limit == 0 || limit > HISTORY_CAPACITY) limit = HISTORY_CAPACITY;
+
+    history_build_path(path, sizeof(path));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    map = history_map(fd);
+    if (!map) {
+        LOG_ERR("Invalid history file %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    records = calloc(HISTORY_CAPACITY, sizeof(*records));
+    values  = calloc(HISTORY_CAPACITY, sizeof(*values));
+    scratch = calloc(HISTORY_CAPACITY, sizeof(*scratch));
+    if (!records || !values || !scratch) {
+        LOG_ERR("Out of memory\n");
+        goto exit;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < HISTORY_CAPACITY; i++) {
+        const struct history_record *rec = &history_records(map)[i];
+        if (history_record_valid(rec)) records[count++] = *rec;
+    }
+
+    qsort(records, count, sizeof(*records), history_compare_seq);
+
+    // Only keep the most recent records
+    struct history_record *recent = &records[count > limit ? count - limit : 0];
+    size_t n                      = count > limit ? limit : count;
+
+    if (n == 0) {
+        printf("No boot recorded yet in %s\n", path);
+        ret = 0;
+        goto exit;
+    }
+
+    size_t failures = 0, first_boots = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (recent[i].exit_code != 0) failures++;
+        if (recent[i].flags & HISTORY_FLAG_FIRST_BOOT) first_boots++;
+    }
+
+    printf("Boot history: %zu boots (seq %u..%u), %zu failed, %zu first boot(s)\n\n",
+           n,
+           recent[0].seq,
+           recent[n - 1].seq,
+           failures,
+           first_boots);
+    printf("%-12s %10s %10s %10s %10s %12s\n",
+           "(ms)",
+           "p50",
+           "p95",
+           "p99",
+           "max",
+           "trend/100");
+
+    struct history_summary sum;
+    for (size_t i = 0; i < n; i++) values[i] = recent[i].total_us / 1000.0;
+    history_summarize(values, n, scratch, &sum);
+    history_print_row("total", &sum);
+
+    // Outliers are detected on the total duration, with a robust z-score
+    double total_p50 = sum.p50;
+    double total_mad = sum.mad;
+
+    for (size_t step = 0; step < REPORT_STEP_COUNT; step++) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            // Steps which did not run are not part of the distribution
+            // (nor deferred ones whose worker did not complete)
+            if ((recent[i].step_action[step] == REPORT_ACTION_NONE ||
+                 recent[i].step_action[step] == REPORT_ACTION_DEFERRED) &&
+                recent[i].step_us[step] == 0) {
+                continue;
+            }
+            values[m++] = recent[i].step_us[step] / 1000.0;
+        }
+        if (m == 0) continue;
+
+        history_summarize(values, m, scratch, &sum);
+        history_print_row(report_step_name(step), &sum);
+    }
+
+    for (size_t i = 0; i < n; i++) values[i] = recent[i].run_written_bytes / 1024.0;
+    history_summarize(values, n, scratch, &sum);
+    printf("\n(KiB)\n");
+    history_print_row("written", &sum);
+
+    printf("\nOutliers (total > p50 + 3 * 1.4826 * MAD):\n");
+    size_t outliers = 0;
+    double limit_ms = total_p50 + 3.0 * 1.4826 * total_mad;
+    for (size_t i = 0; total_mad > 0.0 && i < n; i++) {
+        double total_ms = recent[i].total_us / 1000.0;
+        if (total_ms <= limit_ms) continue;
+
+        char date[32];
+        time_t ts = (time_t)recent[i].timestamp;
+        struct tm tm;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", gmtime_r(&ts, &tm));
+
+        printf("  seq %u at %s UTC: %.1f ms (exit code %d)\n",
+               recent[i].seq,
+               date,
+               total_ms,
+               recent[i].exit_code);
+        outliers++;
+    }
+    if (outliers == 0) printf("  none\n");
+
+    ret = 0;
+
+exit:
+    free(scratch);
+    free(values);
+    free(records);
+    if (map) munmap((void *)map, HISTORY_FILE_SIZE);
+    if (fd >= 0) close(fd);
+    return ret;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "iocg.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+struct iocg_status {
+    const struct iocg_slice *slice;
+    bool ok;
+};
+
+static struct iocg_status iocg_status[IOCG_MAX_SLICES];
+static size_t iocg_status_count;
+
+static int iocg_write(const char *dir, const char *file, const char *value)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t len = (ssize_t)strlen(value);
+    ssize_t ret = write(fd, value, (size_t)len);
+    close(fd);
+
+    return ret == len ? 0 : -1;
+}
+
+/* Create the cgroup and enable the io controller down to it */
+static int iocg_create(const char *name, char *path, size_t size)
+{
+    char parent[PATH_MAX];
+    const char *p = name;
+
+    snprintf(parent, sizeof(parent), "%s", IOCG_ROOT);
+
+    for (;;) {
+        if (iocg_write(parent, "cgroup.subtree_control", "+io") != 0) {
+            LOG_ERR("Failed to enable the io controller in %s: %s\n",
+                    parent,
+                    strerror(errno));
+            return -1;
+        }
+
+        const char *end = strchr(p, '/');
+        size_t len      = end ? (size_t)(end - p) : strlen(p);
+
+        int n = snprintf(path, size, "%s/%.*s", parent, (int)len, p);
+        if (n < 0 || (size_t)n >= size) {
+            LOG_ERR("cgroup path too long: %s/%s\n", parent, p);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            LOG_ERR("Failed to create cgroup %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+
+        if (!end) break;
+
+        snprintf(parent, sizeof(parent), "%s", path);
+        p = end + 1;
+    }
+
+    return 0;
+}
+
+static void iocg_format_limit(char *buf, size_t size, uint64_t value)
+{
+    if (value == 0) {
+        snprintf(buf, size, "max");
+    } else {
+        snprintf(buf, size, "%llu", (unsigned long long)value);
+    }
+}
+
+static int iocg_configure(const struct iocg_slice *slice,
+                          unsigned int major,
+                          unsigned int minor)
+{
+    int ret = 0;
+    char path[PATH_MAX];
+    char value[256];
+
+    if (iocg_create(slice->name, path, sizeof(path)) != 0) return -1;
+
+    if (slice->weight) {
+        snprintf(value, sizeof(value), "%u:%u %u", major, minor, slice->weight);
+        if (iocg_write(path, "io.weight", value) != 0) {
+            LOG_WRN("Failed to set io.weight of %s: %s\n", slice->name, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    if (slice->latency_us) {
+        snprintf(value,
+                 sizeof(value),
+                 "%u:%u target=%u",
+                 major,
+                 minor,
+                 slice->latency_us);
+        if (iocg_write(path, "io.latency", value) != 0) {
+            LOG_WRN("Failed to set io.latency of %s: %s\n", slice->name, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    if (slice->rbps || slice->wbps || slice->riops || slice->wiops) {
+        char rbps[24], wbps[24], riops[24], wiops[24];
+
+        iocg_format_limit(rbps, sizeof(rbps), slice->rbps);
+        iocg_format_limit(wbps, sizeof(wbps), slice->wbps);
+        iocg_format_limit(riops, sizeof(riops), slice->riops);
+        iocg_format_limit(wiops, sizeof(wiops), slice->wiops);
+
+        snprintf(value,
+                 sizeof(value),
+                 "%u:%u rbps=%s wbps=%s riops=%s wiops=%s",
+                 major,
+                 minor,
+                 rbps,
+                 wbps,
+                 riops,
+                 wiops);
+        if (iocg_write(path, "io.max", value) != 0) {
+            LOG_WRN("Failed to set io.max of %s: %s\n", slice->name, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int iocg_apply(const struct iocg_slice *slices, size_t count)
+{
+    int ret = 0;
+    struct stat st;
+
+    if (stat(DISK, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        LOG_ERR("Failed to get device number of %s: %s\n", DISK, strerror(errno));
+        return -1;
+    }
+
+    unsigned int major = major(st.st_rdev);
+    unsigned int minor = minor(st.st_rdev);
+
+    iocg_status_count = 0;
+
+    for (size_t i = 0; i < count && i < IOCG_MAX_SLICES; i++) {
+        bool ok = iocg_configure(&slices[i], major, minor) == 0;
+
+        LOG_INF("I/O slice %s on %u:%u: weight %u, latency %u us, wbps %llu%s\n",
+                slices[i].name,
+                major,
+                minor,
+                slices[i].weight,
+                slices[i].latency_us,
+                (unsigned long long)slices[i].wbps,
+                ok ? "" : " (incomplete)");
+
+        iocg_status[iocg_status_count].slice = &slices[i];
+        iocg_status[iocg_status_count].ok    = ok;
+        iocg_status_count++;
+
+        if (!ok) ret = -1;
+    }
+
+    return ret;
+}
+
+void iocg_write_json(FILE *fp)
+{
+    fprintf(fp, "[");
+    for (size_t i = 0; i < iocg_status_count; i++) {
+        const struct iocg_slice *slice = iocg_status[i].slice;
+
+        fprintf(fp,
+                "%s\n    {\"slice\": \"%s\", \"weight\": %u, \"latency_us\": %u, "
+                "\"rbps\": %llu, \"wbps\": %llu, \"riops\": %u, \"wiops\": %u, "
+                "\"applied\": %s}",
+                i == 0 ? "" : ",",
+                slice->name,
+                slice->weight,
+                slice->latency_us,
+                (unsigned long long)slice->rbps,
+                (unsigned long long)slice->wbps,
+                slice->riops,
+                slice->wiops,
+                iocg_status[i].ok ? "true" : "false");
+    }
+    fprintf(fp, "%s]", iocg_status_count == 0 ? "" : "\n  ");
+}
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "kiosk.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <linux/limits.h>
+#include <linux/magic.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define KIOSK_TMPFS_OPTIONS "mode=0755,size=" KIOSK_TMPFS_SIZE
+#define KIOSK_BOOT_ID_XATTR "user.userfs.boot_id"
+#define KIOSK_MAX_SV        8u
+#define KIOSK_COPY_BUF_SIZE (64u * 1024u)
+
+int kiosk_mount_tmpfs(void)
+{
+    if (create_directories(KIOSK_ROOT) != 0) {
+        LOG_ERR("Failed to create %s: %s\n", KIOSK_ROOT, strerror(errno));
+        return -1;
+    }
+
+    LOG_INF("Kiosk mode, mounting tmpfs on %s with options: %s\n",
+            KIOSK_ROOT,
+            KIOSK_TMPFS_OPTIONS);
+
+    int ret = do_mount(
+        "tmpfs", KIOSK_ROOT, "tmpfs", MS_NOSUID | MS_NODEV, KIOSK_TMPFS_OPTIONS);
+    if (ret != 0) {
+        LOG_ERR("Failed to mount tmpfs on %s: %s\n", KIOSK_ROOT, strerror(errno));
+        return -1;
+    }
+
+    report_add_mount("tmpfs", KIOSK_ROOT, "tmpfs", KIOSK_TMPFS_OPTIONS);
+
+    return 0;
+}
+
+static bool kiosk_is_active(void)
+{
+    struct statvfs vfs;
+    struct statfs sfs;
+
+    return statvfs(USERFS_MOUNT_POINT, &vfs) == 0 && (vfs.f_flag & ST_RDONLY) &&
+           statfs(KIOSK_ROOT, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC;
+}
+
+static int kiosk_read_boot_id(char *buf, size_t size)
+{
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp) return -1;
+
+    char *line = fgets(buf, (int)size, fp);
+    fclose(fp);
+    if (!line) return -1;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Overlay holding an absolute path, and the path relative to its mount point */
+static const struct overlayfs_mount_point *kiosk_find_mount_point(const char *path,
+                                                                  const char **rel)
+{
+    const struct overlayfs_mount_point *mp;
+    const struct overlayfs_mount_point *found = NULL;
+    size_t found_len                          = 0;
+
+    for (size_t i = 0; (mp = overlayfs_get_mount_point(i)) != NULL; i++) {
+        size_t len = strlen(mp->mount_point);
+
+        if (strncmp(path, mp->mount_point, len) != 0) continue;
+        if (path[len] != '/' || path[len + 1] == '\0') continue;
+
+        if (len > found_len) {
+            found     = mp;
+            found_len = len;
+        }
+    }
+
+    if (found) *rel = path + found_len;
+    return found;
+}
+
+static void kiosk_copy_attrs(const char *dst, const struct stat *st)
+{
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+
+    if (lchown(dst, st->st_uid, st->st_gid) != 0) {
+        LOG_WRN("Failed to set the owner of %s: %s\n", dst, strerror(errno));
+    }
+    if (!S_ISLNK(st->st_mode) && chmod(dst, st->st_mode & 07777) != 0) {
+        LOG_WRN("Failed to set the mode of %s: %s\n", dst, strerror(errno));
+    }
+    utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int kiosk_copy_file(const char *src, const char *dst, mode_t mode)
+{
+    static char buf[KIOSK_COPY_BUF_SIZE];
+    int ret = -1;
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            goto exit;
+        }
+        if (n == 0) break;
+
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out, buf + off, (size_t)(n - off));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                goto exit;
+            }
+            off += w;
+        }
+    }
+
+    ret = 0;
+
+exit:
+    close(out);
+    close(in);
+    return ret;
+}
+
+/* Copy a path of the merged view (recursively) with its attributes */
+static int kiosk_copy(const char *src, const char *dst)
+{
+    struct stat st;
+
+    if (lstat(src, &st) != 0) return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdir(dst, 0700) != 0 && errno != EEXIST) return -1;
+
+        DIR *dir = opendir(src);
+        if (!dir) return -1;
+
+        int ret = 0;
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            char src_child[PATH_MAX];
+            char dst_child[PATH_MAX];
+
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+            snprintf(src_child, sizeof(src_child), "%s/%s", src, de->d_name);
+            snprintf(dst_child, sizeof(dst_child), "%s/%s", dst, de->d_name);
+
+            if (kiosk_copy(src_child, dst_child) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        closedir(dir);
+        if (ret != 0) return -1;
+    } else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len < 0) return -1;
+        target[len] = '\0';
+
+        if (symlink(target, dst) != 0) return -1;
+    } else if (S_ISREG(st.st_mode)) {
+        if (kiosk_copy_file(src, dst, st.st_mode) != 0) return -1;
+    } else {
+        if (mknod(dst, st.st_mode, st.st_rdev) != 0) return -1;
+    }
+
+    kiosk_copy_attrs(dst, &st);
+    return 0;
+}
+
+/*
+ * Create the missing parents of rel in the upper directory, with the
+ * attributes of the merged view (they hide the lower directories otherwise).
+ */
+static int kiosk_create_parents(const char *mount_point,
+                                const char *upper,
+                                const char *rel)
+{
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    struct stat st;
+
+    for (const char *p = strchr(rel + 1, '/'); p; p = strchr(p + 1, '/')) {
+        int len = (int)(p - rel);
+
+        int src_len = snprintf(src, sizeof(src), "%s%.*s", mount_point, len, rel);
+        int dst_len = snprintf(dst, sizeof(dst), "%s%.*s", upper, len, rel);
+        if (src_len < 0 || (size_t)src_len >= sizeof(src) || dst_len < 0 ||
+            (size_t)dst_len >= sizeof(dst)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        if (lstat(dst, &st) == 0) continue;
+        if (lstat(src, &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+        if (mkdir(dst, 0700) != 0) return -1;
+
+        kiosk_copy_attrs(dst, &st);
+    }
+
+    return 0;
+}
+
+static int kiosk_commit_path(const char *path,
+                             const struct overlayfs_mount_point *mp,
+                             const char *rel)
+{
+    char upper[PATH_MAX];
+    char dst[PATH_MAX];
+    struct stat st;
+
+    snprintf(upper,
+             sizeof(upper),
+             "%s/%s/%s.next/%s",
+             USERFS_MOUNT_POINT,
+             KIOSK_DIR_NAME,
+             btrfs_get_volume(mp->btrfs_sv_index),
+             mp->upper_name);
+
+    // A truncated path would remove another tree below
+    int len = snprintf(dst, sizeof(dst), "%s%s", upper, rel);
+    if (len < 0 || (size_t)len >= sizeof(dst)) {
+        LOG_ERR("Path too long: %s%s\n", upper, rel);
+        return -1;
+    }
+
+    if (create_directories(upper) != 0 ||
+        kiosk_create_parents(mp->mount_point, upper, rel) != 0) {
+        LOG_ERR("Failed to create the parents of %s: %s\n", dst, strerror(errno));
+        return -1;
+    }
+
+    if (remove_tree_at(AT_FDCWD, dst) != 0) {
+        LOG_ERR("Failed to remove %s: %s\n", dst, strerror(errno));
+        return -1;
+    }
+
+    // Deleted since boot: hide it from the lower layers with a whiteout
+    if (lstat(path, &st) != 0 && errno == ENOENT) {
+        if (mknod(dst, S_IFCHR | 0000, makedev(0, 0)) != 0) {
+            LOG_ERR("Failed to create whiteout %s: %s\n", dst, strerror(errno));
+            return -1;
+        }
+        printf("%s: deleted\n", path);
+        return 0;
+    }
+
+    if (kiosk_copy(path, dst) != 0) {
+        LOG_ERR("Failed to copy %s to %s: %s\n", path, dst, strerror(errno));
+        return -1;
+    }
+
+    printf("%s: committed\n", path);
+    return 0;
+}
+
+/*
+ * Replace the subvolume with its ".next" snapshot. The subvolume the overlays
+ * were mounted with (first commit of the boot) is kept as ".prev".
+ */
+static int kiosk_swap(int root_fd, int kiosk_fd, const char *sv_name, const char *boot_id)
+{
+    char next[NAME_MAX + 1];
+    char prev[NAME_MAX + 1];
+    char prev_boot_id[40] = "";
+
+    snprintf(next, sizeof(next), "%s.next", sv_name);
+    snprintf(prev, sizeof(prev), "%s.prev", sv_name);
+
+    int prev_fd = openat(kiosk_fd, prev, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (prev_fd >= 0) {
+        ssize_t len = fgetxattr(prev_fd,
+                                KIOSK_BOOT_ID_XATTR,
+                                prev_boot_id,
+                                sizeof(prev_boot_id) - 1);
+        prev_boot_id[len > 0 ? len : 0] = '\0';
+        close(prev_fd);
+    }
+
+    if (strcmp(prev_boot_id, boot_id) == 0) {
+        // Committed earlier in this boot, not used by the overlays
+        if (btrfs_delete_subvolume(root_fd, sv_name) != 0) {
+            LOG_ERR("Failed to delete %s: %s\n", sv_name, strerror(errno));
+            return -1;
+        }
+    } else {
+        if (btrfs_delete_subvolume(kiosk_fd, prev) != 0 && errno != ENOENT) {
+            LOG_ERR("Failed to delete %s: %s\n", prev, strerror(errno));
+            return -1;
+        }
+
+        if (renameat(root_fd, sv_name, kiosk_fd, prev) != 0) {
+            LOG_ERR("Failed to move %s away: %s\n", sv_name, strerror(errno));
+            return -1;
+        }
+
+        prev_fd = openat(kiosk_fd, prev, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (prev_fd < 0 ||
+            fsetxattr(prev_fd, KIOSK_BOOT_ID_XATTR, boot_id, strlen(boot_id), 0) != 0) {
+            LOG_WRN("Failed to tag %s with the boot id: %s\n", prev, strerror(errno));
+        }
+        if (prev_fd >= 0) close(prev_fd);
+    }
+
+    if (renameat(kiosk_fd, next, root_fd, sv_name) != 0) {
+        LOG_ERR("Failed to move %s in place: %s\n", next, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void kiosk_print_usage(void)
+{
+    printf("Usage: userfs commit PATH...\n");
+    printf("Persist paths changed in kiosk mode (userfs -k) for the next boots\n\n");
+    printf("PATH are absolute paths below the overlays (e.g. /etc/hostname),\n");
+    printf("deleted paths are persisted as deleted.\n");
+}
+
+int kiosk_cmd_commit(int argc, char *argv[])
+{
+    int opt;
+    int ret      = -1;
+    int root_fd  = -1;
+    int kiosk_fd = -1;
+    bool used[KIOSK_MAX_SV];
+    char boot_id[40];
+    const char *rel;
+    const struct overlayfs_mount_point *mp;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "h")) != -1) {
+        switch (opt) {
+        case 'h':
+            kiosk_print_usage();
+            return 0;
+        default:
+            kiosk_print_usage();
+            return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        kiosk_print_usage();
+        return -1;
+    }
+
+    if (!kiosk_is_active()) {
+        LOG_ERR("Not in kiosk mode, changes are already persisted\n");
+        return -1;
+    }
+
+    memset(used, 0, sizeof(used));
+    for (int i = optind; i < argc; i++) {
+        if (argv[i][0] != '/' || strstr(argv[i], "/../") ||
+            !kiosk_find_mount_point(argv[i], &rel)) {
+            LOG_ERR("%s is not an absolute path below an overlay\n", argv[i]);
+            return -1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        mp = kiosk_find_mount_point(argv[i], &rel);
+        if (mp->btrfs_sv_index < KIOSK_MAX_SV) used[mp->btrfs_sv_index] = true;
+    }
+
+    if (kiosk_read_boot_id(boot_id, sizeof(boot_id)) != 0) {
+        LOG_ERR("Failed to read the boot id: %s\n", strerror(errno));
+        return -1;
+    }
+
+    root_fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        return -1;
+    }
+
+    // Only written to for the duration of the commit
+    if (do_mount(NULL, USERFS_MOUNT_POINT, NULL, MS_REMOUNT, NULL) != 0) {
+        LOG_ERR("Failed to remount %s read-write: %s\n",
+                USERFS_MOUNT_POINT,
+                strerror(errno));
+        close(root_fd);
+        return -1;
+    }
+
+    if (mkdirat(root_fd, KIOSK_DIR_NAME, 0700) != 0 && errno != EEXIST) {
+        LOG_ERR("Failed to create %s: %s\n", KIOSK_DIR_NAME, strerror(errno));
+        goto exit;
+    }
+
+    kiosk_fd = openat(root_fd, KIOSK_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (kiosk_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", KIOSK_DIR_NAME, strerror(errno));
+        goto exit;
+    }
+
+    for (size_t sv = 0; sv < KIOSK_MAX_SV; sv++) {
+        const char *sv_name = btrfs_get_volume(sv);
+        char next[NAME_MAX + 1];
+
+        if (!used[sv]) continue;
+
+        snprintf(next, sizeof(next), "%s.next", sv_name);
+
+        // Left over by an interrupted commit
+        if (btrfs_delete_subvolume(kiosk_fd, next) != 0 && errno != ENOENT) {
+            LOG_ERR("Failed to delete %s: %s\n", next, strerror(errno));
+            goto exit;
+        }
+
+        int sv_fd = openat(root_fd, sv_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sv_fd < 0 || btrfs_snapshot(sv_fd, kiosk_fd, next, false) != 0) {
+            LOG_ERR("Failed to snapshot %s: %s\n", sv_name, strerror(errno));
+            if (sv_fd >= 0) close(sv_fd);
+            goto exit;
+        }
+        close(sv_fd);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        mp = kiosk_find_mount_point(argv[i], &rel);
+        if (kiosk_commit_path(argv[i], mp, rel) != 0) goto exit;
+    }
+
+    for (size_t sv = 0; sv < KIOSK_MAX_SV; sv++) {
+        if (!used[sv]) continue;
+        if (kiosk_swap(root_fd, kiosk_fd, btrfs_get_volume(sv), boot_id) != 0) goto exit;
+    }
+
+    if (syncfs(root_fd) != 0) {
+        LOG_ERR("Failed to sync %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    if (kiosk_fd >= 0) close(kiosk_fd);
+    close(root_fd);
+
+    if (do_mount(NULL, USERFS_MOUNT_POINT, NULL, MS_REMOUNT | MS_RDONLY, NULL) != 0) {
+        LOG_ERR("Failed to remount %s read-only: %s\n",
+                USERFS_MOUNT_POINT,
+                strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "layout.h"
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LAYOUT_RECORD_MAGIC 0x4c594655u // "UFYL"
+#define LAYOUT_SLOT_COUNT   2u
+
+enum layout_op_type {
+    LAYOUT_OP_RENAME = 0, // Rename src to dst
+    LAYOUT_OP_SNAPSHOT,   // Writable snapshot of the subvolume src as dst
+    LAYOUT_OP_PRUNE,      // Remove the entries of src not in keep
+    LAYOUT_OP_REMOVE,     // Remove src (recursively)
+};
+
+/* Paths are relative to USERFS_MOUNT_POINT */
+struct layout_op {
+    enum layout_op_type type;
+    const char *src;
+    const char *dst;
+    const char *const *keep; // NULL terminated
+};
+
+struct layout_migration {
+    const char *name;
+    const struct layout_op *ops;
+    size_t op_count;
+    const char *const *sources; // Migrated paths, nothing to do if none exists
+};
+
+/*
+ * Layout record, two slots written alternately and synced: the migration
+ * checkpoint must survive a power cut.
+ */
+struct layout_record {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t version; // Layout version of the filesystem
+    uint32_t target;  // Version being migrated to, 0 if none
+    uint32_t step;    // Next operation of the migration to target
+    uint32_t crc;
+};
+
+static const char *const layout_v1_config_keep[] = {"etc", ".work.etc", NULL};
+static const char *const layout_v1_data_keep[]   = {
+    "var", ".work.var", "home", ".work.home", "opt", ".work.opt", NULL};
+
+/* Split the converted ext4 root (see convert.h) into vol-config and vol-data */
+static const struct layout_op layout_v1_ops[] = {
+    {.type = LAYOUT_OP_SNAPSHOT, .src = ".", .dst = "vol-config"},
+    {.type = LAYOUT_OP_PRUNE, .src = "vol-config", .keep = layout_v1_config_keep},
+    {.type = LAYOUT_OP_SNAPSHOT, .src = ".", .dst = "vol-data"},
+    {.type = LAYOUT_OP_PRUNE, .src = "vol-data", .keep = layout_v1_data_keep},
+    {.type = LAYOUT_OP_REMOVE, .src = "etc"},
+    {.type = LAYOUT_OP_REMOVE, .src = ".work.etc"},
+    {.type = LAYOUT_OP_REMOVE, .src = "var"},
+    {.type = LAYOUT_OP_REMOVE, .src = ".work.var"},
+    {.type = LAYOUT_OP_REMOVE, .src = "home"},
+    {.type = LAYOUT_OP_REMOVE, .src = ".work.home"},
+    {.type = LAYOUT_OP_REMOVE, .src = "opt"},
+    {.type = LAYOUT_OP_REMOVE, .src = ".work.opt"},
+};
+
+/*
+ * Not conditioned on USERFS_OVERLAY_OPT: a build without it still records
+ * version 2, the /opt directories must be in vol-opt when a later build
+ * mounts the /opt overlay.
+ */
+static const char *const layout_v2_opt_keep[] = {"opt", ".work.opt", NULL};
+static const char *const layout_v2_sources[]  = {
+    "vol-data/opt", "vol-data/.work.opt", NULL};
+
+/* Split vol-data: snapshot it, keep only /opt in the snapshot, drop it from vol-data */
+static const struct layout_op layout_v2_ops[] = {
+    {.type = LAYOUT_OP_SNAPSHOT, .src = "vol-data", .dst = "vol-opt"},
+    {.type = LAYOUT_OP_PRUNE, .src = "vol-opt", .keep = layout_v2_opt_keep},
+    {.type = LAYOUT_OP_REMOVE, .src = "vol-data/opt"},
+    {.type = LAYOUT_OP_REMOVE, .src = "vol-data/.work.opt"},
+};
+
+/* Migration from version i to i + 1 */
+static const struct layout_migration layout_migrations[LAYOUT_VERSION] = {
+    {
+        .name     = "ext4 conversion",
+        .ops      = layout_v1_ops,
+        .op_count = ARRAY_SIZE(layout_v1_ops),
+    },
+    {
+        .name     = "opt subvolume",
+        .ops      = layout_v2_ops,
+        .op_count = ARRAY_SIZE(layout_v2_ops),
+        .sources  = layout_v2_sources,
+    },
+};
+
+static unsigned int layout_version;
+
+unsigned int layout_get_version(void)
+{
+    return layout_version;
+}
+
+static uint32_t layout_record_crc(const struct layout_record *rec)
+{
+    return crc32c(0, rec, offsetof(struct layout_record, crc));
+}
+
+/* Load the most recent valid record, return its slot or -1 if there is none */
+static int layout_load_record(int fd, struct layout_record *rec)
+{
+    int slot = -1;
+
+    for (uint32_t i = 0; i < LAYOUT_SLOT_COUNT; i++) {
+        struct layout_record r;
+
+        off_t offset = (off_t)(i * sizeof(r));
+
+        if (pread(fd, &r, sizeof(r), offset) != (ssize_t)sizeof(r)) continue;
+        if (r.magic != LAYOUT_RECORD_MAGIC || r.crc != layout_record_crc(&r)) continue;
+
+        if (slot < 0 || (int32_t)(r.seq - rec->seq) > 0) {
+            *rec = r;
+            slot = (int)i;
+        }
+    }
+
+    return slot;
+}
+
+static int layout_save_record(int fd, struct layout_record *rec, int *slot)
+{
+    rec->magic = LAYOUT_RECORD_MAGIC;
+    rec->seq   = *slot < 0 ? 0 : rec->seq + 1;
+    rec->crc   = layout_record_crc(rec);
+
+    // Overwrite the oldest slot
+    int next     = (int)((uint32_t)(*slot + 1) % LAYOUT_SLOT_COUNT);
+    off_t offset = (off_t)((uint32_t)next * sizeof(*rec));
+
+    if (pwrite(fd, rec, sizeof(*rec), offset) != (ssize_t)sizeof(*rec) ||
+        fdatasync(fd) != 0) {
+        LOG_ERR("Failed to write the layout record: %s\n", strerror(errno));
+        return -1;
+    }
+
+    *slot = next;
+    return 0;
+}
+
+static bool layout_exists(int root_fd, const char *path)
+{
+    struct stat st;
+
+    return fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/* Whether a migration has something to move, checked before it starts */
+static bool layout_has_sources(int root_fd, const struct layout_migration *m)
+{
+    if (!m->sources) return true;
+
+    for (const char *const *src = m->sources; *src; src++) {
+        if (layout_exists(root_fd, *src)) return true;
+    }
+    return false;
+}
+
+static bool layout_keep(const char *const *keep, const char *name)
+{
+    for (; keep && *keep; keep++) {
+        if (strcmp(*keep, name) == 0) return true;
+    }
+    return false;
+}
+
+static int layout_prune(int root_fd, const char *path, const char *const *keep)
+{
+    int fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (layout_keep(keep, de->d_name)) continue;
+
+        if (remove_tree_at(dirfd(dir), de->d_name) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+/* Run an operation, skip it if already done (interrupted migration) */
+static int layout_run_op(int root_fd, const struct layout_op *op)
+{
+    switch (op->type) {
+    case LAYOUT_OP_RENAME:
+        if (!layout_exists(root_fd, op->src) && layout_exists(root_fd, op->dst)) return 0;
+        return renameat(root_fd, op->src, root_fd, op->dst);
+    case LAYOUT_OP_SNAPSHOT: {
+        if (layout_exists(root_fd, op->dst)) return 0;
+
+        int src_fd = openat(root_fd, op->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (src_fd < 0) return -1;
+
+        int ret = btrfs_snapshot(src_fd, root_fd, op->dst, false);
+        close(src_fd);
+        return ret;
+    }
+    case LAYOUT_OP_PRUNE:
+        return layout_prune(root_fd, op->src, op->keep);
+    case LAYOUT_OP_REMOVE:
+        return remove_tree_at(root_fd, op->src);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+bool layout_is_current(void)
+{
+    char path[PATH_MAX];
+    struct layout_record rec;
+
+    snprintf(path, sizeof(path), "%s/%s", USERFS_MOUNT_POINT, LAYOUT_FILE_NAME);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    memset(&rec, 0, sizeof(rec));
+    int slot = layout_load_record(fd, &rec);
+    close(fd);
+
+    if (slot < 0 || rec.target != 0) return false;
+
+    layout_version = rec.version;
+    return rec.version >= LAYOUT_VERSION;
+}
+
+int layout_migrate(bool formatted)
+{
+    int ret = -1;
+    char path[PATH_MAX];
+    struct layout_record rec;
+
+    int root_fd = open(USERFS_MOUNT_POINT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", USERFS_MOUNT_POINT, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", USERFS_MOUNT_POINT, LAYOUT_FILE_NAME);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        close(root_fd);
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    int slot = formatted ? -1 : layout_load_record(fd, &rec);
+
+    if (slot < 0) {
+        // Unversioned filesystems predate the layout record, or were converted
+        // from ext4 (the rollback image is only removed after the migration)
+        memset(&rec, 0, sizeof(rec));
+        if (formatted) {
+            rec.version = LAYOUT_VERSION;
+        } else {
+            rec.version = layout_exists(root_fd, CONVERT_SAVED_SUBVOL) ? 0u : 1u;
+        }
+        if (layout_save_record(fd, &rec, &slot) != 0) goto exit;
+    }
+
+    if (rec.version > LAYOUT_VERSION) {
+        LOG_WRN("Layout version %u is newer than the supported version %u\n",
+                rec.version,
+                LAYOUT_VERSION);
+        layout_version = rec.version;
+        ret            = 0;
+        goto exit;
+    }
+
+    while (rec.version < LAYOUT_VERSION) {
+        const struct layout_migration *m = &layout_migrations[rec.version];
+
+        if (rec.target != rec.version + 1u) {
+            // e.g. no /opt directories: nothing to split from vol-data
+            if (!layout_has_sources(root_fd, m)) {
+                rec.version++;
+                if (layout_save_record(fd, &rec, &slot) != 0) goto exit;
+                LOG_INF("Layout migrated to version %u (%s: nothing to move)\n",
+                        rec.version,
+                        m->name);
+                continue;
+            }
+
+            rec.target = rec.version + 1u;
+            rec.step   = 0;
+            if (layout_save_record(fd, &rec, &slot) != 0) goto exit;
+        }
+
+        LOG_INF("Migrating layout %u to %u (%s), step %u/%zu\n",
+                rec.version,
+                rec.target,
+                m->name,
+                rec.step,
+                m->op_count);
+
+        while (rec.step < m->op_count) {
+            const struct layout_op *op = &m->ops[rec.step];
+
+            if (layout_run_op(root_fd, op) != 0) {
+                LOG_ERR("Layout migration to %u failed at step %u (%s): %s\n",
+                        rec.target,
+                        rec.step,
+                        op->src,
+                        strerror(errno));
+                goto exit;
+            }
+
+            rec.step++;
+            if (layout_save_record(fd, &rec, &slot) != 0) goto exit;
+        }
+
+        rec.version = rec.target;
+        rec.target  = 0;
+        rec.step    = 0;
+        if (layout_save_record(fd, &rec, &slot) != 0) goto exit;
+
+        LOG_INF("Layout migrated to version %u\n", rec.version);
+    }
+
+    layout_version = rec.version;
+    ret            = 0;
+
+exit:
+    close(fd);
+    close(root_fd);
+    return ret;
+}
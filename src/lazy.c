@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "lazy.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/auto_fs.h>
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define LAZY_MAX       4u
+#define LAZY_PROTO_VER 5
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE  0 // From the nice value
+#define IOPRIO_WHO_PROCESS 1
+
+struct lazy_mount {
+    const struct overlayfs_mount_point *mp;
+    char lowerdir[PATH_MAX];
+    int pipe_fd;  // Read end, autofs packets
+    int ioctl_fd; // Root of the autofs mount
+};
+
+static struct lazy_mount lazy_mounts[LAZY_MAX];
+
+bool lazy_is_enabled(const struct overlayfs_mount_point *mp)
+{
+    const char *list = USERFS_LAZY_OVERLAYS;
+    size_t len       = strlen(mp->mount_point);
+
+    if (!mp->deferrable) return false;
+
+    for (const char *p = list; (p = strstr(p, mp->mount_point)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Keep the lower directory reachable, then cover the mount point with autofs */
+static int lazy_setup(struct lazy_mount *lm)
+{
+    int fds[2];
+    char options[128];
+    unsigned long timeout = 0; // Never expire
+
+    snprintf(lm->lowerdir,
+             sizeof(lm->lowerdir),
+             "%s/%s",
+             LAZY_LOWER_ROOT,
+             lm->mp->upper_name);
+
+    if (create_directories(lm->lowerdir) != 0 ||
+        create_directory(lm->mp->mount_point) != 0) {
+        LOG_ERR("Failed to create %s: %s\n", lm->lowerdir, strerror(errno));
+        return -1;
+    }
+
+    // Bound by a previous run, see lazy_umount_stale()
+    while (do_umount2(lm->lowerdir, MNT_DETACH) == 0) continue;
+
+    if (do_mount(lm->mp->lowerdir, lm->lowerdir, NULL, MS_BIND, NULL) != 0) {
+        LOG_ERR("Failed to bind mount %s on %s: %s\n",
+                lm->mp->lowerdir,
+                lm->lowerdir,
+                strerror(errno));
+        return -1;
+    }
+
+    // Packet mode: one read per autofs packet
+    if (pipe2(fds, O_DIRECT | O_CLOEXEC) != 0) {
+        LOG_ERR("Failed to create the autofs pipe: %s\n", strerror(errno));
+        goto error;
+    }
+
+    snprintf(options,
+             sizeof(options),
+             "fd=%d,pgrp=%d,minproto=%d,maxproto=%d,direct",
+             fds[1],
+             (int)getpgrp(),
+             LAZY_PROTO_VER,
+             LAZY_PROTO_VER);
+
+    int ret = do_mount("userfs", lm->mp->mount_point, "autofs", 0, options);
+    close(fds[1]); // The kernel holds its own reference
+    if (ret != 0) {
+        LOG_ERR("Failed to mount autofs on %s: %s\n",
+                lm->mp->mount_point,
+                strerror(errno));
+        close(fds[0]);
+        goto error;
+    }
+
+    lm->pipe_fd  = fds[0];
+    lm->ioctl_fd = open(lm->mp->mount_point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lm->ioctl_fd < 0 || ioctl(lm->ioctl_fd, AUTOFS_IOC_SETTIMEOUT, &timeout) != 0) {
+        LOG_ERR("Failed to configure autofs on %s: %s\n",
+                lm->mp->mount_point,
+                strerror(errno));
+        if (lm->ioctl_fd >= 0) close(lm->ioctl_fd);
+        close(lm->pipe_fd);
+        do_umount2(lm->mp->mount_point, MNT_DETACH);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    do_umount2(lm->lowerdir, MNT_DETACH);
+    return -1;
+}
+
+static void lazy_teardown(struct lazy_mount *lm)
+{
+    close(lm->ioctl_fd);
+    close(lm->pipe_fd);
+    do_umount2(lm->mp->mount_point, MNT_DETACH);
+    do_umount2(lm->lowerdir, MNT_DETACH);
+}
+
+/* Serve the autofs mounts until all the overlays are mounted */
+static void lazy_serve(size_t count, bool kiosk)
+{
+    struct pollfd pfds[LAZY_MAX];
+    size_t left = count;
+
+    for (size_t i = 0; i < count; i++) {
+        pfds[i].fd     = lazy_mounts[i].pipe_fd;
+        pfds[i].events = POLLIN;
+    }
+
+    while (left > 0) {
+        if (poll(pfds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERR("autofs poll: %s\n", strerror(errno));
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            struct lazy_mount *lm = &lazy_mounts[i];
+            union autofs_v5_packet_union pkt;
+
+            if (pfds[i].fd < 0 || !(pfds[i].revents & (POLLIN | POLLHUP))) continue;
+
+            ssize_t n = read(lm->pipe_fd, &pkt, sizeof(pkt));
+            if (n <= 0) {
+                pfds[i].fd = -1; // Mount gone (e.g. unmounted by hand)
+                left--;
+                continue;
+            }
+
+            if (pkt.hdr.type != autofs_ptype_missing_direct) continue;
+
+            const struct autofs_v5_packet *v5 = &pkt.v5_packet;
+
+            LOG_INF("First access to %s (pid %u), mounting its overlay\n",
+                    lm->mp->mount_point,
+                    v5->pid);
+
+            // Stacked on the autofs mount, which stays underneath
+            int ret = overlayfs_mount_lower(lm->mp, lm->lowerdir, kiosk);
+            ioctl(lm->ioctl_fd,
+                  ret == 0 ? AUTOFS_IOC_READY : AUTOFS_IOC_FAIL,
+                  v5->wait_queue_token);
+
+            // Retry on the next access if the mount failed
+            if (ret == 0) {
+                close(lm->pipe_fd);
+                close(lm->ioctl_fd);
+                pfds[i].fd = -1;
+                left--;
+            }
+        }
+    }
+}
+
+/* Whether the top-most mount on a path is an overlay or autofs mount */
+static bool lazy_is_stale(const char *mount_point)
+{
+    bool stale = false;
+
+    FILE *fp = setmntent("/proc/self/mounts", "r");
+    if (!fp) return false;
+
+    // Listed in mount order, the last one is on top
+    struct mntent *ent;
+    while ((ent = getmntent(fp)) != NULL) {
+        if (strcmp(ent->mnt_dir, mount_point) != 0) continue;
+
+        stale = strcmp(ent->mnt_type, "overlay") == 0 ||
+                strcmp(ent->mnt_type, "autofs") == 0;
+    }
+
+    endmntent(fp);
+    return stale;
+}
+
+/*
+ * Unmount what a previous run left on a mount point (overlay, autofs, or the
+ * overlay stacked on its autofs mount), the bind mount of the lower directory
+ * would otherwise bind them instead.
+ */
+static void lazy_umount_stale(const char *mount_point)
+{
+    while (lazy_is_stale(mount_point)) {
+        if (do_umount2(mount_point, MNT_DETACH) != 0) {
+            LOG_WRN("Failed to unmount %s: %s, continuing anyway\n",
+                    mount_point,
+                    strerror(errno));
+            return;
+        }
+    }
+}
+
+int lazy_arm(const struct overlayfs_mount_point *const *mps, size_t count, bool kiosk)
+{
+    int fds[2];
+    char status = -1;
+
+    if (count == 0) return 0;
+    if (count > LAZY_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) lazy_umount_stale(mps[i]->mount_point);
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        LOG_ERR("Failed to create the status pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The module thread logs, do not fork while it may hold the log lock
+    modules_wait();
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERR("Failed to fork the autofs server: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid > 0) {
+        close(fds[1]);
+        if (read(fds[0], &status, 1) != 1) status = -1;
+        close(fds[0]);
+
+        if (status != 0) {
+            LOG_ERR("Failed to set up the on-demand overlays\n");
+            return -1;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            report_add_mount("userfs", mps[i]->mount_point, "autofs", "direct");
+        }
+
+        LOG_INF("autofs server %d armed for %zu overlay(s)\n", (int)pid, count);
+        return 0;
+    }
+
+    // Server: own process group, its accesses to the mount points never trigger
+    close(fds[0]);
+    setsid();
+
+    // Forked from the deferred worker (idle I/O class, nice 19) when the late
+    // overlays are deferred, while the first accesses it serves are not
+    int ioprio = IOPRIO_CLASS_NONE << IOPRIO_CLASS_SHIFT;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0 ||
+        setpriority(PRIO_PROCESS, 0, 0) != 0) {
+        LOG_WRN("Failed to reset the autofs server priority: %s\n", strerror(errno));
+    }
+
+    size_t armed = 0;
+    for (; armed < count; armed++) {
+        lazy_mounts[armed].mp = mps[armed];
+        if (lazy_setup(&lazy_mounts[armed]) != 0) break;
+    }
+
+    // On failure, the overlays are mounted eagerly by the parent instead
+    status = armed == count ? 0 : -1;
+    if (status != 0) {
+        while (armed > 0) lazy_teardown(&lazy_mounts[--armed]);
+    }
+
+    if (write(fds[1], &status, 1) != 1 && status == 0) {
+        while (armed > 0) lazy_teardown(&lazy_mounts[--armed]);
+        status = -1;
+    }
+    close(fds[1]);
+
+    if (status == 0) lazy_serve(count, kiosk);
+
+    _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
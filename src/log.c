@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct log_ctx {
+    char ring[LOG_RING_SIZE];
+    size_t head;    // Next write position in the ring
+    size_t len;     // Number of bytes used in the ring
+    size_t dropped; // Number of lines overwritten since start
+    enum log_level console_level;
+    int kmsg_fd; // -1 not opened yet, -2 unavailable
+    pthread_mutex_t lock; // Devices are provisioned concurrently (see devices.h)
+};
+
+static struct log_ctx log_ctx = {
+    .console_level = LOG_LEVEL_WRN,
+    .kmsg_fd       = -1,
+    .lock          = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char log_level_char(enum log_level level)
+{
+    switch (level) {
+    case LOG_LEVEL_ERR:
+        return 'E';
+    case LOG_LEVEL_WRN:
+        return 'W';
+    case LOG_LEVEL_INF:
+        return 'I';
+    case LOG_LEVEL_DBG:
+    default:
+        return 'D';
+    }
+}
+
+void log_set_console_level(enum log_level level)
+{
+    log_ctx.console_level = level;
+}
+
+/* Drop the oldest line of the ring */
+static void log_ring_drop_oldest(void)
+{
+    size_t tail = (log_ctx.head + LOG_RING_SIZE - log_ctx.len) % LOG_RING_SIZE;
+
+    while (log_ctx.len > 0) {
+        char c = log_ctx.ring[tail];
+
+        tail = (tail + 1) % LOG_RING_SIZE;
+        log_ctx.len--;
+
+        if (c == '\n') break;
+    }
+
+    log_ctx.dropped++;
+}
+
+static void log_ring_push(const char *line, size_t len)
+{
+    if (len > LOG_RING_SIZE) {
+        line += len - LOG_RING_SIZE;
+        len = LOG_RING_SIZE;
+    }
+
+    while (log_ctx.len + len > LOG_RING_SIZE) {
+        log_ring_drop_oldest();
+    }
+
+    size_t first = LOG_RING_SIZE - log_ctx.head;
+    if (first > len) first = len;
+
+    memcpy(&log_ctx.ring[log_ctx.head], line, first);
+    memcpy(&log_ctx.ring[0], line + first, len - first);
+
+    log_ctx.head = (log_ctx.head + len) % LOG_RING_SIZE;
+    log_ctx.len += len;
+}
+
+static void log_kmsg(enum log_level level, const char *msg)
+{
+    char buf[LOG_MSG_MAX_LEN + 32];
+
+    if (log_ctx.kmsg_fd == -1) {
+        log_ctx.kmsg_fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+        if (log_ctx.kmsg_fd < 0) log_ctx.kmsg_fd = -2;
+    }
+
+    if (log_ctx.kmsg_fd < 0) return;
+
+    // Kernel log priorities: 3 = err, 4 = warning
+    int len = snprintf(buf, sizeof(buf), "<%d>userfs: %s\n", level + 2, msg);
+    if (len > 0) {
+        (void)write(log_ctx.kmsg_fd, buf, (size_t)len);
+    }
+}
+
+void log_write(enum log_level level, const char *fmt, ...)
+{
+    int saved_errno = errno;
+    char msg[LOG_MSG_MAX_LEN];
+    char line[LOG_MSG_MAX_LEN + 32];
+    struct timespec ts;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    if (n < 0) goto exit;
+
+    size_t len = ((size_t)n < sizeof(msg)) ? (size_t)n : sizeof(msg) - 1;
+
+    // Messages are stored one per line, the newline is added back below
+    while (len > 0 && msg[len - 1] == '\n') {
+        msg[--len] = '\0';
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    n = snprintf(line,
+                 sizeof(line),
+                 "[%5lld.%06ld] %c: %s\n",
+                 (long long)ts.tv_sec,
+                 ts.tv_nsec / 1000,
+                 log_level_char(level),
+                 msg);
+    pthread_mutex_lock(&log_ctx.lock);
+
+    if (n > 0) {
+        log_ring_push(line, ((size_t)n < sizeof(line)) ? (size_t)n : sizeof(line) - 1);
+    }
+
+    if (level <= log_ctx.console_level) {
+        fprintf(level <= LOG_LEVEL_WRN ? stderr : stdout, "%s\n", msg);
+    }
+
+    if (level <= LOG_LEVEL_WRN) {
+        log_kmsg(level, msg);
+    }
+
+    pthread_mutex_unlock(&log_ctx.lock);
+
+exit:
+    errno = saved_errno;
+}
+
+static int log_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+int log_flush(const char *path)
+{
+    int ret = -1;
+    int fd  = -1;
+    char header[64];
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        goto exit;
+    }
+
+    if (log_ctx.dropped > 0) {
+        int n = snprintf(header,
+                         sizeof(header),
+                         "[%zu older lines dropped]\n",
+                         log_ctx.dropped);
+        if (log_write_all(fd, header, (size_t)n) != 0) goto exit;
+    }
+
+    size_t tail  = (log_ctx.head + LOG_RING_SIZE - log_ctx.len) % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - tail;
+    if (first > log_ctx.len) first = log_ctx.len;
+
+    if (log_write_all(fd, &log_ctx.ring[tail], first) != 0) goto exit;
+    if (log_write_all(fd, &log_ctx.ring[0], log_ctx.len - first) != 0) goto exit;
+
+    ret = 0;
+
+exit:
+    if (fd >= 0 && close(fd) != 0) ret = -1;
+    return ret;
+}
@@ -12,8 +12,16 @@
 #include <string.h>
 
 // #include <cstdio>
+#include "analyze.h"
+#include "backup.h"
+#include "bmap.h"
+#include "budget.h"
+#include "dedupe.h"
+#include "extents.h"
+#include "kiosk.h"
 #include "userfs.h"
 
+#include <ctype.h>
 #include <errno.h>
 
 #include <fcntl.h>
@@ -25,11 +33,74 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-int verbose = 0;
+struct command {
+    const char *name;
+    int (*handler)(int argc, char *argv[]);
+    const char *help;
+};
+
+static const struct command commands[] = {
+    {
+        .name    = "stats",
+        .handler = history_cmd_stats,
+        .help    = "Print boot timing statistics from the boot history",
+    },
+    {
+        .name    = "budget",
+        .handler = budget_cmd_run,
+        .help    = "Check syscall and fork counts of a run against a budget",
+    },
+    {
+        .name    = "analyze",
+        .handler = analyze_cmd_run,
+        .help    = "Classify overlay copy-ups and optionally prune identical ones",
+    },
+    {
+        .name    = "extents",
+        .handler = extents_cmd_run,
+        .help    = "Print compression and extent statistics of the subvolumes",
+    },
+    {
+        .name    = "health",
+        .handler = health_cmd_run,
+        .help    = "Print or monitor btrfs device errors and commit latency",
+    },
+    {
+        .name    = "backup",
+        .handler = backup_cmd_run,
+        .help    = "Write an incremental btrfs send stream of the subvolumes",
+    },
+    {
+        .name    = "restore",
+        .handler = backup_cmd_restore,
+        .help    = "Receive a backup stream and optionally restore the subvolumes",
+    },
+    {
+        .name    = "bmap",
+        .handler = bmap_cmd_run,
+        .help    = "Write a bmap of the mapped blocks of a provisioned disk",
+    },
+    {
+        .name    = "dedupe",
+        .handler = dedupe_cmd_run,
+        .help    = "Deduplicate identical blocks of the subvolumes when idle",
+    },
+    {
+        .name    = "convert",
+        .handler = convert_cmd_run,
+        .help    = "Show or drop the ext4 rollback image of a converted userfs",
+    },
+    {
+        .name    = "commit",
+        .handler = kiosk_cmd_commit,
+        .help    = "Persist paths changed in kiosk mode",
+    },
+};
 
 static void print_usage(const char *program_name)
 {
     printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("       %s COMMAND [ARGS]\n", program_name);
     printf("Manage userfs partition on %s\n\n", DISK);
     printf("Options:\n");
     printf("  -d    Delete partition %u (userfs) if it exists\n", USERFS_PART_NO);
@@ -38,11 +109,73 @@ static void print_usage(const char *program_name)
     printf("  -f	Force mkfs.btrfs even if already initialized (mutually exclusive "
            "with -t)\n");
     printf("  -o    Skip overlayfs setup (useful for debugging)\n");
+    printf("  -k    Kiosk mode: read-only userfs, changes kept in RAM until reboot\n");
+    printf("  -b MS Boot deadline, deferrable steps not fitting in it run after the "
+           "boot (default: %u, 0 for none)\n",
+           BOOT_DEADLINE_MS);
+    printf("  -x DEV:ROLE Provision an additional device (data, mirror, swap, bulk), "
+           "can be repeated\n");
     printf("  -v    Enable verbose output\n");
     printf("  -h    Show this help message\n");
     printf("  (no args) Create partition %u (userfs) if it doesn't exist\n",
            USERFS_PART_NO);
     printf("\n");
+    printf("Commands:\n");
+    for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+        printf("  %-10s %s\n", commands[i].name, commands[i].help);
+    }
+    printf("\n");
+}
+
+static const struct command *command_find(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+        if (strcmp(commands[i].name, name) == 0) return &commands[i];
+    }
+    return NULL;
+}
+
+/* Deferrable steps, see deadline.h */
+static int late_overlayfs_run(struct args *args, struct disk_info *disk)
+{
+    (void)disk;
+    return step3_create_late_overlayfs(args);
+}
+
+static const struct deadline_task late_overlayfs_task = {
+    .name        = "late_overlay",
+    .step        = REPORT_STEP_LATE_OVERLAYFS,
+    .estimate_ms = 50u,
+    .run         = late_overlayfs_run,
+};
+
+#if defined(SWAP_PART_NO)
+static int swap_run(struct args *args, struct disk_info *disk)
+{
+    return step4_format_swap_partition(args, disk, SWAP_PART_NO);
+}
+
+static const struct deadline_task swap_task = {
+    .name        = "swap",
+    .step        = REPORT_STEP_SWAP,
+    .estimate_ms = 500u,
+    .run         = swap_run,
+};
+#endif /* SWAP_PART_NO */
+
+/* Deadline in milliseconds (-b), digits only and within 32 bits */
+static int parse_deadline(const char *arg, uint32_t *ms)
+{
+    char *end;
+
+    if (!isdigit((unsigned char)arg[0])) return -1;
+
+    errno               = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value > UINT32_MAX) return -1;
+
+    *ms = (uint32_t)value;
+    return 0;
 }
 
 static int parse_args(int argc, char *argv[], struct args *args)
@@ -50,11 +183,13 @@ static int parse_args(int argc, char *argv[], struct args *args)
     int opt;
 
     if (!args) {
-        fprintf(stderr, "Invalid arguments\n");
+        LOG_ERR("Invalid arguments\n");
         return -1;
     }
 
-    while ((opt = getopt(argc, argv, "hdfvot")) != -1) {
+    args->deadline_ms = BOOT_DEADLINE_MS;
+
+    while ((opt = getopt(argc, argv, "hdfvotkb:x:")) != -1) {
         switch (opt) {
         case 'h':
             print_usage(argv[0]);
@@ -71,15 +206,31 @@ static int parse_args(int argc, char *argv[], struct args *args)
         case 'o':
             args->flags |= FLAG_USERFS_SKIP_OVERLAYS;
             break;
+        case 'k':
+            args->flags |= FLAG_USERFS_KIOSK;
+            break;
+        case 'b':
+            if (parse_deadline(optarg, &args->deadline_ms) != 0) {
+                LOG_ERR("Invalid deadline: %s (milliseconds)\n", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'x':
+            if (devices_add(optarg) != 0) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
         case 'v':
-            verbose = 1;
+            log_set_console_level(LOG_LEVEL_DBG);
             break;
         case '?':
-            fprintf(stderr, "Unknown option: -%c\n", opt);
+            LOG_ERR("Unknown option: -%c\n", opt);
             print_usage(argv[0]);
             return -1;
         default:
-            fprintf(stderr, "Unknown option: -%c\n", opt);
+            LOG_ERR("Unknown option: -%c\n", opt);
             print_usage(argv[0]);
             return -1;
         }
@@ -93,55 +244,178 @@ int main(int argc, char *argv[])
     int ret               = -1;
     struct disk_info disk = {0};
     struct args args      = {0};
+    bool userfs_mounted   = false;
+    pid_t worker          = -1;
+    struct history_record rec;
+    bool has_rec = false;
+
+    // Commands (e.g. "userfs stats") run instead of the provisioning steps
+    if (argc > 1 && argv[1][0] != '-') {
+        const struct command *cmd = command_find(argv[1]);
+        if (!cmd) {
+            LOG_ERR("Unknown command: %s\n", argv[1]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        return cmd->handler(argc - 1, argv + 1) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    report_init();
 
     ret = parse_args(argc, argv, &args);
     if (ret != 0) {
-        fprintf(stderr, "Failed to parse arguments\n");
+        LOG_ERR("Failed to parse arguments\n");
         goto exit;
     }
 
+    deadline_init(args.deadline_ms);
+
+    // The modules needed by the mounts load while the disk is inspected
+    if (modules_start() != 0) {
+        LOG_WRN("Continuing without preloading kernel modules\n");
+    }
+
+    // Additional devices are provisioned concurrently with the primary one, the
+    // threads are started first so that they do not inherit the boost
+    if ((args.flags & FLAG_USERFS_DELETE) == 0) {
+        ret = devices_start(&args);
+        if (ret != 0) {
+            LOG_ERR("Failed to start provisioning devices\n");
+            goto exit;
+        }
+    }
+
+    // Critical steps run boosted (-Dboost), until the /etc and /var overlays.
+    // Not with -d: it exits from step1, the governors would never be restored
+    if ((args.flags & FLAG_USERFS_DELETE) == 0) boost_begin();
+
     // STEP1: Inspect the disk and create userfs partition if it doesn't exist
+    report_step_begin(REPORT_STEP_PARTITION);
     ret = step1_create_userfs_partition(&args, &disk);
+    report_step_end(REPORT_STEP_PARTITION, ret);
     if (ret != 0) {
-        fprintf(stderr, "Failed to create userfs partition: %s\n", strerror(errno));
+        LOG_ERR("Failed to create userfs partition: %s\n", strerror(errno));
         goto exit;
     }
 
     // partprob
+    report_step_begin(REPORT_STEP_PARTPROBE);
     ret = disk_partprobe(DISK);
+    report_step_end(REPORT_STEP_PARTPROBE, ret);
     if (ret < 0) {
-        fprintf(stderr, "Failed to partprobe: %s\n", strerror(errno));
+        LOG_ERR("Failed to partprobe: %s\n", strerror(errno));
         goto exit;
     }
 
+    // The data and mirror devices must be known before the filesystem is mounted
+    if (devices_wait() != 0) {
+        LOG_WRN("Continuing without the failed device(s)\n");
+    }
+
     // STEP2: Create BTRFS filesystem on the userfs partition
+    report_step_begin(REPORT_STEP_BTRFS);
     ret = step2_create_btrfs_filesystem(&args, &disk, USERFS_PART_NO);
+    report_step_end(REPORT_STEP_BTRFS, ret);
     if (ret != 0) {
-        fprintf(stderr, "Failed to create BTRFS filesystem: %s\n", strerror(errno));
+        LOG_ERR("Failed to create BTRFS filesystem: %s\n", strerror(errno));
         goto exit;
     }
+    userfs_mounted = true;
+
+    if (devices_attach(&args) != 0) {
+        LOG_WRN("Failed to add device(s) to %s\n", USERFS_MOUNT_POINT);
+    }
 
     if ((args.flags & FLAG_USERFS_SKIP_OVERLAYS) == 0) {
-        // STEP3: Create overlayfs for /etc, /var and /home
+        // STEP3: Create overlayfs for /etc and /var
+        report_step_begin(REPORT_STEP_OVERLAYFS);
         ret = step3_create_overlayfs(&args);
+        report_step_end(REPORT_STEP_OVERLAYFS, ret);
         if (ret != 0) {
-            fprintf(stderr, "Failed to create overlayfs: %s\n", strerror(errno));
+            LOG_ERR("Failed to create overlayfs: %s\n", strerror(errno));
             goto exit;
         }
     } else {
-        printf("Skipping overlayfs setup as per user request\n");
+        LOG_INF("Skipping overlayfs setup as per user request\n");
+    }
+
+    // Critical steps done, the rest runs within the deadline or deferred
+    boost_end();
+
+    if ((args.flags & FLAG_USERFS_SKIP_OVERLAYS) == 0) {
+        // Then for /home and /opt, within the boot deadline or after the boot
+        ret = deadline_run(&late_overlayfs_task, &args, &disk);
+        if (ret != 0) {
+            LOG_ERR("Failed to create late overlayfs: %s\n", strerror(errno));
+            goto exit;
+        }
     }
 
 #if defined(SWAP_PART_NO)
-    // STEP4: Format swap partition if not already formatted
-    ret = step4_format_swap_partition(&args, &disk, SWAP_PART_NO);
+    // STEP4: Format swap partition if not already formatted (deferrable)
+    ret = deadline_run(&swap_task, &args, &disk);
     if (ret != 0) {
-        fprintf(stderr, "Failed to format swap partition: %s\n", strerror(errno));
+        LOG_ERR("Failed to format swap partition: %s\n", strerror(errno));
         goto exit;
     }
 #endif /* SWAP_PART_NO */
 
 exit:
+    // Never leave a device half provisioned, e.g. when step1 failed
+    devices_wait();
+
+    // Neither the report nor the deferred worker run boosted
+    boost_end();
+    modules_wait();
+
+    // Steps deferred past the deadline run in a detached worker, which resumes
+    // here once the parent reported the boot and signaled readiness
+    worker = deadline_spawn_worker(ret);
+    if (worker == 0 || (worker < 0 && ret == 0 && deadline_pending() > 0)) {
+        ret = deadline_run_deferred(&args, &disk);
+    }
+
+    // The report is best effort, never fail the boot because of it
+    report_set_disk(&disk);
+    if (report_write(ret) != 0) {
+        LOG_ERR("Failed to write boot report\n");
+    }
+
+    // Nothing is written to the userfs partition in kiosk mode
+    if (userfs_mounted && !(args.flags & FLAG_USERFS_KIOSK)) {
+        if (worker == 0) {
+            if (deadline_update_history() != 0) {
+                LOG_WRN("Failed to update boot history record\n");
+            }
+        } else {
+            report_fill_history(&rec, ret);
+            has_rec = history_append(&rec) == 0;
+            if (!has_rec) {
+                LOG_WRN("Failed to append boot history record\n");
+            }
+
+            if (wear_account() != 0) {
+                LOG_WRN("Failed to account disk writes\n");
+            }
+        }
+    }
+
+    // Keep the full log on the userfs partition if available (and the card is not
+    // worn), in /run otherwise
+    if (!userfs_mounted || (args.flags & FLAG_USERFS_KIOSK) ||
+        wear_get_profile()->log_to_ram || log_flush(LOG_USERFS_PATH) != 0) {
+        if (log_flush(LOG_RUN_PATH) != 0) {
+            LOG_ERR("Failed to flush log: %s\n", strerror(errno));
+        }
+    }
+
+    if (worker == 0) {
+        deadline_worker_done();
+    } else {
+        deadline_ready(has_rec ? &rec : NULL);
+    }
+
     disk_clear_info(&disk);
     return ret;
 }
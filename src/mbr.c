@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "mbr.h"
+#include "userfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define MBR_ENTRIES_OFF   446u
+#define MBR_ENTRY_SIZE    16u
+#define MBR_SIGNATURE_OFF 510u
+
+/* Names of the types userfs deals with, as libfdisk names them */
+static const struct {
+    uint8_t type;
+    const char *name;
+} mbr_type_names[] = {
+    {0x05u, "Extended"},
+    {0x0bu, "W95 FAT32"},
+    {0x0cu, "W95 FAT32 (LBA)"},
+    {0x0fu, "W95 Ext'd (LBA)"},
+    {0x82u, "Linux swap / Solaris"},
+    {0x83u, "Linux"},
+    {0x85u, "Linux extended"},
+};
+
+static const char *mbr_type_name(uint8_t type)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(mbr_type_names); i++) {
+        if (mbr_type_names[i].type == type) return mbr_type_names[i].name;
+    }
+    return "Unknown";
+}
+
+bool mbr_is_extended(uint8_t type)
+{
+    return type == 0x05u || type == 0x0fu || type == 0x85u;
+}
+
+static int mbr_read_sector(int fd, uint64_t lba, uint8_t *sector)
+{
+    ssize_t n = pread(fd, sector, MBR_SECTOR_SIZE, (off_t)(lba * MBR_SECTOR_SIZE));
+    if (n != (ssize_t)MBR_SECTOR_SIZE) {
+        if (n >= 0) errno = EIO;
+        return -1;
+    }
+
+    if (sector[MBR_SIGNATURE_OFF] != 0x55u || sector[MBR_SIGNATURE_OFF + 1] != 0xaau) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mbr_parse_entry(const uint8_t *sector, size_t index, struct mbr_entry *entry)
+{
+    const uint8_t *raw = sector + MBR_ENTRIES_OFF + index * MBR_ENTRY_SIZE;
+    uint32_t lba, sectors;
+
+    memcpy(&lba, raw + 8, sizeof(lba));
+    memcpy(&sectors, raw + 12, sizeof(sectors));
+
+    entry->type  = raw[4];
+    entry->start = le32toh(lba);
+    entry->size  = le32toh(sectors);
+}
+
+int mbr_walk(int fd, mbr_walk_cb cb, void *arg)
+{
+    uint8_t sector[MBR_SECTOR_SIZE];
+    struct mbr_entry entry;
+    uint64_t ext_lba = 0;
+    int ret;
+
+    if (mbr_read_sector(fd, 0, sector) != 0) return -1;
+
+    // GPT protective MBR
+    for (size_t i = 0; i < MAX_DOS_PARTITIONS; i++) {
+        mbr_parse_entry(sector, i, &entry);
+        if (entry.type == 0xeeu) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < MAX_DOS_PARTITIONS; i++) {
+        mbr_parse_entry(sector, i, &entry);
+        if (entry.type == 0 || entry.size == 0) continue;
+
+        entry.partno = i;
+        entry.ebr    = 0;
+        if (mbr_is_extended(entry.type) && ext_lba == 0) ext_lba = entry.start;
+
+        ret = cb(&entry, arg);
+        if (ret != 0) return ret;
+    }
+
+    size_t partno = MAX_DOS_PARTITIONS;
+    uint64_t ebr  = ext_lba;
+    for (size_t i = 0; ext_lba != 0 && i < MBR_MAX_EBRS; i++) {
+        if (mbr_read_sector(fd, ebr, sector) != 0) {
+            LOG_ERR("Invalid EBR at sector %llu: %s\n",
+                    (unsigned long long)ebr,
+                    strerror(errno));
+            return -1;
+        }
+
+        // First entry: logical partition (relative to this EBR)
+        mbr_parse_entry(sector, 0, &entry);
+        if (entry.type != 0 && entry.size != 0) {
+            entry.partno = partno++;
+            entry.start += ebr;
+            entry.ebr = ebr;
+
+            ret = cb(&entry, arg);
+            if (ret != 0) return ret;
+        }
+
+        // Second entry: next EBR (relative to the extended partition)
+        mbr_parse_entry(sector, 1, &entry);
+        if (entry.type == 0 || entry.start == 0) break;
+        ebr = ext_lba + entry.start;
+    }
+
+    return 0;
+}
+
+static int mbr_fill_partition(const struct mbr_entry *entry, void *arg)
+{
+    struct disk_info *disk = arg;
+
+    // libfdisk has one more slot per logical partition
+    if (entry->partno >= MAX_DOS_PARTITIONS) disk->partition_count = entry->partno + 1u;
+    if (entry->partno >= MAX_SUPPORTED_PARTITIONS) return 0;
+
+    struct part_info *pinfo = &disk->partitions[entry->partno];
+
+    pinfo->partno    = entry->partno;
+    pinfo->used      = 1;
+    pinfo->start     = entry->start;
+    pinfo->size      = entry->size;
+    pinfo->end       = entry->start + entry->size - 1u;
+    pinfo->type      = entry->type;
+    pinfo->type_name = mbr_type_name(entry->type);
+
+    return 0;
+}
+
+int mbr_read_disk(const char *device, struct disk_info *disk)
+{
+    int ret = -1;
+    uint64_t size;
+
+    int fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        LOG_ERR("Failed to get the size of %s: %s\n", device, strerror(errno));
+        goto exit;
+    }
+
+    disk_clear_info(disk);
+    disk->type            = FDISK_DISKLABEL_DOS;
+    disk->total_sectors   = size / SECTOR_SIZE;
+    disk->total_size      = (uint64_t)disk->total_sectors * SECTOR_SIZE;
+    disk->partition_count = MAX_DOS_PARTITIONS;
+
+    for (size_t partno = 0; partno < MAX_SUPPORTED_PARTITIONS; partno++) {
+        disk->partitions[partno].partno = partno;
+    }
+
+    if (mbr_walk(fd, mbr_fill_partition, disk) != 0) {
+        int err = errno;
+        disk_clear_info(disk);
+        errno = err;
+        goto exit;
+    }
+
+    if (disk->partition_count > MAX_SUPPORTED_PARTITIONS) {
+        disk->partition_count = MAX_SUPPORTED_PARTITIONS;
+    }
+
+    // Same free space computation as disk_read_partitions()
+    for (size_t partno = 0; partno < MAX_SUPPORTED_PARTITIONS; partno++) {
+        if (disk->partitions[partno].used) disk->last_used_partno = partno;
+    }
+
+    disk->next_free_sector = disk->partitions[disk->last_used_partno].end + 1;
+    disk->free_sectors     = disk->total_sectors - disk->next_free_sector;
+    disk->free_size        = (uint64_t)disk->free_sectors * SECTOR_SIZE;
+
+    ret = 0;
+
+exit:
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "modules.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#if !defined(MODULE_INIT_COMPRESSED_FILE)
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+#define MODULES_NAME_MAX     64u
+#define MODULES_MAX_DEPS     64u
+#define MODULES_MAX_SOFTDEPS 8u
+
+enum modules_state {
+    MODULES_STATE_PENDING = 0,
+    MODULES_STATE_PRESENT, // Already loaded (or built in with a /sys/module entry)
+    MODULES_STATE_LOADED,
+    MODULES_STATE_ABSENT, // Not in modules.dep: built in or not installed
+    MODULES_STATE_FAILED,
+};
+
+static const char *const modules_state_names[] = {
+    [MODULES_STATE_PENDING] = "pending",
+    [MODULES_STATE_PRESENT] = "present",
+    [MODULES_STATE_LOADED]  = "loaded",
+    [MODULES_STATE_ABSENT]  = "absent",
+    [MODULES_STATE_FAILED]  = "failed",
+};
+
+struct module {
+    char name[MODULES_NAME_MAX];
+    enum modules_state state;
+    char *dep_line;      // modules.dep line of the module
+    unsigned int loaded; // Modules loaded, including dependencies
+    double duration_ms;
+
+    struct module *owner; // Soft dependency of owner (modules.softdep), or NULL
+    bool post;            // Loaded after owner (post:), before it otherwise (pre:)
+};
+
+static struct {
+    struct module list[MODULES_MAX];
+    size_t count;
+    struct module soft[MODULES_MAX_SOFTDEPS]; // Soft dependencies of the list
+    size_t soft_count;
+    char dir[PATH_MAX]; // MODULES_DIR/<release>
+
+    pthread_t thread;
+    bool running;
+    double duration_ms;
+} modules;
+
+static double modules_elapsed_ms(const struct timespec *begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - begin->tv_sec) * 1000.0 +
+           (double)(now.tv_nsec - begin->tv_nsec) / 1000000.0;
+}
+
+/* Module name of a path, e.g. kernel/lib/zstd/zstd_compress.ko.xz -> zstd_compress */
+static void modules_name(const char *path, size_t len, char *name)
+{
+    const char *base = path;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (path[i] == '/') base = &path[i + 1];
+    }
+    len -= (size_t)(base - path);
+
+    for (i = 0; i < len && i < MODULES_NAME_MAX - 1u; i++) {
+        if (strncmp(&base[i], ".ko", 3) == 0) break;
+        name[i] = base[i] == '-' ? '_' : base[i];
+    }
+    name[i] = '\0';
+}
+
+static bool modules_is_loaded(const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/sys/module/%s", name);
+    return stat(path, &st) == 0;
+}
+
+/* Preloaded modules then soft dependencies, i from 0 to count + soft_count */
+static struct module *modules_entry(size_t i)
+{
+    return i < modules.count ? &modules.list[i] : &modules.soft[i - modules.count];
+}
+
+/* Load a module file of modules.dep, return 1 if already loaded */
+static int modules_load_file(const char *relpath, size_t len)
+{
+    char path[PATH_MAX];
+    char name[MODULES_NAME_MAX];
+    int flags = 0;
+
+    modules_name(relpath, len, name);
+    if (modules_is_loaded(name)) return 1;
+
+    int n;
+    if (relpath[0] == '/') {
+        n = snprintf(path, sizeof(path), "%.*s", (int)len, relpath);
+    } else {
+        n = snprintf(path, sizeof(path), "%s/%.*s", modules.dir, (int)len, relpath);
+    }
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        LOG_WRN("Module path too long: %.*s\n", (int)len, relpath);
+        return -1;
+    }
+
+    if (len < 3 || strncmp(&relpath[len - 3], ".ko", 3) != 0) {
+        flags |= MODULE_INIT_COMPRESSED_FILE; // .ko.xz, .ko.zst, .ko.gz
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_WRN("Failed to open module %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = (int)syscall(SYS_finit_module, fd, "", flags);
+    close(fd);
+
+    // A mount may have requested it meanwhile
+    if (ret != 0 && errno == EEXIST) return 1;
+    if (ret != 0) {
+        LOG_WRN("Failed to load module %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    LOG_DBG("Loaded module %s\n", name);
+    return 0;
+}
+
+/* Keep the modules.dep line of each module to load (soft dependencies included) */
+static int modules_read_dep(void)
+{
+    char path[PATH_MAX];
+    char name[MODULES_NAME_MAX];
+    char *line   = NULL;
+    size_t size  = 0;
+    size_t left  = 0;
+    size_t total = modules.count + modules.soft_count;
+    ssize_t len;
+
+    for (size_t i = 0; i < total; i++) {
+        const struct module *mod = modules_entry(i);
+
+        if (mod->state == MODULES_STATE_PENDING && !mod->dep_line) left++;
+    }
+    if (left == 0) return 0;
+
+    int n = snprintf(path, sizeof(path), "%s/%s", modules.dir, MODULES_DEP);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        LOG_WRN("Path too long: %s/%s\n", modules.dir, MODULES_DEP);
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        LOG_WRN("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (left > 0 && (len = getline(&line, &size, fp)) > 0) {
+        char *colon = strchr(line, ':');
+        if (!colon) continue;
+
+        modules_name(line, (size_t)(colon - line), name);
+
+        for (size_t i = 0; i < total; i++) {
+            struct module *mod = modules_entry(i);
+
+            if (mod->state != MODULES_STATE_PENDING || mod->dep_line) continue;
+            if (strcmp(mod->name, name) != 0) continue;
+
+            line[strcspn(line, "\n")] = '\0';
+            mod->dep_line             = strdup(line);
+            left--;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+static void modules_add_soft(struct module *owner, const char *name, bool post)
+{
+    if (modules.soft_count >= MODULES_MAX_SOFTDEPS) {
+        LOG_WRN("Too many soft dependencies, %s not preloaded\n", name);
+        return;
+    }
+
+    struct module *soft = &modules.soft[modules.soft_count++];
+
+    memset(soft, 0, sizeof(*soft));
+    modules_name(name, strlen(name), soft->name);
+    soft->owner = owner;
+    soft->post  = post;
+    soft->state = modules_is_loaded(soft->name) ? MODULES_STATE_PRESENT
+                                                : MODULES_STATE_PENDING;
+}
+
+/*
+ * Add the soft dependencies of the modules to load, from the lines of
+ * modules.softdep, e.g. "softdep btrfs pre: crc32c". The file is optional.
+ */
+static void modules_read_softdep(void)
+{
+    char path[PATH_MAX];
+    char name[MODULES_NAME_MAX];
+    char *line  = NULL;
+    size_t size = 0;
+    char *saveptr;
+
+    int n = snprintf(path, sizeof(path), "%s/%s", modules.dir, MODULES_SOFTDEP);
+    if (n < 0 || (size_t)n >= sizeof(path)) return;
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        LOG_DBG("No soft dependencies, %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    while (getline(&line, &size, fp) > 0) {
+        struct module *owner = NULL;
+        bool post            = false;
+
+        if (strncmp(line, "softdep ", 8) != 0) continue;
+
+        char *tok = strtok_r(line + 8, " \t\n", &saveptr);
+        if (!tok) continue;
+
+        modules_name(tok, strlen(tok), name);
+        for (size_t i = 0; i < modules.count; i++) {
+            if (modules.list[i].state == MODULES_STATE_PENDING &&
+                strcmp(modules.list[i].name, name) == 0) {
+                owner = &modules.list[i];
+            }
+        }
+        if (!owner) continue;
+
+        while ((tok = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+            if (strcmp(tok, "pre:") == 0) {
+                post = false;
+            } else if (strcmp(tok, "post:") == 0) {
+                post = true;
+            } else {
+                modules_add_soft(owner, tok, post);
+            }
+        }
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/*
+ * Resolve the soft dependencies not in modules.dep with modules.alias, e.g.
+ * crc32c is an alias of crc32c_generic (and of the accelerated drivers).
+ * Like modprobe, every module of the alias is loaded.
+ *
+ * @return The number of soft dependencies resolved.
+ */
+static size_t modules_read_alias(void)
+{
+    char path[PATH_MAX];
+    char name[MODULES_NAME_MAX];
+    char wanted[MODULES_MAX_SOFTDEPS][MODULES_NAME_MAX];
+    struct module *soft[MODULES_MAX_SOFTDEPS];
+    bool resolved[MODULES_MAX_SOFTDEPS] = {false};
+    size_t count    = 0;
+    size_t resolves = 0;
+    char *line      = NULL;
+    size_t size     = 0;
+    char *saveptr;
+
+    for (size_t i = 0; i < modules.soft_count; i++) {
+        struct module *mod = &modules.soft[i];
+
+        if (mod->state != MODULES_STATE_PENDING || mod->dep_line) continue;
+
+        strcpy(wanted[count], mod->name);
+        soft[count++] = mod;
+    }
+    if (count == 0) return 0;
+
+    int n = snprintf(path, sizeof(path), "%s/%s", modules.dir, MODULES_ALIAS);
+    if (n < 0 || (size_t)n >= sizeof(path)) return 0;
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        LOG_WRN("Failed to open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    while (getline(&line, &size, fp) > 0) {
+        if (strncmp(line, "alias ", 6) != 0) continue;
+
+        char *alias  = strtok_r(line + 6, " \t\n", &saveptr);
+        char *target = strtok_r(NULL, " \t\n", &saveptr);
+        if (!alias || !target) continue;
+
+        // Same normalization as modprobe, '-' and '_' are equivalent
+        modules_name(alias, strlen(alias), name);
+
+        for (size_t i = 0; i < count; i++) {
+            if (strcmp(wanted[i], name) != 0) continue;
+
+            if (resolved[i]) {
+                modules_add_soft(soft[i]->owner, target, soft[i]->post);
+                continue;
+            }
+
+            modules_name(target, strlen(target), soft[i]->name);
+            if (modules_is_loaded(soft[i]->name)) {
+                soft[i]->state = MODULES_STATE_PRESENT;
+            }
+            resolved[i] = true;
+            resolves++;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return resolves;
+}
+
+static void modules_load(struct module *mod);
+
+/* Load the pre: or post: soft dependencies of a module, a failure is only logged */
+static void modules_load_soft(struct module *mod, bool post)
+{
+    for (size_t i = 0; i < modules.soft_count; i++) {
+        struct module *soft = &modules.soft[i];
+
+        if (soft->owner != mod || soft->post != post) continue;
+        if (soft->state != MODULES_STATE_PENDING) continue;
+
+        if (!soft->dep_line) {
+            LOG_DBG("Soft dependency %s of %s built in or not installed\n",
+                    soft->name,
+                    mod->name);
+            soft->state = MODULES_STATE_ABSENT;
+            continue;
+        }
+
+        modules_load(soft);
+        if (soft->state == MODULES_STATE_FAILED) {
+            LOG_WRN("Failed to load %s, soft dependency of %s\n", soft->name, mod->name);
+        }
+        mod->loaded += soft->loaded;
+    }
+}
+
+/*
+ * Load a module and its dependencies. modules.dep lists all the dependencies,
+ * the last one has to be loaded first (same order as modprobe). The pre: soft
+ * dependencies are loaded before, the post: ones after.
+ */
+static void modules_load(struct module *mod)
+{
+    struct timespec begin;
+    char *deps[MODULES_MAX_DEPS];
+    size_t count = 0;
+    char *saveptr;
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    modules_load_soft(mod, false);
+
+    char *colon = strchr(mod->dep_line, ':');
+    *colon      = '\0';
+
+    for (char *dep = strtok_r(colon + 1, " \t", &saveptr);
+         dep && count < ARRAY_SIZE(deps);
+         dep = strtok_r(NULL, " \t", &saveptr)) {
+        deps[count++] = dep;
+    }
+
+    while (count > 0 && ret >= 0) {
+        const char *dep = deps[--count];
+
+        ret = modules_load_file(dep, strlen(dep));
+        if (ret == 0) mod->loaded++;
+    }
+
+    if (ret >= 0) {
+        ret = modules_load_file(mod->dep_line, strlen(mod->dep_line));
+        if (ret == 0) mod->loaded++;
+    }
+
+    if (ret >= 0) modules_load_soft(mod, true);
+
+    mod->state       = ret < 0 ? MODULES_STATE_FAILED : MODULES_STATE_LOADED;
+    mod->duration_ms = modules_elapsed_ms(&begin);
+}
+
+static void *modules_thread(void *arg)
+{
+    struct timespec begin;
+
+    (void)arg;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    modules_read_softdep();
+
+    int ret = modules_read_dep();
+
+    // Soft dependencies are often aliases, a second pass finds their modules
+    if (ret == 0 && modules_read_alias() > 0) ret = modules_read_dep();
+
+    if (ret != 0) {
+        for (size_t i = 0; i < modules.count; i++) {
+            if (modules.list[i].state == MODULES_STATE_PENDING) {
+                modules.list[i].state = MODULES_STATE_FAILED;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < modules.count; i++) {
+        struct module *mod = &modules.list[i];
+
+        if (mod->state != MODULES_STATE_PENDING) continue;
+
+        if (!mod->dep_line) {
+            LOG_DBG("Module %s not in %s, built in or not installed\n",
+                    mod->name,
+                    MODULES_DEP);
+            mod->state = MODULES_STATE_ABSENT;
+            continue;
+        }
+
+        modules_load(mod);
+    }
+
+    // Including the lines of the modules not loaded (failure, soft dependencies)
+    for (size_t i = 0; i < modules.count + modules.soft_count; i++) {
+        struct module *mod = modules_entry(i);
+
+        free(mod->dep_line);
+        mod->dep_line = NULL;
+    }
+
+    modules.duration_ms = modules_elapsed_ms(&begin);
+    return NULL;
+}
+
+int modules_start(void)
+{
+    char list[] = USERFS_PRELOAD_MODULES;
+    char *saveptr;
+    struct utsname uts;
+    size_t pending = 0;
+
+    for (char *name = strtok_r(list, ",", &saveptr); name && modules.count < MODULES_MAX;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        struct module *mod = &modules.list[modules.count++];
+
+        modules_name(name, strlen(name), mod->name);
+
+        // Nothing to do on most boots but the first one after a kernel update
+        if (modules_is_loaded(mod->name)) {
+            mod->state = MODULES_STATE_PRESENT;
+        } else {
+            pending++;
+        }
+    }
+
+    if (pending == 0) return 0;
+
+    if (uname(&uts) != 0) {
+        LOG_ERR("uname: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(modules.dir, sizeof(modules.dir), "%s/%s", MODULES_DIR, uts.release);
+
+    int err = pthread_create(&modules.thread, NULL, modules_thread, NULL);
+    if (err != 0) {
+        LOG_ERR("Failed to start the module preloading thread: %s\n", strerror(err));
+        return -1;
+    }
+
+    modules.running = true;
+    return 0;
+}
+
+void modules_wait(void)
+{
+    if (!modules.running) return;
+
+    pthread_join(modules.thread, NULL);
+    modules.running = false;
+
+    for (size_t i = 0; i < modules.count; i++) {
+        const struct module *mod = &modules.list[i];
+
+        if (mod->state != MODULES_STATE_LOADED) continue;
+
+        LOG_INF("Preloaded module %s (%u module(s)) in %.1f ms\n",
+                mod->name,
+                mod->loaded,
+                mod->duration_ms);
+    }
+}
+
+void modules_write_json(FILE *fp)
+{
+    fprintf(fp, "{\"duration_ms\": %.3f, \"modules\": [", modules.duration_ms);
+
+    for (size_t i = 0; i < modules.count; i++) {
+        const struct module *mod = &modules.list[i];
+
+        fprintf(fp,
+                "%s{\"name\": \"%s\", \"state\": \"%s\", \"loaded\": %u, "
+                "\"duration_ms\": %.3f}",
+                i == 0 ? "" : ", ",
+                mod->name,
+                modules_state_names[mod->state],
+                mod->loaded,
+                mod->duration_ms);
+    }
+
+    fprintf(fp, "]}");
+}
@@ -4,9 +4,12 @@
  * SPDX-License-Identifier: Apache-2.0
  */
  
+#define _GNU_SOURCE
+
 #include "userfs.h"
 
 #include <errno.h>
+#include <mntent.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -14,14 +17,7 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
-
-struct overlayfs_mount_point {
-    const char *lowerdir;
-    const char *upper_name;
-    const char *work_name;
-    const char *mount_point;
-    size_t btrfs_sv_index;
-};
+#include <unistd.h>
 
 static const struct overlayfs_mount_point overlayfs_mount_points[] = {
     {
@@ -44,132 +40,254 @@ static const struct overlayfs_mount_point overlayfs_mount_points[] = {
         .work_name      = ".work.home", // will end up as /mnt/userfs/vol-data/.work.home
         .mount_point    = "/home",
         .btrfs_sv_index = BTRFS_SV_DATA_INDEX,
+        .deferrable     = true,
     },
 #if defined(USERFS_OVERLAY_OPT)
     {
         .lowerdir       = "/opt",
-        .upper_name     = "opt",       // will end up as /mnt/userfs/vol-data/opt
-        .work_name      = ".work.opt", // will end up as /mnt/userfs/vol-data/.work.opt
+        .upper_name     = "opt",       // will end up as /mnt/userfs/vol-opt/opt
+        .work_name      = ".work.opt", // will end up as /mnt/userfs/vol-opt/.work.opt
         .mount_point    = "/opt",
-        .btrfs_sv_index = BTRFS_SV_DATA_INDEX,
+        .btrfs_sv_index = BTRFS_SV_OPT_INDEX,
+        .deferrable     = true,
     },
 #endif /* USERFS_OVERLAY_OPT */
 };
 
-int step3_create_overlayfs(struct args *args)
+const struct overlayfs_mount_point *overlayfs_get_mount_point(size_t index)
+{
+    if (index >= ARRAY_SIZE(overlayfs_mount_points)) {
+        return NULL;
+    }
+    return &overlayfs_mount_points[index];
+}
+
+bool overlayfs_is_mounted(const char *mount_point)
+{
+    bool mounted = false;
+
+    FILE *fp = setmntent("/proc/self/mounts", "r");
+    if (!fp) return false;
+
+    struct mntent *ent;
+    while ((ent = getmntent(fp)) != NULL) {
+        if (strcmp(ent->mnt_dir, mount_point) == 0 &&
+            strcmp(ent->mnt_type, "overlay") == 0) {
+            mounted = true;
+        }
+    }
+
+    endmntent(fp);
+    return mounted;
+}
+
+int overlayfs_build_upper_dir(char *buf,
+                              size_t size,
+                              const struct overlayfs_mount_point *mp)
+{
+    const char *btrfs_sv_name = btrfs_get_volume(mp->btrfs_sv_index);
+
+    if (!btrfs_sv_name) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return snprintf(
+        buf, size, "%s/%s/%s", USERFS_MOUNT_POINT, btrfs_sv_name, mp->upper_name);
+}
+
+int overlayfs_mount_lower(const struct overlayfs_mount_point *mp,
+                          const char *lowerdir,
+                          bool kiosk)
 {
     int ret;
+    char upper_dir[PATH_MAX];
+    char work_dir[PATH_MAX];
+    char lower_dirs[PATH_MAX + PATH_MAX];
+    const char *btrfs_sv_name = btrfs_get_volume(mp->btrfs_sv_index);
+
+    // Create upper and work directories paths
+    overlayfs_build_upper_dir(upper_dir, sizeof(upper_dir), mp);
+    snprintf(work_dir,
+             sizeof(work_dir),
+             "%s/%s/%s",
+             USERFS_MOUNT_POINT,
+             btrfs_sv_name,
+             mp->work_name);
+
+    if (kiosk) {
+        // The persisted upper directory becomes a read-only middle layer
+        if (access(upper_dir, F_OK) == 0) {
+            snprintf(lower_dirs, sizeof(lower_dirs), "%s:%s", upper_dir, lowerdir);
+        } else {
+            snprintf(lower_dirs, sizeof(lower_dirs), "%s", lowerdir);
+        }
+        snprintf(upper_dir, sizeof(upper_dir), "%s/%s", KIOSK_ROOT, mp->upper_name);
+        snprintf(work_dir, sizeof(work_dir), "%s/%s", KIOSK_ROOT, mp->work_name);
+    } else {
+        snprintf(lower_dirs, sizeof(lower_dirs), "%s", lowerdir);
+    }
+
+    LOG_DBG("Creating overlayfs directories: upper=%s, work=%s\n", upper_dir, work_dir);
+
+    // Create directories if they don't exist
+    ret = create_directory(upper_dir);
+    if (ret != 0) {
+        LOG_ERR("Failed to create upper directory %s: %s\n", upper_dir, strerror(errno));
+        return ret;
+    }
+
+    ret = create_directory(work_dir);
+    if (ret != 0) {
+        LOG_ERR("Failed to create work directory %s: %s\n", work_dir, strerror(errno));
+        return ret;
+    }
+
+    LOG_DBG("Creating overlayfs mount point: %s\n", mp->mount_point);
+
+    // Now mount the overlayfs
+    char mount_options[PATH_MAX + PATH_MAX + PATH_MAX + PATH_MAX + 64]; // Enough space
+    snprintf(mount_options,
+             sizeof(mount_options),
+             "lowerdir=%s,upperdir=%s,workdir=%s",
+             lower_dirs,
+             upper_dir,
+             work_dir);
+
+    LOG_INF(
+        "Mounting overlayfs on %s with options: %s\n", mp->mount_point, mount_options);
+
+    /* Make sure the mount point exist by creating it */
+    ret = create_directory(mp->mount_point);
+    if (ret != 0) {
+        LOG_ERR("Failed to create mount point %s: %s\n",
+                mp->mount_point,
+                strerror(errno));
+        return ret;
+    }
+
+    ret = do_mount("overlay", mp->mount_point, "overlay", 0, mount_options);
+    if (ret < 0) {
+        LOG_ERR(
+            "Failed to mount overlayfs on %s: %s\n", mp->mount_point, strerror(errno));
+        return ret;
+    }
+
+    report_add_mount("overlay", mp->mount_point, "overlay", mount_options);
+
+    return 0;
+}
+
+/* Create the upper and work directories of an overlay and mount it */
+static int overlayfs_mount(const struct overlayfs_mount_point *mp, bool kiosk)
+{
+    // Ensure the mount are not already mounted
+    int ret = do_umount2(mp->mount_point, MNT_DETACH);
+    if (ret < 0 && errno != EINVAL) { // EINVAL means not
+        // mounted, which is fine
+        LOG_WRN("Failed to unmount %s: %s, continuing anyway\n",
+                mp->mount_point,
+                strerror(errno));
+    }
+
+    return overlayfs_mount_lower(mp, mp->lowerdir, kiosk);
+}
 
-    (void)args; // Unused for now
+int step3_create_overlayfs(struct args *args)
+{
+    int ret;
+    bool kiosk = (args->flags & FLAG_USERFS_KIOSK) != 0;
 
     // First we need to umount /var/volatile tmpfs if it is already mounted
-    ret = umount2("/var/volatile", MNT_DETACH);
+    ret = do_umount2("/var/volatile", MNT_DETACH);
     if (ret < 0) {
-        fprintf(stderr,
-                "Failed to unmount /var/volatile: %s, continuing anyway\n",
+        LOG_WRN("Failed to unmount /var/volatile: %s, continuing anyway\n",
                 strerror(errno));
     }
 
-    // Create overlayfs directories
-    char upper_dir[PATH_MAX];
-    char work_dir[PATH_MAX];
+    // Kiosk mode: all the changes go to a size-limited tmpfs
+    if (kiosk) {
+        ret = kiosk_mount_tmpfs();
+        if (ret != 0) goto exit;
+    }
 
+    // Deferrable overlays are mounted by step3_create_late_overlayfs()
     for (size_t i = 0; i < ARRAY_SIZE(overlayfs_mount_points); i++) {
         const struct overlayfs_mount_point *mp = &overlayfs_mount_points[i];
-        const char *btrfs_sv_name              = btrfs_get_volume(mp->btrfs_sv_index);
-
-        // Create upper and work directories paths
-        snprintf(upper_dir,
-                 sizeof(upper_dir),
-                 "%s/%s/%s",
-                 USERFS_MOUNT_POINT,
-                 btrfs_sv_name,
-                 mp->upper_name);
-        snprintf(work_dir,
-                 sizeof(work_dir),
-                 "%s/%s/%s",
-                 USERFS_MOUNT_POINT,
-                 btrfs_sv_name,
-                 mp->work_name);
-
-        LOG("Creating overlayfs directories: upper=%s, work=%s\n", upper_dir, work_dir);
-
-        // Create directories if they don't exist
-        ret = create_directory(upper_dir);
-        if (ret != 0) {
-            fprintf(stderr,
-                    "Failed to create upper directory %s: %s\n",
-                    upper_dir,
-                    strerror(errno));
-            goto exit;
-        }
 
-        ret = create_directory(work_dir);
-        if (ret != 0) {
-            fprintf(stderr,
-                    "Failed to create work directory %s: %s\n",
-                    work_dir,
-                    strerror(errno));
-            goto exit;
-        }
-
-        LOG("Creating overlayfs mount point: %s\n", mp->mount_point);
+        if (mp->deferrable) continue;
 
-        // Ensure the mount are not already mounted
-        ret = umount2(mp->mount_point, MNT_DETACH);
-        if (ret < 0 && errno != EINVAL) { // EINVAL means not
-            // mounted, which is fine
-            fprintf(stderr,
-                    "Failed to unmount %s: %s, continuing anyway\n",
-                    mp->mount_point,
-                    strerror(errno));
-        }
+        ret = overlayfs_mount(mp, kiosk);
+        if (ret != 0) goto exit;
+    }
 
-        // Now mount the overlayfs
-        char mount_options[PATH_MAX + PATH_MAX + PATH_MAX +
-                           64]; // Enough space for options
-        snprintf(mount_options,
-                 sizeof(mount_options),
-                 "lowerdir=%s,upperdir=%s,workdir=%s",
-                 mp->lowerdir,
-                 upper_dir,
-                 work_dir);
-
-        printf("Mounting overlayfs on %s with options: %s\n",
-               mp->mount_point,
-               mount_options);
-
-        /* Make sure the mount point exist by creating it */
-        ret = create_directory(mp->mount_point);
+#if defined(USERFS_CONTAINERS_PATH)
+    // Container storage is not overlaid, mount it over the /var overlay
+    if (kiosk) {
+        LOG_WRN("Kiosk mode, container storage is not persisted\n");
+    } else {
+        ret = btrfs_mount_containers();
         if (ret != 0) {
-            fprintf(stderr,
-                    "Failed to create mount point %s: %s\n",
-                    mp->mount_point,
-                    strerror(errno));
-            goto exit;
-        }
-
-        ret = mount("overlay", mp->mount_point, "overlay", 0, mount_options);
-        if (ret < 0) {
-            fprintf(stderr,
-                    "Failed to mount overlayfs on %s: %s\n",
-                    mp->mount_point,
-                    strerror(errno));
+            LOG_ERR("Failed to mount the container storage: %s\n", strerror(errno));
             goto exit;
         }
     }
+#endif
 
     // Finally mount /var/volatile again
-    printf("Mounting tmpfs on /var/volatile with mode 0755\n");
+    LOG_INF("Mounting tmpfs on /var/volatile with mode 0755\n");
 
-    ret = mount("tmpfs", "/var/volatile", "tmpfs", 0, "mode=0755");
+    ret = do_mount("tmpfs", "/var/volatile", "tmpfs", 0, "mode=0755");
     if (ret < 0) {
-        fprintf(stderr, "Failed to mount /var/volatile: %s\n", strerror(errno));
+        LOG_ERR("Failed to mount /var/volatile: %s\n", strerror(errno));
         goto exit;
     }
 
+    report_add_mount("tmpfs", "/var/volatile", "tmpfs", "mode=0755");
+
+    // Keep logs off the card if the wear profile asks for it
+    if (wear_mount_log_tmpfs() != 0) {
+        LOG_WRN("Logs will be written to the userfs partition\n");
+    }
+    report_set_action(REPORT_STEP_OVERLAYFS, REPORT_ACTION_MOUNTED);
+
     return 0;
 
 exit:
     return ret;
 }
+
+int step3_create_late_overlayfs(struct args *args)
+{
+    bool kiosk = (args->flags & FLAG_USERFS_KIOSK) != 0;
+    const struct overlayfs_mount_point *lazy[ARRAY_SIZE(overlayfs_mount_points)];
+    size_t lazy_count = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(overlayfs_mount_points); i++) {
+        const struct overlayfs_mount_point *mp = &overlayfs_mount_points[i];
+
+        if (!mp->deferrable) continue;
+
+        // Mounted on first access, see lazy.h
+        if (lazy_is_enabled(mp)) {
+            lazy[lazy_count++] = mp;
+            continue;
+        }
+
+        int ret = overlayfs_mount(mp, kiosk);
+        if (ret != 0) return ret;
+    }
+
+    if (lazy_arm(lazy, lazy_count, kiosk) != 0) {
+        LOG_WRN("Mounting the on-demand overlays now\n");
+
+        for (size_t i = 0; i < lazy_count; i++) {
+            int ret = overlayfs_mount(lazy[i], kiosk);
+            if (ret != 0) return ret;
+        }
+    }
+
+    report_set_action(REPORT_STEP_LATE_OVERLAYFS, REPORT_ACTION_MOUNTED);
+
+    return 0;
+}
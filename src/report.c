@@ -0,0 +1,664 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "report.h"
+#include "trace.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/limits.h>
+#include <mntent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+struct report_step_info {
+    struct timespec begin;
+    struct timespec end;
+    enum report_action action;
+    int ret;
+    int err; // errno at the time the step failed
+    bool ran;
+};
+
+struct report_mount {
+    char source[128];
+    char target[128];
+    char fstype[16];
+    char options[512];
+};
+
+struct report {
+    struct timespec start;
+    time_t timestamp;
+    uint64_t start_written_bytes;
+
+    struct report_step_info steps[REPORT_STEP_COUNT];
+
+    struct report_mount mounts[REPORT_MAX_MOUNTS];
+    size_t mount_count;
+
+    struct disk_info disk;
+    bool has_disk;
+
+    struct btrfs_health health;
+    bool has_health;
+};
+
+static struct report report;
+
+static const char *const report_step_names[REPORT_STEP_COUNT] = {
+    [REPORT_STEP_PARTITION]      = "partition",
+    [REPORT_STEP_PARTPROBE]      = "partprobe",
+    [REPORT_STEP_BTRFS]          = "btrfs",
+    [REPORT_STEP_OVERLAYFS]      = "overlayfs",
+    [REPORT_STEP_SWAP]           = "swap",
+    [REPORT_STEP_LATE_OVERLAYFS] = "late_overlay",
+    [REPORT_STEP_DEVICES]        = "devices",
+};
+
+static const char *report_action_to_string(enum report_action action)
+{
+    switch (action) {
+    case REPORT_ACTION_SKIPPED:
+        return "skipped";
+    case REPORT_ACTION_CREATED:
+        return "created";
+    case REPORT_ACTION_FORMATTED:
+        return "formatted";
+    case REPORT_ACTION_MOUNTED:
+        return "mounted";
+    case REPORT_ACTION_FAILED:
+        return "failed";
+    case REPORT_ACTION_DEFERRED:
+        return "deferred";
+    case REPORT_ACTION_CONVERTED:
+        return "converted";
+    case REPORT_ACTION_NONE:
+    default:
+        return "none";
+    }
+}
+
+static double timespec_diff_ms(const struct timespec *begin, const struct timespec *end)
+{
+    return (double)(end->tv_sec - begin->tv_sec) * 1000.0 +
+           (double)(end->tv_nsec - begin->tv_nsec) / 1000000.0;
+}
+
+void report_init(void)
+{
+    memset(&report, 0, sizeof(report));
+    clock_gettime(CLOCK_MONOTONIC, &report.start);
+    report.timestamp = time(NULL);
+
+    if (history_disk_written_bytes(&report.start_written_bytes) != 0) {
+        report.start_written_bytes = 0;
+    }
+}
+
+void report_step_begin(enum report_step step)
+{
+    if (step >= REPORT_STEP_COUNT) return;
+
+    TRACE2(step__entry, (int)step, report_step_names[step]);
+
+    report.steps[step].ran = true;
+    clock_gettime(CLOCK_MONOTONIC, &report.steps[step].begin);
+}
+
+void report_step_end(enum report_step step, int ret)
+{
+    if (step >= REPORT_STEP_COUNT) return;
+
+    struct report_step_info *info = &report.steps[step];
+
+    clock_gettime(CLOCK_MONOTONIC, &info->end);
+    info->ret = ret;
+    if (ret != 0) {
+        info->err    = errno;
+        info->action = REPORT_ACTION_FAILED;
+    }
+
+    TRACE3(step__exit, (int)step, report_step_names[step], ret);
+}
+
+void report_set_action(enum report_step step, enum report_action action)
+{
+    if (step >= REPORT_STEP_COUNT) return;
+
+    report.steps[step].action = action;
+}
+
+static void report_copy_string(char *dst, size_t dst_len, const char *src)
+{
+    snprintf(dst, dst_len, "%s", src ? src : "");
+}
+
+void report_add_mount(const char *source,
+                      const char *target,
+                      const char *fstype,
+                      const char *options)
+{
+    if (report.mount_count >= REPORT_MAX_MOUNTS) return;
+
+    struct report_mount *m = &report.mounts[report.mount_count++];
+
+    report_copy_string(m->source, sizeof(m->source), source);
+    report_copy_string(m->target, sizeof(m->target), target);
+    report_copy_string(m->fstype, sizeof(m->fstype), fstype);
+    report_copy_string(m->options, sizeof(m->options), options);
+}
+
+void report_set_disk(const struct disk_info *disk)
+{
+    if (!disk) return;
+
+    report.disk     = *disk;
+    report.has_disk = true;
+}
+
+const char *report_step_name(enum report_step step)
+{
+    if (step >= REPORT_STEP_COUNT) return "unknown";
+
+    return report_step_names[step];
+}
+
+/* Replace requested mount options with the ones the kernel actually applied */
+static void report_resolve_mount_options(void)
+{
+    FILE *fp = setmntent("/proc/self/mounts", "r");
+    if (!fp) return;
+
+    struct mntent *ent;
+    while ((ent = getmntent(fp)) != NULL) {
+        for (size_t i = 0; i < report.mount_count; i++) {
+            struct report_mount *m = &report.mounts[i];
+
+            // Last matching entry wins, as it is the one on top of the stack
+            if (strcmp(ent->mnt_dir, m->target) == 0 &&
+                strcmp(ent->mnt_type, m->fstype) == 0) {
+                report_copy_string(m->options, sizeof(m->options), ent->mnt_opts);
+            }
+        }
+    }
+
+    endmntent(fp);
+}
+
+#if defined(SWAP_PART_NO)
+static bool report_swap_is_active(const char *device)
+{
+    char line[PATH_MAX + 128];
+    bool active = false;
+    size_t len  = strlen(device);
+
+    FILE *fp = fopen("/proc/swaps", "r");
+    if (!fp) return false;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, device, len) == 0 && (line[len] == ' ' || line[len] == '\t')) {
+            active = true;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return active;
+}
+#endif /* SWAP_PART_NO */
+
+static void json_write_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (const char *c = str; c && *c; c++) {
+        switch (*c) {
+        case '"':
+            fputs("\\\"", fp);
+            break;
+        case '\\':
+            fputs("\\\\", fp);
+            break;
+        case '\n':
+            fputs("\\n", fp);
+            break;
+        case '\t':
+            fputs("\\t", fp);
+            break;
+        default:
+            if ((unsigned char)*c < 0x20) {
+                fprintf(fp, "\\u%04x", (unsigned char)*c);
+            } else {
+                fputc(*c, fp);
+            }
+            break;
+        }
+    }
+    fputc('"', fp);
+}
+
+static bool report_first_boot(void)
+{
+    return report.steps[REPORT_STEP_PARTITION].action == REPORT_ACTION_CREATED;
+}
+
+static int report_failed_step(void)
+{
+    for (int step = 0; step < REPORT_STEP_COUNT; step++) {
+        if (report.steps[step].ran && report.steps[step].ret != 0) return step;
+    }
+    return -1;
+}
+
+static void
+report_write_json(FILE *fp, int ret, const struct statvfs *vfs, double total_ms)
+{
+    char path[PATH_MAX];
+    int failed_step = report_failed_step();
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"version\": 1,\n");
+    fprintf(fp, "  \"timestamp\": %lld,\n", (long long)report.timestamp);
+    fprintf(fp, "  \"success\": %s,\n", ret == 0 ? "true" : "false");
+    fprintf(fp, "  \"exit_code\": %d,\n", ret);
+    fprintf(fp, "  \"first_boot\": %s,\n", report_first_boot() ? "true" : "false");
+    fprintf(fp, "  \"duration_ms\": %.3f,\n", total_ms);
+
+    fprintf(fp, "  \"failed_step\": ");
+    if (failed_step >= 0) {
+        json_write_string(fp, report_step_names[failed_step]);
+        fprintf(fp, ",\n  \"error\": ");
+        json_write_string(fp, strerror(report.steps[failed_step].err));
+        fprintf(fp, ",\n");
+    } else {
+        fprintf(fp, "null,\n");
+    }
+
+    fprintf(fp, "  \"disk\": {\n");
+    fprintf(fp, "    \"device\": ");
+    json_write_string(fp, DISK);
+    fprintf(fp, ",\n");
+    fprintf(fp,
+            "    \"label\": \"%s\",\n",
+            report.disk.type == FDISK_DISKLABEL_DOS ? "dos" : "unknown");
+    fprintf(fp,
+            "    \"total_sectors\": %llu,\n",
+            (unsigned long long)report.disk.total_sectors);
+    fprintf(fp,
+            "    \"total_bytes\": %llu,\n",
+            (unsigned long long)report.disk.total_size);
+    fprintf(fp,
+            "    \"free_sectors\": %llu,\n",
+            (unsigned long long)report.disk.free_sectors);
+    fprintf(fp,
+            "    \"free_bytes\": %llu,\n",
+            (unsigned long long)report.disk.free_size);
+    fprintf(fp, "    \"partitions\": [");
+
+    bool first = true;
+    for (size_t n = 0; report.has_disk && n < MAX_SUPPORTED_PARTITIONS; n++) {
+        const struct part_info *pinfo = &report.disk.partitions[n];
+
+        if (!pinfo->used) continue;
+
+        disk_part_build_path(path, sizeof(path), pinfo->partno);
+
+        fprintf(fp, "%s\n      {", first ? "" : ",");
+        fprintf(fp, "\"partno\": %zu, \"device\": ", pinfo->partno);
+        json_write_string(fp, path);
+        fprintf(fp,
+                ", \"start\": %llu, \"end\": %llu, \"size\": %llu, "
+                "\"type\": \"0x%02x\", ",
+                (unsigned long long)pinfo->start,
+                (unsigned long long)pinfo->end,
+                (unsigned long long)pinfo->size,
+                (unsigned int)pinfo->type);
+        fprintf(fp, "\"fs\": {\"type\": ");
+        json_write_string(fp, fs_type_to_string(pinfo->fs_info.type));
+        fprintf(fp, ", \"uuid\": ");
+        json_write_string(fp, pinfo->fs_info.uuid);
+        fprintf(fp, "}}");
+        first = false;
+    }
+    fprintf(fp, "%s]\n", first ? "" : "\n    ");
+    fprintf(fp, "  },\n");
+
+    fprintf(fp, "  \"steps\": [");
+    first = true;
+    for (int step = 0; step < REPORT_STEP_COUNT; step++) {
+        const struct report_step_info *info = &report.steps[step];
+
+        if (!info->ran) continue;
+
+        fprintf(fp, "%s\n    {\"name\": ", first ? "" : ",");
+        json_write_string(fp, report_step_names[step]);
+        fprintf(fp, ", \"action\": ");
+        json_write_string(fp, report_action_to_string(info->action));
+        fprintf(fp,
+                ", \"duration_ms\": %.3f, \"ret\": %d}",
+                timespec_diff_ms(&info->begin, &info->end),
+                info->ret);
+        first = false;
+    }
+    fprintf(fp, "%s],\n", first ? "" : "\n  ");
+
+    fprintf(fp, "  \"mounts\": [");
+    for (size_t i = 0; i < report.mount_count; i++) {
+        const struct report_mount *m = &report.mounts[i];
+
+        fprintf(fp, "%s\n    {\"source\": ", i == 0 ? "" : ",");
+        json_write_string(fp, m->source);
+        fprintf(fp, ", \"target\": ");
+        json_write_string(fp, m->target);
+        fprintf(fp, ", \"fstype\": ");
+        json_write_string(fp, m->fstype);
+        fprintf(fp, ", \"options\": ");
+        json_write_string(fp, m->options);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "%s],\n", report.mount_count == 0 ? "" : "\n  ");
+
+    fprintf(fp, "  \"userfs\": ");
+    if (vfs) {
+        fprintf(fp,
+                "{\"mount_point\": \"%s\", \"total_bytes\": %llu, \"free_bytes\": %llu, "
+                "\"available_bytes\": %llu}",
+                USERFS_MOUNT_POINT,
+                (unsigned long long)vfs->f_blocks * vfs->f_frsize,
+                (unsigned long long)vfs->f_bfree * vfs->f_frsize,
+                (unsigned long long)vfs->f_bavail * vfs->f_frsize);
+    } else {
+        fprintf(fp, "null");
+    }
+
+    fprintf(fp, ",\n  \"format\": ");
+    format_write_json(fp);
+
+    fprintf(fp, ",\n  \"layout_version\": %u", layout_get_version());
+
+    fprintf(fp, ",\n  \"deadline\": ");
+    deadline_write_json(fp);
+
+    fprintf(fp, ",\n  \"devices\": ");
+    devices_write_json(fp);
+
+    fprintf(fp, ",\n  \"modules\": ");
+    modules_write_json(fp);
+
+    fprintf(fp, ",\n  \"wear\": ");
+    wear_write_json(fp);
+
+#if defined(USERFS_BOOST)
+    fprintf(fp, ",\n  \"boost\": ");
+    boost_write_json(fp);
+#endif
+
+#if defined(USERFS_CGROUP_IO)
+    fprintf(fp, ",\n  \"cgroup_io\": ");
+    iocg_write_json(fp);
+#endif
+
+    fprintf(fp, ",\n  \"btrfs_health\": ");
+    if (report.has_health) {
+        health_write_json(fp, &report.health);
+    } else {
+        fprintf(fp, "null");
+    }
+
+#if defined(SWAP_PART_NO)
+    const struct part_info *swap_part = &report.disk.partitions[SWAP_PART_NO];
+    enum report_action swap_action    = report.steps[REPORT_STEP_SWAP].action;
+    bool swap_formatted               = swap_part->fs_info.type == FS_TYPE_SWAP ||
+                                        swap_action == REPORT_ACTION_FORMATTED;
+
+    disk_part_build_path(path, sizeof(path), SWAP_PART_NO);
+    fprintf(fp, ",\n  \"swap\": {\"partno\": %u, \"device\": ", SWAP_PART_NO);
+    json_write_string(fp, path);
+    fprintf(fp,
+            ", \"formatted\": %s, \"active\": %s}\n",
+            swap_formatted ? "true" : "false",
+            report_swap_is_active(path) ? "true" : "false");
+#else
+    fprintf(fp, ",\n  \"swap\": null\n");
+#endif /* SWAP_PART_NO */
+
+    fprintf(fp, "}\n");
+}
+
+static void
+report_write_prom(FILE *fp, int ret, const struct statvfs *vfs, double total_ms)
+{
+    fprintf(fp, "# HELP userfs_last_run_timestamp_seconds Time of the last run.\n");
+    fprintf(fp, "# TYPE userfs_last_run_timestamp_seconds gauge\n");
+    fprintf(fp, "userfs_last_run_timestamp_seconds %lld\n", (long long)report.timestamp);
+
+    fprintf(fp, "# HELP userfs_success Whether the last userfs run succeeded.\n");
+    fprintf(fp, "# TYPE userfs_success gauge\n");
+    fprintf(fp, "userfs_success %d\n", ret == 0 ? 1 : 0);
+
+    fprintf(fp, "# HELP userfs_first_boot Whether the userfs partition was created.\n");
+    fprintf(fp, "# TYPE userfs_first_boot gauge\n");
+    fprintf(fp, "userfs_first_boot %d\n", report_first_boot() ? 1 : 0);
+
+    fprintf(fp, "# HELP userfs_duration_seconds Total duration of the userfs run.\n");
+    fprintf(fp, "# TYPE userfs_duration_seconds gauge\n");
+    fprintf(fp, "userfs_duration_seconds %.6f\n", total_ms / 1000.0);
+
+    fprintf(fp, "# HELP userfs_step_duration_seconds Duration of each userfs step.\n");
+    fprintf(fp, "# TYPE userfs_step_duration_seconds gauge\n");
+    for (int step = 0; step < REPORT_STEP_COUNT; step++) {
+        const struct report_step_info *info = &report.steps[step];
+
+        if (!info->ran) continue;
+
+        fprintf(fp,
+                "userfs_step_duration_seconds{step=\"%s\"} %.6f\n",
+                report_step_names[step],
+                timespec_diff_ms(&info->begin, &info->end) / 1000.0);
+    }
+
+    fprintf(fp, "# HELP userfs_step_action Action taken by each userfs step.\n");
+    fprintf(fp, "# TYPE userfs_step_action gauge\n");
+    for (int step = 0; step < REPORT_STEP_COUNT; step++) {
+        const struct report_step_info *info = &report.steps[step];
+
+        if (!info->ran) continue;
+
+        fprintf(fp,
+                "userfs_step_action{step=\"%s\",action=\"%s\"} 1\n",
+                report_step_names[step],
+                report_action_to_string(info->action));
+    }
+
+    fprintf(fp, "# HELP userfs_disk_size_bytes Size of the userfs block device.\n");
+    fprintf(fp, "# TYPE userfs_disk_size_bytes gauge\n");
+    fprintf(fp,
+            "userfs_disk_size_bytes{device=\"%s\"} %llu\n",
+            DISK,
+            (unsigned long long)report.disk.total_size);
+
+    fprintf(fp, "# HELP userfs_partition_size_bytes Size of each partition.\n");
+    fprintf(fp, "# TYPE userfs_partition_size_bytes gauge\n");
+    for (size_t n = 0; report.has_disk && n < MAX_SUPPORTED_PARTITIONS; n++) {
+        const struct part_info *pinfo = &report.disk.partitions[n];
+
+        if (!pinfo->used) continue;
+
+        fprintf(fp,
+                "userfs_partition_size_bytes"
+                "{partno=\"%zu\",type=\"0x%02x\",fstype=\"%s\"} %llu\n",
+                pinfo->partno,
+                (unsigned int)pinfo->type,
+                fs_type_to_string(pinfo->fs_info.type),
+                (unsigned long long)pinfo->size * SECTOR_SIZE);
+    }
+
+    fprintf(fp, "# HELP userfs_mount_info Filesystems mounted by userfs.\n");
+    fprintf(fp, "# TYPE userfs_mount_info gauge\n");
+    for (size_t i = 0; i < report.mount_count; i++) {
+        fprintf(fp,
+                "userfs_mount_info{target=\"%s\",fstype=\"%s\"} 1\n",
+                report.mounts[i].target,
+                report.mounts[i].fstype);
+    }
+
+    if (vfs) {
+        fprintf(fp, "# HELP userfs_fs_size_bytes Size of the userfs filesystem.\n");
+        fprintf(fp, "# TYPE userfs_fs_size_bytes gauge\n");
+        fprintf(fp,
+                "userfs_fs_size_bytes %llu\n",
+                (unsigned long long)vfs->f_blocks * vfs->f_frsize);
+        fprintf(fp, "# HELP userfs_fs_free_bytes Free space on the userfs filesystem.\n");
+        fprintf(fp, "# TYPE userfs_fs_free_bytes gauge\n");
+        fprintf(fp,
+                "userfs_fs_free_bytes %llu\n",
+                (unsigned long long)vfs->f_bfree * vfs->f_frsize);
+        fprintf(fp, "# HELP userfs_fs_avail_bytes Space available to non-root users.\n");
+        fprintf(fp, "# TYPE userfs_fs_avail_bytes gauge\n");
+        fprintf(fp,
+                "userfs_fs_avail_bytes %llu\n",
+                (unsigned long long)vfs->f_bavail * vfs->f_frsize);
+    }
+
+    if (report.has_health) {
+        health_write_prom(fp, &report.health, "userfs_btrfs_");
+    }
+
+    wear_write_prom(fp);
+
+#if defined(SWAP_PART_NO)
+    char path[PATH_MAX];
+    disk_part_build_path(path, sizeof(path), SWAP_PART_NO);
+
+    fprintf(fp, "# HELP userfs_swap_active Whether the swap partition is in use.\n");
+    fprintf(fp, "# TYPE userfs_swap_active gauge\n");
+    fprintf(fp, "userfs_swap_active %d\n", report_swap_is_active(path) ? 1 : 0);
+#endif /* SWAP_PART_NO */
+}
+
+void report_fill_history(struct history_record *rec, int ret)
+{
+    struct timespec now;
+    uint64_t written = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->timestamp = (int64_t)report.timestamp;
+    rec->exit_code = ret;
+    rec->total_us  = (uint32_t)(timespec_diff_ms(&report.start, &now) * 1000.0);
+
+    if (report_first_boot()) rec->flags |= HISTORY_FLAG_FIRST_BOOT;
+
+    for (int step = 0; step < REPORT_STEP_COUNT; step++) {
+        const struct report_step_info *info = &report.steps[step];
+
+        if (!info->ran) continue;
+
+        double step_ms         = timespec_diff_ms(&info->begin, &info->end);
+        rec->step_us[step]     = (uint32_t)(step_ms * 1000.0);
+        rec->step_action[step] = (uint8_t)info->action;
+    }
+
+    if (history_disk_written_bytes(&written) == 0) {
+        rec->dev_written_bytes = written;
+        if (report.start_written_bytes && written >= report.start_written_bytes) {
+            rec->run_written_bytes = written - report.start_written_bytes;
+        }
+    }
+}
+
+typedef void (*report_writer_t)(FILE *fp,
+                                int ret,
+                                const struct statvfs *vfs,
+                                double total_ms);
+
+static int report_write_file(const char *path,
+                             report_writer_t writer,
+                             int ret,
+                             const struct statvfs *vfs,
+                             double total_ms)
+{
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    fp = fopen(tmp_path, "w");
+    if (!fp) {
+        LOG_ERR("Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    writer(fp, ret, vfs, total_ms);
+
+    if (fclose(fp) != 0) {
+        LOG_ERR("Failed to write %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+        LOG_ERR("Failed to rename %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int report_write(int ret)
+{
+    struct timespec now;
+    struct statvfs vfs;
+    const struct statvfs *pvfs = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double total_ms = timespec_diff_ms(&report.start, &now);
+
+    // Only report userfs space if the btrfs step actually mounted it
+    if (report.steps[REPORT_STEP_BTRFS].ran && report.steps[REPORT_STEP_BTRFS].ret == 0 &&
+        statvfs(USERFS_MOUNT_POINT, &vfs) == 0) {
+        pvfs = &vfs;
+        report.has_health = health_collect(USERFS_MOUNT_POINT, &report.health) == 0;
+    }
+
+    // Errors survive reboots (persisted by btrfs), flag them on every boot
+    for (size_t i = 0; report.has_health && i < HEALTH_DEV_STAT_COUNT; i++) {
+        if (report.health.dev_stats[i] != 0) {
+            LOG_WRN("btrfs device errors recorded on %s, see %s\n",
+                    USERFS_MOUNT_POINT,
+                    REPORT_JSON_PATH);
+            break;
+        }
+    }
+
+    report_resolve_mount_options();
+
+    if (mkdir(REPORT_DIR, 0755) != 0 && errno != EEXIST) {
+        LOG_ERR("Failed to create %s: %s\n", REPORT_DIR, strerror(errno));
+        return -1;
+    }
+
+    if (report_write_file(
+            REPORT_JSON_PATH, report_write_json, ret, pvfs, total_ms) != 0) {
+        return -1;
+    }
+
+    if (report_write_file(
+            REPORT_PROM_PATH, report_write_prom, ret, pvfs, total_ms) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
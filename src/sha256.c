@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sha256.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+static uint32_t sha256_ror(uint32_t x, unsigned int n)
+{
+    return (x >> n) | (x << (32u - n));
+}
+
+static void sha256_transform(struct sha256_ctx *ctx, const uint8_t *block)
+{
+    uint32_t w[64];
+    uint32_t s[8];
+
+    for (size_t i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+
+    for (size_t i = 16; i < 64; i++) {
+        uint32_t w15 = w[i - 15];
+        uint32_t w2  = w[i - 2];
+        uint32_t s0  = sha256_ror(w15, 7) ^ sha256_ror(w15, 18) ^ (w15 >> 3);
+        uint32_t s1  = sha256_ror(w2, 17) ^ sha256_ror(w2, 19) ^ (w2 >> 10);
+        w[i]         = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+
+    for (size_t i = 0; i < 64; i++) {
+        uint32_t e  = s[4];
+        uint32_t a  = s[0];
+        uint32_t t1 = s[7] + (sha256_ror(e, 6) ^ sha256_ror(e, 11) ^ sha256_ror(e, 25)) +
+                      ((e & s[5]) ^ (~e & s[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (sha256_ror(a, 2) ^ sha256_ror(a, 13) ^ sha256_ror(a, 22)) +
+                      ((a & s[1]) ^ (a & s[2]) ^ (s[1] & s[2]));
+
+        memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+
+    for (size_t i = 0; i < 8; i++) ctx->state[i] += s[i];
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667,
+        0xbb67ae85,
+        0x3c6ef372,
+        0xa54ff53a,
+        0x510e527f,
+        0x9b05688c,
+        0x1f83d9ab,
+        0x5be0cd19,
+    };
+
+    memset(ctx, 0, sizeof(*ctx));
+    memcpy(ctx->state, init, sizeof(init));
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    ctx->length += len;
+
+    if (ctx->block_len > 0) {
+        size_t n = SHA256_BLOCK_SIZE - ctx->block_len;
+        if (n > len) n = len;
+
+        memcpy(ctx->block + ctx->block_len, p, n);
+        ctx->block_len += n;
+        p += n;
+        len -= n;
+
+        if (ctx->block_len < SHA256_BLOCK_SIZE) return;
+
+        sha256_transform(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    for (; len >= SHA256_BLOCK_SIZE; p += SHA256_BLOCK_SIZE, len -= SHA256_BLOCK_SIZE) {
+        sha256_transform(ctx, p);
+    }
+
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    uint64_t bits = ctx->length * 8u;
+    uint8_t pad[SHA256_BLOCK_SIZE + 8] = {0x80};
+
+    // Pad to 56 bytes modulo 64, then the message length in bits (big endian)
+    size_t pad_len = (ctx->block_len < 56u ? 56u : 120u) - ctx->block_len;
+    for (size_t i = 0; i < 8; i++) pad[pad_len + i] = (uint8_t)(bits >> (56u - 8u * i));
+
+    sha256_update(ctx, pad, pad_len + 8u);
+
+    for (size_t i = 0; i < 8; i++) {
+        digest[4 * i]     = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex)
+{
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
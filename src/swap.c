@@ -23,23 +23,23 @@ int step4_format_swap_partition(struct args *args, struct disk_info *disk, size_
     int ret = -1;
 
     if (swap_partno >= disk->partition_count) {
-        fprintf(stderr, "Invalid swap partition number: %d\n", swap_partno);
+        LOG_ERR("Invalid swap partition number: %zu\n", swap_partno);
         goto exit;
     }
 
     char swap_part_device[PATH_MAX];
     ret = disk_part_build_path(swap_part_device, sizeof(swap_part_device), swap_partno);
     if (ret < 0) {
-        fprintf(stderr, "Failed to build swap partition path: %s\n", strerror(errno));
+        LOG_ERR("Failed to build swap partition path: %s\n", strerror(errno));
         goto exit;
     }
 
-    printf("Formatting swap partition %zu (%s)\n", swap_partno, swap_part_device);
+    LOG_INF("Formatting swap partition %zu (%s)\n", swap_partno, swap_part_device);
 
     struct part_info *swap_part = &disk->partitions[swap_partno];
     ret                         = fs_probe(swap_part_device, &swap_part->fs_info);
     if (ret < 0) {
-        fprintf(stderr, "Failed to probe swap partition: %s\n", strerror(errno));
+        LOG_ERR("Failed to probe swap partition: %s\n", strerror(errno));
         goto exit;
     }
 
@@ -48,7 +48,7 @@ int step4_format_swap_partition(struct args *args, struct disk_info *disk, size_
     bool do_format_swap = false;
     switch (swap_part->fs_info.type) {
     case FS_TYPE_SWAP:
-        printf("Swap partition %zu already formatted, skipping\n", swap_partno);
+        LOG_INF("Swap partition %zu already formatted, skipping\n", swap_partno);
         break;
     case FS_TYPE_UNKNOWN:
     default:
@@ -65,13 +65,16 @@ int step4_format_swap_partition(struct args *args, struct disk_info *disk, size_
 
         command_display(mkswap_args[0], (char *const *)mkswap_args);
         ret = command_run(NULL, NULL, mkswap_args[0], (char *const *)mkswap_args);
-        LOG("mkswap returned: %d\n", ret);
+        LOG_DBG("mkswap returned: %d\n", ret);
         if (ret < 0) {
-            fprintf(stderr, "Failed to create swap space: %s\n", strerror(errno));
+            LOG_ERR("Failed to create swap space: %s\n", strerror(errno));
             goto exit;
         }
 
-        LOG("Swap space created successfully on %s\n", swap_part_device);
+        LOG_DBG("Swap space created successfully on %s\n", swap_part_device);
+        report_set_action(REPORT_STEP_SWAP, REPORT_ACTION_FORMATTED);
+    } else {
+        report_set_action(REPORT_STEP_SWAP, REPORT_ACTION_SKIPPED);
     }
 
     ret = 0;
@@ -4,11 +4,17 @@
  * SPDX-License-Identifier: Apache-2.0
  */
  
+#define _GNU_SOURCE
+
+#include "trace.h"
 #include "userfs.h"
 
+#include <dirent.h>
 #include <stdio.h>
 
 #include <fcntl.h>
+#include <linux/limits.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -17,43 +23,145 @@ int create_directory(const char *dir)
 {
     struct stat sb;
 
-    LOG("Creating directory: %s\n", dir);
+    LOG_DBG("Creating directory: %s\n", dir);
 
     if (stat(dir, &sb) == 0) {
         if (S_ISDIR(sb.st_mode)) {
-            LOG("Directory already exists: %s\n", dir);
+            LOG_DBG("Directory already exists: %s\n", dir);
             return 0;
         } else {
-            fprintf(stderr, "Path exists but is not a directory: %s\n", dir);
+            LOG_ERR("Path exists but is not a directory: %s\n", dir);
             return -1;
         }
     }
 
     if (errno != ENOENT) {
-        fprintf(stderr, "Failed to check directory existence: %s\n", dir);
-        perror("stat");
+        LOG_ERR("Failed to check directory existence: %s: %s\n", dir, strerror(errno));
         return -1;
     }
 
     // Directory does not exist, try to create it
     if (mkdir(dir, 0755) != 0) {
-        fprintf(stderr, "Failed to create directory: %s\n", dir);
-        perror("mkdir");
+        LOG_ERR("Failed to create directory: %s: %s\n", dir, strerror(errno));
         return -1;
     }
 
     return 0;
 }
 
+int create_directories(const char *path)
+{
+    char dir[PATH_MAX];
+
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') continue;
+
+        *p = '\0';
+        int ret = create_directory(dir);
+        *p = '/';
+        if (ret != 0) return -1;
+    }
+
+    return create_directory(dir);
+}
+
+int remove_tree_at(int dir_fd, const char *name)
+{
+    struct stat st;
+
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) return unlinkat(dir_fd, name, 0);
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        if (remove_tree_at(dirfd(dir), de->d_name) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    closedir(dir);
+    if (ret != 0) return -1;
+
+    return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
 void command_display(const char *program, char *const argv[])
 {
+    char line[LOG_MSG_MAX_LEN];
+    size_t len = 0;
+
     if (!program || !argv) return;
 
-    printf("Running command: %s ", program);
-    for (int i = 1; argv[i]; i++) {
-        printf("%s ", argv[i]);
+    for (int i = 1; argv[i] && len < sizeof(line); i++) {
+        int n = snprintf(&line[len], sizeof(line) - len, " %s", argv[i]);
+        if (n < 0) break;
+        len += (size_t)n;
+    }
+    line[len < sizeof(line) ? len : sizeof(line) - 1] = '\0';
+
+    LOG_INF("Running command: %s%s\n", program, line);
+}
+
+/* Forward the output of a command to the log, line by line */
+static void command_log_output(int fd, const char *program)
+{
+    char buf[4096];
+    char line[LOG_MSG_MAX_LEN];
+    size_t len = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        const char *p   = buf;
+        const char *end = buf + n;
+
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t chunk   = (size_t)((nl ? nl : end) - p);
+
+            // Lines longer than the log message are truncated
+            if (chunk > sizeof(line) - 1u - len) chunk = sizeof(line) - 1u - len;
+            memcpy(&line[len], p, chunk);
+            len += chunk;
+
+            if (!nl) break;
+
+            line[len] = '\0';
+            LOG_DBG("%s: %s\n", program, line);
+            len = 0;
+            p   = nl + 1;
+        }
+    }
+
+    if (len > 0) {
+        line[len] = '\0';
+        LOG_DBG("%s: %s\n", program, line);
     }
-    printf("\n");
 }
 
 int command_run(char *buf, size_t *buflen, const char *program, char *const argv[])
@@ -69,54 +177,63 @@ int command_run(char *buf, size_t *buflen, const char *program, char *const argv
         return -1;
     }
 
-    if (capture_output && pipe(pipefd) < 0) {
-        perror("pipe");
+    // The output is always read back: either into the caller buffer or into the
+    // log, so that verbose tools (mkfs.btrfs, ...) do not write to the console.
+    // Close on exec: a command run concurrently (see devices.h) must not keep
+    // the write end open, the read below would wait for it to exit too
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        LOG_ERR("pipe: %s\n", strerror(errno));
         return -1;
     }
 
     pid = fork();
     if (pid < 0) {
-        perror("fork");
+        LOG_ERR("fork: %s\n", strerror(errno));
         goto cleanup;
     } else if (pid == 0) {
         // Child
-        if (capture_output) {
-            close(pipefd[0]); // Close read end
-
-            if (dup2(pipefd[1], STDOUT_FILENO) < 0) {
-                perror("dup2");
-                _exit(EXIT_FAILURE);
-            }
+        close(pipefd[0]); // Close read end
 
-            close(pipefd[1]); // Not needed after dup2
+        if (dup2(pipefd[1], STDOUT_FILENO) < 0) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
         }
 
+        close(pipefd[1]); // Not needed after dup2
+
         execvp(program, argv);
         // If execvp returns, it failed
         perror("execvp");
         _exit(EXIT_FAILURE);
     } else {
         // Parent
-        if (capture_output) {
-            close(pipefd[1]); // Close write end
+        TRACE2(command__spawn, program, pid);
 
+        close(pipefd[1]); // Close write end
+        pipefd[1] = -1;
+
+        if (capture_output) {
             ssize_t nread = read(pipefd[0], buf, *buflen);
             if (nread < 0) {
-                perror("read");
+                LOG_ERR("read: %s\n", strerror(errno));
                 goto cleanup;
             }
             *buflen = (size_t)nread;
+        } else {
+            command_log_output(pipefd[0], program);
         }
 
         int status;
         ret = waitpid(pid, &status, 0);
         if (ret < 0) {
-            perror("waitpid");
+            LOG_ERR("waitpid: %s\n", strerror(errno));
         } else if (WIFEXITED(status)) {
             ret = WEXITSTATUS(status); // ret now holds the exit code of the child
         } else {
             ret = -1; // Abnormal termination
         }
+
+        TRACE3(command__exit, program, pid, ret);
     }
 
 cleanup:
@@ -126,3 +243,44 @@ cleanup:
     // TODO fix returned value if command failed
     return ret;
 }
+
+int do_mount(const char *source,
+             const char *target,
+             const char *fstype,
+             unsigned long flags,
+             const void *data)
+{
+    int ret;
+
+    TRACE3(mount__entry, source, target, fstype);
+    ret = mount(source, target, fstype, flags, data);
+    TRACE3(mount__exit, target, ret, errno);
+
+    return ret;
+}
+
+int do_umount2(const char *target, int flags)
+{
+    int ret;
+
+    TRACE1(umount__entry, target);
+    ret = umount2(target, flags);
+    TRACE3(umount__exit, target, ret, errno);
+
+    return ret;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+        }
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2025 Lucas Dietrich <lucas.dietrich.git@proton.me>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "wear.h"
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <linux/magic.h>
+#include <sys/mount.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#define WEAR_RECORD_MAGIC 0x52574655u // "UFWR"
+#define WEAR_SLOT_COUNT   2u
+
+#define WEAR_LOG_DIR     "/var/log"
+#define WEAR_LOG_OPTIONS "mode=0755,size=16m"
+
+/*
+ * I/O slices: the latency target protects foreground.slice, bulk.slice
+ * (package updates, log rotation, backups) gets a low weight and a write
+ * bandwidth cap, tightened on worn cards.
+ */
+#if defined(USERFS_BLOCK_DEVICE_TYPE_MMC)
+#define WEAR_IO_LATENCY_US 20000u
+#define WEAR_IO_BULK_WBPS  (8ull * 1024u * 1024u)
+#else
+#define WEAR_IO_LATENCY_US 5000u
+#define WEAR_IO_BULK_WBPS  0ull
+#endif
+
+#define WEAR_IO_FOREGROUND_SLICE "foreground.slice"
+#define WEAR_IO_BULK_SLICE       "bulk.slice"
+
+/*
+ * Lifetime write counter, two slots written alternately so that a torn write
+ * never loses the previous value.
+ */
+struct wear_record {
+    uint32_t magic;
+    uint32_t seq;
+    char boot_id[40];           // Boot the dev_written_bytes sample belongs to
+    uint64_t dev_written_bytes; // Disk write counter at the last accounting
+    uint64_t lifetime_written_bytes;
+    uint32_t _reserved;
+    uint32_t crc;
+};
+
+static const struct iocg_slice wear_io_normal[] = {
+    {.name = WEAR_IO_FOREGROUND_SLICE, .weight = 1000, .latency_us = WEAR_IO_LATENCY_US},
+    {.name = WEAR_IO_BULK_SLICE, .weight = 25, .wbps = WEAR_IO_BULK_WBPS},
+};
+
+static const struct iocg_slice wear_io_reduced[] = {
+    {.name = WEAR_IO_FOREGROUND_SLICE, .weight = 1000, .latency_us = WEAR_IO_LATENCY_US},
+    {.name = WEAR_IO_BULK_SLICE, .weight = 10, .wbps = WEAR_IO_BULK_WBPS / 2u},
+};
+
+static const struct wear_profile wear_profiles[WEAR_LEVEL_COUNT] = {
+    [WEAR_LEVEL_HEALTHY] =
+        {
+            .name           = "normal",
+            .mount_flags    = 0,
+            .btrfs_options  = NULL,
+            .log_to_ram     = false,
+            .io_slices      = wear_io_normal,
+            .io_slice_count = ARRAY_SIZE(wear_io_normal),
+        },
+    [WEAR_LEVEL_WORN] =
+        {
+            .name           = "reduced",
+            .mount_flags    = MS_NOATIME,
+            .btrfs_options  = "commit=120,compress=zstd:6",
+            .log_to_ram     = true,
+            .io_slices      = wear_io_reduced,
+            .io_slice_count = ARRAY_SIZE(wear_io_reduced),
+        },
+    [WEAR_LEVEL_CRITICAL] =
+        {
+            .name           = "minimal",
+            .mount_flags    = MS_NOATIME,
+            .btrfs_options  = "commit=300,compress=zstd:15",
+            .log_to_ram     = true,
+            .io_slices      = wear_io_reduced,
+            .io_slice_count = ARRAY_SIZE(wear_io_reduced),
+        },
+};
+
+static struct wear_info wear = {.used_percent = -1};
+static bool wear_evaluated;
+
+static const char *wear_disk_name(void)
+{
+    const char *name = strrchr(DISK, '/');
+    return name ? name + 1 : DISK;
+}
+
+/* Read a single line sysfs attribute of the disk device, strip the newline */
+static int wear_read_attr(const char *attr, char *buf, size_t size)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/sys/block/%s/device/%s", wear_disk_name(), attr);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char *line = fgets(buf, (int)size, fp);
+    fclose(fp);
+    if (!line) return -1;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static void wear_read_card_info(struct wear_info *info)
+{
+    char buf[64];
+
+    wear_read_attr("type", info->type, sizeof(info->type));
+    wear_read_attr("name", info->name, sizeof(info->name));
+    wear_read_attr("cid", info->cid, sizeof(info->cid));
+
+    if (wear_read_attr("manfid", buf, sizeof(buf)) == 0) {
+        sscanf(buf, "%x", &info->manfid);
+    }
+    if (wear_read_attr("oemid", buf, sizeof(buf)) == 0) {
+        sscanf(buf, "%x", &info->oemid);
+    }
+
+    // eMMC only: "0x01 0x02", device life time estimation type A and B
+    if (wear_read_attr("life_time", buf, sizeof(buf)) == 0) {
+        sscanf(buf, "%x %x", &info->life_time_a, &info->life_time_b);
+    }
+    if (wear_read_attr("pre_eol_info", buf, sizeof(buf)) == 0) {
+        sscanf(buf, "%x", &info->pre_eol);
+    }
+}
+
+static int wear_read_boot_id(char *buf, size_t size)
+{
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp) return -1;
+
+    char *line = fgets(buf, (int)size, fp);
+    fclose(fp);
+    if (!line) return -1;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static uint32_t wear_record_crc(const struct wear_record *rec)
+{
+    return crc32c(0, rec, offsetof(struct wear_record, crc));
+}
+
+static void wear_build_path(char *buf, size_t size)
+{
+    snprintf(buf,
+             size,
+             "%s/%s/%s",
+             USERFS_MOUNT_POINT,
+             btrfs_get_volume(BTRFS_SV_DATA_INDEX),
+             WEAR_FILE_NAME);
+}
+
+/* Load the most recent valid record, return its slot or -1 if there is none */
+static int wear_load_record(int fd, struct wear_record *rec)
+{
+    int slot = -1;
+
+    for (uint32_t i = 0; i < WEAR_SLOT_COUNT; i++) {
+        struct wear_record r;
+
+        off_t offset = (off_t)(i * sizeof(r));
+
+        if (pread(fd, &r, sizeof(r), offset) != (ssize_t)sizeof(r)) continue;
+        if (r.magic != WEAR_RECORD_MAGIC || r.crc != wear_record_crc(&r)) continue;
+
+        if (slot < 0 || (int32_t)(r.seq - rec->seq) > 0) {
+            *rec = r;
+            slot = (int)i;
+        }
+    }
+
+    return slot;
+}
+
+/*
+ * Lifetime writes including the current boot. Writes of a previous boot after
+ * its last accounting are lost (power cut), the counter is a lower bound.
+ */
+static uint64_t wear_lifetime_written(const struct wear_record *rec,
+                                      const char *boot_id,
+                                      uint64_t dev_written)
+{
+    if (strcmp(rec->boot_id, boot_id) == 0 && dev_written >= rec->dev_written_bytes) {
+        return rec->lifetime_written_bytes + (dev_written - rec->dev_written_bytes);
+    }
+
+    return rec->lifetime_written_bytes + dev_written;
+}
+
+int wear_account(void)
+{
+    int ret = -1;
+    char path[PATH_MAX];
+    char boot_id[40];
+    uint64_t dev_written;
+    struct wear_record rec;
+    struct statvfs vfs;
+
+    // Nothing is written to a read-only filesystem (kiosk mode)
+    if (statvfs(USERFS_MOUNT_POINT, &vfs) == 0 && (vfs.f_flag & ST_RDONLY)) return 0;
+
+    if (wear_read_boot_id(boot_id, sizeof(boot_id)) != 0 ||
+        history_disk_written_bytes(&dev_written) != 0) {
+        return -1;
+    }
+
+    wear_build_path(path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    int slot = wear_load_record(fd, &rec);
+
+    rec.lifetime_written_bytes = wear_lifetime_written(&rec, boot_id, dev_written);
+    rec.dev_written_bytes      = dev_written;
+    rec.magic                  = WEAR_RECORD_MAGIC;
+    rec.seq                    = slot < 0 ? 0 : rec.seq + 1;
+    snprintf(rec.boot_id, sizeof(rec.boot_id), "%s", boot_id);
+    rec.crc = wear_record_crc(&rec);
+
+    // Overwrite the oldest slot, no fsync (same as the boot history)
+    off_t offset = (off_t)(((uint32_t)(slot + 1) % WEAR_SLOT_COUNT) * sizeof(rec));
+    if (pwrite(fd, &rec, sizeof(rec), offset) != (ssize_t)sizeof(rec)) {
+        LOG_ERR("Failed to write %s: %s\n", path, strerror(errno));
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    close(fd);
+    return ret;
+}
+
+static void wear_read_lifetime_written(struct wear_info *info)
+{
+    char path[PATH_MAX];
+    char boot_id[40];
+    uint64_t dev_written;
+    struct wear_record rec;
+
+    if (wear_read_boot_id(boot_id, sizeof(boot_id)) != 0 ||
+        history_disk_written_bytes(&dev_written) != 0) {
+        return;
+    }
+
+    wear_build_path(path, sizeof(path));
+
+    memset(&rec, 0, sizeof(rec));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        wear_load_record(fd, &rec);
+        close(fd);
+    }
+
+    info->lifetime_written_bytes = wear_lifetime_written(&rec, boot_id, dev_written);
+    info->has_lifetime_written   = true;
+}
+
+static void wear_evaluate(struct wear_info *info, uint64_t disk_size)
+{
+    wear_read_card_info(info);
+    wear_read_lifetime_written(info);
+
+    unsigned int life_time = info->life_time_a;
+    if (info->life_time_b > life_time) life_time = info->life_time_b;
+
+    if (life_time != 0) {
+        // 0x01: 0-10% used ... 0x0A: 90-100%, 0x0B: exceeded, use the upper bound
+        info->used_percent = (int)life_time * 10;
+    } else if (info->has_lifetime_written && disk_size != 0) {
+        uint64_t endurance = disk_size * WEAR_SD_ENDURANCE_CYCLES;
+        info->used_percent = (int)(info->lifetime_written_bytes * 100u / endurance);
+    }
+
+    // pre_eol_info: 0x01 normal, 0x02 warning (80% of reserved blocks), 0x03 urgent
+    if (info->pre_eol >= 3 || info->used_percent >= WEAR_CRITICAL_PERCENT) {
+        info->level = WEAR_LEVEL_CRITICAL;
+    } else if (info->pre_eol == 2 || info->used_percent >= WEAR_WORN_PERCENT) {
+        info->level = WEAR_LEVEL_WORN;
+    } else {
+        info->level = WEAR_LEVEL_HEALTHY;
+    }
+}
+
+const struct wear_profile *wear_get_profile(void)
+{
+    return &wear_profiles[wear.level];
+}
+
+int wear_apply_profile(const char *part_device, uint64_t disk_size, bool readonly)
+{
+    wear_evaluate(&wear, disk_size);
+    wear_evaluated = true;
+
+    const struct wear_profile *profile = wear_get_profile();
+
+    LOG_INF("Card wear: %d%% used (life_time 0x%02x/0x%02x, pre_eol 0x%02x), "
+            "profile %s\n",
+            wear.used_percent,
+            wear.life_time_a,
+            wear.life_time_b,
+            wear.pre_eol,
+            profile->name);
+
+#if defined(USERFS_CGROUP_IO)
+    if (iocg_apply(profile->io_slices, profile->io_slice_count) != 0) {
+        LOG_WRN("I/O slices of the %s profile partially applied\n", profile->name);
+    }
+#endif
+
+    if (!profile->btrfs_options && !profile->mount_flags) return 0;
+
+    // A remount would make the filesystem writable (kiosk mode)
+    if (readonly) return 0;
+
+    LOG_WRN("Worn card, applying the %s write profile: %s\n",
+            profile->name,
+            profile->btrfs_options);
+
+    int ret = do_mount(part_device,
+                       USERFS_MOUNT_POINT,
+                       "btrfs",
+                       MS_REMOUNT | profile->mount_flags,
+                       profile->btrfs_options);
+    if (ret != 0) {
+        LOG_ERR("Failed to remount %s with the %s profile: %s\n",
+                USERFS_MOUNT_POINT,
+                profile->name,
+                strerror(errno));
+        return -1;
+    }
+
+    // The report picks the effective options of the mount up from the kernel
+    return 0;
+}
+
+int wear_mount_log_tmpfs(void)
+{
+    struct statfs sfs;
+
+    if (!wear_get_profile()->log_to_ram) return 0;
+
+    // Usually a symlink to /var/volatile/log, already in RAM
+    if (statfs(WEAR_LOG_DIR, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC) return 0;
+
+    unsigned long flags = MS_NOSUID | MS_NODEV;
+    if (create_directory(WEAR_LOG_DIR) != 0 ||
+        do_mount("tmpfs", WEAR_LOG_DIR, "tmpfs", flags, WEAR_LOG_OPTIONS) != 0) {
+        LOG_ERR("Failed to mount tmpfs on %s: %s\n", WEAR_LOG_DIR, strerror(errno));
+        return -1;
+    }
+
+    report_add_mount("tmpfs", WEAR_LOG_DIR, "tmpfs", WEAR_LOG_OPTIONS);
+    return 0;
+}
+
+static const char *wear_level_to_string(enum wear_level level)
+{
+    switch (level) {
+    case WEAR_LEVEL_WORN:
+        return "worn";
+    case WEAR_LEVEL_CRITICAL:
+        return "critical";
+    case WEAR_LEVEL_HEALTHY:
+    default:
+        return "healthy";
+    }
+}
+
+void wear_write_json(FILE *fp)
+{
+    if (!wear_evaluated) {
+        fprintf(fp, "null");
+        return;
+    }
+
+    fprintf(fp,
+            "{\"type\": \"%s\", \"name\": \"%s\", \"cid\": \"%s\", \"manfid\": %u, "
+            "\"oemid\": %u, \"life_time_a\": %u, \"life_time_b\": %u, \"pre_eol\": %u, "
+            "\"lifetime_written_bytes\": %llu, \"used_percent\": %d, \"level\": \"%s\", "
+            "\"profile\": \"%s\"}",
+            wear.type,
+            wear.name,
+            wear.cid,
+            wear.manfid,
+            wear.oemid,
+            wear.life_time_a,
+            wear.life_time_b,
+            wear.pre_eol,
+            (unsigned long long)wear.lifetime_written_bytes,
+            wear.used_percent,
+            wear_level_to_string(wear.level),
+            wear_get_profile()->name);
+}
+
+void wear_write_prom(FILE *fp)
+{
+    if (!wear_evaluated) return;
+
+    fprintf(fp, "# HELP userfs_wear_used_percent Estimated card endurance used.\n");
+    fprintf(fp, "# TYPE userfs_wear_used_percent gauge\n");
+    fprintf(fp, "userfs_wear_used_percent %d\n", wear.used_percent);
+
+    if (wear.has_lifetime_written) {
+        fprintf(fp, "# HELP userfs_wear_written_bytes_total Lifetime disk writes.\n");
+        fprintf(fp, "# TYPE userfs_wear_written_bytes_total counter\n");
+        fprintf(fp,
+                "userfs_wear_written_bytes_total %llu\n",
+                (unsigned long long)wear.lifetime_written_bytes);
+    }
+
+    fprintf(fp, "# HELP userfs_wear_profile Write profile applied at mount.\n");
+    fprintf(fp, "# TYPE userfs_wear_profile gauge\n");
+    fprintf(fp,
+            "userfs_wear_profile{profile=\"%s\",level=\"%s\"} 1\n",
+            wear_get_profile()->name,
+            wear_level_to_string(wear.level));
+}